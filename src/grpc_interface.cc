@@ -79,6 +79,17 @@ LedgerdStatus GrpcInterface::translate_status(ledger_status rc) {
     return LedgerdStatus::OK;
 }
 
+ledger_checksum GrpcInterface::translate_checksum(Checksum checksum) {
+    switch(checksum) {
+        case Checksum::CHECKSUM_CRC32:
+            return ::LEDGER_CHECKSUM_CRC32;
+        case Checksum::CHECKSUM_NONE:
+            return ::LEDGER_CHECKSUM_NONE;
+        default:
+            return ::LEDGER_CHECKSUM_CRC32C;
+    }
+}
+
 grpc::Status GrpcInterface::Ping(grpc::ServerContext *context, const PingRequest *req,
                                  PingResponse *resp) {
     resp->set_pong("pong");
@@ -102,6 +113,13 @@ grpc::Status GrpcInterface::OpenTopic(grpc::ServerContext *context, const OpenTo
         topic_options.drop_corrupt = opts.drop_corrupt();
         topic_options.journal_max_size_bytes = opts.journal_max_size_bytes();
         topic_options.journal_purge_age_seconds = opts.journal_purge_age_seconds();
+        topic_options.durability = static_cast<ledger_durability>(opts.durability());
+        topic_options.durability_interval_ms = opts.durability_interval_ms();
+        topic_options.durability_bytes = opts.durability_bytes();
+        topic_options.journal_preallocate = opts.journal_preallocate();
+        topic_options.checksum = translate_checksum(opts.checksum());
+        topic_options.compression = static_cast<ledger_codec_id>(opts.compression());
+        topic_options.compact = opts.compact();
     }
 
     rc = ledgerd_service_.OpenTopic(req->name(), partition_ids, &topic_options);
@@ -176,6 +194,7 @@ grpc::Status GrpcInterface::StreamPartition(grpc::ServerContext *context, const
 
     ledger_init_consumer_options(&consumer_options);
     consumer_options.read_chunk_size = request->read_chunk_size();
+    consumer_options.scheduled = true;
     if(request->position_settings().behavior() == PositionBehavior::STORE) {
         consumer_options.position_behavior = ::LEDGER_STORE;
         consumer_options.position_key = position_key.c_str();
@@ -217,6 +236,7 @@ grpc::Status GrpcInterface::Stream(grpc::ServerContext *context, const StreamReq
 
     ledger_init_consumer_options(&consumer_options);
     consumer_options.read_chunk_size = request->read_chunk_size();
+    consumer_options.scheduled = true;
     if(request->position_settings().behavior() == PositionBehavior::STORE) {
         consumer_options.position_behavior = ::LEDGER_STORE;
         consumer_options.position_key = position_key.c_str();
@@ -28,6 +28,7 @@ public:
                                 WriteResponse *resp) override;
 
     LedgerdStatus translate_status(ledger_status rc);
+    ledger_checksum translate_checksum(Checksum checksum);
 
     grpc::Status ReadPartition(grpc::ServerContext *context, const ReadPartitionRequest *req,
                                ReadResponse *resp) override;
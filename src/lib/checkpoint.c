@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checkpoint.h"
+
+// How long the checkpointer sleeps when no checkpoint has an interval
+#define IDLE_INTERVAL_MS 1000
+
+static uint64_t now_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Callers hold the checkpointer's store lock
+static ledger_status store_checkpoint(ledger_checkpointer *checkpointer,
+                                      ledger_checkpoint *checkpoint) {
+    ledger_status rc;
+    uint64_t version, pos;
+
+    // The position is loaded after its version, so it's at least as new
+    version = __atomic_load_n(&checkpoint->version, __ATOMIC_ACQUIRE);
+    if(version == checkpoint->stored_version) {
+        return LEDGER_OK;
+    }
+    pos = __atomic_load_n(&checkpoint->pos, __ATOMIC_ACQUIRE);
+
+    rc = ledger_position_storage_set(checkpointer->storage, checkpoint->position_key,
+                                     checkpoint->partition_num, pos);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to store consumer position");
+
+    checkpoint->stored_version = version;
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static void *checkpoint_loop(void *arg) {
+    ledger_checkpointer *checkpointer = (ledger_checkpointer *)arg;
+    ledger_checkpoint *checkpoint, *due;
+    struct timespec deadline;
+    uint64_t now, wait_ms, due_at;
+    bool requested;
+
+    pthread_mutex_lock(&checkpointer->lock);
+    while(checkpointer->running) {
+        checkpointer->kicked = false;
+        now = now_ms();
+        wait_ms = IDLE_INTERVAL_MS;
+        due = NULL;
+
+        for(checkpoint = checkpointer->checkpoints; checkpoint != NULL; checkpoint = checkpoint->next) {
+            requested = __atomic_exchange_n(&checkpoint->requested, false, __ATOMIC_ACQ_REL);
+            due_at = checkpoint->stored_at_ms + checkpoint->interval_ms;
+
+            if(requested || (checkpoint->interval_ms > 0 && now >= due_at)) {
+                checkpoint->due_next = due;
+                due = checkpoint;
+                checkpoint->stored_at_ms = now;
+                due_at = now + checkpoint->interval_ms;
+            }
+            if(checkpoint->interval_ms > 0 && due_at - now < wait_ms) {
+                wait_ms = due_at - now;
+            }
+        }
+
+        // Unregistering waits for the pass, so the due checkpoints
+        // outlive the writes
+        if(due != NULL) {
+            checkpointer->storing = true;
+            pthread_mutex_unlock(&checkpointer->lock);
+
+            pthread_mutex_lock(&checkpointer->store_lock);
+            for(checkpoint = due; checkpoint != NULL; checkpoint = checkpoint->due_next) {
+                // Failed stores are retried on the next interval
+                store_checkpoint(checkpointer, checkpoint);
+            }
+            pthread_mutex_unlock(&checkpointer->store_lock);
+
+            pthread_mutex_lock(&checkpointer->lock);
+            checkpointer->storing = false;
+            pthread_cond_broadcast(&checkpointer->stored_cond);
+        }
+
+        if(checkpointer->running && !checkpointer->kicked) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += wait_ms / 1000;
+            deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+            if(deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&checkpointer->cond, &checkpointer->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&checkpointer->lock);
+
+    return NULL;
+}
+
+ledger_status ledger_checkpointer_start(ledger_checkpointer *checkpointer,
+                                        ledger_position_storage *storage) {
+    ledger_status rc;
+    pthread_condattr_t cattr;
+
+    checkpointer->storage = storage;
+    checkpointer->checkpoints = NULL;
+    checkpointer->running = false;
+    checkpointer->kicked = false;
+    checkpointer->storing = false;
+
+    rc = pthread_condattr_init(&cattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize cond attribute");
+
+    rc = pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to set checkpointer cond clock");
+
+    rc = pthread_mutex_init(&checkpointer->lock, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize checkpointer mutex");
+
+    rc = pthread_mutex_init(&checkpointer->store_lock, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize checkpointer store mutex");
+
+    rc = pthread_cond_init(&checkpointer->cond, &cattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize checkpointer cond");
+
+    rc = pthread_cond_init(&checkpointer->stored_cond, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize checkpointer stored cond");
+
+    checkpointer->running = true;
+    rc = pthread_create(&checkpointer->thread, NULL, checkpoint_loop, checkpointer);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to start checkpointer thread");
+
+    pthread_condattr_destroy(&cattr);
+    return LEDGER_OK;
+
+error:
+    checkpointer->running = false;
+    return rc;
+}
+
+void ledger_checkpointer_stop(ledger_checkpointer *checkpointer) {
+    ledger_checkpoint *checkpoint, *next;
+
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpointer->running = false;
+    pthread_cond_signal(&checkpointer->cond);
+    pthread_mutex_unlock(&checkpointer->lock);
+
+    pthread_join(checkpointer->thread, NULL);
+
+    // Consumers left running lose no more than they would by stopping
+    pthread_mutex_lock(&checkpointer->store_lock);
+    for(checkpoint = checkpointer->checkpoints; checkpoint != NULL; checkpoint = next) {
+        next = checkpoint->next;
+        store_checkpoint(checkpointer, checkpoint);
+        free(checkpoint->position_key);
+        free(checkpoint);
+    }
+    pthread_mutex_unlock(&checkpointer->store_lock);
+    checkpointer->checkpoints = NULL;
+
+    pthread_cond_destroy(&checkpointer->cond);
+    pthread_cond_destroy(&checkpointer->stored_cond);
+    pthread_mutex_destroy(&checkpointer->store_lock);
+    pthread_mutex_destroy(&checkpointer->lock);
+}
+
+ledger_status ledger_checkpointer_register(ledger_checkpointer *checkpointer,
+                                           const char *position_key, unsigned int partition_num,
+                                           uint64_t pos, uint64_t interval_ms,
+                                           ledger_checkpoint **checkpoint_out) {
+    ledger_status rc;
+    ledger_checkpoint *checkpoint = NULL;
+
+    checkpoint = malloc(sizeof(ledger_checkpoint));
+    ledger_check_rc(checkpoint != NULL, LEDGER_ERR_MEMORY, "Failed to allocate checkpoint");
+
+    checkpoint->position_key = strdup(position_key);
+    ledger_check_rc(checkpoint->position_key != NULL, LEDGER_ERR_MEMORY, "Failed to copy position key");
+
+    checkpoint->partition_num = partition_num;
+    checkpoint->interval_ms = interval_ms;
+    checkpoint->pos = pos;
+    checkpoint->version = 0;
+    checkpoint->requested = false;
+    checkpoint->stored_version = 0;
+    checkpoint->stored_at_ms = now_ms();
+    checkpoint->due_next = NULL;
+
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpoint->next = checkpointer->checkpoints;
+    checkpointer->checkpoints = checkpoint;
+    // Picks up the new interval
+    checkpointer->kicked = true;
+    pthread_cond_signal(&checkpointer->cond);
+    pthread_mutex_unlock(&checkpointer->lock);
+
+    *checkpoint_out = checkpoint;
+    return LEDGER_OK;
+
+error:
+    if(checkpoint) {
+        free(checkpoint);
+    }
+    return rc;
+}
+
+void ledger_checkpointer_unregister(ledger_checkpointer *checkpointer,
+                                    ledger_checkpoint *checkpoint) {
+    ledger_checkpoint **link;
+
+    pthread_mutex_lock(&checkpointer->lock);
+    for(link = &checkpointer->checkpoints; *link != NULL; link = &(*link)->next) {
+        if(*link == checkpoint) {
+            *link = checkpoint->next;
+            break;
+        }
+    }
+    // A pass may still be storing it
+    while(checkpointer->storing) {
+        pthread_cond_wait(&checkpointer->stored_cond, &checkpointer->lock);
+    }
+    pthread_mutex_unlock(&checkpointer->lock);
+
+    free(checkpoint->position_key);
+    free(checkpoint);
+}
+
+void ledger_checkpoint_update(ledger_checkpoint *checkpoint, uint64_t pos) {
+    if(__atomic_exchange_n(&checkpoint->pos, pos, __ATOMIC_RELEASE) != pos) {
+        __atomic_add_fetch(&checkpoint->version, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void ledger_checkpointer_request(ledger_checkpointer *checkpointer,
+                                 ledger_checkpoint *checkpoint) {
+    __atomic_store_n(&checkpoint->requested, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpointer->kicked = true;
+    pthread_cond_signal(&checkpointer->cond);
+    pthread_mutex_unlock(&checkpointer->lock);
+}
+
+ledger_status ledger_checkpointer_flush(ledger_checkpointer *checkpointer,
+                                        ledger_checkpoint *checkpoint) {
+    ledger_status rc;
+
+    pthread_mutex_lock(&checkpointer->store_lock);
+    rc = store_checkpoint(checkpointer, checkpoint);
+    pthread_mutex_unlock(&checkpointer->store_lock);
+
+    return rc;
+}
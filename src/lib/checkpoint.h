@@ -0,0 +1,77 @@
+#ifndef LIB_LEDGER_CHECKPOINT_H
+#define LIB_LEDGER_CHECKPOINT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "position_storage.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// One consumer's position, updated by the consumer without locking and
+// stored by the checkpointer
+typedef struct ledger_checkpoint {
+    char *position_key;
+    unsigned int partition_num;
+    uint64_t interval_ms;
+    // Written by the consumer
+    uint64_t pos;
+    uint64_t version;
+    bool requested;
+    // Owned by the checkpointer, stored_version under its store lock
+    uint64_t stored_version;
+    uint64_t stored_at_ms;
+    struct ledger_checkpoint *next;
+    // In the checkpointer's pass, among those due to be stored
+    struct ledger_checkpoint *due_next;
+} ledger_checkpoint;
+
+// Stores the positions of every consumer in a context from one thread,
+// so however often consumers move along, each position is written at
+// most once per interval or request.
+typedef struct {
+    ledger_position_storage *storage;
+    ledger_checkpoint *checkpoints;
+    pthread_mutex_t lock;
+    // Held while positions are written instead of the lock, so
+    // registering and requesting never wait on storage
+    pthread_mutex_t store_lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    bool kicked;
+    // The thread is writing a pass's due checkpoints, which unregistering
+    // waits on stored_cond for
+    bool storing;
+    pthread_cond_t stored_cond;
+} ledger_checkpointer;
+
+ledger_status ledger_checkpointer_start(ledger_checkpointer *checkpointer,
+                                        ledger_position_storage *storage);
+// Stores whatever positions are still pending before stopping
+void ledger_checkpointer_stop(ledger_checkpointer *checkpointer);
+
+// interval_ms of 0 only stores the position when asked to
+ledger_status ledger_checkpointer_register(ledger_checkpointer *checkpointer,
+                                           const char *position_key, unsigned int partition_num,
+                                           uint64_t pos, uint64_t interval_ms,
+                                           ledger_checkpoint **checkpoint_out);
+void ledger_checkpointer_unregister(ledger_checkpointer *checkpointer,
+                                    ledger_checkpoint *checkpoint);
+
+void ledger_checkpoint_update(ledger_checkpoint *checkpoint, uint64_t pos);
+// Has the checkpointer store the position on its next pass
+void ledger_checkpointer_request(ledger_checkpointer *checkpointer,
+                                 ledger_checkpoint *checkpoint);
+// Stores the position now, on the caller
+ledger_status ledger_checkpointer_flush(ledger_checkpointer *checkpointer,
+                                        ledger_checkpoint *checkpoint);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
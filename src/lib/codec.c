@@ -0,0 +1,43 @@
+#include <string.h>
+
+#include "codec.h"
+#include "lz.h"
+
+static size_t none_bound(size_t len) {
+    return len;
+}
+
+static ledger_status none_compress(const void *src, size_t src_len,
+                                   void *dst, size_t dst_len, size_t *out_len) {
+    if(src_len > dst_len) {
+        return LEDGER_ERR_ARGS;
+    }
+    memcpy(dst, src, src_len);
+    *out_len = src_len;
+    return LEDGER_OK;
+}
+
+static ledger_status none_decompress(const void *src, size_t src_len,
+                                     void *dst, size_t dst_len) {
+    if(src_len != dst_len) {
+        return LEDGER_ERR_IO;
+    }
+    memcpy(dst, src, src_len);
+    return LEDGER_OK;
+}
+
+static const ledger_codec codecs[] = {
+    {LEDGER_CODEC_NONE, "none", none_bound, none_compress, none_decompress},
+    {LEDGER_CODEC_LZ, "lz", lz_compress_bound, lz_compress, lz_decompress}
+};
+
+const ledger_codec *ledger_codec_lookup(ledger_codec_id id) {
+    size_t i;
+
+    for(i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if(codecs[i].id == id) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef LIB_LEDGER_CODEC_H
+#define LIB_LEDGER_CODEC_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef enum {
+    // Messages are written as plain records, one per message
+    LEDGER_CODEC_NONE = 0,
+    // Messages written together are compressed as one batch, with an
+    // LZ77 family codec built for speed
+    LEDGER_CODEC_LZ
+} ledger_codec_id;
+
+typedef struct {
+    ledger_codec_id id;
+    const char *name;
+    // Largest possible output for len bytes of input
+    size_t (*bound)(size_t len);
+    // Fails when the output doesn't fit in dst_len
+    ledger_status (*compress)(const void *src, size_t src_len,
+                              void *dst, size_t dst_len, size_t *out_len);
+    // Fails unless the input decompresses to exactly dst_len bytes
+    ledger_status (*decompress)(const void *src, size_t src_len,
+                                void *dst, size_t dst_len);
+} ledger_codec;
+
+// NULL for ids this build doesn't know about
+const ledger_codec *ledger_codec_lookup(ledger_codec_id id);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
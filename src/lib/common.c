@@ -16,6 +16,7 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
 
 #include <errno.h>
 #include <stdlib.h>
@@ -23,6 +24,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -101,3 +103,36 @@ int ledger_pread(int fd, void *buf, size_t count, off_t offset) {
 
     return 1;
 }
+
+// Writes every buffer in iov, retrying short writes. The iov array
+// is modified as buffers are consumed.
+int ledger_pwritev(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t rv;
+
+    while(iovcnt > 0) {
+        if(iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        rv = pwritev(fd, iov, iovcnt, offset);
+        if(rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if(rv <= 0) {
+            return 0;
+        }
+        offset += rv;
+        while(iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+
+    return 1;
+}
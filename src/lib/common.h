@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 typedef enum {
@@ -30,5 +31,6 @@ ssize_t ledger_concat_path(const char *s1, const char *s2, char **out);
 void *ledger_reallocarray(void *ptr, size_t nmemb, size_t size);
 int ledger_pwrite(int fd, const void *buf, size_t count, off_t offset);
 int ledger_pread(int fd, void *buf, size_t count, off_t offset);
+int ledger_pwritev(int fd, struct iovec *iov, int iovcnt, off_t offset);
 
 #endif
@@ -1,110 +1,566 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
 #include <assert.h>
 #include <string.h>
-#include <time.h>
 
 #include "consumer.h"
 
 #define DEFAULT_READ_CHUNK_SIZE 64
+#define DEFAULT_CHECKPOINT_INTERVAL_MS 100
+#define SCHEDULED_STEPS 8
 
-static void *consumer_loop(void *consumer_ptr) {
-    ledger_status rc;
+static void checkpoint_position(ledger_consumer *consumer, uint64_t next_message,
+                                unsigned int *batches) {
+    ledger_checkpoint_update(consumer->checkpoint, next_message);
+
+    if(consumer->options.checkpoint_batches > 0 &&
+       ++*batches >= consumer->options.checkpoint_batches) {
+        ledger_checkpointer_request(&consumer->ctx->checkpointer, consumer->checkpoint);
+        *batches = 0;
+    }
+}
+
+static size_t message_set_bytes(ledger_message_set *messages) {
+    size_t i, nbytes = 0;
+
+    for(i = 0; i < messages->nmessages; i++) {
+        nbytes += messages->messages[i].len;
+    }
+    return nbytes;
+}
+
+static bool prefetching(ledger_consumer *consumer) {
+    return consumer->options.prefetch_messages > 0;
+}
+
+// Callers hold the prefetch lock. An empty queue is never full, so one
+// set bigger than the bounds still gets through.
+static bool prefetch_full(ledger_consumer *consumer) {
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+
+    if(prefetch->count == 0) {
+        return false;
+    }
+    return prefetch->count == prefetch->capacity ||
+        prefetch->nmessages >= consumer->options.prefetch_messages ||
+        (consumer->options.prefetch_bytes > 0 &&
+         prefetch->nbytes >= consumer->options.prefetch_bytes);
+}
+
+// Callers hold the prefetch lock
+static void prefetch_event(ledger_consumer_prefetch *prefetch) {
+    ledger_signal_publish(&prefetch->events, ++prefetch->nevents);
+}
+
+// Takes the oldest set read ahead. LEDGER_NEXT when there's none yet,
+// with the event count to wait past in seen.
+static ledger_status take_prefetched(ledger_consumer *consumer, ledger_message_set *messages,
+                                     uint64_t *seen) {
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+    ledger_status rc = LEDGER_OK;
+    bool was_full = false;
+
+    pthread_mutex_lock(&prefetch->lock);
+    if(prefetch->count == 0) {
+        rc = prefetch->status == LEDGER_OK ? LEDGER_NEXT : prefetch->status;
+        *seen = prefetch->nevents;
+    } else {
+        was_full = prefetch_full(consumer);
+        *messages = prefetch->sets[prefetch->head];
+        prefetch->head = (prefetch->head + 1) % prefetch->capacity;
+        prefetch->count--;
+        prefetch->nmessages -= messages->nmessages;
+        prefetch->nbytes -= message_set_bytes(messages);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+
+    if(was_full) {
+        ledger_scheduler_wake(prefetch->scheduler, &prefetch->task);
+    }
+    return rc;
+}
+
+static void finish_prefetch(ledger_consumer *consumer, ledger_status status) {
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+
+    ledger_partition_handle_unwatch(&consumer->partition, &prefetch->watch);
+    ledger_scheduler_remove(prefetch->scheduler, &prefetch->task);
+
+    // The consumer may finish as soon as the lock is let go
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->status = status;
+    prefetch->running = false;
+    prefetch_event(prefetch);
+    pthread_cond_broadcast(&prefetch->stopped_cond);
+    if(consumer->scheduler != NULL) {
+        ledger_scheduler_wake(consumer->scheduler, &consumer->task);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+// Reads chunks into the queue until it's full or caught up, a few at a
+// time like scheduled consumers
+static ledger_task_status run_prefetch(ledger_task *task) {
+    ledger_consumer *consumer = (ledger_consumer *)task->data;
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
     ledger_message_set messages;
-    ledger_consumer_ctx ctx;
-    ledger_consumer *consumer = (ledger_consumer *)consumer_ptr;
-    ledger_consume_status consume_status;
-    uint64_t next_message = consumer->start_id;
-    uint64_t last_pos;
+    ledger_status rc;
+    bool stopping, full;
+    int i;
 
-    ctx.topic_name = consumer->topic_name;
-    ctx.partition_num = consumer->partition_num;
+    for(i = 0; i < SCHEDULED_STEPS; i++) {
+        pthread_mutex_lock(&prefetch->lock);
+        stopping = prefetch->stopping;
+        full = prefetch_full(consumer);
+        pthread_mutex_unlock(&prefetch->lock);
 
-    while(consumer->active) {
-        rc = ledger_read_partition(consumer->ctx, consumer->topic_name,
-                                   consumer->partition_num, next_message,
-                                   consumer->options.read_chunk_size, &messages);
+        if(stopping) {
+            finish_prefetch(consumer, LEDGER_OK);
+            return LEDGER_TASK_DONE;
+        }
+        if(full) {
+            return LEDGER_TASK_PARK;
+        }
 
+        rc = ledger_partition_handle_read_cursor(&consumer->partition, &prefetch->cursor,
+                                                 prefetch->next_id,
+                                                 consumer->options.read_chunk_size, &messages);
         if(rc != LEDGER_OK) {
-            consumer->status = rc;
-            ledger_consumer_stop(consumer);
-            return NULL;
+            finish_prefetch(consumer, rc);
+            return LEDGER_TASK_DONE;
         }
 
         if(messages.nmessages == 0) {
-            if(next_message == LEDGER_END) {
-                last_pos = next_message;
-                next_message = messages.next_id;
-                ledger_consumer_position_set(&consumer->position, last_pos);
-
-                if(consumer->options.position_behavior == LEDGER_STORE) {
-                    rc = ledger_position_storage_set(&consumer->ctx->position_storage,
-                                                     consumer->options.position_key,
-                                                     consumer->partition_num,
-                                                     next_message);
-                    if(rc != LEDGER_OK) {
-                        consumer->status = rc;
-                        ledger_consumer_stop(consumer);
-
-                        return NULL;
-                    }
+            if(prefetch->next_id == LEDGER_END) {
+                prefetch->next_id = messages.next_id;
+                // Nothing's consumed yet, so store where the end was
+                if(consumer->checkpoint != NULL) {
+                    ledger_checkpoint_update(consumer->checkpoint, prefetch->next_id);
                 }
+            } else if(messages.next_id > prefetch->next_id) {
+                prefetch->next_id = messages.next_id;
             }
             ledger_message_set_free(&messages);
-            ledger_wait_messages(consumer->ctx, consumer->topic_name,
-                                 consumer->partition_num);
-            continue;
+            return LEDGER_TASK_PARK;
+        }
+        prefetch->next_id = messages.next_id;
+
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->sets[(prefetch->head + prefetch->count) % prefetch->capacity] = messages;
+        prefetch->count++;
+        prefetch->nmessages += messages.nmessages;
+        prefetch->nbytes += message_set_bytes(&messages);
+        prefetch_event(prefetch);
+        pthread_mutex_unlock(&prefetch->lock);
+
+        if(consumer->scheduler != NULL) {
+            ledger_scheduler_wake(consumer->scheduler, &consumer->task);
         }
+    }
 
-        if(rc == LEDGER_OK) {
-            consume_status = consumer->func(&ctx, &messages, consumer->data);
-            if(consume_status == LEDGER_CONSUMER_ERROR) {
-                ledger_message_set_free(&messages);
-                return NULL;
-            }
+    return LEDGER_TASK_YIELD;
+}
+
+static bool prefetch_ready(ledger_task *task) {
+    ledger_consumer *consumer = (ledger_consumer *)task->data;
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+    bool full;
+
+    pthread_mutex_lock(&prefetch->lock);
+    full = prefetch_full(consumer);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return !full && ledger_partition_handle_has_message(&consumer->partition, prefetch->next_id);
+}
+
+static void notify_prefetch(ledger_partition_watch *watch) {
+    ledger_consumer *consumer = (ledger_consumer *)watch->data;
+
+    ledger_scheduler_wake(consumer->prefetch.scheduler, &consumer->prefetch.task);
+}
+
+static ledger_status start_prefetch(ledger_consumer *consumer) {
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+    ledger_status rc;
+    size_t chunk_size = consumer->options.read_chunk_size;
+
+    rc = ledger_get_consumer_scheduler(consumer->ctx, &prefetch->scheduler);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to get consumer scheduler");
+
+    rc = ledger_get_partition_handle(consumer->ctx, consumer->topic_name,
+                                     consumer->partition_num, &consumer->partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find consumer partition");
+
+    // Enough sets for the message bound, were every read a full chunk
+    prefetch->capacity = (consumer->options.prefetch_messages + chunk_size - 1) / chunk_size;
+    prefetch->sets = ledger_reallocarray(NULL, prefetch->capacity, sizeof(ledger_message_set));
+    ledger_check_rc(prefetch->sets != NULL, LEDGER_ERR_MEMORY, "Failed to allocate prefetch queue");
+
+    prefetch->head = 0;
+    prefetch->count = 0;
+    prefetch->nmessages = 0;
+    prefetch->nbytes = 0;
+    prefetch->next_id = consumer->next_message;
+    // Sets outlive the next read, so they can't come from the arena
+    ledger_read_cursor_init(&prefetch->cursor);
+    prefetch->status = LEDGER_OK;
+    prefetch->running = true;
+    prefetch->stopping = false;
+
+    ledger_task_init(&prefetch->task, run_prefetch, prefetch_ready, consumer);
+    prefetch->task.signal = ledger_partition_handle_message_signal(&consumer->partition);
+    prefetch->watch.notify = notify_prefetch;
+    prefetch->watch.data = consumer;
+
+    ledger_partition_handle_watch(&consumer->partition, &prefetch->watch);
+    rc = ledger_scheduler_add(prefetch->scheduler, &prefetch->task);
+    if(rc != LEDGER_OK) {
+        ledger_partition_handle_unwatch(&consumer->partition, &prefetch->watch);
+        free(prefetch->sets);
+    }
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to schedule reading ahead");
+
+    return LEDGER_OK;
+
+error:
+    prefetch->scheduler = NULL;
+    return rc;
+}
+
+// Asks reading ahead to stop, true once it has
+static bool stop_prefetch(ledger_consumer *consumer) {
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+    bool running;
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stopping = true;
+    running = prefetch->running;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    if(running) {
+        ledger_scheduler_wake(prefetch->scheduler, &prefetch->task);
+    }
+    return !running;
+}
+
+static void wait_prefetch_stopped(ledger_consumer *consumer) {
+    ledger_consumer_prefetch *prefetch = &consumer->prefetch;
+
+    if(stop_prefetch(consumer)) {
+        return;
+    }
+    pthread_mutex_lock(&prefetch->lock);
+    while(prefetch->running) {
+        pthread_cond_wait(&prefetch->stopped_cond, &prefetch->lock);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+// Frees whatever was read ahead and never consumed
+static void free_prefetched(ledger_consumer_prefetch *prefetch) {
+    while(prefetch->count > 0) {
+        ledger_message_set_free(&prefetch->sets[prefetch->head]);
+        prefetch->head = (prefetch->head + 1) % prefetch->capacity;
+        prefetch->count--;
+    }
+    free(prefetch->sets);
+    prefetch->sets = NULL;
+    prefetch->scheduler = NULL;
+}
+
+typedef enum {
+    STEP_CONSUMED,
+    STEP_WAIT,
+    STEP_DONE
+} consume_step_result;
+
+// Takes the next chunk read ahead, or waits for one
+static consume_step_result prefetched_step(ledger_consumer *consumer,
+                                           ledger_message_set *messages) {
+    ledger_status rc;
+    uint64_t seen;
+
+    rc = take_prefetched(consumer, messages, &seen);
+    if(rc == LEDGER_NEXT) {
+        if(consumer->scheduler == NULL && consumer->active) {
+            ledger_signal_wait(&consumer->prefetch.events, seen, -1);
+        }
+        return STEP_WAIT;
+    }
+    if(rc != LEDGER_OK) {
+        consumer->status = rc;
+        ledger_consumer_stop(consumer);
+        return STEP_DONE;
+    }
+    return STEP_CONSUMED;
+}
+
+// Reads the next chunk, or takes it from the ones read ahead, and hands
+// it to the consume function. STEP_WAIT when there's nothing past
+// next_message yet.
+static consume_step_result consume_step(ledger_consumer *consumer) {
+    ledger_status rc;
+    ledger_message_set messages;
+    ledger_consumer_ctx ctx;
+    ledger_consume_status consume_status;
+    consume_step_result step;
+    uint64_t last_pos;
+
+    ctx.topic_name = consumer->topic_name;
+    ctx.partition_num = consumer->partition_num;
+
+    if(prefetching(consumer)) {
+        step = prefetched_step(consumer, &messages);
+        if(step != STEP_CONSUMED) {
+            return step;
+        }
+        goto consume;
+    }
+
+    // Each set is freed before the next read, so the thread's arena is
+    // recycled from one read to the next
+    consumer->cursor.arena = ledger_message_arena_local();
+
+    rc = ledger_partition_handle_read_cursor(&consumer->partition, &consumer->cursor,
+                                             consumer->next_message,
+                                             consumer->options.read_chunk_size, &messages);
+    if(rc != LEDGER_OK) {
+        consumer->status = rc;
+        ledger_consumer_stop(consumer);
+        return STEP_DONE;
+    }
 
-            next_message = messages.next_id;
-            last_pos = messages.messages[messages.nmessages-1].id;
+    if(messages.nmessages == 0) {
+        if(consumer->next_message == LEDGER_END) {
+            last_pos = consumer->next_message;
+            consumer->next_message = messages.next_id;
             ledger_consumer_position_set(&consumer->position, last_pos);
 
-            if(consumer->options.position_behavior == LEDGER_STORE) {
-                rc = ledger_position_storage_set(&consumer->ctx->position_storage,
-                                                 consumer->options.position_key,
-                                                 consumer->partition_num,
-                                                 next_message);
-                if(rc != LEDGER_OK) {
-                    consumer->status = rc;
-                    ledger_consumer_stop(consumer);
-                    return NULL;
-                }
+            if(consumer->checkpoint != NULL) {
+                ledger_checkpoint_update(consumer->checkpoint, consumer->next_message);
             }
+        } else if(messages.next_id > consumer->next_message) {
+            // Skipped past messages compaction removed
+            consumer->next_message = messages.next_id;
+        }
+        ledger_message_set_free(&messages);
+        return STEP_WAIT;
+    }
 
-            ledger_message_set_free(&messages);
+consume:
+    consume_status = consumer->func(&ctx, &messages, consumer->data);
+    if(consume_status == LEDGER_CONSUMER_ERROR) {
+        ledger_message_set_free(&messages);
+        ledger_consumer_stop(consumer);
+        return STEP_DONE;
+    }
+
+    consumer->next_message = messages.next_id;
+    last_pos = messages.messages[messages.nmessages-1].id;
+    ledger_consumer_position_set(&consumer->position, last_pos);
 
-            if(consume_status == LEDGER_CONSUMER_STOP) {
-                ledger_consumer_stop(consumer);
+    if(consumer->checkpoint != NULL) {
+        checkpoint_position(consumer, consumer->next_message, &consumer->batches);
+    }
+
+    ledger_message_set_free(&messages);
+
+    if(consume_status == LEDGER_CONSUMER_STOP) {
+        ledger_consumer_stop(consumer);
+    }
+    return STEP_CONSUMED;
+}
+
+// Reading ahead has stopped by now
+static void finish_consuming(ledger_consumer *consumer) {
+    ledger_status rc;
+
+    if(consumer->prefetch.scheduler != NULL) {
+        free_prefetched(&consumer->prefetch);
+    }
+
+    if(consumer->checkpoint != NULL) {
+        if(consumer->options.checkpoint_on_stop) {
+            rc = ledger_checkpointer_flush(&consumer->ctx->checkpointer, consumer->checkpoint);
+            if(rc != LEDGER_OK && consumer->status == LEDGER_OK) {
+                consumer->status = rc;
             }
         }
+        ledger_checkpointer_unregister(&consumer->ctx->checkpointer, consumer->checkpoint);
+        consumer->checkpoint = NULL;
+    }
+}
+
+static void *consumer_loop(void *consumer_ptr) {
+    ledger_status rc;
+    ledger_consumer *consumer = (ledger_consumer *)consumer_ptr;
+    consume_step_result step;
+    uint32_t signals;
+
+    rc = ledger_get_partition_handle(consumer->ctx, consumer->topic_name,
+                                     consumer->partition_num, &consumer->partition);
+    if(rc != LEDGER_OK) {
+        consumer->status = rc;
+        ledger_consumer_stop(consumer);
     }
+
+    while(rc == LEDGER_OK) {
+        // Read before active, so a stop signaling readers after this is
+        // never missed by the wait below
+        signals = ledger_partition_handle_reader_signals(&consumer->partition);
+        if(!__atomic_load_n(&consumer->active, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        step = consume_step(consumer);
+        if(step == STEP_DONE) {
+            break;
+        }
+        if(step == STEP_WAIT && !prefetching(consumer)) {
+            ledger_partition_handle_wait_message_since(&consumer->partition, consumer->next_message,
+                                                       signals, -1);
+        }
+    }
+
+    if(consumer->prefetch.scheduler != NULL) {
+        wait_prefetch_stopped(consumer);
+    }
+    finish_consuming(consumer);
     return NULL;
 }
 
+// Scheduled consumers run a few chunks at a time, then make way for the
+// others on their worker
+static ledger_task_status run_consumer(ledger_task *task) {
+    ledger_consumer *consumer = (ledger_consumer *)task->data;
+    consume_step_result step = STEP_CONSUMED;
+    int i;
+
+    for(i = 0; i < SCHEDULED_STEPS && consumer->active; i++) {
+        step = consume_step(consumer);
+        if(step == STEP_WAIT) {
+            return LEDGER_TASK_PARK;
+        }
+        if(step == STEP_DONE) {
+            break;
+        }
+    }
+    if(step != STEP_DONE && consumer->active) {
+        return LEDGER_TASK_YIELD;
+    }
+    // Woken again once reading ahead stops
+    if(consumer->prefetch.scheduler != NULL && !stop_prefetch(consumer)) {
+        return LEDGER_TASK_PARK;
+    }
+
+    ledger_partition_handle_unwatch(&consumer->partition, &consumer->watch);
+    ledger_scheduler_remove(consumer->scheduler, task);
+    finish_consuming(consumer);
+
+    // Waiters may free the consumer as soon as they see this
+    pthread_mutex_lock(&consumer->lock);
+    consumer->finished = true;
+    pthread_cond_broadcast(&consumer->finished_cond);
+    pthread_mutex_unlock(&consumer->lock);
+
+    return LEDGER_TASK_DONE;
+}
+
+// Catches messages written by other processes, which don't notify
+static bool consumer_ready(ledger_task *task) {
+    ledger_consumer *consumer = (ledger_consumer *)task->data;
+    bool queued;
+
+    if(prefetching(consumer)) {
+        pthread_mutex_lock(&consumer->prefetch.lock);
+        queued = consumer->prefetch.count > 0 || !consumer->prefetch.running;
+        pthread_mutex_unlock(&consumer->prefetch.lock);
+        return queued;
+    }
+    return ledger_partition_handle_has_message(&consumer->partition, consumer->next_message);
+}
+
+static void notify_consumer(ledger_partition_watch *watch) {
+    ledger_consumer *consumer = (ledger_consumer *)watch->data;
+
+    ledger_scheduler_wake(consumer->scheduler, &consumer->task);
+}
+
+static ledger_status start_scheduled(ledger_consumer *consumer) {
+    ledger_status rc;
+
+    rc = ledger_get_consumer_scheduler(consumer->ctx, &consumer->scheduler);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to get consumer scheduler");
+
+    rc = ledger_get_partition_handle(consumer->ctx, consumer->topic_name,
+                                     consumer->partition_num, &consumer->partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find consumer partition");
+
+    consumer->finished = false;
+    consumer->active = true;
+    ledger_task_init(&consumer->task, run_consumer, consumer_ready, consumer);
+    consumer->task.signal = ledger_partition_handle_message_signal(&consumer->partition);
+    consumer->watch.notify = notify_consumer;
+    consumer->watch.data = consumer;
+
+    ledger_partition_handle_watch(&consumer->partition, &consumer->watch);
+    rc = ledger_scheduler_add(consumer->scheduler, &consumer->task);
+    if(rc != LEDGER_OK) {
+        ledger_partition_handle_unwatch(&consumer->partition, &consumer->watch);
+        consumer->active = false;
+    }
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to add consumer task");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
 ledger_status ledger_init_consumer_options(ledger_consumer_options *options) {
     options->read_chunk_size = DEFAULT_READ_CHUNK_SIZE;
     options->position_behavior = LEDGER_FORGET;
     options->position_key = NULL;
+    options->checkpoint_batches = 0;
+    options->checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS;
+    options->checkpoint_on_stop = true;
+    options->scheduled = false;
+    options->prefetch_messages = 0;
+    options->prefetch_bytes = 0;
     return LEDGER_OK;
 }
 
 ledger_status ledger_consumer_init(ledger_consumer *consumer, ledger_consume_function func, ledger_consumer_options *options, void *data) {
+    ledger_status rc;
+
+    ledger_check_rc(options->position_behavior != LEDGER_STORE ||
+                    options->position_key == NULL ||
+                    strlen(options->position_key) <= LEDGER_POSITION_KEY_MAX,
+                    LEDGER_ERR_ARGS, "Position key is too long");
+
     consumer->func = func;
     consumer->data = data;
     consumer->active = false;
     consumer->status = LEDGER_OK;
+    consumer->checkpoint = NULL;
+    consumer->scheduler = NULL;
+    consumer->finished = false;
+    pthread_mutex_init(&consumer->lock, NULL);
+    pthread_cond_init(&consumer->finished_cond, NULL);
+    consumer->prefetch.sets = NULL;
+    consumer->prefetch.count = 0;
+    consumer->prefetch.scheduler = NULL;
+    consumer->prefetch.nevents = 0;
+    ledger_signal_init(&consumer->prefetch.events, 0);
+    pthread_mutex_init(&consumer->prefetch.lock, NULL);
+    pthread_cond_init(&consumer->prefetch.stopped_cond, NULL);
     ledger_consumer_position_init(&consumer->position);
     memcpy(&consumer->options, options, sizeof(ledger_consumer_options));
 
     return LEDGER_OK;
+
+error:
+    return rc;
 }
 
 ledger_status ledger_consumer_attach(ledger_consumer *consumer, ledger_ctx *ctx,
@@ -130,78 +586,111 @@ ledger_status ledger_consumer_start(ledger_consumer *consumer, uint64_t start_id
         if(rc == LEDGER_ERR_POSITION_NOT_FOUND) {
             consumer->start_id = start_id;
         }
+
+        rc = ledger_checkpointer_register(&consumer->ctx->checkpointer,
+                                          consumer->options.position_key,
+                                          consumer->partition_num,
+                                          consumer->start_id,
+                                          consumer->options.checkpoint_interval_ms,
+                                          &consumer->checkpoint);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to register consumer checkpoint");
     } else {
         consumer->start_id = start_id;
     }
 
-    rc = pthread_create(&consumer->consumer_thread, NULL, consumer_loop, consumer);
-    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to launch consumer thread");
+    consumer->next_message = consumer->start_id;
+    consumer->batches = 0;
+    ledger_read_cursor_init(&consumer->cursor);
+
+    if(prefetching(consumer)) {
+        rc = start_prefetch(consumer);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to start reading ahead");
+    }
 
+    if(consumer->options.scheduled) {
+        rc = start_scheduled(consumer);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to schedule consumer");
+        return LEDGER_OK;
+    }
+
+    // Before the thread starts, so a consumer stopping itself straight
+    // away stays stopped
     consumer->active = true;
+    rc = pthread_create(&consumer->consumer_thread, NULL, consumer_loop, consumer);
+    if(rc != 0) {
+        consumer->active = false;
+    }
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to launch consumer thread");
 
     return LEDGER_OK;
 
 error:
+    if(consumer->prefetch.scheduler != NULL) {
+        wait_prefetch_stopped(consumer);
+        free_prefetched(&consumer->prefetch);
+    }
+    if(consumer->checkpoint != NULL) {
+        ledger_checkpointer_unregister(&consumer->ctx->checkpointer, consumer->checkpoint);
+        consumer->checkpoint = NULL;
+    }
     return rc;
 }
 
 ledger_status ledger_consumer_stop(ledger_consumer *consumer) {
-    consumer->active = false;
-    ledger_signal_readers(consumer->ctx, consumer->topic_name,
-                          consumer->partition_num);
+    __atomic_store_n(&consumer->active, false, __ATOMIC_SEQ_CST);
+    if(consumer->scheduler != NULL) {
+        ledger_scheduler_wake(consumer->scheduler, &consumer->task);
+    } else {
+        ledger_signal_readers(consumer->ctx, consumer->topic_name,
+                              consumer->partition_num);
+    }
+    if(prefetching(consumer)) {
+        pthread_mutex_lock(&consumer->prefetch.lock);
+        prefetch_event(&consumer->prefetch);
+        pthread_mutex_unlock(&consumer->prefetch.lock);
+    }
     return LEDGER_OK;
 }
 
 void ledger_consumer_wait(ledger_consumer *consumer) {
-    // 2 milliseconds
-    static const struct timespec time = {
-        0,
-        2 * 1000L * 1000L,
-    };
-
-    while(consumer->active) {
-        ledger_signal_readers(consumer->ctx, consumer->topic_name,
-                              consumer->partition_num);
-        nanosleep(&time, NULL);
+    if(consumer->options.scheduled) {
+        pthread_mutex_lock(&consumer->lock);
+        while(!consumer->finished) {
+            pthread_cond_wait(&consumer->finished_cond, &consumer->lock);
+        }
+        pthread_mutex_unlock(&consumer->lock);
+        return;
     }
 
-   pthread_join(consumer->consumer_thread, NULL);
+    pthread_join(consumer->consumer_thread, NULL);
 }
 
 void ledger_consumer_wait_for_position(ledger_consumer *consumer, uint64_t message_id) {
-    // 2 milliseconds
-    static const struct timespec time = {
-        0,
-        2 * 1000L * 1000L,
-    };
-    uint64_t pos;
-
-    do {
-        pos = ledger_consumer_position_get(&consumer->position);
-        nanosleep(&time, NULL);
-    } while(pos < message_id || pos == LEDGER_END);
+    // Only ever cut short by a spurious wake
+    while(ledger_signal_wait(&consumer->position.consumed, message_id, -1) != LEDGER_OK);
 }
 
 void ledger_consumer_close(ledger_consumer *consumer) {
+    pthread_cond_destroy(&consumer->prefetch.stopped_cond);
+    pthread_mutex_destroy(&consumer->prefetch.lock);
+    pthread_cond_destroy(&consumer->finished_cond);
+    pthread_mutex_destroy(&consumer->lock);
 }
 
 void ledger_consumer_position_init(ledger_consumer_position *position) {
-    pthread_mutex_init(&position->lock, NULL);
+    position->pos = LEDGER_END;
+    ledger_signal_init(&position->consumed, 0);
 }
 
 void ledger_consumer_position_set(ledger_consumer_position *position, uint64_t p) {
-    pthread_mutex_lock(&position->lock);
-    position->pos = p;
-    pthread_mutex_unlock(&position->lock);
+    __atomic_store_n(&position->pos, p, __ATOMIC_RELEASE);
+    if(p != LEDGER_END) {
+        ledger_signal_publish(&position->consumed, p + 1);
+    }
 }
 
 uint64_t ledger_consumer_position_get(ledger_consumer_position *position) {
-    uint64_t p;
-
-    pthread_mutex_lock(&position->lock);
-    p = position->pos;
-    pthread_mutex_unlock(&position->lock);
-    return p;
+    return __atomic_load_n(&position->pos, __ATOMIC_ACQUIRE);
 }
 
 ledger_status ledger_consumer_group_init(ledger_consumer_group *group, unsigned int nconsumers,
@@ -292,5 +781,10 @@ void ledger_consumer_group_wait(ledger_consumer_group *group) {
 }
 
 void ledger_consumer_group_close(ledger_consumer_group *group) {
+    int i;
+
+    for(i = 0; i < group->nconsumers; i++) {
+        ledger_consumer_close(&group->consumers[i]);
+    }
     free(group->consumers);
 }
@@ -22,14 +22,33 @@ typedef enum {
 } ledger_consumer_position_behavior;
 
 typedef struct {
+    // The last message consumed, LEDGER_END before the first
     uint64_t pos;
-    pthread_mutex_t lock;
+    // One past the last message consumed, waited on for positions
+    ledger_signal consumed;
 } ledger_consumer_position;
 
 typedef struct {
     size_t read_chunk_size;
     ledger_consumer_position_behavior position_behavior;
+    // Stored positions are keyed by this and the partition, so it can be at
+    // most LEDGER_POSITION_KEY_MAX bytes long
     const char *position_key;
+    // With LEDGER_STORE, positions go to the context's checkpointer. It
+    // stores them every checkpoint_interval_ms, and is asked to every
+    // checkpoint_batches batches, 0 turning either off. Positions since
+    // the last one stored are consumed again after a crash.
+    unsigned int checkpoint_batches;
+    uint64_t checkpoint_interval_ms;
+    bool checkpoint_on_stop;
+    // Shares the context's consumer scheduler threads with the other
+    // scheduled consumers, rather than running on a thread of its own
+    bool scheduled;
+    // Reads up to prefetch_messages messages, and prefetch_bytes bytes of
+    // them, ahead of the consume function on the consumer scheduler. 0
+    // messages turns read ahead off, 0 bytes leaves the bytes unbounded.
+    size_t prefetch_messages;
+    size_t prefetch_bytes;
 } ledger_consumer_options;
 
 typedef struct {
@@ -37,6 +56,31 @@ typedef struct {
     unsigned int partition_num;
 } ledger_consumer_ctx;
 
+// Message sets read ahead of the consume function, oldest first
+typedef struct {
+    ledger_message_set *sets;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t nmessages;
+    size_t nbytes;
+    // Where the next read starts
+    uint64_t next_id;
+    ledger_read_cursor cursor;
+    ledger_status status;
+    bool running;
+    bool stopping;
+    // Raised with every set queued, whenever reading ahead stops and
+    // whenever the consumer is stopped. Consumers on threads wait on it.
+    ledger_signal events;
+    uint64_t nevents;
+    ledger_scheduler *scheduler;
+    ledger_task task;
+    ledger_partition_watch watch;
+    pthread_mutex_t lock;
+    pthread_cond_t stopped_cond;
+} ledger_consumer_prefetch;
+
 typedef ledger_consume_status (*ledger_consume_function)(ledger_consumer_ctx *ctx, ledger_message_set *messages, void *data);
 
 typedef struct {
@@ -47,11 +91,26 @@ typedef struct {
     const char *topic_name;
     unsigned int partition_num;
     uint64_t start_id;
-    bool active; // TOOD: Needs locking?
+    // Cleared by stop, and read atomically by the consuming thread
+    bool active;
     ledger_status status;
     ledger_consumer_position position;
+    ledger_checkpoint *checkpoint;
+    // Where consuming is up to, kept here for scheduled consumers to
+    // pick up from run to run
+    ledger_partition_handle partition;
+    ledger_read_cursor cursor;
+    uint64_t next_message;
+    unsigned int batches;
     pthread_t consumer_thread;
+    // Scheduled consumers
+    ledger_scheduler *scheduler;
+    ledger_task task;
+    ledger_partition_watch watch;
+    bool finished;
+    pthread_cond_t finished_cond;
     pthread_mutex_t lock;
+    ledger_consumer_prefetch prefetch;
 } ledger_consumer;
 
 typedef struct {
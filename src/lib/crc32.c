@@ -1,4 +1,23 @@
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_X86 1
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include "crc32.h"
+
+// Castagnoli polynomial, bit reflected
+#define CRC32C_POLY 0x82f63b78
+
+// Block lengths for the three interleaved streams of the PCLMUL kernel
+#define CRC32C_LONG_BLOCK 8192
+#define CRC32C_SHORT_BLOCK 256
 
 unsigned long crc32_compute(unsigned long in_crc32, const void *buf,
                             size_t buflen) {
@@ -53,3 +72,206 @@ unsigned long crc32_compute(unsigned long in_crc32, const void *buf,
     }
     return( crc32 ^ 0xFFFFFFFF );
 }
+
+typedef uint32_t (*crc32c_function)(uint32_t crc, const unsigned char *buf, size_t len);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_function crc32c_impl;
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_tables() {
+    uint32_t crc;
+    int i, j;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for(j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Slicing-by-8, for CPUs without the crc32 instruction
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint32_t hi;
+
+    crc = ~crc;
+    while(len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while(len >= 8) {
+        crc ^= load_le32(buf);
+        hi = load_le32(buf + 4);
+        crc = crc32c_table[7][crc & 0xff] ^
+            crc32c_table[6][(crc >> 8) & 0xff] ^
+            crc32c_table[5][(crc >> 16) & 0xff] ^
+            crc32c_table[4][crc >> 24] ^
+            crc32c_table[3][hi & 0xff] ^
+            crc32c_table[2][(hi >> 8) & 0xff] ^
+            crc32c_table[1][(hi >> 16) & 0xff] ^
+            crc32c_table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+// Multipliers that move a CRC past one or two blocks of zeros, see
+// shift_crc. Indexed by the number of blocks.
+static uint32_t long_shifts[3];
+static uint32_t short_shifts[3];
+
+// x^n mod P, bit reflected
+static uint32_t crc32c_xpow(uint64_t n) {
+    uint32_t r = 0x80000000;
+
+    while(n-- > 0) {
+        r = r & 1 ? (r >> 1) ^ CRC32C_POLY : r >> 1;
+    }
+    return r;
+}
+
+static void crc32c_init_shifts() {
+    int i;
+
+    // The carry-less product comes out one degree high, and the crc32
+    // instruction adds another 32, which the multiplier makes up for
+    for(i = 1; i <= 2; i++) {
+        long_shifts[i] = crc32c_xpow((uint64_t)CRC32C_LONG_BLOCK * 8 * i - 33);
+        short_shifts[i] = crc32c_xpow((uint64_t)CRC32C_SHORT_BLOCK * 8 * i - 33);
+    }
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(uint64_t));
+    return v;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t crc0 = ~crc;
+
+    while(len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *buf++);
+        len--;
+    }
+    while(len >= 8) {
+        crc0 = _mm_crc32_u64(crc0, load64(buf));
+        buf += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        crc0 = _mm_crc32_u8(crc0, *buf++);
+        len--;
+    }
+    return ~(uint32_t)crc0;
+}
+
+// Multiplies crc by x^(n * 8) mod P, where shift was made for n bytes
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t shift_crc(uint64_t crc, uint32_t shift) {
+    __m128i product;
+
+    product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((uint32_t)crc),
+                                   _mm_cvtsi32_si128(shift), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+// The crc32 instruction has a latency of three cycles but a throughput of
+// one, so three independent streams keep it busy. Their CRCs are joined
+// with carry-less multiplies.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_pclmul(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t crc0 = ~crc;
+    uint64_t crc1, crc2;
+    const unsigned char *end;
+
+    while(len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *buf++);
+        len--;
+    }
+
+    while(len >= CRC32C_LONG_BLOCK * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = buf + CRC32C_LONG_BLOCK;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(buf));
+            crc1 = _mm_crc32_u64(crc1, load64(buf + CRC32C_LONG_BLOCK));
+            crc2 = _mm_crc32_u64(crc2, load64(buf + CRC32C_LONG_BLOCK * 2));
+            buf += 8;
+        } while(buf < end);
+        crc0 = shift_crc(crc0, long_shifts[2]) ^ shift_crc(crc1, long_shifts[1]) ^ crc2;
+        buf += CRC32C_LONG_BLOCK * 2;
+        len -= CRC32C_LONG_BLOCK * 3;
+    }
+
+    while(len >= CRC32C_SHORT_BLOCK * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = buf + CRC32C_SHORT_BLOCK;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(buf));
+            crc1 = _mm_crc32_u64(crc1, load64(buf + CRC32C_SHORT_BLOCK));
+            crc2 = _mm_crc32_u64(crc2, load64(buf + CRC32C_SHORT_BLOCK * 2));
+            buf += 8;
+        } while(buf < end);
+        crc0 = shift_crc(crc0, short_shifts[2]) ^ shift_crc(crc1, short_shifts[1]) ^ crc2;
+        buf += CRC32C_SHORT_BLOCK * 2;
+        len -= CRC32C_SHORT_BLOCK * 3;
+    }
+
+    return crc32c_sse42(~(uint32_t)crc0, buf, len);
+}
+
+#endif
+
+static void crc32c_select() {
+#ifdef CRC32C_X86
+    unsigned int eax, ebx, ecx, edx;
+#endif
+
+    crc32c_init_tables();
+    crc32c_impl = crc32c_sw;
+
+#ifdef CRC32C_X86
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+        crc32c_impl = crc32c_sse42;
+        if(ecx & bit_PCLMUL) {
+            crc32c_init_shifts();
+            crc32c_impl = crc32c_pclmul;
+        }
+    }
+#endif
+}
+
+uint32_t crc32c_compute(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_select);
+    return crc32c_impl(crc, (const unsigned char *)buf, len);
+}
+
+uint32_t crc32c_compute_sw(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_select);
+    return crc32c_sw(crc, (const unsigned char *)buf, len);
+}
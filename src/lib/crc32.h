@@ -1,7 +1,22 @@
 #ifndef LIB_LEDGER_CRC32_H
 #define LIB_LEDGER_CRC32_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
 unsigned long crc32_compute(unsigned long inCrc32, const void *buf,
                             size_t bufLen);
 
+// CRC32C, on the fastest kernel the CPU supports
+uint32_t crc32c_compute(uint32_t crc, const void *buf, size_t len);
+// The portable kernel, for checking the others against
+uint32_t crc32c_compute_sw(uint32_t crc, const void *buf, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
 #endif
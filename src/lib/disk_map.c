@@ -0,0 +1,482 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "disk_map.h"
+#include "murmur3.h"
+
+#define DISK_MAP_MAGIC 0x4c444d31
+#define DISK_MAP_VERSION 1
+#define MURMUR_SEED 42
+#define GROUP_SIZE 16
+#define TAGS_OFFSET 64
+#define MIN_CAPACITY 16
+// Slots moved to the next table by every set while growing
+#define MIGRATE_SLOTS 64
+
+#define TAG_EMPTY 0
+#define TAG_FULL 0x80
+
+typedef struct {
+    const char *key;
+    size_t key_len;
+    uint32_t hash;
+    uint8_t tag;
+} map_key;
+
+static void init_key(map_key *k, const char *key, size_t key_len) {
+    k->key = key;
+    k->key_len = key_len;
+    MurmurHash3_x86_32(key, key_len, MURMUR_SEED, &k->hash);
+    k->tag = TAG_FULL | (k->hash >> 25);
+}
+
+static size_t slots_offset(uint64_t capacity) {
+    return (TAGS_OFFSET + capacity + 63) & ~(size_t)63;
+}
+
+static size_t table_len(uint64_t capacity) {
+    return slots_offset(capacity) + capacity * sizeof(ledger_disk_map_slot);
+}
+
+static uint64_t table_capacity(ledger_disk_map_table *table) {
+    return table->hdr->capacity;
+}
+
+// A bit for every tag in the group equal to tag
+static uint32_t match_tags(const uint8_t *group, uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i tags = _mm_loadu_si128((const __m128i *)group);
+
+    // Tags are published after their slots
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t matches = 0;
+    int i;
+
+    for(i = 0; i < GROUP_SIZE; i++) {
+        if(__atomic_load_n(&group[i], __ATOMIC_ACQUIRE) == tag) {
+            matches |= 1u << i;
+        }
+    }
+    return matches;
+#endif
+}
+
+// Reads a slot's key and value together, retrying around writers
+static bool read_slot(ledger_disk_map_slot *slot, map_key *k, uint64_t *value) {
+    uint32_t seq;
+    bool match;
+    uint64_t v;
+
+    for(;;) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            continue;
+        }
+        match = slot->key_len == k->key_len && memcmp(slot->key, k->key, k->key_len) == 0;
+        v = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    if(match) {
+        *value = v;
+    }
+    return match;
+}
+
+static void write_slot(ledger_disk_map_slot *slot, map_key *k, uint64_t value) {
+    // Odd whatever a writer that died midway left behind
+    uint32_t seq = slot->seq | 1;
+
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if(k != NULL) {
+        memcpy(slot->key, k->key, k->key_len);
+        slot->key_len = k->key_len;
+    }
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// A process that died writing a slot leaves its seq odd, and gets would
+// wait on it forever. Callers hold the write lock.
+static void repair_slots(ledger_disk_map_table *table) {
+    uint64_t i;
+
+    for(i = 0; i < table_capacity(table); i++) {
+        if(table->slots[i].seq & 1) {
+            __atomic_store_n(&table->slots[i].seq, table->slots[i].seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Probes for the key. Returns true with its slot when it's there, and
+// otherwise false with the empty slot it belongs in, -1 when the table
+// is full.
+static bool probe(ledger_disk_map_table *table, map_key *k, int64_t *idx_out,
+                  uint64_t *value) {
+    uint64_t ngroups = table_capacity(table) / GROUP_SIZE;
+    uint64_t group, i;
+    uint32_t matches, empty;
+    uint64_t ignored;
+    int bit;
+
+    group = k->hash & (ngroups - 1);
+    for(i = 0; i < ngroups; i++) {
+        matches = match_tags(&table->tags[group * GROUP_SIZE], k->tag);
+        while(matches != 0) {
+            bit = __builtin_ctz(matches);
+            if(read_slot(&table->slots[group * GROUP_SIZE + bit], k,
+                         value != NULL ? value : &ignored)) {
+                *idx_out = group * GROUP_SIZE + bit;
+                return true;
+            }
+            matches &= matches - 1;
+        }
+
+        // Slots are never emptied, so the key would be here by now
+        empty = match_tags(&table->tags[group * GROUP_SIZE], TAG_EMPTY);
+        if(empty != 0) {
+            *idx_out = group * GROUP_SIZE + __builtin_ctz(empty);
+            return false;
+        }
+        group = (group + 1) & (ngroups - 1);
+    }
+
+    *idx_out = -1;
+    return false;
+}
+
+// Callers hold the write lock
+static ledger_status insert(ledger_disk_map_table *table, map_key *k, int64_t idx,
+                            uint64_t value) {
+    ledger_status rc;
+
+    ledger_check_rc(idx >= 0, LEDGER_ERR_GENERAL, "Disk map is full");
+
+    write_slot(&table->slots[idx], k, value);
+    __atomic_store_n(&table->tags[idx], k->tag, __ATOMIC_RELEASE);
+    table->hdr->count++;
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Callers hold the write lock
+static ledger_status upsert(ledger_disk_map_table *table, map_key *k, uint64_t value) {
+    int64_t idx;
+
+    if(probe(table, k, &idx, NULL)) {
+        write_slot(&table->slots[idx], NULL, value);
+        return LEDGER_OK;
+    }
+    return insert(table, k, idx, value);
+}
+
+static void unmap_table(ledger_disk_map_table *table) {
+    munmap(table->mmap, table->mmap_len);
+    free(table);
+}
+
+// Maps the table at path, creating it with capacity slots when it's
+// empty or missing
+static ledger_status map_table(const char *path, uint64_t capacity, int flags,
+                               ledger_disk_map_table **table_out) {
+    ledger_status rc;
+    int fd = -1;
+    struct stat st;
+    ledger_disk_map_table *table = NULL;
+    bool created;
+
+    table = malloc(sizeof(ledger_disk_map_table));
+    ledger_check_rc(table != NULL, LEDGER_ERR_MEMORY, "Failed to allocate disk map table");
+    table->mmap = MAP_FAILED;
+    table->retired = NULL;
+
+    fd = open(path, O_RDWR|O_CREAT|flags, 0644);
+    ledger_check_rc(fd >= 0, LEDGER_ERR_IO, "Failed to open disk map");
+
+    rc = fstat(fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat disk map");
+
+    created = st.st_size == 0;
+    if(created) {
+        table->mmap_len = table_len(capacity);
+        // Sparse, and so all empty tags
+        rc = ftruncate(fd, table->mmap_len);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to size disk map");
+    } else {
+        ledger_check_rc(st.st_size >= TAGS_OFFSET, LEDGER_ERR_BAD_META, "Disk map is truncated");
+        table->mmap_len = st.st_size;
+    }
+
+    table->mmap = mmap(NULL, table->mmap_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    ledger_check_rc(table->mmap != MAP_FAILED, LEDGER_ERR_IO, "Failed to map disk map");
+
+    table->hdr = (ledger_disk_map_hdr *)table->mmap;
+    if(created) {
+        table->hdr->magic = DISK_MAP_MAGIC;
+        table->hdr->version = DISK_MAP_VERSION;
+        table->hdr->capacity = capacity;
+        table->hdr->count = 0;
+    }
+    ledger_check_rc(table->hdr->magic == DISK_MAP_MAGIC &&
+                    table->hdr->version == DISK_MAP_VERSION, LEDGER_ERR_BAD_META, "Not a disk map");
+    ledger_check_rc(table->hdr->capacity >= MIN_CAPACITY &&
+                    (table->hdr->capacity & (table->hdr->capacity - 1)) == 0 &&
+                    table_len(table->hdr->capacity) == table->mmap_len,
+                    LEDGER_ERR_BAD_META, "Disk map size doesn't match its capacity");
+
+    table->tags = table->mmap + TAGS_OFFSET;
+    table->slots = (ledger_disk_map_slot *)(table->mmap + slots_offset(table->hdr->capacity));
+
+    close(fd);
+    *table_out = table;
+    return LEDGER_OK;
+
+error:
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(table) {
+        if(table->mmap != MAP_FAILED) {
+            munmap(table->mmap, table->mmap_len);
+        }
+        free(table);
+    }
+    return rc;
+}
+
+// Callers hold the write lock
+static ledger_status migrate(ledger_disk_map *map, uint64_t nslots) {
+    ledger_status rc;
+    ledger_disk_map_table *current = map->current;
+    ledger_disk_map_table *next = map->next;
+    ledger_disk_map_slot *slot;
+    map_key k;
+    int64_t idx;
+    uint64_t end;
+
+    end = map->migrated + nslots;
+    if(end > table_capacity(current)) {
+        end = table_capacity(current);
+    }
+
+    for(; map->migrated < end; map->migrated++) {
+        if(current->tags[map->migrated] == TAG_EMPTY) {
+            continue;
+        }
+        slot = &current->slots[map->migrated];
+        init_key(&k, slot->key, slot->key_len);
+        // Keys set since growing began are already there, and newer
+        if(!probe(next, &k, &idx, NULL)) {
+            rc = insert(next, &k, idx, slot->value);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to move disk map slot");
+        }
+    }
+
+    if(map->migrated == table_capacity(current)) {
+        rc = rename(map->next_path, map->path);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to replace grown disk map");
+
+        // Gets load next before current, so they always find one of them
+        // holding everything
+        __atomic_store_n(&map->current, next, __ATOMIC_RELEASE);
+        __atomic_store_n(&map->next, NULL, __ATOMIC_RELEASE);
+        current->retired = map->retired;
+        map->retired = current;
+    }
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Callers hold the write lock
+static ledger_status grow(ledger_disk_map *map) {
+    ledger_status rc;
+    ledger_disk_map_table *next;
+
+    rc = map_table(map->next_path, table_capacity(map->current) * 2, O_TRUNC, &next);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to create grown disk map");
+
+    map->migrated = 0;
+    __atomic_store_n(&map->next, next, __ATOMIC_RELEASE);
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_disk_map_open(ledger_disk_map *map, const char *path,
+                                   uint64_t initial_capacity) {
+    ledger_status rc;
+    size_t path_len;
+    uint64_t capacity = MIN_CAPACITY;
+
+    map->current = NULL;
+    map->next = NULL;
+    map->retired = NULL;
+    map->migrated = 0;
+    map->path = NULL;
+    map->next_path = NULL;
+
+    rc = pthread_mutex_init(&map->write_lock, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize disk map lock");
+
+    map->path = strdup(path);
+    ledger_check_rc(map->path != NULL, LEDGER_ERR_MEMORY, "Failed to copy disk map path");
+
+    path_len = strlen(path);
+    map->next_path = malloc(path_len + sizeof(".next"));
+    ledger_check_rc(map->next_path != NULL, LEDGER_ERR_MEMORY, "Failed to build grown disk map path");
+    memcpy(map->next_path, path, path_len);
+    memcpy(map->next_path + path_len, ".next", sizeof(".next"));
+
+    while(capacity < initial_capacity) {
+        capacity *= 2;
+    }
+    rc = map_table(map->path, capacity, 0, &map->current);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open disk map");
+
+    pthread_mutex_lock(&map->write_lock);
+    repair_slots(map->current);
+
+    // Growing was cut short, and the next table holds the newest values.
+    // One created but never filled in is started over on the next set.
+    if(access(map->next_path, F_OK) == 0) {
+        rc = map_table(map->next_path, 0, 0, &map->next);
+        if(rc == LEDGER_OK) {
+            repair_slots(map->next);
+            rc = migrate(map, table_capacity(map->current));
+        } else {
+            unlink(map->next_path);
+            rc = LEDGER_OK;
+        }
+    }
+    pthread_mutex_unlock(&map->write_lock);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to finish growing disk map");
+
+    return LEDGER_OK;
+
+error:
+    if(map->path == NULL) {
+        pthread_mutex_destroy(&map->write_lock);
+    }
+    ledger_disk_map_close(map);
+    return rc;
+}
+
+void ledger_disk_map_close(ledger_disk_map *map) {
+    ledger_disk_map_table *table, *retired;
+
+    if(map->path == NULL) {
+        return;
+    }
+    if(map->next) {
+        unmap_table(map->next);
+    }
+    if(map->current) {
+        unmap_table(map->current);
+    }
+    for(table = map->retired; table != NULL; table = retired) {
+        retired = table->retired;
+        unmap_table(table);
+    }
+    pthread_mutex_destroy(&map->write_lock);
+
+    free(map->path);
+    free(map->next_path);
+    map->path = NULL;
+    map->next_path = NULL;
+    map->current = NULL;
+    map->next = NULL;
+    map->retired = NULL;
+}
+
+ledger_status ledger_disk_map_set(ledger_disk_map *map, const char *key,
+                                  size_t key_len, uint64_t value) {
+    ledger_status rc;
+    ledger_disk_map_table *current;
+    map_key k;
+    int64_t idx;
+
+    ledger_check_rc(key_len > 0 && key_len <= LEDGER_DISK_MAP_KEY_MAX, LEDGER_ERR_ARGS, "Bad disk map key length");
+    init_key(&k, key, key_len);
+
+    pthread_mutex_lock(&map->write_lock);
+    current = map->current;
+
+    if(map->next == NULL) {
+        if(probe(current, &k, &idx, NULL)) {
+            write_slot(&current->slots[idx], NULL, value);
+            pthread_mutex_unlock(&map->write_lock);
+            return LEDGER_OK;
+        }
+        if(idx >= 0 && (current->hdr->count + 1) * 4 <= table_capacity(current) * 3) {
+            rc = insert(current, &k, idx, value);
+            pthread_mutex_unlock(&map->write_lock);
+            return rc;
+        }
+
+        rc = grow(map);
+        if(rc != LEDGER_OK) {
+            pthread_mutex_unlock(&map->write_lock);
+            goto error;
+        }
+    }
+
+    rc = upsert(map->next, &k, value);
+    if(rc == LEDGER_OK) {
+        rc = migrate(map, MIGRATE_SLOTS);
+    }
+    pthread_mutex_unlock(&map->write_lock);
+
+    return rc;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_disk_map_get(ledger_disk_map *map, const char *key,
+                                  size_t key_len, uint64_t *value) {
+    ledger_disk_map_table *current, *next;
+    map_key k;
+    int64_t idx;
+
+    if(key_len == 0 || key_len > LEDGER_DISK_MAP_KEY_MAX) {
+        return LEDGER_NEXT;
+    }
+    init_key(&k, key, key_len);
+
+    next = __atomic_load_n(&map->next, __ATOMIC_ACQUIRE);
+    current = __atomic_load_n(&map->current, __ATOMIC_ACQUIRE);
+
+    if(next != NULL && next != current && probe(next, &k, &idx, value)) {
+        return LEDGER_OK;
+    }
+    if(probe(current, &k, &idx, value)) {
+        return LEDGER_OK;
+    }
+    return LEDGER_NEXT;
+}
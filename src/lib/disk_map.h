@@ -0,0 +1,73 @@
+#ifndef LIB_LEDGER_DISK_MAP_H
+#define LIB_LEDGER_DISK_MAP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define LEDGER_DISK_MAP_KEY_MAX 112
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t count;
+} ledger_disk_map_hdr;
+
+// Slots are only ever filled and updated, never emptied. seq is odd
+// while a slot is being written.
+typedef struct {
+    uint32_t seq;
+    uint16_t key_len;
+    uint16_t reserved;
+    uint64_t value;
+    char key[LEDGER_DISK_MAP_KEY_MAX];
+} ledger_disk_map_slot;
+
+// One memory mapped file: the header, a tag byte per slot probed 16 at
+// a time, then the slots
+typedef struct ledger_disk_map_table {
+    uint8_t *mmap;
+    size_t mmap_len;
+    ledger_disk_map_hdr *hdr;
+    uint8_t *tags;
+    ledger_disk_map_slot *slots;
+    struct ledger_disk_map_table *retired;
+} ledger_disk_map_table;
+
+// A memory mapped hash table from keys to 64 bit values, updated in
+// place. Gets take no lock and run alongside sets, which serialize on
+// the write lock. Growing builds the next table beside the current one
+// and moves a few slots over with every set, rather than all at once.
+typedef struct {
+    char *path;
+    char *next_path;
+    ledger_disk_map_table *current;
+    // Set while growing, and looked in before current
+    ledger_disk_map_table *next;
+    uint64_t migrated;
+    // Tables grown out of, kept for gets still on them
+    ledger_disk_map_table *retired;
+    pthread_mutex_t write_lock;
+} ledger_disk_map;
+
+ledger_status ledger_disk_map_open(ledger_disk_map *map, const char *path,
+                                   uint64_t initial_capacity);
+void ledger_disk_map_close(ledger_disk_map *map);
+
+ledger_status ledger_disk_map_set(ledger_disk_map *map, const char *key,
+                                  size_t key_len, uint64_t value);
+// LEDGER_NEXT when there's no such key
+ledger_status ledger_disk_map_get(ledger_disk_map *map, const char *key,
+                                  size_t key_len, uint64_t *value);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
@@ -0,0 +1,609 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IO_URING_SUPPORTED 1
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "io_engine.h"
+
+// Registered file table, shared by every journal of the context
+#define FILE_SLOTS 4096
+
+#ifdef IO_URING_SUPPORTED
+
+struct ledger_io_ring {
+    int fd;
+    unsigned int entries;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Prepared but not yet accepted by the kernel
+    unsigned int unsubmitted;
+};
+
+static int ring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+// Only ever submits, completions are waited for on the event fd
+static int ring_enter(ledger_io_ring *ring, unsigned int to_submit) {
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int ring_register(ledger_io_ring *ring, unsigned int opcode, const void *arg,
+                         unsigned int nargs) {
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nargs);
+}
+
+static void ring_close(ledger_io_ring *ring) {
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if(ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if(ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    if(ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static ledger_status ring_open(unsigned int entries, ledger_io_ring **out) {
+    ledger_status rc;
+    struct io_uring_params params;
+    ledger_io_ring *ring;
+    char *sq, *cq;
+
+    ring = malloc(sizeof(ledger_io_ring));
+    ledger_check_rc(ring != NULL, LEDGER_ERR_MEMORY, "Failed to allocate io ring");
+    memset(ring, 0, sizeof(ledger_io_ring));
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = ring_setup(entries, &params);
+    ledger_check_rc(ring->fd >= 0, LEDGER_ERR_GENERAL, "io_uring is not available");
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_map_len > ring->sq_map_len) {
+            ring->sq_map_len = ring->cq_map_len;
+        }
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ledger_check_rc(ring->sq_map != MAP_FAILED, LEDGER_ERR_IO, "Failed to map submission ring");
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        ledger_check_rc(ring->cq_map != MAP_FAILED, LEDGER_ERR_IO, "Failed to map completion ring");
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    ledger_check_rc(ring->sqes != MAP_FAILED, LEDGER_ERR_IO, "Failed to map submission entries");
+
+    sq = ring->sq_map;
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+    cq = ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    *out = ring;
+    return LEDGER_OK;
+
+error:
+    if(ring) {
+        ring_close(ring);
+    }
+    return rc;
+}
+
+// Only the I/O thread touches the rings, so the kernel is the only other
+// party to synchronize with
+static void ring_prepare(ledger_io_ring *ring, ledger_io_request *request, bool link) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if(request->buf_index != LEDGER_IO_NO_SLOT) {
+        sqe->opcode = request->op == LEDGER_IO_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)request->buf;
+        sqe->len = request->len;
+        sqe->buf_index = request->buf_index;
+    } else if(request->op == LEDGER_IO_WRITEV) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)request->iov;
+        sqe->len = request->iovcnt;
+    } else {
+        request->vec.iov_base = request->buf;
+        request->vec.iov_len = request->len;
+        sqe->opcode = request->op == LEDGER_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)&request->vec;
+        sqe->len = 1;
+    }
+    if(request->file_slot != LEDGER_IO_NO_SLOT) {
+        sqe->fd = request->file_slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = request->fd;
+    }
+    if(link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe->off = request->offset;
+    sqe->user_data = (uintptr_t)request;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
+
+static void raise_event(ledger_io_engine *engine) {
+    uint64_t value = 1;
+
+    while(write(engine->event_fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    }
+}
+
+// Submissions and completions both raise the event fd, so whatever
+// happens between checking for them and waiting isn't missed
+static void wait_event(ledger_io_engine *engine) {
+    uint64_t value;
+
+    while(read(engine->event_fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    }
+}
+
+// Hands the ring as much of the queue as it has room for. Returns how
+// many requests it took.
+static size_t prepare_queued(ledger_io_engine *engine) {
+    ledger_io_ring *ring = engine->ring;
+    ledger_io_submission *submission;
+    size_t i, room, prepared = 0;
+
+    while((submission = engine->queue_head) != NULL) {
+        room = ring->entries - engine->inflight;
+        if(room == 0 || (submission->linked && submission->nrequests > room)) {
+            break;
+        }
+
+        while(submission->nprepared < submission->nrequests && room > 0) {
+            i = submission->nprepared++;
+            ring_prepare(ring, &submission->requests[i],
+                         i + 1 < submission->nrequests && submission->requests[i + 1].link);
+            engine->inflight++;
+            prepared++;
+            room--;
+        }
+        if(submission->nprepared < submission->nrequests) {
+            break;
+        }
+
+        engine->queue_head = submission->next;
+        if(engine->queue_head == NULL) {
+            engine->queue_tail = NULL;
+        }
+    }
+    return prepared;
+}
+
+// Returns how many completions it collected
+static size_t reap_completions(ledger_io_engine *engine) {
+    ledger_io_ring *ring = engine->ring;
+    ledger_io_submission *submission;
+    ledger_io_request *request;
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    size_t reaped = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        request = (ledger_io_request *)(uintptr_t)cqe->user_data;
+        request->result = cqe->res;
+        submission = request->submission;
+        if(--submission->remaining == 0 && submission->done != NULL) {
+            submission->done(submission->done_arg);
+        }
+        engine->inflight--;
+        reaped++;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if(reaped > 0) {
+        pthread_cond_broadcast(&engine->done_cond);
+    }
+    return reaped;
+}
+
+static void *io_loop(void *engine_ptr) {
+    ledger_io_engine *engine = engine_ptr;
+    ledger_io_ring *ring = engine->ring;
+    size_t prepared, reaped;
+    int rv;
+
+    pthread_mutex_lock(&engine->lock);
+    for(;;) {
+        // Everything queued since the last round goes out together, as
+        // long as the completions have room
+        prepared = prepare_queued(engine);
+        if(!engine->running && engine->queue_head == NULL && engine->inflight == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&engine->lock);
+
+        // Never waits in the kernel, which would hold up submissions
+        // queued meanwhile until something completed
+        if(ring->unsubmitted > 0) {
+            rv = ring_enter(ring, ring->unsubmitted);
+            if(rv > 0) {
+                ring->unsubmitted -= rv;
+            }
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        reaped = reap_completions(engine);
+
+        // The kernel turning submissions away with nothing in flight is
+        // retried straight away, there'd be no completion to wake for
+        if(prepared == 0 && reaped == 0 &&
+           (ring->unsubmitted == 0 || engine->inflight > ring->unsubmitted)) {
+            pthread_mutex_unlock(&engine->lock);
+            wait_event(engine);
+            pthread_mutex_lock(&engine->lock);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return NULL;
+}
+
+static ledger_status register_file_table(ledger_io_engine *engine) {
+    ledger_status rc;
+    size_t i;
+
+    engine->file_slots = malloc(FILE_SLOTS * sizeof(int));
+    ledger_check_rc(engine->file_slots != NULL, LEDGER_ERR_MEMORY, "Failed to allocate file slots");
+    for(i = 0; i < FILE_SLOTS; i++) {
+        engine->file_slots[i] = -1;
+    }
+
+    // Sparse tables need a newer kernel. Requests use plain descriptors
+    // without one.
+    if(ring_register(engine->ring, IORING_REGISTER_FILES, engine->file_slots, FILE_SLOTS) == 0) {
+        engine->nfile_slots = FILE_SLOTS;
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_io_engine_open(ledger_io_engine *engine, unsigned int entries) {
+    ledger_status rc;
+    int rv;
+
+    memset(engine, 0, sizeof(ledger_io_engine));
+    engine->event_fd = -1;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->done_cond, NULL);
+
+    rc = ring_open(entries, &engine->ring);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open io ring");
+
+    engine->event_fd = eventfd(0, EFD_CLOEXEC);
+    ledger_check_rc(engine->event_fd >= 0, LEDGER_ERR_GENERAL, "Failed to create I/O event fd");
+
+    rv = ring_register(engine->ring, IORING_REGISTER_EVENTFD, &engine->event_fd, 1);
+    ledger_check_rc(rv == 0, LEDGER_ERR_GENERAL, "Failed to register I/O event fd");
+
+    rc = register_file_table(engine);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to register file table");
+
+    engine->running = true;
+    rv = pthread_create(&engine->thread, NULL, io_loop, engine);
+    ledger_check_rc(rv == 0, LEDGER_ERR_GENERAL, "Failed to start I/O thread");
+
+    return LEDGER_OK;
+
+error:
+    engine->running = false;
+    if(engine->ring) {
+        ring_close(engine->ring);
+        engine->ring = NULL;
+    }
+    if(engine->file_slots) {
+        free(engine->file_slots);
+        engine->file_slots = NULL;
+    }
+    if(engine->event_fd >= 0) {
+        close(engine->event_fd);
+        engine->event_fd = -1;
+    }
+    pthread_cond_destroy(&engine->done_cond);
+    pthread_mutex_destroy(&engine->lock);
+    return rc;
+}
+
+void ledger_io_engine_close(ledger_io_engine *engine) {
+    pthread_mutex_lock(&engine->lock);
+    engine->running = false;
+    raise_event(engine);
+    pthread_mutex_unlock(&engine->lock);
+    pthread_join(engine->thread, NULL);
+
+    ring_close(engine->ring);
+    engine->ring = NULL;
+    free(engine->file_slots);
+    engine->file_slots = NULL;
+    engine->nfile_slots = 0;
+    close(engine->event_fd);
+    engine->event_fd = -1;
+
+    pthread_cond_destroy(&engine->done_cond);
+    pthread_mutex_destroy(&engine->lock);
+}
+
+int ledger_io_engine_register_file(ledger_io_engine *engine, int fd) {
+    struct io_uring_files_update update;
+    int slot = LEDGER_IO_NO_SLOT;
+    size_t i;
+
+    pthread_mutex_lock(&engine->lock);
+    for(i = 0; i < engine->nfile_slots; i++) {
+        if(engine->file_slots[i] == -1) {
+            memset(&update, 0, sizeof(update));
+            update.offset = i;
+            update.fds = (uintptr_t)&fd;
+            if(ring_register(engine->ring, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+                engine->file_slots[i] = fd;
+                slot = i;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return slot;
+}
+
+void ledger_io_engine_unregister_file(ledger_io_engine *engine, int slot) {
+    struct io_uring_files_update update;
+    int fd = -1;
+
+    if(slot == LEDGER_IO_NO_SLOT) {
+        return;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uintptr_t)&fd;
+    ring_register(engine->ring, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    engine->file_slots[slot] = -1;
+    pthread_mutex_unlock(&engine->lock);
+}
+
+ledger_status ledger_io_engine_register_buffers(ledger_io_engine *engine,
+                                                const struct iovec *buffers, size_t nbuffers) {
+    ledger_status rc;
+
+    ring_register(engine->ring, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    rc = ring_register(engine->ring, IORING_REGISTER_BUFFERS, buffers, nbuffers);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to register buffers");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+#else
+
+ledger_status ledger_io_engine_open(ledger_io_engine *engine, unsigned int entries) {
+    memset(engine, 0, sizeof(ledger_io_engine));
+    return LEDGER_ERR_GENERAL;
+}
+
+void ledger_io_engine_close(ledger_io_engine *engine) {
+}
+
+int ledger_io_engine_register_file(ledger_io_engine *engine, int fd) {
+    return LEDGER_IO_NO_SLOT;
+}
+
+void ledger_io_engine_unregister_file(ledger_io_engine *engine, int slot) {
+}
+
+ledger_status ledger_io_engine_register_buffers(ledger_io_engine *engine,
+                                                const struct iovec *buffers, size_t nbuffers) {
+    return LEDGER_ERR_GENERAL;
+}
+
+#endif
+
+void ledger_io_request_init(ledger_io_request *request, ledger_io_op op, int fd,
+                            void *buf, size_t len, uint64_t offset) {
+    memset(request, 0, sizeof(ledger_io_request));
+    request->op = op;
+    request->fd = fd;
+    request->file_slot = LEDGER_IO_NO_SLOT;
+    request->buf = buf;
+    request->buf_index = LEDGER_IO_NO_SLOT;
+    request->len = len;
+    request->offset = offset;
+}
+
+// Finishes whatever the ring left undone with plain system calls
+static ledger_status finish_request(ledger_io_request *request) {
+    ledger_status rc;
+    size_t done = request->result > 0 ? request->result : 0;
+    struct iovec *iov = request->iov;
+    int iovcnt = request->iovcnt;
+    int ok;
+
+    if(done == request->len) {
+        return LEDGER_OK;
+    }
+
+    switch(request->op) {
+    case LEDGER_IO_READ:
+        ok = ledger_pread(request->fd, (char *)request->buf + done, request->len - done,
+                          request->offset + done);
+        break;
+    case LEDGER_IO_WRITE:
+        ok = ledger_pwrite(request->fd, (char *)request->buf + done, request->len - done,
+                           request->offset + done);
+        break;
+    default:
+        while(iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+        ok = ledger_pwritev(request->fd, iov, iovcnt,
+                            request->offset + (request->result > 0 ? request->result : 0));
+        break;
+    }
+    ledger_check_rc(ok, LEDGER_ERR_IO, "Failed to finish I/O request");
+
+    request->result = request->len;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+void ledger_io_engine_submit(ledger_io_engine *engine, ledger_io_submission *submission,
+                             ledger_io_request *requests, size_t nrequests,
+                             void (*done)(void *arg), void *done_arg) {
+    size_t i;
+
+    submission->requests = requests;
+    submission->nrequests = nrequests;
+    submission->nprepared = 0;
+    submission->remaining = nrequests;
+    submission->linked = false;
+    submission->done = done;
+    submission->done_arg = done_arg;
+    submission->next = NULL;
+    for(i = 0; i < nrequests; i++) {
+        requests[i].result = 0;
+        requests[i].submission = submission;
+        if(requests[i].link) {
+            submission->linked = true;
+        }
+    }
+
+#ifdef IO_URING_SUPPORTED
+    if(engine != NULL && engine->ring != NULL && nrequests > 0 &&
+       (!submission->linked || nrequests <= engine->ring->entries)) {
+        pthread_mutex_lock(&engine->lock);
+        if(engine->queue_tail != NULL) {
+            engine->queue_tail->next = submission;
+        } else {
+            engine->queue_head = submission;
+        }
+        engine->queue_tail = submission;
+        raise_event(engine);
+        pthread_mutex_unlock(&engine->lock);
+        return;
+    }
+#endif
+
+    // Left for ledger_io_engine_complete to carry out
+    submission->remaining = 0;
+    if(done != NULL) {
+        done(done_arg);
+    }
+}
+
+bool ledger_io_engine_done(ledger_io_engine *engine, ledger_io_submission *submission) {
+    bool done;
+
+    if(engine == NULL || engine->ring == NULL) {
+        return true;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    done = submission->remaining == 0;
+    pthread_mutex_unlock(&engine->lock);
+    return done;
+}
+
+ledger_status ledger_io_engine_complete(ledger_io_engine *engine,
+                                        ledger_io_submission *submission) {
+    ledger_status rc;
+    size_t i;
+
+    if(engine != NULL && engine->ring != NULL) {
+        pthread_mutex_lock(&engine->lock);
+        while(submission->remaining > 0) {
+            pthread_cond_wait(&engine->done_cond, &engine->lock);
+        }
+        pthread_mutex_unlock(&engine->lock);
+    }
+
+    // In order, so a link broken by a short transfer still completes
+    // before the requests that follow it
+    for(i = 0; i < submission->nrequests; i++) {
+        rc = finish_request(&submission->requests[i]);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to complete I/O request");
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_io_engine_run(ledger_io_engine *engine, ledger_io_request *requests,
+                                   size_t nrequests) {
+    ledger_io_submission submission;
+
+    ledger_io_engine_submit(engine, &submission, requests, nrequests, NULL, NULL);
+    return ledger_io_engine_complete(engine, &submission);
+}
@@ -0,0 +1,132 @@
+#ifndef LIB_LEDGER_IO_ENGINE_H
+#define LIB_LEDGER_IO_ENGINE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef enum {
+    // Every read and write is a system call on the caller's thread
+    LEDGER_IO_SYNC = 0,
+    // Reads and writes are queued to an io_uring driven by one I/O
+    // thread per context. It saves system calls, batching what
+    // concurrent callers queue, and orders linked writes. Callers either
+    // wait for their requests, or submit them and are called back once
+    // they complete. Falls back to LEDGER_IO_SYNC when the kernel
+    // doesn't support it.
+    LEDGER_IO_URING
+} ledger_io_backend;
+
+typedef enum {
+    LEDGER_IO_READ = 0,
+    LEDGER_IO_WRITE,
+    LEDGER_IO_WRITEV
+} ledger_io_op;
+
+#define LEDGER_IO_NO_SLOT (-1)
+
+typedef struct ledger_io_request {
+    ledger_io_op op;
+    int fd;
+    // Registered file standing in for fd, or LEDGER_IO_NO_SLOT
+    int file_slot;
+    void *buf;
+    // Registered buffer holding buf, or LEDGER_IO_NO_SLOT
+    int buf_index;
+    struct iovec *iov;
+    int iovcnt;
+    size_t len;
+    uint64_t offset;
+    // Starts once the request before it in the same submission has
+    // completed in full
+    bool link;
+    // Bytes transferred, or a negative errno
+    ssize_t result;
+    // Single buffer requests are submitted as vectors of one
+    struct iovec vec;
+    struct ledger_io_submission *submission;
+} ledger_io_request;
+
+typedef struct ledger_io_submission {
+    ledger_io_request *requests;
+    size_t nrequests;
+    // Handed to the ring so far, submissions bigger than it go in pieces
+    size_t nprepared;
+    size_t remaining;
+    // Linked requests have to reach the ring together
+    bool linked;
+    void (*done)(void *arg);
+    void *done_arg;
+    struct ledger_io_submission *next;
+} ledger_io_submission;
+
+typedef struct ledger_io_ring ledger_io_ring;
+
+typedef struct {
+    ledger_io_ring *ring;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Registered with the ring, so it's raised for every completion as
+    // well as every submission. The I/O thread waits on it.
+    int event_fd;
+    pthread_cond_t done_cond;
+    ledger_io_submission *queue_head;
+    ledger_io_submission *queue_tail;
+    size_t inflight;
+    bool running;
+    int *file_slots;
+    size_t nfile_slots;
+} ledger_io_engine;
+
+// Fails with LEDGER_ERR_GENERAL when io_uring isn't available
+ledger_status ledger_io_engine_open(ledger_io_engine *engine, unsigned int entries);
+void ledger_io_engine_close(ledger_io_engine *engine);
+
+// Queues the requests for the I/O thread, which submits everything
+// queued meanwhile together, and waits for them to complete. Short and
+// failed transfers are finished with plain system calls, so requests
+// either complete in full or the call fails.
+ledger_status ledger_io_engine_run(ledger_io_engine *engine, ledger_io_request *requests,
+                                   size_t nrequests);
+
+// Queues the requests without waiting for them. done, which may be NULL,
+// is called once they've all completed, on the I/O thread with the
+// engine locked, so it must not block or call into the engine. Waking a
+// task parked on the submission with ledger_scheduler_wake is what it's
+// for. Requests the ring can't take complete straight away, calling done
+// on the caller's thread. The submission and requests must stay put
+// until they're collected with ledger_io_engine_complete.
+void ledger_io_engine_submit(ledger_io_engine *engine, ledger_io_submission *submission,
+                             ledger_io_request *requests, size_t nrequests,
+                             void (*done)(void *arg), void *done_arg);
+// Whether every request of the submission has completed
+bool ledger_io_engine_done(ledger_io_engine *engine, ledger_io_submission *submission);
+// Waits for the submission if it's still running, then finishes short and
+// failed transfers the same as ledger_io_engine_run
+ledger_status ledger_io_engine_complete(ledger_io_engine *engine,
+                                        ledger_io_submission *submission);
+
+// Registered files save the kernel looking the descriptor up for every
+// request. LEDGER_IO_NO_SLOT when the table is full.
+int ledger_io_engine_register_file(ledger_io_engine *engine, int fd);
+void ledger_io_engine_unregister_file(ledger_io_engine *engine, int slot);
+// Pins the buffers for requests naming them by index. Replaces any
+// buffers registered before.
+ledger_status ledger_io_engine_register_buffers(ledger_io_engine *engine,
+                                                const struct iovec *buffers, size_t nbuffers);
+
+// Fills in a request with no registered file or buffer
+void ledger_io_request_init(ledger_io_request *request, ledger_io_op op, int fd,
+                            void *buf, size_t len, uint64_t offset);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
@@ -1,20 +1,68 @@
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE 500
 #define __STDC_FORMAT_MACROS
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <inttypes.h>
+#include <unistd.h>
 
+#include "codec.h"
 #include "crc32.h"
 #include "journal.h"
 
 #define JOURNAL_EXT "jnl"
 #define JOURNAL_IDX_EXT "idx"
+#define JOURNAL_TIME_EXT "tim"
+#define JOURNAL_COMPACT_EXT "cjn"
+#define JOURNAL_COMPACT_IDX_EXT "cix"
+#define JOURNAL_KEYS_EXT "key"
+#define JOURNAL_KEYS_TMP_EXT "ktm"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Gaps left by compaction are written this many index entries at a time
+#define GAP_CHUNK_SIZE 512
+
+// Batches up to this size are staged on the stack
+#define STACK_BATCH_SIZE 16
+
+// Requests a write of this many chunks submits without allocating
+#define STACK_IO_REQUESTS 8
+
+// Upper bound on a single coalesced read, unless one message is larger
+#define COALESCE_MAX_BYTES 1048576
+
+// Messages written together are split into compressed batches of at most
+// this many uncompressed bytes, unless a single message is larger
+#define BATCH_MAX_RAW_BYTES 262144
+
+static ledger_status journal_file_path(const char *partition_path, uint32_t journal_id,
+                                       const char *ext, char **path) {
+    ledger_status rc;
+    char journal_path[13];
+    ssize_t path_len;
+
+    rc = snprintf(journal_path, 13, "%08d.%s", journal_id, ext);
+    ledger_check_rc(rc > 0, LEDGER_ERR_GENERAL, "Error building journal path");
+
+    path_len = ledger_concat_path(partition_path, journal_path, path);
+    ledger_check_rc(path_len > 0, LEDGER_ERR_MEMORY, "Failed to build journal path");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
 
 ledger_status open_journal_index(ledger_journal *journal, const char *partition_path,
                                  uint32_t id) {
@@ -25,7 +73,7 @@ ledger_status open_journal_index(ledger_journal *journal, const char *partition_
     
     journal->idx.fd = -1;
 
-    rc = snprintf(journal_path, 13, "%08d.%s", journal->metadata->id, JOURNAL_IDX_EXT);
+    rc = snprintf(journal_path, 13, "%08d.%s", journal->id, JOURNAL_IDX_EXT);
     ledger_check_rc(rc > 0, LEDGER_ERR_GENERAL, "Error building journal index path");
 
     path_len = ledger_concat_path(partition_path, journal_path, &path);
@@ -47,6 +95,85 @@ error:
     return rc;
 }
 
+// Loads the time of the last entry, dropping any entry a crash left
+// half written so later appends stay aligned
+static ledger_status open_time_index(ledger_journal *journal, const char *partition_path) {
+    ledger_status rc;
+    char *path = NULL;
+    struct stat st;
+    ledger_journal_time_entry entry;
+    off_t len;
+
+    journal->time_fd = -1;
+    journal->last_time_ms = 0;
+
+    rc = journal_file_path(partition_path, journal->id, JOURNAL_TIME_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build journal time index path");
+
+    journal->time_fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0700);
+    ledger_check_rc(journal->time_fd > 0, LEDGER_ERR_IO, "Failed to open journal time index file");
+
+    rc = fstat(journal->time_fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal time index file");
+
+    len = st.st_size - st.st_size % sizeof(ledger_journal_time_entry);
+    if(len != st.st_size) {
+        rc = ftruncate(journal->time_fd, len);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to truncate journal time index file");
+    }
+
+    if(len > 0) {
+        rc = ledger_pread(journal->time_fd, &entry, sizeof(entry), len - sizeof(entry));
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read journal time index");
+        journal->last_time_ms = entry.time_ms;
+    }
+
+    free(path);
+    return LEDGER_OK;
+
+error:
+    if(journal->time_fd > 0) {
+        close(journal->time_fd);
+        journal->time_fd = -1;
+    }
+    if(path) {
+        free(path);
+    }
+    return rc;
+}
+
+// Compaction replaces the index first, so a crash between the renames
+// leaves a compacted journal without its index next to a compacted index.
+// Finishing the swap keeps the journal and its index from the same pass.
+static ledger_status recover_compaction(const char *partition_path, uint32_t id) {
+    ledger_status rc;
+    char *compact_path = NULL;
+    char *compact_idx_path = NULL;
+    char *path = NULL;
+
+    rc = journal_file_path(partition_path, id, JOURNAL_COMPACT_EXT, &compact_path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build compacted journal path");
+
+    rc = journal_file_path(partition_path, id, JOURNAL_COMPACT_IDX_EXT, &compact_idx_path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build compacted index path");
+
+    rc = journal_file_path(partition_path, id, JOURNAL_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build journal path");
+
+    if(access(compact_path, F_OK) == 0 && access(compact_idx_path, F_OK) != 0) {
+        rc = rename(compact_path, path);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to finish replacing a compacted journal");
+    }
+
+    rc = LEDGER_OK;
+
+error:
+    free(compact_path);
+    free(compact_idx_path);
+    free(path);
+    return rc;
+}
+
 ledger_status open_journal(ledger_journal *journal, const char *partition_path,
                            uint32_t id) {
     ledger_status rc;
@@ -56,7 +183,7 @@ ledger_status open_journal(ledger_journal *journal, const char *partition_path,
 
     journal->fd = -1;
 
-    rc = snprintf(journal_path, 13, "%08d.%s", journal->metadata->id, JOURNAL_EXT);
+    rc = snprintf(journal_path, 13, "%08d.%s", journal->id, JOURNAL_EXT);
     ledger_check_rc(rc > 0, LEDGER_ERR_GENERAL, "Error building journal path");
 
     path_len = ledger_concat_path(partition_path, journal_path, &path);
@@ -79,217 +206,2132 @@ error:
 }
 
 ledger_status ledger_journal_open(ledger_journal *journal, const char *partition_path,
-                                  ledger_journal_meta_entry *metadata, ledger_journal_options *options) {
+                                  ledger_journal_meta_entry *metadata, ledger_journal_tail *tail,
+                                  ledger_journal_options *options) {
     ledger_status rc;
 
-    journal->metadata = metadata;
+    journal->fd = -1;
+    journal->idx.fd = -1;
+    journal->time_fd = -1;
+    journal->io_slot = LEDGER_IO_NO_SLOT;
+    journal->idx.io_slot = LEDGER_IO_NO_SLOT;
+    journal->id = metadata->id;
+    journal->first_message_id = metadata->first_message_id;
+    journal->tail = tail;
+    journal->mapping = NULL;
+    pthread_mutex_init(&journal->mapping_lock, NULL);
     memcpy(&journal->options, options, sizeof(ledger_journal_options));
 
+    rc = recover_compaction(partition_path, metadata->id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to recover journal compaction");
+
     rc = open_journal(journal, partition_path, metadata->id);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open ledger journal");
 
     rc = open_journal_index(journal, partition_path, metadata->id);
-    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open ledger journal index");    
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open ledger journal index");
+
+    rc = open_time_index(journal, partition_path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open ledger journal time index");
+
+    if(options->io_engine != NULL) {
+        journal->io_slot = ledger_io_engine_register_file(options->io_engine, journal->fd);
+        journal->idx.io_slot = ledger_io_engine_register_file(options->io_engine, journal->idx.fd);
+    }
 
     return LEDGER_OK;
 
 error:
+    ledger_journal_close(journal);
     return rc;
 }
  
 
-void ledger_journal_close(ledger_journal *journal) {
-    if(journal->fd) {
-        close(journal->fd);
-    }
-    if(journal->idx.fd) {
-        close(journal->idx.fd);
+static void release_mapping(void *ref) {
+    ledger_journal_mapping *mapping = ref;
+
+    if(__atomic_sub_fetch(&mapping->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(mapping->map, mapping->len);
+        free(mapping);
     }
 }
 
-ledger_status ledger_journal_write(ledger_journal *journal, void *data,
-                                   size_t len, ledger_write_status *status) {
+// Returns a referenced mapping that covers at least the first end bytes
+// of the journal, remapping when the journal has grown past the current one.
+static ledger_status acquire_mapping(ledger_journal *journal, uint64_t end,
+                                     ledger_journal_mapping **out) {
     ledger_status rc;
-    ledger_message_hdr message_header;
-    uint64_t offset;
+    ledger_journal_mapping *mapping = NULL;
     struct stat st;
 
-    message_header.len = len;
-    message_header.crc32 = crc32_compute(0, data, len);
+    pthread_mutex_lock(&journal->mapping_lock);
+    if(journal->mapping == NULL || journal->mapping->len < end) {
+        rc = fstat(journal->fd, &st);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal file");
+        ledger_check_rc(st.st_size >= end, LEDGER_ERR_IO, "Journal is shorter than its index");
 
-    rc = fstat(journal->fd, &st);
-    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal file");
+        mapping = malloc(sizeof(ledger_journal_mapping));
+        ledger_check_rc(mapping != NULL, LEDGER_ERR_MEMORY, "Failed to allocate journal mapping");
 
-    if(st.st_size > journal->options.max_size_bytes) {
-        return LEDGER_NEXT;
+        mapping->len = st.st_size;
+        mapping->refs = 1;
+        mapping->map = mmap(NULL, mapping->len, PROT_READ, MAP_SHARED, journal->fd, 0);
+        ledger_check_rc(mapping->map != MAP_FAILED, LEDGER_ERR_IO, "Failed to memory map journal");
+
+        // Readers of the old mapping keep it alive until they're done
+        if(journal->mapping != NULL) {
+            release_mapping(journal->mapping);
+        }
+        journal->mapping = mapping;
+        mapping = NULL;
     }
+    __atomic_add_fetch(&journal->mapping->refs, 1, __ATOMIC_RELAXED);
+    *out = journal->mapping;
+    pthread_mutex_unlock(&journal->mapping_lock);
 
-    rc = ledger_pwrite(journal->fd, (void *)&message_header, sizeof(message_header), st.st_size);
-    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write message header");
+    return LEDGER_OK;
 
-    rc = ledger_pwrite(journal->fd, data, len, st.st_size + sizeof(message_header));
-    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write message");
+error:
+    pthread_mutex_unlock(&journal->mapping_lock);
+    if(mapping) {
+        free(mapping);
+    }
+    return rc;
+}
 
-    if(status != NULL) {
-        rc = ledger_journal_latest_message_id(journal, &status->message_id);
-        ledger_check_rc(rc == LEDGER_OK, LEDGER_ERR_IO, "Failed to fetch the latest message ID");
+void ledger_journal_close(ledger_journal *journal) {
+    if(journal->mapping != NULL) {
+        release_mapping(journal->mapping);
+        journal->mapping = NULL;
+    }
+    pthread_mutex_destroy(&journal->mapping_lock);
+    if(journal->options.io_engine != NULL) {
+        ledger_io_engine_unregister_file(journal->options.io_engine, journal->io_slot);
+        ledger_io_engine_unregister_file(journal->options.io_engine, journal->idx.io_slot);
+        journal->io_slot = LEDGER_IO_NO_SLOT;
+        journal->idx.io_slot = LEDGER_IO_NO_SLOT;
+    }
+    if(journal->fd > 0) {
+        close(journal->fd);
+    }
+    if(journal->idx.fd > 0) {
+        close(journal->idx.fd);
+    }
+    if(journal->time_fd > 0) {
+        close(journal->time_fd);
     }
+    journal->fd = -1;
+    journal->idx.fd = -1;
+    journal->time_fd = -1;
+}
 
-    offset = st.st_size;
-    rc = ledger_pwrite(journal->idx.fd, (void *)&offset, sizeof(uint64_t), 0);
-    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write index offset");
+void ledger_journal_tail_load(const ledger_journal_tail *tail, ledger_journal_tail *out) {
+    uint32_t seq;
 
-    return LEDGER_OK;
+    // Writers bump seq to an odd value while they update the tail
+    do {
+        seq = __atomic_load_n(&tail->seq, __ATOMIC_ACQUIRE);
+        out->journal_id = __atomic_load_n(&tail->journal_id, __ATOMIC_RELAXED);
+        out->end_offset = __atomic_load_n(&tail->end_offset, __ATOMIC_RELAXED);
+        out->next_message_id = __atomic_load_n(&tail->next_message_id, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || seq != __atomic_load_n(&tail->seq, __ATOMIC_RELAXED));
+    out->seq = seq;
+}
 
-error:
-    return rc;
+void ledger_journal_tail_store(ledger_journal_tail *tail, uint32_t journal_id,
+                               uint64_t end_offset, uint64_t next_message_id) {
+    uint32_t seq;
+
+    // Odd whatever a writer that died midway left behind
+    seq = __atomic_load_n(&tail->seq, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&tail->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&tail->journal_id, journal_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&tail->end_offset, end_offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&tail->next_message_id, next_message_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&tail->seq, seq + 1, __ATOMIC_RELEASE);
 }
 
-ledger_status ledger_journal_latest_message_id(ledger_journal *journal, uint64_t *id) {
+void ledger_journal_tail_reset(ledger_journal_tail *tail) {
+    uint32_t seq = __atomic_load_n(&tail->seq, __ATOMIC_RELAXED);
+
+    if(seq & 1) {
+        __atomic_store_n(&tail->seq, seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Takes a snapshot of the shared tail, returning whether it describes
+// this journal. Otherwise the journal is sealed, or nobody has written
+// to it since it was created, and the files have to be consulted.
+static bool load_tail(ledger_journal *journal, ledger_journal_tail *snapshot) {
+    if(journal->tail == NULL) {
+        snapshot->journal_id = 0;
+        return false;
+    }
+    ledger_journal_tail_load(journal->tail, snapshot);
+    return snapshot->journal_id == journal->id;
+}
+
+static ledger_status indexed_message_id(ledger_journal *journal, uint64_t *id) {
     ledger_status rc;
-    uint64_t journal_id;
     struct stat idx_st;
 
     rc = fstat(journal->idx.fd, &idx_st);
     ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal index file");
 
-    journal_id = idx_st.st_size / sizeof(uint64_t);
-    *id = journal->metadata->first_message_id + journal_id;
-
+    *id = journal->first_message_id + idx_st.st_size / sizeof(uint64_t);
     return LEDGER_OK;
+
 error:
     return rc;
 }
 
-ledger_status ledger_journal_read(ledger_journal *journal, uint64_t start_id,
-                                  size_t nmessages, ledger_message_set *messages) {
+// Reads or writes one of the journal's files through the I/O engine when
+// the journal has one. Non-zero once the transfer is complete, like
+// ledger_pread and ledger_pwrite.
+static int journal_io(ledger_journal *journal, ledger_io_op op, int fd, int file_slot,
+                      void *buf, size_t len, uint64_t offset) {
+    ledger_io_request request;
+
+    if(journal->options.io_engine == NULL) {
+        if(op == LEDGER_IO_READ) {
+            return ledger_pread(fd, buf, len, offset);
+        }
+        return ledger_pwrite(fd, buf, len, offset);
+    }
+
+    ledger_io_request_init(&request, op, fd, buf, len, offset);
+    request.file_slot = file_slot;
+    return ledger_io_engine_run(journal->options.io_engine, &request, 1) == LEDGER_OK;
+}
+
+static int journal_pread(ledger_journal *journal, void *buf, size_t len, uint64_t offset) {
+    return journal_io(journal, LEDGER_IO_READ, journal->fd, journal->io_slot, buf, len, offset);
+}
+
+static int index_pread(ledger_journal *journal, void *buf, size_t len, uint64_t offset) {
+    return journal_io(journal, LEDGER_IO_READ, journal->idx.fd, journal->idx.io_slot,
+                      buf, len, offset);
+}
+
+static int time_index_io(ledger_journal *journal, ledger_io_op op, void *buf, size_t len,
+                         uint64_t offset) {
+    return journal_io(journal, op, journal->time_fd, LEDGER_IO_NO_SLOT, buf, len, offset);
+}
+
+static ledger_status message_end(ledger_journal *journal, uint64_t offset, uint64_t *end) {
     ledger_status rc;
-    int i;
-    int ncorrupt = 0;
-    struct stat idx_st;
-    size_t journal_read_len, previous_count, total_messages;
-    uint64_t first_message_id, index_id;
-    uint64_t start_idx_offset, end_idx_offset;
-    uint64_t message_offset;
-    uint64_t *message_offsets;
-    uint32_t crc32_verification;
     ledger_message_hdr message_hdr;
-    ledger_message *current_message;
-    bool over_journal = false;
 
-    journal->idx.map = NULL;
+    rc = journal_pread(journal, (void *)&message_hdr, sizeof(message_hdr), offset);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message header");
 
-    if(start_id == LEDGER_END) {
-        ledger_message_set_init(messages, 0);
-        rc = ledger_journal_latest_message_id(journal, &messages->next_id);
-        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to fetch the latest message id");
+    *end = offset + sizeof(ledger_message_hdr) + ledger_message_hdr_len(&message_hdr);
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Where the last indexed message ends. The journal file itself can be
+// longer, when it holds a torn write or a recycled journal's zeroed blocks.
+static ledger_status indexed_end_offset(ledger_journal *journal, uint64_t next_id,
+                                        uint64_t *end) {
+    ledger_status rc;
+    uint64_t last_offset;
+    struct stat st;
+    uint64_t count = next_id - journal->first_message_id;
+
+    if(count == 0) {
+        *end = 0;
         return LEDGER_OK;
     }
 
-    rc = fstat(journal->idx.fd, &idx_st);
-    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal index file");
+    rc = index_pread(journal, (void *)&last_offset, sizeof(uint64_t),
+                     (count - 1) * sizeof(uint64_t));
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read the last index entry");
 
-    first_message_id = journal->metadata->first_message_id;
-    index_id = start_id - first_message_id;
-    start_idx_offset = index_id * sizeof(uint64_t);
-    if(start_idx_offset > idx_st.st_size) {
-        // Reached the end of the journal
-        return LEDGER_NEXT;
+    rc = message_end(journal, last_offset, end);
+    if(rc == LEDGER_ERR_IO) {
+        // The index points past the journal file, which was replaced
+        // underneath it. Carry on after whatever the file holds.
+        rc = fstat(journal->fd, &st);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal file");
+        *end = st.st_size;
+        rc = LEDGER_OK;
     }
-    end_idx_offset = start_idx_offset + (nmessages * sizeof(uint64_t));
-    if(end_idx_offset > idx_st.st_size) {
-        end_idx_offset = idx_st.st_size;
-        over_journal = true;
+    return rc;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_journal_write(ledger_journal *journal, void *data,
+                                   size_t len, ledger_write_status *status) {
+    ledger_status rc;
+    struct iovec message;
+    ledger_write_batch_status batch_status;
+
+    message.iov_base = data;
+    message.iov_len = len;
+
+    rc = ledger_journal_write_batch(journal, &message, 1,
+                                    status != NULL ? &batch_status : NULL);
+    if(rc == LEDGER_OK && status != NULL) {
+        status->message_id = batch_status.first_message_id;
     }
-    journal_read_len = end_idx_offset - start_idx_offset;
-    total_messages = journal_read_len / sizeof(uint64_t);
+    return rc;
+}
 
-    journal->idx.map = mmap(NULL, idx_st.st_size, PROT_READ, MAP_PRIVATE,
-                            journal->idx.fd, 0);
-    ledger_check_rc(journal->idx.map != (void *)-1, LEDGER_ERR_IO, "Failed to memory map journal index");
-    journal->idx.map_len = journal_read_len;
+static uint32_t compute_checksum(ledger_checksum checksum, const void *data, size_t len) {
+    switch(checksum) {
+    case LEDGER_CHECKSUM_CRC32:
+        return crc32_compute(0, data, len);
+    case LEDGER_CHECKSUM_CRC32C:
+        return crc32c_compute(0, data, len);
+    default:
+        return 0;
+    }
+}
 
-    if(messages->initialized) {
-        previous_count = messages->nmessages;
-        rc = ledger_message_set_grow(messages, total_messages);
-        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to grow message set");
-    } else {
-        previous_count = 0;
-        rc = ledger_message_set_init(messages, total_messages);
-        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate message set");
+// Every offset of the batch goes to the index in a single append
+static ledger_status write_index(ledger_journal *journal, uint64_t *offsets, size_t nmessages) {
+    ledger_status rc;
+
+    rc = journal_io(journal, LEDGER_IO_WRITE, journal->idx.fd, journal->idx.io_slot,
+                    (void *)offsets, nmessages * sizeof(uint64_t), 0);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write index offsets");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static uint64_t realtime_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Other processes append to the index too, so the last entry is read
+// again before adding one after it
+static ledger_status load_last_time(ledger_journal *journal) {
+    ledger_status rc;
+    struct stat st;
+    ledger_journal_time_entry entry;
+    off_t len;
+
+    rc = fstat(journal->time_fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal time index file");
+
+    len = st.st_size - st.st_size % sizeof(entry);
+    if(len > 0) {
+        rc = time_index_io(journal, LEDGER_IO_READ, (void *)&entry, sizeof(entry),
+                           len - sizeof(entry));
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read journal time index");
+        journal->last_time_ms = entry.time_ms;
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Writes after the first one in a millisecond are covered by its entry.
+// A clock stepping back files messages under the last entry's time, so
+// the index stays sorted. Callers hold the partition's write lock.
+static ledger_status write_time_index(ledger_journal *journal, uint64_t first_id) {
+    ledger_status rc;
+    ledger_journal_time_entry entry;
+
+    // The cached time only ever trails the file's, so it rules out most
+    // writes without reading anything
+    entry.time_ms = realtime_ms();
+    if(entry.time_ms <= journal->last_time_ms) {
+        return LEDGER_OK;
+    }
+    rc = load_last_time(journal);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to load the last time index entry");
+    if(entry.time_ms <= journal->last_time_ms) {
+        return LEDGER_OK;
     }
+    entry.message_id = first_id;
 
-    message_offsets = (uint64_t *)journal->idx.map;
-    message_offsets = message_offsets + index_id;
-    for(i = 0; i < total_messages; i++) {
-        message_offset = *message_offsets;
-        current_message = &messages->messages[i+previous_count-ncorrupt];
+    rc = time_index_io(journal, LEDGER_IO_WRITE, (void *)&entry, sizeof(entry), 0);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write time index entry");
+
+    journal->last_time_ms = entry.time_ms;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
 
-        rc = ledger_pread(journal->fd, (void *)&message_hdr,
-                          sizeof(message_hdr), message_offset);
-        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message header");
+// Checks the record at offset against its checksum. Leaves nmessages at
+// 0 when the record runs past len, or doesn't match. Zeroed space after
+// the last write reads as an empty record, so it only counts as one when
+// the index vouches for it.
+static ledger_status check_record(ledger_journal *journal, uint64_t offset, uint64_t len,
+                                  bool indexed, uint64_t *end, uint32_t *nmessages) {
+    ledger_status rc;
+    ledger_message_hdr hdr;
+    ledger_batch_hdr batch_hdr;
+    ledger_checksum checksum;
+    uint32_t body_len;
+    char *body = NULL;
 
-        current_message->data = malloc(message_hdr.len);
-        ledger_check_rc(current_message->data != NULL, LEDGER_ERR_MEMORY, "Failed to allocate message buffer");
+    *nmessages = 0;
+    if(offset > len || len - offset < sizeof(ledger_message_hdr)) {
+        return LEDGER_OK;
+    }
 
-        current_message->len = message_hdr.len;
+    rc = journal_pread(journal, (void *)&hdr, sizeof(ledger_message_hdr), offset);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message header");
 
-        rc = ledger_pread(journal->fd, current_message->data,
-                          current_message->len, message_offset + sizeof(ledger_message_hdr));
-        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message");
+    body_len = ledger_message_hdr_len(&hdr);
+    if(len - offset - sizeof(ledger_message_hdr) < body_len ||
+       (!indexed && hdr.len == 0 && hdr.crc32 == 0)) {
+        return LEDGER_OK;
+    }
+    *end = offset + sizeof(ledger_message_hdr) + body_len;
 
-        if(journal->options.drop_corrupt) {
-            crc32_verification = crc32_compute(0, current_message->data, current_message->len);
-            if(crc32_verification != message_hdr.crc32) {
-                // Message is corrupt
-                ledger_message_free(current_message);
-                messages->nmessages--;
-                ncorrupt++;
-            }
+    checksum = ledger_message_hdr_checksum(&hdr);
+    if(ledger_message_hdr_is_batch(&hdr)) {
+        if(body_len < sizeof(ledger_batch_hdr)) {
+            return LEDGER_OK;
         }
-
-        current_message->id = start_id + i;
-        messages->next_id = start_id + i + 1;
-        message_offsets++;
+    } else if(checksum == LEDGER_CHECKSUM_NONE) {
+        *nmessages = 1;
+        return LEDGER_OK;
     }
 
-    munmap(journal->idx.map, journal->idx.map_len);
+    body = malloc(body_len + 1);
+    ledger_check_rc(body != NULL, LEDGER_ERR_MEMORY, "Failed to allocate record buffer");
 
-    if(over_journal) {
-        return LEDGER_NEXT;
+    rc = journal_pread(journal, body, body_len, offset + sizeof(ledger_message_hdr));
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read record");
+
+    if(ledger_message_hdr_is_batch(&hdr)) {
+        memcpy(&batch_hdr, body, sizeof(ledger_batch_hdr));
+        if(batch_hdr.checksum == LEDGER_CHECKSUM_NONE ||
+           (batch_hdr.checksum < LEDGER_CHECKSUM_NONE &&
+            compute_checksum(batch_hdr.checksum, body, body_len) == hdr.crc32)) {
+            *nmessages = batch_hdr.nmessages;
+        }
+    } else if(compute_checksum(checksum, body, body_len) == hdr.crc32) {
+        *nmessages = 1;
     }
 
+    free(body);
     return LEDGER_OK;
 
 error:
-    if(journal->idx.map) {
-        munmap(journal->idx.map, journal->idx.map_len);
+    if(body) {
+        free(body);
     }
     return rc;
 }
 
-ledger_status ledger_journal_delete(const char *partition_path, uint32_t journal_id) {
+// Whether a zeroed record header sits at offset, as it does past the end
+// of a recycled journal
+static ledger_status zeroed_at(ledger_journal *journal, uint64_t offset, uint64_t len,
+                               bool *zeroed) {
     ledger_status rc;
-    char *path = NULL;
-    char journal_path[13];
-    size_t path_len;
+    ledger_message_hdr hdr;
 
-    rc = snprintf(journal_path, 13, "%08d.%s", journal_id, JOURNAL_EXT);
-    ledger_check_rc(rc > 0, LEDGER_ERR_GENERAL, "Error building journal path");
+    *zeroed = false;
+    if(offset > len || len - offset < sizeof(ledger_message_hdr)) {
+        return LEDGER_OK;
+    }
 
-    path_len = ledger_concat_path(partition_path, journal_path, &path);
-    ledger_check_rc(path_len > 0, LEDGER_ERR_MEMORY, "Failed to build journal path");
+    rc = journal_pread(journal, (void *)&hdr, sizeof(ledger_message_hdr), offset);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message header");
 
-    rc = unlink(path);
-    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to unlink journal file");
+    *zeroed = hdr.len == 0 && hdr.crc32 == 0;
+    return LEDGER_OK;
 
-    free(path);
+error:
+    return rc;
+}
+
+// Counts how many of the last nindexed index entries point at offset,
+// which is every message of a batch record
+static ledger_status count_trailing_entries(ledger_journal *journal, uint64_t nindexed,
+                                            uint64_t offset, uint64_t *count) {
+    ledger_status rc;
+    uint64_t entries[GAP_CHUNK_SIZE];
+    size_t i, chunk;
+
+    *count = 0;
+    while(*count < nindexed) {
+        chunk = nindexed - *count < GAP_CHUNK_SIZE ? nindexed - *count : GAP_CHUNK_SIZE;
+        rc = index_pread(journal, (void *)entries, chunk * sizeof(uint64_t),
+                         (nindexed - *count - chunk) * sizeof(uint64_t));
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read index entries");
 
+        for(i = chunk; i > 0; i--) {
+            if(entries[i - 1] != offset) {
+                return LEDGER_OK;
+            }
+            (*count)++;
+        }
+    }
     return LEDGER_OK;
 
 error:
-    if(path) {
-        free(path);
-    }
     return rc;
 }
+
+static ledger_status push_offsets(uint64_t **offsets, size_t *noffsets, size_t *cap,
+                                  uint64_t offset, uint64_t count) {
+    uint64_t *grown;
+
+    for(; count > 0; count--) {
+        if(*noffsets == *cap) {
+            grown = ledger_reallocarray(*offsets, *cap > 0 ? *cap * 2 : 64, sizeof(uint64_t));
+            if(grown == NULL) {
+                return LEDGER_ERR_MEMORY;
+            }
+            *offsets = grown;
+            *cap = *cap > 0 ? *cap * 2 : 64;
+        }
+        (*offsets)[(*noffsets)++] = offset;
+    }
+    return LEDGER_OK;
+}
+
+// Drops time index entries for messages the recovery took back
+static ledger_status trim_time_index(ledger_journal *journal, uint64_t next_id) {
+    ledger_status rc;
+    struct stat st;
+    ledger_journal_time_entry entry;
+    uint64_t nentries;
+
+    rc = fstat(journal->time_fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal time index file");
+
+    nentries = st.st_size / sizeof(ledger_journal_time_entry);
+    journal->last_time_ms = 0;
+    while(nentries > 0) {
+        rc = time_index_io(journal, LEDGER_IO_READ, (void *)&entry, sizeof(entry),
+                           (nentries - 1) * sizeof(entry));
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read journal time index");
+
+        if(entry.message_id < next_id) {
+            journal->last_time_ms = entry.time_ms;
+            break;
+        }
+        nentries--;
+    }
+
+    if(nentries * sizeof(entry) != st.st_size) {
+        rc = ftruncate(journal->time_fd, nentries * sizeof(entry));
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to truncate journal time index file");
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Repairs what a crash mid-write leaves behind: index entries whose
+// records never reached the disk, records that did without their index
+// entries, and torn records after them. Only the last indexed record and
+// what follows it are read, so this costs the size of the torn write
+// rather than the journal.
+ledger_status ledger_journal_recover_tail(ledger_journal *journal) {
+    ledger_status rc;
+    struct stat st;
+    uint64_t journal_len, nindexed, last_offset, nlast, end, next_id;
+    uint32_t nmessages = 0;
+    uint64_t *offsets = NULL;
+    size_t noffsets = 0, offsets_cap = 0;
+    bool zeroed;
+
+    rc = fstat(journal->idx.fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal index file");
+
+    nindexed = st.st_size / sizeof(uint64_t);
+    if(nindexed * sizeof(uint64_t) != st.st_size) {
+        rc = ftruncate(journal->idx.fd, nindexed * sizeof(uint64_t));
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to truncate torn index entry");
+    }
+
+    rc = fstat(journal->fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal file");
+    journal_len = st.st_size;
+
+    end = 0;
+    while(nindexed > 0) {
+        rc = index_pread(journal, (void *)&last_offset, sizeof(uint64_t),
+                         (nindexed - 1) * sizeof(uint64_t));
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read the last index entry");
+
+        rc = count_trailing_entries(journal, nindexed, last_offset, &nlast);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read the last index entries");
+
+        rc = check_record(journal, last_offset, journal_len, true, &end, &nmessages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to check the last indexed record");
+
+        if(nmessages > 0) {
+            // The index append of a batch can be cut short too
+            if(nlast < nmessages) {
+                rc = push_offsets(&offsets, &noffsets, &offsets_cap, last_offset, nmessages - nlast);
+                ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate recovered offsets");
+            }
+            break;
+        }
+
+        nindexed -= nlast;
+        end = 0;
+        rc = ftruncate(journal->idx.fd, nindexed * sizeof(uint64_t));
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to drop index entries of a torn record");
+    }
+
+    for(;;) {
+        last_offset = end;
+        rc = check_record(journal, last_offset, journal_len, false, &end, &nmessages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to check an unindexed record");
+        if(nmessages == 0) {
+            end = last_offset;
+            break;
+        }
+
+        rc = push_offsets(&offsets, &noffsets, &offsets_cap, last_offset, nmessages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate recovered offsets");
+    }
+
+    // Recycled journals stay their full length, zeroed past the records
+    rc = zeroed_at(journal, end, journal_len, &zeroed);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to check the end of the journal");
+
+    if(journal_len > end && !zeroed) {
+        rc = ftruncate(journal->fd, end);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to truncate torn journal records");
+    }
+
+    if(noffsets > 0) {
+        rc = write_index(journal, offsets, noffsets);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to index recovered records");
+    }
+
+    next_id = journal->first_message_id + nindexed + noffsets;
+    rc = trim_time_index(journal, next_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to trim the journal time index");
+
+    ledger_journal_tail_store(journal->tail, journal->id, end, next_id);
+
+    free(offsets);
+    return LEDGER_OK;
+
+error:
+    if(offsets) {
+        free(offsets);
+    }
+    return rc;
+}
+
+// Submits the records, back to back from offset, and the index append
+// as one linked chain, so the index is only written once the records it
+// points at are
+static ledger_status write_linked(ledger_journal *journal, struct iovec *vecs, size_t nvecs,
+                                  uint64_t offset, uint64_t *offsets, size_t nmessages) {
+    ledger_status rc;
+    ledger_io_request stack_requests[STACK_IO_REQUESTS];
+    ledger_io_request *requests = stack_requests;
+    size_t nchunks = (nvecs + IOV_MAX - 1) / IOV_MAX;
+    size_t i, j, chunk_start, chunk_len;
+
+    if(nchunks + 1 > STACK_IO_REQUESTS) {
+        requests = ledger_reallocarray(NULL, nchunks + 1, sizeof(ledger_io_request));
+        ledger_check_rc(requests != NULL, LEDGER_ERR_MEMORY, "Failed to allocate I/O requests");
+    }
+
+    for(i = 0, chunk_start = 0; chunk_start < nvecs; i++, chunk_start += chunk_len) {
+        chunk_len = nvecs - chunk_start;
+        if(chunk_len > IOV_MAX) {
+            chunk_len = IOV_MAX;
+        }
+        ledger_io_request_init(&requests[i], LEDGER_IO_WRITEV, journal->fd, NULL, 0, offset);
+        requests[i].file_slot = journal->io_slot;
+        requests[i].iov = &vecs[chunk_start];
+        requests[i].iovcnt = chunk_len;
+        for(j = 0; j < chunk_len; j++) {
+            requests[i].len += vecs[chunk_start + j].iov_len;
+        }
+        requests[i].link = i > 0;
+        offset += requests[i].len;
+    }
+    ledger_io_request_init(&requests[i], LEDGER_IO_WRITE, journal->idx.fd, offsets,
+                           nmessages * sizeof(uint64_t), 0);
+    requests[i].file_slot = journal->idx.io_slot;
+    requests[i].link = true;
+
+    rc = ledger_io_engine_run(journal->options.io_engine, requests, nchunks + 1);
+    ledger_check_rc(rc == LEDGER_OK, LEDGER_ERR_IO, "Failed to write messages");
+
+error:
+    if(requests != stack_requests) {
+        free(requests);
+    }
+    return rc;
+}
+
+static ledger_status write_records(ledger_journal *journal, const struct iovec *messages,
+                                   size_t nmessages, off_t journal_offset,
+                                   ledger_message_hdr *headers, struct iovec *vecs,
+                                   uint64_t *offsets, uint64_t *end_offset) {
+    ledger_status rc;
+    size_t i, chunk_start, chunk_len;
+    size_t chunk_messages = IOV_MAX / 2;
+    off_t offset = journal_offset;
+
+    for(i = 0; i < nmessages; i++) {
+        ledger_check_rc(messages[i].iov_len <= LEDGER_MESSAGE_MAX_LEN, LEDGER_ERR_ARGS, "Message is too large");
+
+        headers[i].len = (uint32_t)messages[i].iov_len |
+            (uint32_t)journal->options.checksum << LEDGER_MESSAGE_CHECKSUM_SHIFT;
+        headers[i].crc32 = compute_checksum(journal->options.checksum, messages[i].iov_base,
+                                            messages[i].iov_len);
+
+        vecs[i*2].iov_base = &headers[i];
+        vecs[i*2].iov_len = sizeof(ledger_message_hdr);
+        vecs[i*2+1].iov_base = messages[i].iov_base;
+        vecs[i*2+1].iov_len = messages[i].iov_len;
+
+        offsets[i] = offset;
+        offset += sizeof(ledger_message_hdr) + messages[i].iov_len;
+    }
+    *end_offset = offset;
+
+    if(journal->options.io_engine != NULL) {
+        return write_linked(journal, vecs, nmessages*2, journal_offset, offsets, nmessages);
+    }
+
+    for(chunk_start = 0; chunk_start < nmessages; chunk_start += chunk_len) {
+        chunk_len = nmessages - chunk_start;
+        if(chunk_len > chunk_messages) {
+            chunk_len = chunk_messages;
+        }
+        rc = ledger_pwritev(journal->fd, &vecs[chunk_start*2], chunk_len*2, offsets[chunk_start]);
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write messages");
+    }
+
+    return write_index(journal, offsets, nmessages);
+
+error:
+    return rc;
+}
+
+// Length of a record's body in a batch, key included
+static size_t batch_record_len(const struct iovec *keys, const struct iovec *messages, size_t i) {
+    if(keys == NULL) {
+        return messages[i].iov_len;
+    }
+    return sizeof(uint32_t) + keys[i].iov_len + messages[i].iov_len;
+}
+
+// Writes the messages as batch records. Each message is indexed at the
+// offset of the batch record holding it. Keys, when given, are stored
+// in front of their messages.
+static ledger_status write_compressed(ledger_journal *journal, const struct iovec *keys,
+                                      const struct iovec *messages, size_t nmessages,
+                                      off_t journal_offset, uint64_t *offsets,
+                                      uint64_t *end_offset) {
+    ledger_status rc;
+    const ledger_codec *codec;
+    ledger_message_hdr record_hdr;
+    ledger_batch_hdr batch_hdr;
+    size_t first, last, i;
+    size_t raw_len, raw_cap = 0;
+    size_t record_len, records_len = 0, records_cap = 0;
+    size_t compressed_len, body_len, len;
+    uint32_t key_len;
+    char *raw = NULL;
+    char *records = NULL;
+    char *record, *body, *next, *grown;
+    struct iovec records_vec;
+    off_t offset = journal_offset;
+
+    codec = ledger_codec_lookup(journal->options.codec);
+    ledger_check_rc(codec != NULL, LEDGER_ERR_ARGS, "Unknown compression codec");
+
+    for(first = 0; first < nmessages; first = last) {
+        raw_len = 0;
+        last = first;
+        do {
+            len = batch_record_len(keys, messages, last);
+            ledger_check_rc(len <= LEDGER_MESSAGE_MAX_LEN, LEDGER_ERR_ARGS, "Message is too large");
+            raw_len += sizeof(ledger_message_hdr) + len;
+            last++;
+        } while(last < nmessages &&
+                raw_len + sizeof(ledger_message_hdr) + batch_record_len(keys, messages, last) <= BATCH_MAX_RAW_BYTES);
+
+        if(raw_len > raw_cap) {
+            free(raw);
+            raw = malloc(raw_len);
+            ledger_check_rc(raw != NULL, LEDGER_ERR_MEMORY, "Failed to allocate batch buffer");
+            raw_cap = raw_len;
+        }
+        record_len = sizeof(ledger_message_hdr) + sizeof(ledger_batch_hdr) + codec->bound(raw_len);
+        if(record_len < sizeof(ledger_message_hdr) + sizeof(ledger_batch_hdr) + raw_len) {
+            record_len = sizeof(ledger_message_hdr) + sizeof(ledger_batch_hdr) + raw_len;
+        }
+        // Records go out back to back in a single write, after the last
+        if(records_len + record_len > records_cap) {
+            grown = realloc(records, records_len + record_len);
+            ledger_check_rc(grown != NULL, LEDGER_ERR_MEMORY, "Failed to allocate batch records");
+            records = grown;
+            records_cap = records_len + record_len;
+        }
+        record = records + records_len;
+
+        // The envelope's checksum covers the records inside it
+        next = raw;
+        for(i = first; i < last; i++) {
+            record_hdr.len = (uint32_t)batch_record_len(keys, messages, i) |
+                (uint32_t)LEDGER_CHECKSUM_NONE << LEDGER_MESSAGE_CHECKSUM_SHIFT;
+            record_hdr.crc32 = 0;
+            memcpy(next, &record_hdr, sizeof(ledger_message_hdr));
+            next += sizeof(ledger_message_hdr);
+            if(keys != NULL) {
+                key_len = keys[i].iov_len;
+                memcpy(next, &key_len, sizeof(uint32_t));
+                if(key_len > 0) {
+                    memcpy(next + sizeof(uint32_t), keys[i].iov_base, key_len);
+                }
+                next += sizeof(uint32_t) + key_len;
+            }
+            if(messages[i].iov_len > 0) {
+                memcpy(next, messages[i].iov_base, messages[i].iov_len);
+            }
+            next += messages[i].iov_len;
+        }
+
+        body = record + sizeof(ledger_message_hdr);
+        batch_hdr.codec = codec->id;
+        rc = LEDGER_ERR_GENERAL;
+        if(codec->id != LEDGER_CODEC_NONE) {
+            rc = codec->compress(raw, raw_len, body + sizeof(ledger_batch_hdr),
+                                 record_len - sizeof(ledger_message_hdr) - sizeof(ledger_batch_hdr),
+                                 &compressed_len);
+        }
+        if(rc != LEDGER_OK || compressed_len >= raw_len) {
+            // Incompressible batches are stored as they are
+            batch_hdr.codec = LEDGER_CODEC_NONE;
+            memcpy(body + sizeof(ledger_batch_hdr), raw, raw_len);
+            compressed_len = raw_len;
+        }
+
+        body_len = sizeof(ledger_batch_hdr) + compressed_len;
+        ledger_check_rc(body_len <= LEDGER_MESSAGE_MAX_LEN, LEDGER_ERR_ARGS, "Message batch is too large");
+
+        batch_hdr.checksum = journal->options.checksum;
+        batch_hdr.flags = keys != NULL ? LEDGER_BATCH_KEYED : 0;
+        batch_hdr.reserved = 0;
+        batch_hdr.nmessages = last - first;
+        batch_hdr.raw_len = raw_len;
+        memcpy(body, &batch_hdr, sizeof(ledger_batch_hdr));
+
+        record_hdr.len = (uint32_t)body_len | (uint32_t)LEDGER_MESSAGE_BATCH << LEDGER_MESSAGE_CHECKSUM_SHIFT;
+        record_hdr.crc32 = compute_checksum(journal->options.checksum, body, body_len);
+        memcpy(record, &record_hdr, sizeof(ledger_message_hdr));
+
+        for(i = first; i < last; i++) {
+            offsets[i] = offset;
+        }
+        offset += sizeof(ledger_message_hdr) + body_len;
+        records_len += sizeof(ledger_message_hdr) + body_len;
+    }
+    *end_offset = offset;
+
+    if(journal->options.io_engine != NULL) {
+        records_vec.iov_base = records;
+        records_vec.iov_len = records_len;
+        rc = write_linked(journal, &records_vec, 1, journal_offset, offsets, nmessages);
+    } else {
+        rc = ledger_pwrite(journal->fd, records, records_len, journal_offset);
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write message batches");
+
+        rc = write_index(journal, offsets, nmessages);
+    }
+
+error:
+    free(raw);
+    free(records);
+    return rc;
+}
+
+static ledger_status write_batch(ledger_journal *journal, const struct iovec *keys,
+                                 const struct iovec *messages, size_t nmessages,
+                                 ledger_write_batch_status *status) {
+    ledger_status rc;
+    ledger_journal_tail tail;
+    uint64_t first_id, start_offset, end_offset;
+    bool publish;
+    ledger_message_hdr stack_headers[STACK_BATCH_SIZE];
+    struct iovec stack_vecs[STACK_BATCH_SIZE*2];
+    uint64_t stack_offsets[STACK_BATCH_SIZE];
+    ledger_message_hdr *headers = stack_headers;
+    struct iovec *vecs = stack_vecs;
+    uint64_t *offsets = stack_offsets;
+
+    ledger_check_rc(nmessages > 0, LEDGER_ERR_ARGS, "Empty message batch");
+
+    if(load_tail(journal, &tail)) {
+        start_offset = tail.end_offset;
+        first_id = tail.next_message_id;
+        publish = true;
+    } else {
+        rc = indexed_message_id(journal, &first_id);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the next message id");
+
+        rc = indexed_end_offset(journal, first_id, &start_offset);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the end of the journal");
+
+        // The first write to a new journal takes the tail over
+        publish = journal->tail != NULL && tail.journal_id < journal->id;
+    }
+
+    if(start_offset > journal->options.max_size_bytes) {
+        return LEDGER_NEXT;
+    }
+
+    if(nmessages > STACK_BATCH_SIZE) {
+        headers = ledger_reallocarray(NULL, nmessages, sizeof(ledger_message_hdr));
+        vecs = ledger_reallocarray(NULL, nmessages*2, sizeof(struct iovec));
+        offsets = ledger_reallocarray(NULL, nmessages, sizeof(uint64_t));
+        ledger_check_rc(headers != NULL && vecs != NULL && offsets != NULL,
+                        LEDGER_ERR_MEMORY, "Failed to allocate batch buffers");
+    }
+
+    // Keys only fit in batch records
+    if(journal->options.codec != LEDGER_CODEC_NONE || keys != NULL) {
+        rc = write_compressed(journal, keys, messages, nmessages, start_offset, offsets, &end_offset);
+    } else {
+        rc = write_records(journal, messages, nmessages, start_offset, headers, vecs,
+                           offsets, &end_offset);
+    }
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write message batch");
+
+    rc = write_time_index(journal, first_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to index message batch time");
+
+    if(status != NULL) {
+        status->first_message_id = first_id;
+        status->last_message_id = first_id + nmessages - 1;
+    }
+
+    if(publish) {
+        ledger_journal_tail_store(journal->tail, journal->id,
+                                  end_offset, first_id + nmessages);
+    }
+
+    rc = LEDGER_OK;
+
+error:
+    if(headers != stack_headers) {
+        free(headers);
+    }
+    if(vecs != stack_vecs) {
+        free(vecs);
+    }
+    if(offsets != stack_offsets) {
+        free(offsets);
+    }
+    return rc;
+}
+
+ledger_status ledger_journal_write_batch(ledger_journal *journal, const struct iovec *messages,
+                                         size_t nmessages, ledger_write_batch_status *status) {
+    return write_batch(journal, NULL, messages, nmessages, status);
+}
+
+ledger_status ledger_journal_write_keyed_batch(ledger_journal *journal, const struct iovec *keys,
+                                               const struct iovec *messages, size_t nmessages,
+                                               ledger_write_batch_status *status) {
+    return write_batch(journal, keys, messages, nmessages, status);
+}
+
+ledger_status ledger_journal_sync(ledger_journal *journal) {
+    ledger_status rc;
+
+    rc = fdatasync(journal->fd);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to sync journal file");
+
+    rc = fdatasync(journal->idx.fd);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to sync journal index file");
+
+    return LEDGER_OK;
+error:
+    return rc;
+}
+
+ledger_status ledger_journal_latest_message_id(ledger_journal *journal, uint64_t *id) {
+    ledger_journal_tail tail;
+
+    if(load_tail(journal, &tail)) {
+        *id = tail.next_message_id;
+        return LEDGER_OK;
+    }
+    return indexed_message_id(journal, id);
+}
+
+ledger_status ledger_journal_seek_time(ledger_journal *journal, uint64_t time_ms, uint64_t *id) {
+    ledger_status rc;
+    struct stat st;
+    ledger_journal_time_entry entry;
+    uint64_t low, high, mid, next_id;
+
+    rc = fstat(journal->time_fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal time index file");
+
+    // The first entry at or after time_ms
+    low = 0;
+    high = st.st_size / sizeof(ledger_journal_time_entry);
+    if(high == 0) {
+        rc = ledger_journal_latest_message_id(journal, &next_id);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the latest message id");
+
+        // Journals from before the time index can't be narrowed down
+        if(next_id == journal->first_message_id) {
+            return LEDGER_NEXT;
+        }
+        *id = journal->first_message_id;
+        return LEDGER_OK;
+    }
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        rc = time_index_io(journal, LEDGER_IO_READ, &entry, sizeof(entry), mid * sizeof(entry));
+        ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read journal time index");
+        if(entry.time_ms < time_ms) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if(low == st.st_size / sizeof(ledger_journal_time_entry)) {
+        return LEDGER_NEXT;
+    }
+
+    rc = time_index_io(journal, LEDGER_IO_READ, &entry, sizeof(entry), low * sizeof(entry));
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read journal time index");
+
+    *id = entry.message_id;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Where message i ends, which is where the next indexed record starts.
+// Messages of a batch share its offset. The last record in the index ends
+// at the known tail_end, or has its header read to find out.
+static ledger_status message_end_offset(ledger_journal *journal, const uint64_t *offsets,
+                                        size_t i, size_t nindexed, uint64_t tail_end,
+                                        uint64_t *end) {
+    size_t next = i + 1;
+
+    while(next < nindexed && (offsets[next] == offsets[i] || offsets[next] == LEDGER_INDEX_GAP)) {
+        next++;
+    }
+    if(next < nindexed) {
+        *end = offsets[next];
+        return LEDGER_OK;
+    }
+    if(tail_end > 0) {
+        *end = tail_end;
+        return LEDGER_OK;
+    }
+    return message_end(journal, offsets[i], end);
+}
+
+// Reads the messages starting at first, up to COALESCE_MAX_BYTES worth,
+// with a single pread. The buffer is handed to the message set.
+static ledger_status read_run(ledger_journal *journal, const uint64_t *offsets,
+                              size_t first, size_t nmessages, size_t nindexed,
+                              uint64_t tail_end, ledger_message_set *messages, char **run,
+                              uint64_t *run_start, uint64_t *run_len, size_t *run_next) {
+    ledger_status rc;
+    size_t last = first;
+    uint64_t start, end, next_end;
+    char *buf = NULL;
+
+    start = offsets[first];
+    rc = message_end_offset(journal, offsets, first, nindexed, tail_end, &end);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the end of the message");
+
+    while(last + 1 < nmessages) {
+        if(offsets[last + 1] == offsets[last] || offsets[last + 1] == LEDGER_INDEX_GAP) {
+            // Same batch record, already part of the run, or nothing to read
+            last++;
+            continue;
+        }
+        rc = message_end_offset(journal, offsets, last + 1, nindexed, tail_end, &next_end);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the end of the message");
+        if(next_end - start > COALESCE_MAX_BYTES) {
+            break;
+        }
+        end = next_end;
+        last++;
+    }
+    ledger_check_rc(end > start, LEDGER_ERR_IO, "Journal is shorter than its index");
+
+    // The buffer belongs to the message set from here on
+    buf = ledger_message_set_alloc(messages, end - start);
+    ledger_check_rc(buf != NULL, LEDGER_ERR_MEMORY, "Failed to allocate read buffer");
+
+    rc = journal_pread(journal, buf, end - start, start);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read messages");
+
+    *run = buf;
+    *run_start = start;
+    *run_len = end - start;
+    *run_next = last + 1;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Where a message's record was read to, shared by the messages of a batch
+typedef struct {
+    char *data;
+    uint64_t len;
+} read_record;
+
+// Reads the record of every message with a single submission to the I/O
+// engine, rather than a header and then a body read per message. The
+// records share one buffer, handed to the message set.
+static ledger_status read_records(ledger_journal *journal, const uint64_t *offsets,
+                                  size_t nmessages, size_t nindexed, uint64_t tail_end,
+                                  ledger_message_set *messages, read_record *records) {
+    ledger_status rc;
+    ledger_io_request *requests = NULL;
+    size_t i, nrequests = 0, last = nmessages;
+    uint64_t end, total = 0;
+    char *buf;
+
+    requests = ledger_reallocarray(NULL, nmessages, sizeof(ledger_io_request));
+    ledger_check_rc(requests != NULL, LEDGER_ERR_MEMORY, "Failed to allocate read requests");
+
+    for(i = 0; i < nmessages; i++) {
+        records[i].data = NULL;
+        records[i].len = 0;
+        if(offsets[i] == LEDGER_INDEX_GAP) {
+            continue;
+        }
+        if(last < nmessages && offsets[last] == offsets[i]) {
+            // Same batch record
+            records[i].len = records[last].len;
+            continue;
+        }
+
+        rc = message_end_offset(journal, offsets, i, nindexed, tail_end, &end);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the end of the message");
+        ledger_check_rc(end > offsets[i], LEDGER_ERR_IO, "Journal is shorter than its index");
+
+        records[i].len = end - offsets[i];
+        total += records[i].len;
+        last = i;
+    }
+
+    buf = ledger_message_set_alloc(messages, total);
+    ledger_check_rc(buf != NULL, LEDGER_ERR_MEMORY, "Failed to allocate read buffer");
+
+    last = nmessages;
+    for(i = 0; i < nmessages; i++) {
+        if(offsets[i] == LEDGER_INDEX_GAP) {
+            continue;
+        }
+        if(last < nmessages && offsets[last] == offsets[i]) {
+            records[i].data = records[last].data;
+            continue;
+        }
+
+        records[i].data = buf;
+        ledger_io_request_init(&requests[nrequests], LEDGER_IO_READ, journal->fd,
+                               buf, records[i].len, offsets[i]);
+        requests[nrequests].file_slot = journal->io_slot;
+        nrequests++;
+        buf += records[i].len;
+        last = i;
+    }
+
+    rc = ledger_io_engine_run(journal->options.io_engine, requests, nrequests);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read messages");
+
+    free(requests);
+    return LEDGER_OK;
+
+error:
+    if(requests) {
+        free(requests);
+    }
+    return rc;
+}
+
+// A batch record decompressed for reading, shared by every message read
+// out of it
+typedef struct {
+    bool valid;
+    bool corrupt;
+    bool keyed;
+    uint64_t offset;
+    uint64_t first_index;
+    uint32_t nmessages;
+    char *data;
+    uint32_t *records;
+} read_batch;
+
+// Decompresses a batch record's body and finds the records in it. The
+// decompressed buffer comes from the message set, so it's drawn from the
+// set's arena when it has one. Batches that fail to verify or decompress
+// are marked corrupt, leaving the buffer to go with the set.
+static ledger_status decode_batch(ledger_journal *journal, const ledger_message_hdr *hdr,
+                                  const char *body, read_batch *batch,
+                                  ledger_message_set *messages) {
+    ledger_status rc;
+    ledger_batch_hdr batch_hdr;
+    ledger_message_hdr record_hdr;
+    const ledger_codec *codec;
+    uint32_t body_len = ledger_message_hdr_len(hdr);
+    char *data = NULL;
+    size_t pos;
+    uint32_t i, record_len, key_len;
+
+    batch->corrupt = true;
+    batch->nmessages = 0;
+    batch->data = NULL;
+
+    if(body_len < sizeof(ledger_batch_hdr)) {
+        return LEDGER_OK;
+    }
+    memcpy(&batch_hdr, body, sizeof(ledger_batch_hdr));
+
+    if(journal->options.drop_corrupt && batch_hdr.checksum != LEDGER_CHECKSUM_NONE &&
+       compute_checksum(batch_hdr.checksum, body, body_len) != hdr->crc32) {
+        return LEDGER_OK;
+    }
+
+    codec = ledger_codec_lookup(batch_hdr.codec);
+    if(codec == NULL || batch_hdr.nmessages == 0 || batch_hdr.raw_len == 0) {
+        return LEDGER_OK;
+    }
+
+    if(batch->records) {
+        free(batch->records);
+    }
+    batch->records = ledger_reallocarray(NULL, batch_hdr.nmessages, sizeof(uint32_t));
+    ledger_check_rc(batch->records != NULL, LEDGER_ERR_MEMORY, "Failed to allocate batch records");
+
+    data = ledger_message_set_alloc(messages, batch_hdr.raw_len);
+    ledger_check_rc(data != NULL, LEDGER_ERR_MEMORY, "Failed to allocate batch buffer");
+
+    rc = codec->decompress(body + sizeof(ledger_batch_hdr), body_len - sizeof(ledger_batch_hdr),
+                           data, batch_hdr.raw_len);
+    if(rc != LEDGER_OK) {
+        return LEDGER_OK;
+    }
+
+    pos = 0;
+    for(i = 0; i < batch_hdr.nmessages; i++) {
+        if(pos + sizeof(ledger_message_hdr) > batch_hdr.raw_len) {
+            return LEDGER_OK;
+        }
+        memcpy(&record_hdr, data + pos, sizeof(ledger_message_hdr));
+        record_len = ledger_message_hdr_len(&record_hdr);
+        if(batch_hdr.flags & LEDGER_BATCH_KEYED) {
+            if(record_len < sizeof(uint32_t) ||
+               pos + sizeof(ledger_message_hdr) + sizeof(uint32_t) > batch_hdr.raw_len) {
+                return LEDGER_OK;
+            }
+            memcpy(&key_len, data + pos + sizeof(ledger_message_hdr), sizeof(uint32_t));
+            if(key_len > record_len - sizeof(uint32_t)) {
+                return LEDGER_OK;
+            }
+        }
+        batch->records[i] = pos;
+        pos += sizeof(ledger_message_hdr) + record_len;
+    }
+    if(pos != batch_hdr.raw_len) {
+        return LEDGER_OK;
+    }
+
+    batch->corrupt = false;
+    batch->keyed = (batch_hdr.flags & LEDGER_BATCH_KEYED) != 0;
+    batch->nmessages = batch_hdr.nmessages;
+    batch->data = data;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Every message of a batch is indexed at the batch's offset, so a
+// message's place in its batch is how far it is from the first index
+// entry with that offset. Batches are only decompressed once something
+// is read from them.
+static ledger_status read_batch_message(ledger_journal *journal, const uint64_t *index,
+                                        uint64_t index_id, const ledger_message_hdr *hdr,
+                                        const char *body, read_batch *batch,
+                                        ledger_message_set *messages, ledger_message *message,
+                                        bool *corrupt) {
+    ledger_status rc;
+    ledger_message_hdr record_hdr;
+    char *read_body = NULL;
+    char *record;
+    uint64_t offset = index[index_id];
+    uint64_t pos;
+    uint32_t key_len;
+
+    if(!batch->valid || batch->offset != offset) {
+        if(body == NULL) {
+            read_body = malloc(ledger_message_hdr_len(hdr));
+            ledger_check_rc(read_body != NULL, LEDGER_ERR_MEMORY, "Failed to allocate batch read buffer");
+
+            rc = journal_pread(journal, read_body, ledger_message_hdr_len(hdr),
+                               offset + sizeof(ledger_message_hdr));
+            ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message batch");
+            body = read_body;
+        }
+
+        rc = decode_batch(journal, hdr, body, batch, messages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to decode message batch");
+
+        batch->valid = true;
+        batch->offset = offset;
+        batch->first_index = index_id;
+        while(batch->first_index > 0 && index[batch->first_index - 1] == offset) {
+            batch->first_index--;
+        }
+
+        if(read_body) {
+            free(read_body);
+            read_body = NULL;
+        }
+    }
+
+    pos = index_id - batch->first_index;
+    *corrupt = batch->corrupt || pos >= batch->nmessages;
+    ledger_check_rc(!*corrupt || journal->options.drop_corrupt, LEDGER_ERR_IO, "Corrupt message batch");
+
+    message->borrowed = true;
+    if(*corrupt) {
+        message->data = NULL;
+        message->len = 0;
+        return LEDGER_OK;
+    }
+
+    record = batch->data + batch->records[pos];
+    memcpy(&record_hdr, record, sizeof(ledger_message_hdr));
+    message->data = record + sizeof(ledger_message_hdr);
+    message->len = ledger_message_hdr_len(&record_hdr);
+    if(batch->keyed) {
+        // Verified to fit when the batch was decoded
+        memcpy(&key_len, message->data, sizeof(uint32_t));
+        message->key = key_len > 0 ? (char *)message->data + sizeof(uint32_t) : NULL;
+        message->key_len = key_len;
+        message->data = (char *)message->data + sizeof(uint32_t) + key_len;
+        message->len -= sizeof(uint32_t) + key_len;
+    }
+    return LEDGER_OK;
+
+error:
+    if(read_body) {
+        free(read_body);
+    }
+    return rc;
+}
+
+ledger_status ledger_journal_read(ledger_journal *journal, uint64_t start_id,
+                                  size_t nmessages, ledger_message_set *messages) {
+    ledger_status rc;
+    int i;
+    int nskipped = 0;
+    struct stat idx_st;
+    ledger_journal_tail tail;
+    uint64_t idx_len;
+    uint64_t tail_end = 0;
+    size_t journal_read_len, previous_count, total_messages;
+    uint64_t first_message_id, index_id;
+    uint64_t start_idx_offset, end_idx_offset;
+    uint64_t message_offset, last_offset;
+    uint64_t *message_offsets;
+    uint32_t crc32_verification;
+    ledger_checksum checksum;
+    ledger_message_hdr message_hdr;
+    ledger_message *current_message;
+    bool over_journal = false;
+    void *idx_map = NULL;
+    size_t idx_map_len = 0;
+    ledger_journal_mapping *mapping = NULL;
+    char *run = NULL;
+    uint64_t run_start = 0;
+    uint64_t run_len = 0;
+    size_t run_next = 0;
+    size_t nindexed;
+    uint64_t message_end;
+    char *record_data;
+    bool corrupt;
+    read_batch batch;
+    read_record *records = NULL;
+
+    memset(&batch, 0, sizeof(read_batch));
+
+    if(start_id == LEDGER_END) {
+        ledger_message_set_init_arena(messages, 0, messages->arena);
+        rc = ledger_journal_latest_message_id(journal, &messages->next_id);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to fetch the latest message id");
+        return LEDGER_OK;
+    }
+
+    first_message_id = journal->first_message_id;
+    if(load_tail(journal, &tail)) {
+        // Only what the tail has published is visible to readers
+        idx_len = (tail.next_message_id - first_message_id) * sizeof(uint64_t);
+        tail_end = tail.end_offset;
+    } else {
+        rc = fstat(journal->idx.fd, &idx_st);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal index file");
+        idx_len = idx_st.st_size;
+    }
+
+    index_id = start_id - first_message_id;
+    start_idx_offset = index_id * sizeof(uint64_t);
+    if(start_idx_offset > idx_len) {
+        // Reached the end of the journal
+        return LEDGER_NEXT;
+    }
+    end_idx_offset = start_idx_offset + (nmessages * sizeof(uint64_t));
+    if(end_idx_offset > idx_len) {
+        end_idx_offset = idx_len;
+        over_journal = true;
+    }
+    journal_read_len = end_idx_offset - start_idx_offset;
+    total_messages = journal_read_len / sizeof(uint64_t);
+
+    messages->next_id = start_id;
+    if(total_messages == 0) {
+        // Nothing to map, the index is empty past this point
+        if(!messages->initialized) {
+            rc = ledger_message_set_init_arena(messages, 0, messages->arena);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate message set");
+        }
+        return over_journal ? LEDGER_NEXT : LEDGER_OK;
+    }
+
+    // The journal may be shared between readers, so the index mapping
+    // stays local to this read.
+    idx_map_len = idx_len;
+    idx_map = mmap(NULL, idx_map_len, PROT_READ, MAP_PRIVATE,
+                   journal->idx.fd, 0);
+    if(idx_map == MAP_FAILED) {
+        idx_map = NULL;
+    }
+    ledger_check_rc(idx_map != NULL, LEDGER_ERR_IO, "Failed to memory map journal index");
+
+    if(messages->initialized) {
+        previous_count = messages->nmessages;
+        rc = ledger_message_set_grow(messages, total_messages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to grow message set");
+    } else {
+        previous_count = 0;
+        rc = ledger_message_set_init_arena(messages, total_messages, messages->arena);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate message set");
+    }
+
+    message_offsets = (uint64_t *)idx_map;
+    message_offsets = message_offsets + index_id;
+
+    last_offset = LEDGER_INDEX_GAP;
+    for(i = total_messages; i > 0 && last_offset == LEDGER_INDEX_GAP; i--) {
+        last_offset = message_offsets[i - 1];
+    }
+
+    if(journal->options.read_mode == LEDGER_READ_MMAP && last_offset != LEDGER_INDEX_GAP) {
+        // Map far enough to cover the last message, headers included
+        message_offset = last_offset;
+        rc = acquire_mapping(journal, message_offset + sizeof(ledger_message_hdr), &mapping);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to map journal");
+
+        memcpy(&message_hdr, (char *)mapping->map + message_offset, sizeof(ledger_message_hdr));
+        message_end = message_offset + sizeof(ledger_message_hdr) + ledger_message_hdr_len(&message_hdr);
+        if(mapping->len < message_end) {
+            release_mapping(mapping);
+            mapping = NULL;
+            rc = acquire_mapping(journal, message_end, &mapping);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to remap journal");
+        }
+
+        rc = ledger_message_set_add_backing(messages, mapping, release_mapping);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to add journal mapping to message set");
+
+        // The message set owns the reference from here on
+        run = mapping->map;
+        run_len = mapping->len;
+        run_next = total_messages;
+        mapping = NULL;
+    }
+
+    nindexed = idx_len / sizeof(uint64_t) - index_id;
+    if(journal->options.read_mode == LEDGER_READ_COPY && journal->options.io_engine != NULL) {
+        records = ledger_reallocarray(NULL, total_messages, sizeof(read_record));
+        ledger_check_rc(records != NULL, LEDGER_ERR_MEMORY, "Failed to allocate read records");
+
+        rc = read_records(journal, message_offsets, total_messages, nindexed, tail_end,
+                          messages, records);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read message records");
+    }
+
+    for(i = 0; i < total_messages; i++) {
+        message_offset = message_offsets[i];
+        current_message = &messages->messages[i+previous_count-nskipped];
+
+        if(message_offset == LEDGER_INDEX_GAP) {
+            if(i == run_next) {
+                run_next++;
+            }
+            messages->nmessages--;
+            nskipped++;
+            messages->next_id = start_id + i + 1;
+            continue;
+        }
+        // The slot may have held a corrupt message dropped before this one
+        ledger_message_init(current_message);
+
+        if(journal->options.read_mode == LEDGER_READ_COALESCED && i == run_next) {
+            rc = read_run(journal, message_offsets, i, total_messages, nindexed, tail_end,
+                          messages, &run, &run_start, &run_len, &run_next);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read message run");
+        }
+        if(records != NULL) {
+            run = records[i].data;
+            run_start = message_offset;
+            run_len = records[i].len;
+        }
+
+        record_data = NULL;
+        if(run != NULL) {
+            message_offset -= run_start;
+            ledger_check_rc(message_offset + sizeof(ledger_message_hdr) <= run_len, LEDGER_ERR_IO,
+                            "Message header is past the end of the journal");
+            memcpy(&message_hdr, run + message_offset, sizeof(ledger_message_hdr));
+
+            message_end = message_offset + sizeof(ledger_message_hdr) + ledger_message_hdr_len(&message_hdr);
+            ledger_check_rc(message_end <= run_len, LEDGER_ERR_IO, "Message is past the end of the journal");
+
+            record_data = run + message_offset + sizeof(ledger_message_hdr);
+        } else {
+            rc = journal_pread(journal, (void *)&message_hdr,
+                               sizeof(message_hdr), message_offset);
+            ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message header");
+        }
+
+        corrupt = false;
+        if(ledger_message_hdr_is_batch(&message_hdr)) {
+            rc = read_batch_message(journal, (uint64_t *)idx_map, index_id + i, &message_hdr,
+                                    record_data, &batch, messages, current_message, &corrupt);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read message batch");
+        } else {
+            current_message->len = ledger_message_hdr_len(&message_hdr);
+            if(record_data != NULL) {
+                current_message->data = record_data;
+                current_message->borrowed = true;
+            } else {
+                // Arena payloads are released with the set
+                if(messages->arena) {
+                    current_message->data = ledger_message_set_alloc(messages, current_message->len);
+                    current_message->borrowed = true;
+                } else {
+                    current_message->data = malloc(current_message->len);
+                    current_message->borrowed = false;
+                }
+                ledger_check_rc(current_message->data != NULL, LEDGER_ERR_MEMORY, "Failed to allocate message buffer");
+
+                rc = journal_pread(journal, current_message->data,
+                                   current_message->len, message_offset + sizeof(ledger_message_hdr));
+                ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read message");
+            }
+
+            if(journal->options.drop_corrupt) {
+                checksum = ledger_message_hdr_checksum(&message_hdr);
+                crc32_verification = compute_checksum(checksum, current_message->data, current_message->len);
+                corrupt = checksum != LEDGER_CHECKSUM_NONE && crc32_verification != message_hdr.crc32;
+            }
+        }
+
+        if(corrupt) {
+            ledger_message_free(current_message);
+            messages->nmessages--;
+            nskipped++;
+        }
+
+        current_message->id = start_id + i;
+        messages->next_id = start_id + i + 1;
+    }
+
+    munmap(idx_map, idx_map_len);
+    if(batch.records) {
+        free(batch.records);
+    }
+    if(records) {
+        free(records);
+    }
+
+    if(over_journal) {
+        return LEDGER_NEXT;
+    }
+
+    return LEDGER_OK;
+
+error:
+    if(idx_map) {
+        munmap(idx_map, idx_map_len);
+    }
+    if(mapping) {
+        release_mapping(mapping);
+    }
+    if(batch.records) {
+        free(batch.records);
+    }
+    if(records) {
+        free(records);
+    }
+    return rc;
+}
+
+// The index is rebuilt from the journal, journals written before there
+// was a time index have none, and compaction files only exist while it
+// runs, so any of them may already be gone
+static ledger_status unlink_index(const char *partition_path, uint32_t journal_id,
+                                  const char *ext) {
+    ledger_status rc;
+    char *path = NULL;
+
+    rc = journal_file_path(partition_path, journal_id, ext, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build index path");
+
+    rc = unlink(path);
+    ledger_check_rc(rc == 0 || errno == ENOENT, LEDGER_ERR_IO, "Failed to unlink index file");
+
+    free(path);
+    return LEDGER_OK;
+
+error:
+    if(path) {
+        free(path);
+    }
+    return rc;
+}
+
+// Everything kept alongside a journal, including what a compaction
+// pass interrupted by a crash left behind
+static ledger_status unlink_side_files(const char *partition_path, uint32_t journal_id) {
+    static const char *exts[] = {JOURNAL_IDX_EXT, JOURNAL_TIME_EXT,
+                                 JOURNAL_COMPACT_EXT, JOURNAL_COMPACT_IDX_EXT,
+                                 JOURNAL_KEYS_EXT, JOURNAL_KEYS_TMP_EXT};
+    ledger_status rc;
+    size_t i;
+
+    for(i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        rc = unlink_index(partition_path, journal_id, exts[i]);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to unlink journal side file");
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_journal_preallocate(const char *partition_path, uint32_t journal_id,
+                                         size_t size_bytes) {
+    ledger_status rc;
+    char *path = NULL;
+    int fd = -1;
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build journal path");
+
+    fd = open(path, O_RDWR|O_CREAT, 0700);
+    ledger_check_rc(fd > 0, LEDGER_ERR_IO, "Failed to open journal file");
+
+    // Keeping the size means an unused preallocated journal still looks empty
+    rc = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size_bytes);
+    ledger_check_rc(rc == 0 || errno == EOPNOTSUPP, LEDGER_ERR_IO, "Failed to preallocate journal file");
+
+    close(fd);
+    free(path);
+    return LEDGER_OK;
+
+error:
+    if(fd > 0) {
+        close(fd);
+    }
+    if(path) {
+        free(path);
+    }
+    return rc;
+}
+
+// Zeroes the records, which recovery would otherwise take for the new
+// journal's own, but keeps the blocks and the size. Truncating would free
+// the blocks, and fault readers still mapping the file in other processes.
+static ledger_status empty_journal_file(const char *path) {
+    ledger_status rc;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    ledger_check_rc(fd > 0, LEDGER_ERR_IO, "Failed to open journal file");
+
+    rc = fstat(fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat journal file");
+
+    // Only marks the extents unwritten, so nothing is written out. Callers
+    // delete the file where the file system can't.
+    if(st.st_size > 0) {
+        rc = fallocate(fd, FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, 0, st.st_size);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to zero journal file");
+    }
+
+    close(fd);
+    return LEDGER_OK;
+
+error:
+    if(fd > 0) {
+        close(fd);
+    }
+    return rc;
+}
+
+ledger_status ledger_journal_recycle(const char *partition_path, uint32_t journal_id,
+                                     uint32_t new_journal_id) {
+    ledger_status rc;
+    char *path = NULL;
+    char *new_path = NULL;
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build journal path");
+
+    rc = journal_file_path(partition_path, new_journal_id, JOURNAL_EXT, &new_path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build recycled journal path");
+
+    rc = empty_journal_file(path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to empty recycled journal file");
+
+    // Linking first never replaces a file the new journal already has
+    rc = link(path, new_path);
+    if(rc != 0 && errno == EEXIST) {
+        rc = LEDGER_NEXT;
+        goto error;
+    }
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to link recycled journal file");
+
+    rc = unlink(path);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to unlink recycled journal file");
+
+    rc = unlink_side_files(partition_path, journal_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to unlink recycled journal indexes");
+
+    free(path);
+    free(new_path);
+    return LEDGER_OK;
+
+error:
+    if(path) {
+        free(path);
+    }
+    if(new_path) {
+        free(new_path);
+    }
+    return rc;
+}
+
+ledger_status ledger_journal_delete(const char *partition_path, uint32_t journal_id) {
+    ledger_status rc;
+    char *path = NULL;
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build journal path");
+
+    rc = unlink(path);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to unlink journal file");
+
+    rc = unlink_side_files(partition_path, journal_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to unlink journal indexes");
+
+    free(path);
+
+    return LEDGER_OK;
+
+error:
+    if(path) {
+        free(path);
+    }
+    return rc;
+}
+
+static ledger_status write_gaps(ledger_journal *journal, uint64_t ngaps) {
+    ledger_status rc;
+    uint64_t gaps[GAP_CHUNK_SIZE];
+    size_t i, chunk;
+
+    for(i = 0; i < GAP_CHUNK_SIZE && i < ngaps; i++) {
+        gaps[i] = LEDGER_INDEX_GAP;
+    }
+    for(; ngaps > 0; ngaps -= chunk) {
+        chunk = ngaps < GAP_CHUNK_SIZE ? ngaps : GAP_CHUNK_SIZE;
+        rc = write_index(journal, gaps, chunk);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write index gaps");
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_journal_compaction_open(ledger_journal_compaction *compaction,
+                                             const char *partition_path,
+                                             const ledger_journal_meta_entry *metadata,
+                                             ledger_journal_options *options) {
+    ledger_status rc;
+    ledger_journal *journal = &compaction->journal;
+    char *path = NULL;
+
+    memcpy(&compaction->metadata, metadata, sizeof(ledger_journal_meta_entry));
+    compaction->next_id = metadata->first_message_id;
+    compaction->end_offset = 0;
+
+    journal->fd = -1;
+    journal->idx.fd = -1;
+    journal->time_fd = -1;
+    journal->io_slot = LEDGER_IO_NO_SLOT;
+    journal->idx.io_slot = LEDGER_IO_NO_SLOT;
+    journal->id = metadata->id;
+    journal->first_message_id = metadata->first_message_id;
+    journal->tail = NULL;
+    journal->mapping = NULL;
+    pthread_mutex_init(&journal->mapping_lock, NULL);
+    memcpy(&journal->options, options, sizeof(ledger_journal_options));
+    journal->options.io_engine = NULL;
+
+    // The index is created first, so a compacted journal is never found
+    // alone unless its index has replaced the old one. Whatever an earlier
+    // pass left behind is started over.
+    rc = journal_file_path(partition_path, metadata->id, JOURNAL_COMPACT_IDX_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build compacted index path");
+
+    journal->idx.fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0700);
+    ledger_check_rc(journal->idx.fd > 0, LEDGER_ERR_IO, "Failed to open compacted index file");
+    free(path);
+    path = NULL;
+
+    rc = journal_file_path(partition_path, metadata->id, JOURNAL_COMPACT_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build compacted journal path");
+
+    journal->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0700);
+    ledger_check_rc(journal->fd > 0, LEDGER_ERR_IO, "Failed to open compacted journal file");
+    free(path);
+
+    return LEDGER_OK;
+
+error:
+    if(path) {
+        free(path);
+    }
+    ledger_journal_compaction_abort(compaction, partition_path);
+    return rc;
+}
+
+ledger_status ledger_journal_compaction_write(ledger_journal_compaction *compaction,
+                                              const ledger_message *messages, size_t nmessages) {
+    ledger_status rc;
+    struct iovec *keys = NULL;
+    struct iovec *vecs = NULL;
+    uint64_t *offsets = NULL;
+    size_t first, last;
+
+    if(nmessages == 0) {
+        return LEDGER_OK;
+    }
+
+    keys = ledger_reallocarray(NULL, nmessages, sizeof(struct iovec));
+    vecs = ledger_reallocarray(NULL, nmessages, sizeof(struct iovec));
+    offsets = ledger_reallocarray(NULL, nmessages, sizeof(uint64_t));
+    ledger_check_rc(keys != NULL && vecs != NULL && offsets != NULL,
+                    LEDGER_ERR_MEMORY, "Failed to allocate compaction buffers");
+
+    // Runs of consecutive ids are batched together, with the gaps
+    // between them left in the index. Every message keeps its key, so
+    // later passes can compact it again.
+    for(first = 0; first < nmessages; first = last) {
+        ledger_check_rc(messages[first].id >= compaction->next_id, LEDGER_ERR_ARGS,
+                        "Compacted messages are out of order");
+
+        rc = write_gaps(&compaction->journal, messages[first].id - compaction->next_id);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write compaction gaps");
+        compaction->next_id = messages[first].id;
+
+        for(last = first;
+            last < nmessages && messages[last].id == compaction->next_id + (last - first);
+            last++) {
+            keys[last - first].iov_base = messages[last].key;
+            keys[last - first].iov_len = messages[last].key_len;
+            vecs[last - first].iov_base = messages[last].data;
+            vecs[last - first].iov_len = messages[last].len;
+        }
+
+        rc = write_compressed(&compaction->journal, keys, vecs, last - first,
+                              compaction->end_offset, offsets, &compaction->end_offset);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write compacted messages");
+        compaction->next_id += last - first;
+    }
+
+    rc = LEDGER_OK;
+
+error:
+    free(keys);
+    free(vecs);
+    free(offsets);
+    return rc;
+}
+
+ledger_status ledger_journal_compaction_finish(ledger_journal_compaction *compaction,
+                                               uint64_t end_id) {
+    ledger_status rc;
+
+    ledger_check_rc(end_id >= compaction->next_id, LEDGER_ERR_ARGS, "Compaction ends before its messages");
+
+    rc = write_gaps(&compaction->journal, end_id - compaction->next_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write compaction gaps");
+    compaction->next_id = end_id;
+
+    return ledger_journal_sync(&compaction->journal);
+
+error:
+    return rc;
+}
+
+// Ahead of a key summary, which it checks, so one torn by a crash is
+// taken for missing
+typedef struct {
+    uint32_t crc32;
+    uint32_t reserved;
+    uint64_t len;
+} keys_hdr;
+
+static ledger_status write_keys_file(const char *partition_path, uint32_t journal_id,
+                                     const void *data, size_t len) {
+    ledger_status rc;
+    char *path = NULL;
+    keys_hdr hdr;
+    int fd = -1;
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_KEYS_TMP_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build key summary path");
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0700);
+    ledger_check_rc(fd >= 0, LEDGER_ERR_IO, "Failed to open key summary file");
+
+    memset(&hdr, 0, sizeof(keys_hdr));
+    hdr.crc32 = crc32c_compute(0, data, len);
+    hdr.len = len;
+    rc = ledger_pwrite(fd, &hdr, sizeof(keys_hdr), 0);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write key summary header");
+
+    rc = ledger_pwrite(fd, data, len, sizeof(keys_hdr));
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write key summary");
+
+    close(fd);
+    free(path);
+    return LEDGER_OK;
+
+error:
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(path) {
+        free(path);
+    }
+    return rc;
+}
+
+// Moves a summary written next to the journal into place. Without one,
+// whatever summary the journal had no longer describes it.
+static ledger_status replace_keys_file(const char *partition_path, uint32_t journal_id) {
+    ledger_status rc;
+    char *from = NULL;
+    char *to = NULL;
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_KEYS_TMP_EXT, &from);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build key summary path");
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_KEYS_EXT, &to);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build key summary path");
+
+    rc = rename(from, to);
+    if(rc != 0 && errno == ENOENT) {
+        rc = unlink(to);
+        ledger_check_rc(rc == 0 || errno == ENOENT, LEDGER_ERR_IO, "Failed to unlink key summary");
+    } else {
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to replace key summary");
+    }
+    rc = LEDGER_OK;
+
+error:
+    if(from) {
+        free(from);
+    }
+    if(to) {
+        free(to);
+    }
+    return rc;
+}
+
+ledger_status ledger_journal_read_keys(const char *partition_path, uint32_t journal_id,
+                                       void **data, size_t *len) {
+    ledger_status rc;
+    char *path = NULL;
+    char *buf = NULL;
+    keys_hdr hdr;
+    struct stat st;
+    int fd = -1;
+
+    rc = journal_file_path(partition_path, journal_id, JOURNAL_KEYS_EXT, &path);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build key summary path");
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 && errno == ENOENT) {
+        rc = LEDGER_NEXT;
+        goto error;
+    }
+    ledger_check_rc(fd >= 0, LEDGER_ERR_IO, "Failed to open key summary file");
+
+    rc = fstat(fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat key summary file");
+
+    rc = LEDGER_NEXT;
+    if(st.st_size < sizeof(keys_hdr) || !ledger_pread(fd, &hdr, sizeof(keys_hdr), 0) ||
+       hdr.len != st.st_size - sizeof(keys_hdr)) {
+        goto error;
+    }
+
+    buf = malloc(hdr.len > 0 ? hdr.len : 1);
+    ledger_check_rc(buf != NULL, LEDGER_ERR_MEMORY, "Failed to allocate key summary");
+
+    rc = ledger_pread(fd, buf, hdr.len, sizeof(keys_hdr));
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to read key summary");
+
+    rc = LEDGER_NEXT;
+    if(crc32c_compute(0, buf, hdr.len) != hdr.crc32) {
+        goto error;
+    }
+
+    close(fd);
+    free(path);
+    *data = buf;
+    *len = hdr.len;
+    return LEDGER_OK;
+
+error:
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(path) {
+        free(path);
+    }
+    if(buf) {
+        free(buf);
+    }
+    return rc;
+}
+
+ledger_status ledger_journal_write_keys(const char *partition_path, uint32_t journal_id,
+                                        const void *data, size_t len) {
+    ledger_status rc;
+
+    rc = write_keys_file(partition_path, journal_id, data, len);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write key summary");
+
+    return replace_keys_file(partition_path, journal_id);
+
+error:
+    return rc;
+}
+
+ledger_status ledger_journal_compaction_write_keys(ledger_journal_compaction *compaction,
+                                                   const char *partition_path,
+                                                   const void *data, size_t len) {
+    return write_keys_file(partition_path, compaction->metadata.id, data, len);
+}
+
+ledger_status ledger_journal_compaction_commit(ledger_journal_compaction *compaction,
+                                               const char *partition_path) {
+    ledger_status rc;
+    uint32_t id = compaction->metadata.id;
+    char *from = NULL;
+    char *to = NULL;
+
+    rc = journal_file_path(partition_path, id, JOURNAL_COMPACT_IDX_EXT, &from);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build compacted index path");
+
+    rc = journal_file_path(partition_path, id, JOURNAL_IDX_EXT, &to);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build index path");
+
+    // The index goes first, see recover_compaction
+    rc = rename(from, to);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to replace journal index");
+    free(from);
+    free(to);
+    from = NULL;
+    to = NULL;
+
+    rc = journal_file_path(partition_path, id, JOURNAL_COMPACT_EXT, &from);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build compacted journal path");
+
+    rc = journal_file_path(partition_path, id, JOURNAL_EXT, &to);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to build journal path");
+
+    rc = rename(from, to);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to replace journal");
+
+    rc = replace_keys_file(partition_path, id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to replace journal key summary");
+
+error:
+    if(from) {
+        free(from);
+    }
+    if(to) {
+        free(to);
+    }
+    ledger_journal_close(&compaction->journal);
+    return rc;
+}
+
+void ledger_journal_compaction_abort(ledger_journal_compaction *compaction,
+                                     const char *partition_path) {
+    char *path = NULL;
+
+    ledger_journal_close(&compaction->journal);
+
+    // The journal goes before its index, for the same reason
+    if(journal_file_path(partition_path, compaction->metadata.id, JOURNAL_COMPACT_EXT, &path) == LEDGER_OK) {
+        unlink(path);
+        free(path);
+    }
+    if(journal_file_path(partition_path, compaction->metadata.id, JOURNAL_COMPACT_IDX_EXT, &path) == LEDGER_OK) {
+        unlink(path);
+        free(path);
+    }
+    if(journal_file_path(partition_path, compaction->metadata.id, JOURNAL_KEYS_TMP_EXT, &path) == LEDGER_OK) {
+        unlink(path);
+        free(path);
+    }
+}
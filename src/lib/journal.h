@@ -8,53 +8,189 @@ extern "C" {
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
+#include "codec.h"
 #include "common.h"
+#include "io_engine.h"
 #include "message.h"
 
 #define LEDGER_BEGIN 0
 #define LEDGER_END UINT64_MAX
 #define LEDGER_CHUNK_SIZE 64
+// Index entry of a message removed by compaction. Its id stays taken,
+// and readers skip over it.
+#define LEDGER_INDEX_GAP UINT64_MAX
 
 typedef struct {
     uint32_t id;
     uint64_t first_message_id;
     uint64_t create_time;
+    // Unused, writers lock the partition lock file. Kept so existing
+    // meta files still line up.
     pthread_mutex_t write_lock;
 } ledger_journal_meta_entry;
 
 typedef struct {
     int fd;
+    int io_slot;
     void *map;
     size_t map_len;
 } ledger_journal_index;
 
+// Sparse time index: an entry for the first message appended in each
+// millisecond, so every message up to the next entry shares its time
+typedef struct {
+    uint64_t time_ms;
+    uint64_t message_id;
+} ledger_journal_time_entry;
+
+typedef enum {
+    // Each message is copied out of the journal. With an I/O engine,
+    // every message of a read is requested at once.
+    LEDGER_READ_COPY = 0,
+    // Messages point into a shared read-only mapping of the journal
+    LEDGER_READ_MMAP,
+    // Consecutive messages are read together, and point into a buffer
+    // shared by the whole run
+    LEDGER_READ_COALESCED
+} ledger_read_mode;
+
 typedef struct {
     bool drop_corrupt;
     size_t max_size_bytes;
+    ledger_read_mode read_mode;
+    ledger_checksum checksum;
+    ledger_codec_id codec;
+    // Reads and writes go through the engine when set
+    ledger_io_engine *io_engine;
 } ledger_journal_options;
 
+// Tail of the journal being appended to. It lives in the partition's
+// shared lock file and is published by writers under the journal's write
+// lock, so readers can find new messages without touching the files.
+typedef struct {
+    uint32_t seq;
+    uint32_t journal_id;
+    uint64_t end_offset;
+    uint64_t next_message_id;
+} ledger_journal_tail;
+
+// Read-only view of a journal file. Message sets that borrow from it
+// hold a reference, so it can outlive the journal it was mapped from.
+typedef struct {
+    void *map;
+    size_t len;
+    unsigned int refs;
+} ledger_journal_mapping;
+
 typedef struct {
     int fd;
+    // The descriptors' places in the I/O engine's file table
+    int io_slot;
     ledger_journal_options options;
     ledger_journal_index idx;
-    ledger_journal_meta_entry *metadata;
+    int time_fd;
+    // Time of the last time index entry this process saw, which other
+    // processes' entries may have passed
+    uint64_t last_time_ms;
+    // From the journal's meta entry, which moves whenever the meta file
+    // is remapped. Neither changes, so they're copied once at open.
+    uint32_t id;
+    uint64_t first_message_id;
+    ledger_journal_tail *tail;
+    pthread_mutex_t mapping_lock;
+    ledger_journal_mapping *mapping;
 } ledger_journal;
 
+// A journal being rewritten by compaction. The messages kept go to new
+// files next to the journal's, which replace them once complete.
+typedef struct {
+    ledger_journal journal;
+    ledger_journal_meta_entry metadata;
+    uint64_t next_id;
+    uint64_t end_offset;
+} ledger_journal_compaction;
+
 typedef struct {
     uint64_t message_id;
     unsigned int partition_num;
 } ledger_write_status;
 
+typedef struct {
+    uint64_t first_message_id;
+    uint64_t last_message_id;
+    unsigned int partition_num;
+} ledger_write_batch_status;
+
 ledger_status ledger_journal_open(ledger_journal *journal, const char *partition_path,
-                                  ledger_journal_meta_entry *metadata, ledger_journal_options *options);
+                                  ledger_journal_meta_entry *metadata, ledger_journal_tail *tail,
+                                  ledger_journal_options *options);
 void ledger_journal_close(ledger_journal *journal);
 ledger_status ledger_journal_write(ledger_journal *journal, void *data,
                                    size_t len, ledger_write_status *status);
+ledger_status ledger_journal_write_batch(ledger_journal *journal, const struct iovec *messages,
+                                         size_t nmessages, ledger_write_batch_status *status);
+// Writes messages along with their keys. Messages with an empty key are
+// read back without one.
+ledger_status ledger_journal_write_keyed_batch(ledger_journal *journal, const struct iovec *keys,
+                                               const struct iovec *messages, size_t nmessages,
+                                               ledger_write_batch_status *status);
+ledger_status ledger_journal_sync(ledger_journal *journal);
 ledger_status ledger_journal_latest_message_id(ledger_journal *journal, uint64_t *id);
 ledger_status ledger_journal_read(ledger_journal *journal, uint64_t start_id,
                                   size_t nmessages, ledger_message_set *messages);
+ledger_status ledger_journal_recover_tail(ledger_journal *journal);
+// Finds the first message appended at or after time_ms, in milliseconds
+// since the epoch. Returns LEDGER_NEXT when every message was appended
+// before it.
+ledger_status ledger_journal_seek_time(ledger_journal *journal, uint64_t time_ms, uint64_t *id);
 ledger_status ledger_journal_delete(const char *partition_path, uint32_t journal_id);
+// Allocates space for a journal file ahead of its first write
+ledger_status ledger_journal_preallocate(const char *partition_path, uint32_t journal_id,
+                                         size_t size_bytes);
+// Hands the file of a purged journal over to a journal yet to be created.
+// Returns LEDGER_NEXT when the new journal already has a file.
+ledger_status ledger_journal_recycle(const char *partition_path, uint32_t journal_id,
+                                     uint32_t new_journal_id);
+// Key summaries, kept next to sealed journals so compaction needn't read
+// them again. What they hold is up to the caller. Reading returns
+// LEDGER_NEXT when the journal has no summary, or a damaged one.
+ledger_status ledger_journal_read_keys(const char *partition_path, uint32_t journal_id,
+                                       void **data, size_t *len);
+ledger_status ledger_journal_write_keys(const char *partition_path, uint32_t journal_id,
+                                        const void *data, size_t len);
+
+ledger_status ledger_journal_compaction_open(ledger_journal_compaction *compaction,
+                                             const char *partition_path,
+                                             const ledger_journal_meta_entry *metadata,
+                                             ledger_journal_options *options);
+// Appends the messages kept, in id order. The ids skipped over are left
+// as gaps in the index.
+ledger_status ledger_journal_compaction_write(ledger_journal_compaction *compaction,
+                                              const ledger_message *messages, size_t nmessages);
+// Leaves gaps up to end_id, where the journal ends, and syncs the files
+ledger_status ledger_journal_compaction_finish(ledger_journal_compaction *compaction,
+                                               uint64_t end_id);
+// Writes the compacted journal's key summary, which replaces the
+// journal's along with its files
+ledger_status ledger_journal_compaction_write_keys(ledger_journal_compaction *compaction,
+                                                   const char *partition_path,
+                                                   const void *data, size_t len);
+// Replaces the journal's files. Readers that already have it open carry
+// on with the old ones. A key summary not written for the compacted
+// journal is dropped.
+ledger_status ledger_journal_compaction_commit(ledger_journal_compaction *compaction,
+                                               const char *partition_path);
+void ledger_journal_compaction_abort(ledger_journal_compaction *compaction,
+                                     const char *partition_path);
+
+void ledger_journal_tail_load(const ledger_journal_tail *tail, ledger_journal_tail *out);
+void ledger_journal_tail_store(ledger_journal_tail *tail, uint32_t journal_id,
+                               uint64_t end_offset, uint64_t next_message_id);
+// Rounds seq up to even, for a tail whose writer died while storing it.
+// Only with the partition's write lock held, so no writer is live.
+void ledger_journal_tail_reset(ledger_journal_tail *tail);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,246 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "journal_cache.h"
+
+#define FILES_PER_JOURNAL 2
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ledger_cached_journal *lru_head = NULL;
+static ledger_cached_journal *lru_tail = NULL;
+static size_t open_files = 0;
+static size_t max_files = LEDGER_JOURNAL_CACHE_MAX_FILES;
+
+static void lru_unlink(ledger_cached_journal *cached) {
+    if(cached->lru_prev) {
+        cached->lru_prev->lru_next = cached->lru_next;
+    } else {
+        lru_head = cached->lru_next;
+    }
+    if(cached->lru_next) {
+        cached->lru_next->lru_prev = cached->lru_prev;
+    } else {
+        lru_tail = cached->lru_prev;
+    }
+    cached->lru_prev = NULL;
+    cached->lru_next = NULL;
+}
+
+static void lru_push(ledger_cached_journal *cached) {
+    cached->lru_prev = NULL;
+    cached->lru_next = lru_head;
+    if(lru_head) {
+        lru_head->lru_prev = cached;
+    }
+    lru_head = cached;
+    if(lru_tail == NULL) {
+        lru_tail = cached;
+    }
+}
+
+static void cache_unlink(ledger_journal_cache *cache, ledger_cached_journal *cached) {
+    ledger_cached_journal **cur;
+
+    for(cur = &cache->journals; *cur != NULL; cur = &(*cur)->next) {
+        if(*cur == cached) {
+            *cur = cached->next;
+            break;
+        }
+    }
+    cached->next = NULL;
+}
+
+// Must be called with the cache lock held. Journals that are no longer
+// referenced are pushed onto the closing list, so their descriptors can be
+// closed once the lock is released.
+static void evict_locked(ledger_journal_cache *cache, ledger_cached_journal *cached,
+                         ledger_cached_journal **closing) {
+    cache_unlink(cache, cached);
+    lru_unlink(cached);
+    open_files -= FILES_PER_JOURNAL;
+    cached->evicted = true;
+
+    if(cached->refs == 0) {
+        cached->next = *closing;
+        *closing = cached;
+    }
+}
+
+static void enforce_budget_locked(ledger_cached_journal **closing) {
+    ledger_cached_journal *cached, *prev;
+
+    cached = lru_tail;
+    while(open_files > max_files && cached != NULL) {
+        prev = cached->lru_prev;
+        if(cached->refs == 0) {
+            evict_locked(cached->cache, cached, closing);
+        }
+        cached = prev;
+    }
+}
+
+static void close_all(ledger_cached_journal *closing) {
+    ledger_cached_journal *next;
+
+    while(closing != NULL) {
+        next = closing->next;
+        ledger_journal_close(&closing->journal);
+        free(closing);
+        closing = next;
+    }
+}
+
+static ledger_cached_journal *find_locked(ledger_journal_cache *cache, uint32_t journal_id) {
+    ledger_cached_journal *cached;
+
+    for(cached = cache->journals; cached != NULL; cached = cached->next) {
+        if(cached->id == journal_id) {
+            return cached;
+        }
+    }
+    return NULL;
+}
+
+void ledger_journal_cache_init(ledger_journal_cache *cache, const char *partition_path,
+                               ledger_journal_tail *tail) {
+    cache->partition_path = partition_path;
+    cache->tail = tail;
+    cache->journals = NULL;
+}
+
+ledger_status ledger_journal_cache_acquire(ledger_journal_cache *cache,
+                                           ledger_journal_meta_entry *metadata,
+                                           ledger_journal_options *options,
+                                           ledger_cached_journal **out) {
+    ledger_status rc;
+    ledger_cached_journal *opened = NULL;
+    ledger_cached_journal *cached;
+    ledger_cached_journal *closing = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    cached = find_locked(cache, metadata->id);
+    if(cached != NULL) {
+        cached->refs++;
+        lru_unlink(cached);
+        lru_push(cached);
+        pthread_mutex_unlock(&cache_lock);
+
+        *out = cached;
+        return LEDGER_OK;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Open the journal outside of the lock, so other partitions don't wait on
+    // our file system calls.
+    opened = malloc(sizeof(ledger_cached_journal));
+    ledger_check_rc(opened != NULL, LEDGER_ERR_MEMORY, "Failed to allocate cached journal");
+    memset(opened, 0, sizeof(ledger_cached_journal));
+    opened->cache = cache;
+
+    rc = ledger_journal_open(&opened->journal, cache->partition_path, metadata,
+                             cache->tail, options);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open journal");
+
+    pthread_mutex_lock(&cache_lock);
+    cached = find_locked(cache, metadata->id);
+    if(cached != NULL) {
+        // Someone else opened the same journal while we were unlocked
+        cached->refs++;
+        lru_unlink(cached);
+        lru_push(cached);
+        pthread_mutex_unlock(&cache_lock);
+
+        ledger_journal_close(&opened->journal);
+        free(opened);
+        *out = cached;
+        return LEDGER_OK;
+    }
+
+    cached = opened;
+    cached->id = metadata->id;
+    cached->refs = 1;
+    cached->next = cache->journals;
+    cache->journals = cached;
+    lru_push(cached);
+    open_files += FILES_PER_JOURNAL;
+
+    enforce_budget_locked(&closing);
+    pthread_mutex_unlock(&cache_lock);
+
+    close_all(closing);
+
+    *out = cached;
+    return LEDGER_OK;
+
+error:
+    if(opened) {
+        free(opened);
+    }
+    return rc;
+}
+
+void ledger_journal_cache_release(ledger_cached_journal *cached) {
+    bool close_journal = false;
+
+    pthread_mutex_lock(&cache_lock);
+    cached->refs--;
+    if(cached->refs == 0 && cached->evicted) {
+        close_journal = true;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if(close_journal) {
+        ledger_journal_close(&cached->journal);
+        free(cached);
+    }
+}
+
+bool ledger_journal_cache_evict(ledger_journal_cache *cache, uint32_t journal_id) {
+    ledger_cached_journal *cached;
+    ledger_cached_journal *closing = NULL;
+    bool in_use = false;
+
+    pthread_mutex_lock(&cache_lock);
+    cached = find_locked(cache, journal_id);
+    if(cached != NULL) {
+        in_use = cached->refs > 0;
+        evict_locked(cache, cached, &closing);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    close_all(closing);
+    return in_use;
+}
+
+void ledger_journal_cache_close(ledger_journal_cache *cache) {
+    ledger_cached_journal *closing = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    while(cache->journals != NULL) {
+        evict_locked(cache, cache->journals, &closing);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    close_all(closing);
+}
+
+void ledger_journal_cache_set_max_files(size_t files) {
+    ledger_cached_journal *closing = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    max_files = files;
+    enforce_budget_locked(&closing);
+    pthread_mutex_unlock(&cache_lock);
+
+    close_all(closing);
+}
+
+size_t ledger_journal_cache_open_files(void) {
+    size_t n;
+
+    pthread_mutex_lock(&cache_lock);
+    n = open_files;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
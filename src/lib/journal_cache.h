@@ -0,0 +1,57 @@
+#ifndef LIB_LEDGER_JOURNAL_CACHE_H
+#define LIB_LEDGER_JOURNAL_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "journal.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Each cached journal holds two descriptors, the journal and its index
+#define LEDGER_JOURNAL_CACHE_MAX_FILES 1024
+
+typedef struct ledger_cached_journal {
+    ledger_journal journal;
+    uint32_t id;
+    unsigned int refs;
+    bool evicted;
+    struct ledger_journal_cache *cache;
+    struct ledger_cached_journal *next;
+    struct ledger_cached_journal *lru_prev;
+    struct ledger_cached_journal *lru_next;
+} ledger_cached_journal;
+
+typedef struct ledger_journal_cache {
+    const char *partition_path;
+    ledger_journal_tail *tail;
+    ledger_cached_journal *journals;
+} ledger_journal_cache;
+
+void ledger_journal_cache_init(ledger_journal_cache *cache, const char *partition_path,
+                               ledger_journal_tail *tail);
+// The journal is opened with the options the first time it's acquired,
+// and keeps them. Cached journals are shared, so nothing about them
+// changes once opened.
+ledger_status ledger_journal_cache_acquire(ledger_journal_cache *cache,
+                                           ledger_journal_meta_entry *metadata,
+                                           ledger_journal_options *options,
+                                           ledger_cached_journal **out);
+void ledger_journal_cache_release(ledger_cached_journal *cached);
+// Returns whether the journal was still in use when evicted
+bool ledger_journal_cache_evict(ledger_journal_cache *cache, uint32_t journal_id);
+void ledger_journal_cache_close(ledger_journal_cache *cache);
+
+// Process wide budget of open journal file descriptors, shared by
+// every partition. Journals in use are never closed, so the budget
+// can be exceeded temporarily.
+void ledger_journal_cache_set_max_files(size_t max_files);
+size_t ledger_journal_cache_open_files(void);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
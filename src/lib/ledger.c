@@ -1,53 +1,220 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "dict.h"
 #include "ledger.h"
 #include "murmur3.h"
+#include "parallel.h"
 #include "position_storage.h"
 #include "topic.h"
 
-#define MAX_TOPICS 255
+#define PARTITION_KEY_SEED 42
+#define MAINTENANCE_INTERVAL_MS 1000
+#define IO_ENGINE_ENTRIES 256
+#define CLOSE_POLL_MS 10
 
 const char *ledger_err(ledger_ctx *ctx) {
     return ctx->last_error;
 }
 
+// Callers hold the maintenance lock. The topics are only locked to take
+// a reference to each, so opening and closing others carries on while
+// they're maintained.
+static ledger_status maintain_topics(ledger_ctx *ctx) {
+    ledger_status rc = LEDGER_OK;
+    ledger_topic **topics = NULL;
+    ledger_topic **grown;
+    ledger_topic *topic = NULL;
+    size_t pos = 0;
+    size_t i, ntopics = 0, cap = 0;
+
+    pthread_mutex_lock(&ctx->topics_lock);
+    while((topic = ledger_topic_table_next(&ctx->topics, &pos)) != NULL) {
+        if(ntopics == cap) {
+            grown = ledger_reallocarray(topics, cap > 0 ? cap * 2 : 16, sizeof(ledger_topic *));
+            if(grown == NULL) {
+                rc = LEDGER_ERR_MEMORY;
+                break;
+            }
+            topics = grown;
+            cap = cap > 0 ? cap * 2 : 16;
+        }
+        __atomic_add_fetch(&topic->refs, 1, __ATOMIC_SEQ_CST);
+        topics[ntopics++] = topic;
+    }
+    pthread_mutex_unlock(&ctx->topics_lock);
+
+    for(i = 0; i < ntopics && rc == LEDGER_OK; i++) {
+        rc = ledger_topic_maintain(topics[i]);
+    }
+
+    pthread_mutex_lock(&ctx->topics_lock);
+    for(i = 0; i < ntopics; i++) {
+        __atomic_sub_fetch(&topics[i]->refs, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_cond_broadcast(&ctx->topics_cond);
+    pthread_mutex_unlock(&ctx->topics_lock);
+
+    if(topics) {
+        free(topics);
+    }
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to maintain topics");
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static void *maintenance_loop(void *arg) {
+    ledger_ctx *ctx = (ledger_ctx *)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&ctx->maintenance_lock);
+    while(ctx->maintenance_running) {
+        // Failed passes are retried on the next interval
+        maintain_topics(ctx);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += MAINTENANCE_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (MAINTENANCE_INTERVAL_MS % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if(ctx->maintenance_running) {
+            pthread_cond_timedwait(&ctx->maintenance_cond, &ctx->maintenance_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&ctx->maintenance_lock);
+
+    return NULL;
+}
+
+static ledger_status start_maintenance(ledger_ctx *ctx) {
+    ledger_status rc;
+    pthread_condattr_t cattr;
+
+    rc = pthread_condattr_init(&cattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize cond attribute");
+
+    rc = pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to set maintenance cond clock");
+
+    rc = pthread_mutex_init(&ctx->maintenance_lock, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize maintenance mutex");
+
+    rc = pthread_cond_init(&ctx->maintenance_cond, &cattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize maintenance cond");
+
+    ctx->maintenance_running = true;
+    rc = pthread_create(&ctx->maintenance_thread, NULL, maintenance_loop, ctx);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to start maintenance thread");
+
+    pthread_condattr_destroy(&cattr);
+    return LEDGER_OK;
+
+error:
+    ctx->maintenance_running = false;
+    return rc;
+}
+
+static void stop_maintenance(ledger_ctx *ctx) {
+    pthread_mutex_lock(&ctx->maintenance_lock);
+    ctx->maintenance_running = false;
+    pthread_cond_signal(&ctx->maintenance_cond);
+    pthread_mutex_unlock(&ctx->maintenance_lock);
+
+    pthread_join(ctx->maintenance_thread, NULL);
+    pthread_cond_destroy(&ctx->maintenance_cond);
+    pthread_mutex_destroy(&ctx->maintenance_lock);
+}
+
 ledger_status ledger_open_context(ledger_ctx *ctx, const char *root_directory) {
     ledger_status rc;
 
     ctx->root_directory = root_directory;
-    dict_init(&ctx->topics, MAX_TOPICS, (dict_comp_t)strcmp);
+    ctx->maintenance_running = false;
+    ctx->checkpointer_running = false;
+    ctx->scheduler_running = false;
+    ctx->io_engine_open = false;
+    pthread_mutex_init(&ctx->scheduler_lock, NULL);
+    pthread_mutex_init(&ctx->topics_lock, NULL);
+    pthread_cond_init(&ctx->topics_cond, NULL);
+    ledger_topic_table_init(&ctx->topics);
 
     ledger_position_storage_init(&ctx->position_storage);
     rc = ledger_position_storage_open(&ctx->position_storage, root_directory);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open position storage");
 
+    rc = ledger_checkpointer_start(&ctx->checkpointer, &ctx->position_storage);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to start position checkpointer");
+    ctx->checkpointer_running = true;
+
+    rc = start_maintenance(ctx);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to start topic maintenance");
+
     return LEDGER_OK;
 
 error:
     return rc;
 }
 
+ledger_status ledger_run_maintenance(ledger_ctx *ctx) {
+    ledger_status rc;
+
+    pthread_mutex_lock(&ctx->maintenance_lock);
+    rc = maintain_topics(ctx);
+    pthread_mutex_unlock(&ctx->maintenance_lock);
+
+    return rc;
+}
+
 void ledger_close_context(ledger_ctx *ctx) {
-    dnode_t *cur;
     ledger_topic *topic = NULL;
+    size_t pos = 0;
 
-    for(cur = dict_first(&ctx->topics);
-        cur != NULL;
-        cur = dict_next(&ctx->topics, cur)) {
+    if(ctx->maintenance_running) {
+        stop_maintenance(ctx);
+    }
+    if(ctx->scheduler_running) {
+        ledger_scheduler_stop(&ctx->scheduler);
+        ctx->scheduler_running = false;
+    }
+    pthread_mutex_destroy(&ctx->scheduler_lock);
 
-        topic = dnode_get(cur);
+    while((topic = ledger_topic_table_next(&ctx->topics, &pos)) != NULL) {
         ledger_topic_close(topic);
         free(topic);
     }
 
+    if(ctx->checkpointer_running) {
+        ledger_checkpointer_stop(&ctx->checkpointer);
+        ctx->checkpointer_running = false;
+    }
     ledger_position_storage_close(&ctx->position_storage);
-    dict_free_nodes(&ctx->topics);
+    ledger_topic_table_free(&ctx->topics);
+    pthread_cond_destroy(&ctx->topics_cond);
+    pthread_mutex_destroy(&ctx->topics_lock);
+
+    if(ctx->io_engine_open) {
+        ledger_io_engine_close(&ctx->io_engine);
+        ctx->io_engine_open = false;
+    }
+}
+
+// NULL when the kernel has no io_uring, and the topic stays on plain
+// system calls
+static ledger_io_engine *context_io_engine(ledger_ctx *ctx) {
+    if(!ctx->io_engine_open) {
+        ctx->io_engine_open = ledger_io_engine_open(&ctx->io_engine, IO_ENGINE_ENTRIES) == LEDGER_OK;
+    }
+    return ctx->io_engine_open ? &ctx->io_engine : NULL;
 }
 
 ledger_status ledger_open_topic(ledger_ctx *ctx,
@@ -56,10 +223,13 @@ ledger_status ledger_open_topic(ledger_ctx *ctx,
                                 size_t partition_count,
                                 ledger_topic_options *options) {
     ledger_status rc;
-    int rv;
     ledger_topic *topic = NULL;
     ledger_topic *lookup = NULL;
 
+    // Maintenance snapshots the topics either before insertion or once
+    // fully opened
+    pthread_mutex_lock(&ctx->topics_lock);
+
     ledger_check_rc(partition_count > 0, LEDGER_ERR_BAD_TOPIC, "You must specify more than one partition");
 
     lookup = ledger_lookup_topic(ctx, name);
@@ -68,41 +238,102 @@ ledger_status ledger_open_topic(ledger_ctx *ctx,
     rc = ledger_topic_new(name, &topic);
     ledger_check_rc(rc == LEDGER_OK, LEDGER_ERR_MEMORY, "Failed to allocate topic");
 
-    rv = dict_alloc_insert(&ctx->topics, topic->name, topic);
-    ledger_check_rc(rv == 1, LEDGER_ERR_GENERAL, "Failed to insert topic into context");
+    if(options->io_backend == LEDGER_IO_URING) {
+        topic->io_engine = context_io_engine(ctx);
+    }
+
+    rc = ledger_topic_open(topic, ctx->root_directory,
+                           partition_ids, partition_count,
+                           options);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open topic");
 
-    return ledger_topic_open(topic, ctx->root_directory,
-                             partition_ids, partition_count,
-                             options);
+    // Lookups find the topic only once it's fully opened
+    rc = ledger_topic_table_insert(&ctx->topics, topic);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to insert topic into context");
+
+    pthread_mutex_unlock(&ctx->topics_lock);
+    return LEDGER_OK;
 
 error:
+    pthread_mutex_unlock(&ctx->topics_lock);
     if(topic) {
+        ledger_topic_close(topic);
         free(topic);
     }
     return rc;
 }
 
 ledger_topic *ledger_lookup_topic(ledger_ctx *ctx, const char *name) {
-    ledger_topic *topic = NULL;
-    dnode_t *dtopic;
+    return ledger_topic_table_lookup(&ctx->topics, name);
+}
+
+// Calls by name use the topic in a reader section, which closing the
+// topic waits out before freeing it
+static ledger_topic *enter_topic(ledger_ctx *ctx, const char *name, size_t *section) {
+    *section = ledger_topic_table_enter(&ctx->topics);
+    return ledger_lookup_topic(ctx, name);
+}
 
-    dtopic = dict_lookup(&ctx->topics, name);
-    if(dtopic != NULL) {
-        topic = dnode_get(dtopic);
-        return topic;
+static void exit_topic(ledger_ctx *ctx, size_t section) {
+    ledger_topic_table_exit(&ctx->topics, section);
+}
+
+// For calls that block, which would otherwise hold up every close. The
+// reference keeps just this topic open, and ends the reader section.
+static ledger_topic *ref_topic(ledger_ctx *ctx, const char *name) {
+    ledger_topic *topic;
+    size_t section;
+
+    topic = enter_topic(ctx, name, &section);
+    if(topic != NULL) {
+        __atomic_add_fetch(&topic->refs, 1, __ATOMIC_SEQ_CST);
+    }
+    exit_topic(ctx, section);
+    return topic;
+}
+
+static void unref_topic(ledger_topic *topic) {
+    __atomic_sub_fetch(&topic->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+// Waiters blocked on the topic return once readers are signaled
+static void signal_topic_readers(ledger_topic *topic) {
+    size_t i;
+
+    for(i = 0; i < topic->npartitions; i++) {
+        ledger_partition_signal_readers(&topic->partitions[i]);
     }
-    return NULL;
 }
 
 void ledger_close_topic(ledger_ctx *ctx, const char *name) {
     ledger_topic *topic = NULL;
-    dnode_t *dtopic;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&ctx->topics_lock);
+    topic = ledger_topic_table_remove(&ctx->topics, name);
+    if(topic != NULL) {
+        // Calls that looked the topic up have either finished or taken
+        // a reference by the time this returns
+        ledger_topic_table_synchronize(&ctx->topics);
+    }
+    // Only a pass already working on the topic, or a call waiting on
+    // it, holds the close up. A waiter may only start waiting after the
+    // readers were last signaled, so they're signaled until it's gone.
+    while(topic != NULL && __atomic_load_n(&topic->refs, __ATOMIC_SEQ_CST) > 0) {
+        signal_topic_readers(topic);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CLOSE_POLL_MS * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ctx->topics_cond, &ctx->topics_lock, &deadline);
+    }
+    pthread_mutex_unlock(&ctx->topics_lock);
 
-    dtopic = dict_lookup(&ctx->topics, name);
-    if(dtopic != NULL) {
-        topic = dnode_get(dtopic);
+    if(topic != NULL) {
         ledger_topic_close(topic);
-        dict_delete_free(&ctx->topics, dtopic);
+        free(topic);
     }
 }
 
@@ -111,13 +342,33 @@ ledger_status ledger_write_partition(ledger_ctx *ctx, const char *name,
                                      size_t len, ledger_write_status *status) {
     ledger_status rc;
     ledger_topic *topic = NULL;
+    size_t section;
+
+    topic = enter_topic(ctx, name, &section);
+    ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
+
+    rc = ledger_topic_write_partition(topic, partition_num, data, len, status);
+
+error:
+    exit_topic(ctx, section);
+    return rc;
+}
+
+ledger_status ledger_write_partition_batch(ledger_ctx *ctx, const char *name,
+                                           unsigned int partition_num,
+                                           const struct iovec *messages, size_t nmessages,
+                                           ledger_write_batch_status *status) {
+    ledger_status rc;
+    ledger_topic *topic = NULL;
+    size_t section;
 
-    topic = ledger_lookup_topic(ctx, name);
+    topic = enter_topic(ctx, name, &section);
     ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
 
-    return ledger_topic_write_partition(topic, partition_num, data, len, status);
+    rc = ledger_topic_write_partition_batch(topic, partition_num, messages, nmessages, status);
 
 error:
+    exit_topic(ctx, section);
     return rc;
 }
 
@@ -125,21 +376,17 @@ ledger_status ledger_write(ledger_ctx *ctx, const char *topic_name,
                            const char *partition_key, size_t key_len,
                            void *data, size_t len,
                            ledger_write_status *status) {
-    uint32_t hash;
-    unsigned int partition_num;
     ledger_status rc;
-    ledger_topic *topic = NULL;
-    static const uint32_t seed = 42;
-
-    topic = ledger_lookup_topic(ctx, topic_name);
-    ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
+    ledger_topic_handle handle;
+    size_t section;
 
-    MurmurHash3_x86_32(partition_key, key_len, seed, &hash);
-    partition_num = hash % topic->npartitions;
+    handle.topic = enter_topic(ctx, topic_name, &section);
+    ledger_check_rc(handle.topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
 
-    return ledger_topic_write_partition(topic, partition_num, data, len, status);
+    rc = ledger_topic_handle_write(&handle, partition_key, key_len, data, len, status);
 
 error:
+    exit_topic(ctx, section);
     return rc;
 }
 
@@ -147,13 +394,31 @@ ledger_status ledger_latest_message_id(ledger_ctx *ctx, const char *name,
                                        unsigned int partition_num, uint64_t *id) {
     ledger_status rc;
     ledger_topic *topic = NULL;
+    size_t section;
 
-    topic = ledger_lookup_topic(ctx, name);
+    topic = enter_topic(ctx, name, &section);
     ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
 
-    return ledger_topic_latest_message_id(topic, partition_num, id);
+    rc = ledger_topic_latest_message_id(topic, partition_num, id);
 
 error:
+    exit_topic(ctx, section);
+    return rc;
+}
+
+ledger_status ledger_seek_time(ledger_ctx *ctx, const char *name, unsigned int partition_num,
+                               uint64_t time_ms, uint64_t *id) {
+    ledger_status rc;
+    ledger_topic *topic = NULL;
+    size_t section;
+
+    topic = enter_topic(ctx, name, &section);
+    ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
+
+    rc = ledger_topic_seek_time(topic, partition_num, time_ms, id);
+
+error:
+    exit_topic(ctx, section);
     return rc;
 }
 
@@ -162,14 +427,35 @@ ledger_status ledger_read_partition(ledger_ctx *ctx, const char *name,
                                     size_t nmessages, ledger_message_set *messages) {
     ledger_status rc;
     ledger_topic *topic = NULL;
+    size_t section;
 
-    topic = ledger_lookup_topic(ctx, name);
+    topic = enter_topic(ctx, name, &section);
     ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
 
-    return ledger_topic_read_partition(topic, partition_num, start_id,
+    rc = ledger_topic_read_partition(topic, partition_num, start_id,
                                        nmessages, messages);
 
 error:
+    exit_topic(ctx, section);
+    return rc;
+}
+
+ledger_status ledger_read_partition_cursor(ledger_ctx *ctx, const char *name,
+                                           unsigned int partition_num, ledger_read_cursor *cursor,
+                                           uint64_t start_id, size_t nmessages,
+                                           ledger_message_set *messages) {
+    ledger_status rc;
+    ledger_topic *topic = NULL;
+    size_t section;
+
+    topic = enter_topic(ctx, name, &section);
+    ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
+
+    rc = ledger_topic_read_partition_cursor(topic, partition_num, cursor, start_id,
+                                              nmessages, messages);
+
+error:
+    exit_topic(ctx, section);
     return rc;
 }
 
@@ -178,10 +464,29 @@ ledger_status ledger_wait_messages(ledger_ctx *ctx, const char *name,
     ledger_status rc;
     ledger_topic *topic = NULL;
 
-    topic = ledger_lookup_topic(ctx, name);
+    topic = ref_topic(ctx, name);
     ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
 
-    return ledger_topic_wait_messages(topic, partition_num);
+    rc = ledger_topic_wait_messages(topic, partition_num);
+    unref_topic(topic);
+    return rc;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_wait_message(ledger_ctx *ctx, const char *name,
+                                  unsigned int partition_num, uint64_t id,
+                                  long int timeout_ms) {
+    ledger_status rc;
+    ledger_topic *topic = NULL;
+
+    topic = ref_topic(ctx, name);
+    ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
+
+    rc = ledger_topic_wait_message(topic, partition_num, id, timeout_ms);
+    unref_topic(topic);
+    return rc;
 
 error:
     return rc;
@@ -191,13 +496,162 @@ ledger_status ledger_signal_readers(ledger_ctx *ctx, const char *name,
                                     unsigned int partition_num) {
     ledger_status rc;
     ledger_topic *topic = NULL;
+    size_t section;
 
-    topic = ledger_lookup_topic(ctx, name);
+    topic = enter_topic(ctx, name, &section);
     ledger_check_rc(topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
 
-    return ledger_topic_signal_readers(topic, partition_num);
+    rc = ledger_topic_signal_readers(topic, partition_num);
 
 error:
+    exit_topic(ctx, section);
     return rc;
 }
 
+
+ledger_status ledger_get_topic_handle(ledger_ctx *ctx, const char *name,
+                                      ledger_topic_handle *handle) {
+    ledger_status rc;
+
+    handle->topic = ledger_lookup_topic(ctx, name);
+    ledger_check_rc(handle->topic != NULL, LEDGER_ERR_BAD_TOPIC, "Topic not found");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_get_partition_handle(ledger_ctx *ctx, const char *name,
+                                          unsigned int partition_num,
+                                          ledger_partition_handle *handle) {
+    ledger_status rc;
+    ledger_topic_handle topic;
+
+    rc = ledger_get_topic_handle(ctx, name, &topic);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Topic not found");
+
+    return ledger_topic_handle_partition(&topic, partition_num, handle);
+
+error:
+    return rc;
+}
+
+ledger_status ledger_topic_handle_partition(ledger_topic_handle *topic, unsigned int partition_num,
+                                            ledger_partition_handle *handle) {
+    ledger_status rc;
+
+    ledger_check_rc(partition_num < topic->topic->npartitions, LEDGER_ERR_BAD_PARTITION, "Unknown partition");
+
+    handle->partition = &topic->topic->partitions[partition_num];
+    handle->partition_num = partition_num;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+ledger_status ledger_topic_handle_write(ledger_topic_handle *handle,
+                                        const char *partition_key, size_t key_len,
+                                        void *data, size_t len,
+                                        ledger_write_status *status) {
+    uint32_t hash;
+    unsigned int partition_num;
+
+    MurmurHash3_x86_32(partition_key, key_len, PARTITION_KEY_SEED, &hash);
+    partition_num = hash % handle->topic->npartitions;
+
+    return ledger_topic_write_partition_keyed(handle->topic, partition_num, partition_key, key_len,
+                                              data, len, status);
+}
+
+ledger_status ledger_partition_handle_write(ledger_partition_handle *handle, void *data,
+                                            size_t len, ledger_write_status *status) {
+    return ledger_partition_write(handle->partition, data, len, status);
+}
+
+ledger_status ledger_partition_handle_write_batch(ledger_partition_handle *handle,
+                                                  const struct iovec *messages, size_t nmessages,
+                                                  ledger_write_batch_status *status) {
+    return ledger_partition_write_batch(handle->partition, messages, nmessages, status);
+}
+
+ledger_status ledger_partition_handle_read(ledger_partition_handle *handle, uint64_t start_id,
+                                           size_t nmessages, ledger_message_set *messages) {
+    return ledger_partition_read(handle->partition, start_id, nmessages, messages);
+}
+
+ledger_status ledger_partition_handle_read_cursor(ledger_partition_handle *handle,
+                                                  ledger_read_cursor *cursor, uint64_t start_id,
+                                                  size_t nmessages, ledger_message_set *messages) {
+    return ledger_partition_read_cursor(handle->partition, cursor, start_id, nmessages, messages);
+}
+
+ledger_status ledger_partition_handle_latest_message_id(ledger_partition_handle *handle,
+                                                        uint64_t *id) {
+    return ledger_partition_latest_message_id(handle->partition, id);
+}
+
+ledger_status ledger_partition_handle_seek_time(ledger_partition_handle *handle,
+                                                uint64_t time_ms, uint64_t *id) {
+    return ledger_partition_seek_time(handle->partition, time_ms, id);
+}
+
+ledger_status ledger_partition_handle_wait_messages(ledger_partition_handle *handle) {
+    ledger_partition_wait_messages(handle->partition);
+    return LEDGER_OK;
+}
+
+ledger_status ledger_partition_handle_wait_message(ledger_partition_handle *handle, uint64_t id,
+                                                   long int timeout_ms) {
+    return ledger_partition_wait_message(handle->partition, id, timeout_ms);
+}
+
+uint32_t ledger_partition_handle_reader_signals(ledger_partition_handle *handle) {
+    return ledger_partition_reader_signals(handle->partition);
+}
+
+ledger_status ledger_partition_handle_wait_message_since(ledger_partition_handle *handle, uint64_t id,
+                                                         uint32_t signals, long int timeout_ms) {
+    return ledger_partition_wait_message_since(handle->partition, id, signals, timeout_ms);
+}
+
+ledger_status ledger_partition_handle_signal_readers(ledger_partition_handle *handle) {
+    ledger_partition_signal_readers(handle->partition);
+    return LEDGER_OK;
+}
+
+bool ledger_partition_handle_has_message(ledger_partition_handle *handle, uint64_t id) {
+    return ledger_partition_has_message(handle->partition, id);
+}
+
+void ledger_partition_handle_watch(ledger_partition_handle *handle, ledger_partition_watch *watch) {
+    ledger_partition_watch_add(handle->partition, watch);
+}
+
+void ledger_partition_handle_unwatch(ledger_partition_handle *handle, ledger_partition_watch *watch) {
+    ledger_partition_watch_remove(handle->partition, watch);
+}
+
+ledger_signal *ledger_partition_handle_message_signal(ledger_partition_handle *handle) {
+    return ledger_partition_message_signal(handle->partition);
+}
+
+ledger_status ledger_get_consumer_scheduler(ledger_ctx *ctx, ledger_scheduler **scheduler) {
+    ledger_status rc = LEDGER_OK;
+
+    pthread_mutex_lock(&ctx->scheduler_lock);
+    if(!ctx->scheduler_running) {
+        // Consumers mostly wait on I/O and on their callbacks
+        rc = ledger_scheduler_start(&ctx->scheduler, ledger_parallel_threads(SIZE_MAX));
+        ctx->scheduler_running = rc == LEDGER_OK;
+    }
+    pthread_mutex_unlock(&ctx->scheduler_lock);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to start consumer scheduler");
+
+    *scheduler = &ctx->scheduler;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
@@ -5,10 +5,15 @@
 #include <cstddef>
 #endif
 
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "checkpoint.h"
 #include "common.h"
-#include "dict.h"
 #include "position_storage.h"
+#include "scheduler.h"
 #include "topic.h"
+#include "topic_table.h"
 
 #if defined(__cplusplus)
 extern "C" {
@@ -17,10 +22,44 @@ extern "C" {
 typedef struct {
     const char *root_directory;
     const char *last_error;
-    dict_t topics;
+    ledger_topic_table topics;
+    // Held to open and close topics, and to take the maintenance
+    // thread's snapshot of them. Closing waits on topics_cond for the
+    // topic's references to go.
+    pthread_mutex_t topics_lock;
+    pthread_cond_t topics_cond;
     ledger_position_storage position_storage;
+    // Stores consumer positions off the consumers' threads
+    ledger_checkpointer checkpointer;
+    bool checkpointer_running;
+    // Runs scheduled consumers, started with the first
+    pthread_mutex_t scheduler_lock;
+    ledger_scheduler scheduler;
+    bool scheduler_running;
+    // Purging and compaction run here, so writers only ever switch
+    // to the next journal. Held for a whole pass, so passes don't
+    // overlap.
+    pthread_mutex_t maintenance_lock;
+    pthread_cond_t maintenance_cond;
+    pthread_t maintenance_thread;
+    bool maintenance_running;
+    // Shared by every topic using LEDGER_IO_URING, opened with the first
+    ledger_io_engine io_engine;
+    bool io_engine_open;
 } ledger_ctx;
 
+// Resolved once from the topic name, so calls through a handle skip the
+// lookup. Closing the topic doesn't wait for handles, so they have to be
+// done with before it's closed.
+typedef struct {
+    ledger_topic *topic;
+} ledger_topic_handle;
+
+typedef struct {
+    ledger_partition *partition;
+    unsigned int partition_num;
+} ledger_partition_handle;
+
 const char *ledger_err(ledger_ctx *ctx);
 ledger_status ledger_open_context(ledger_ctx *ctx, const char *root_directory);
 ledger_status ledger_open_topic(ledger_ctx *ctx,
@@ -29,24 +68,95 @@ ledger_status ledger_open_topic(ledger_ctx *ctx,
                                 size_t partition_count,
                                 ledger_topic_options *options);
 void ledger_close_topic(ledger_ctx *ctx, const char *name);
+// The key picks the partition, and is kept with the message for readers
+// and compaction
 ledger_status ledger_write(ledger_ctx *ctx, const char *topic_name,
                            const char *partition_key, size_t key_len,
                            void *data, size_t len,
                            ledger_write_status *status);
+// As with handles, the topic has to be done with before it's closed
 ledger_topic *ledger_lookup_topic(ledger_ctx *ctx, const char *name);
 ledger_status ledger_write_partition(ledger_ctx *ctx, const char *name,
                                      unsigned int partition_num, void *data,
                                      size_t len, ledger_write_status *status);
+ledger_status ledger_write_partition_batch(ledger_ctx *ctx, const char *name,
+                                           unsigned int partition_num,
+                                           const struct iovec *messages, size_t nmessages,
+                                           ledger_write_batch_status *status);
 ledger_status ledger_read_partition(ledger_ctx *ctx, const char *name,
                                     unsigned int partition_num, uint64_t start_id,
                                     size_t nmessages, ledger_message_set *messages);
+// Same as ledger_read_partition, for readers that keep a cursor between
+// reads so finding their journal doesn't take a search
+ledger_status ledger_read_partition_cursor(ledger_ctx *ctx, const char *name,
+                                           unsigned int partition_num, ledger_read_cursor *cursor,
+                                           uint64_t start_id, size_t nmessages,
+                                           ledger_message_set *messages);
 ledger_status ledger_latest_message_id(ledger_ctx *ctx, const char *name,
                                        unsigned int partition_num, uint64_t *id);
+// The id of the first message appended to the partition at or after
+// time_ms, in milliseconds since the epoch. Where a reader should start
+// to replay from that time.
+ledger_status ledger_seek_time(ledger_ctx *ctx, const char *name, unsigned int partition_num,
+                               uint64_t time_ms, uint64_t *id);
 ledger_status ledger_wait_messages(ledger_ctx *ctx, const char *name,
                                    unsigned int partition_num);
+// Waits until message id has been written, for at most timeout_ms
+// unless it's negative. A reader that found nothing at id passes it
+// here, and can't miss a write landing in between. LEDGER_NEXT when the
+// wait timed out, or readers were signaled, first.
+ledger_status ledger_wait_message(ledger_ctx *ctx, const char *name,
+                                  unsigned int partition_num, uint64_t id,
+                                  long int timeout_ms);
 ledger_status ledger_signal_readers(ledger_ctx *ctx, const char *name,
                                     unsigned int partition_num);
 
+ledger_status ledger_get_topic_handle(ledger_ctx *ctx, const char *name,
+                                      ledger_topic_handle *handle);
+ledger_status ledger_get_partition_handle(ledger_ctx *ctx, const char *name,
+                                          unsigned int partition_num,
+                                          ledger_partition_handle *handle);
+ledger_status ledger_topic_handle_partition(ledger_topic_handle *topic, unsigned int partition_num,
+                                            ledger_partition_handle *handle);
+// Same as ledger_write, through a handle
+ledger_status ledger_topic_handle_write(ledger_topic_handle *handle,
+                                        const char *partition_key, size_t key_len,
+                                        void *data, size_t len,
+                                        ledger_write_status *status);
+ledger_status ledger_partition_handle_write(ledger_partition_handle *handle, void *data,
+                                            size_t len, ledger_write_status *status);
+ledger_status ledger_partition_handle_write_batch(ledger_partition_handle *handle,
+                                                  const struct iovec *messages, size_t nmessages,
+                                                  ledger_write_batch_status *status);
+ledger_status ledger_partition_handle_read(ledger_partition_handle *handle, uint64_t start_id,
+                                           size_t nmessages, ledger_message_set *messages);
+ledger_status ledger_partition_handle_read_cursor(ledger_partition_handle *handle,
+                                                  ledger_read_cursor *cursor, uint64_t start_id,
+                                                  size_t nmessages, ledger_message_set *messages);
+ledger_status ledger_partition_handle_latest_message_id(ledger_partition_handle *handle,
+                                                        uint64_t *id);
+ledger_status ledger_partition_handle_seek_time(ledger_partition_handle *handle,
+                                                uint64_t time_ms, uint64_t *id);
+ledger_status ledger_partition_handle_wait_messages(ledger_partition_handle *handle);
+ledger_status ledger_partition_handle_wait_message(ledger_partition_handle *handle, uint64_t id,
+                                                   long int timeout_ms);
+uint32_t ledger_partition_handle_reader_signals(ledger_partition_handle *handle);
+ledger_status ledger_partition_handle_wait_message_since(ledger_partition_handle *handle, uint64_t id,
+                                                         uint32_t signals, long int timeout_ms);
+ledger_status ledger_partition_handle_signal_readers(ledger_partition_handle *handle);
+bool ledger_partition_handle_has_message(ledger_partition_handle *handle, uint64_t id);
+void ledger_partition_handle_watch(ledger_partition_handle *handle, ledger_partition_watch *watch);
+void ledger_partition_handle_unwatch(ledger_partition_handle *handle, ledger_partition_watch *watch);
+// Raised by every process's writes, for scheduled tasks to wait on
+ledger_signal *ledger_partition_handle_message_signal(ledger_partition_handle *handle);
+
+// The scheduler consumers share worker threads on
+ledger_status ledger_get_consumer_scheduler(ledger_ctx *ctx, ledger_scheduler **scheduler);
+
+// Runs a maintenance pass over every topic right away, rather than
+// waiting on the maintenance thread
+ledger_status ledger_run_maintenance(ledger_ctx *ctx);
+
 void ledger_close_context(ledger_ctx *ctx);
 
 
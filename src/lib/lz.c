@@ -0,0 +1,211 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+// Matches never start in the last bytes of the input, which keeps the
+// match finder from reading past the end
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Lengths past the token's nibble carry on in bytes of 255, ending with
+// a smaller one
+static bool write_length(unsigned char **op, unsigned char *end, size_t len) {
+    while(len >= 255) {
+        if(*op >= end) {
+            return false;
+        }
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if(*op >= end) {
+        return false;
+    }
+    *(*op)++ = (unsigned char)len;
+    return true;
+}
+
+static bool write_sequence(unsigned char **op, unsigned char *end,
+                           const unsigned char *literals, size_t nliterals,
+                           size_t offset, size_t match_len) {
+    unsigned char *token;
+    size_t match_code = match_len >= LZ_MIN_MATCH ? match_len - LZ_MIN_MATCH : 0;
+
+    if(*op >= end) {
+        return false;
+    }
+    token = (*op)++;
+    *token = (unsigned char)((nliterals < 15 ? nliterals : 15) << 4);
+    if(nliterals >= 15 && !write_length(op, end, nliterals - 15)) {
+        return false;
+    }
+
+    if((size_t)(end - *op) < nliterals) {
+        return false;
+    }
+    if(nliterals > 0) {
+        memcpy(*op, literals, nliterals);
+    }
+    *op += nliterals;
+
+    if(match_len == 0) {
+        return true;
+    }
+
+    if(end - *op < 2) {
+        return false;
+    }
+    *(*op)++ = offset & 0xff;
+    *(*op)++ = offset >> 8;
+
+    *token |= match_code < 15 ? match_code : 15;
+    if(match_code >= 15 && !write_length(op, end, match_code - 15)) {
+        return false;
+    }
+    return true;
+}
+
+ledger_status lz_compress(const void *src, size_t src_len,
+                          void *dst, size_t dst_len, size_t *out_len) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *end = op + dst_len;
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t ref, match_len, limit;
+    uint32_t seq, h;
+
+    // Positions are stored one up, so zero means empty
+    memset(table, 0, sizeof(table));
+
+    if(src_len > LZ_MATCH_LIMIT) {
+        limit = src_len - LZ_MATCH_LIMIT;
+        while(ip < limit) {
+            seq = read32(in + ip);
+            h = hash32(seq);
+            ref = table[h];
+            table[h] = ip + 1;
+
+            if(ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || read32(in + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            match_len = LZ_MIN_MATCH;
+            while(ip + match_len < src_len - LZ_LAST_LITERALS && in[ref + match_len] == in[ip + match_len]) {
+                match_len++;
+            }
+
+            if(!write_sequence(&op, end, in + anchor, ip - anchor, ip - ref, match_len)) {
+                return LEDGER_ERR_ARGS;
+            }
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    if(!write_sequence(&op, end, in + anchor, src_len - anchor, 0, 0)) {
+        return LEDGER_ERR_ARGS;
+    }
+
+    *out_len = op - (unsigned char *)dst;
+    return LEDGER_OK;
+}
+
+static bool read_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+
+    do {
+        if(*ip >= end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 255);
+    return true;
+}
+
+ledger_status lz_decompress(const void *src, size_t src_len,
+                            void *dst, size_t dst_len) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *in_end = ip + src_len;
+    unsigned char *out = (unsigned char *)dst;
+    size_t op = 0;
+    size_t nliterals, match_len, offset;
+    unsigned char token;
+
+    while(ip < in_end) {
+        token = *ip++;
+
+        nliterals = token >> 4;
+        if(nliterals == 15 && !read_length(&ip, in_end, &nliterals)) {
+            return LEDGER_ERR_IO;
+        }
+        if((size_t)(in_end - ip) < nliterals || dst_len - op < nliterals) {
+            return LEDGER_ERR_IO;
+        }
+        if(nliterals > 0) {
+            memcpy(out + op, ip, nliterals);
+        }
+        ip += nliterals;
+        op += nliterals;
+
+        if(ip == in_end) {
+            // The last sequence has no match
+            break;
+        }
+
+        if(in_end - ip < 2) {
+            return LEDGER_ERR_IO;
+        }
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if(offset == 0 || offset > op) {
+            return LEDGER_ERR_IO;
+        }
+
+        match_len = token & 15;
+        if(match_len == 15 && !read_length(&ip, in_end, &match_len)) {
+            return LEDGER_ERR_IO;
+        }
+        match_len += LZ_MIN_MATCH;
+        if(dst_len - op < match_len) {
+            return LEDGER_ERR_IO;
+        }
+
+        // Matches can overlap what they're writing, so this goes a byte
+        // at a time unless they're far enough apart
+        if(offset >= match_len) {
+            memcpy(out + op, out + op - offset, match_len);
+            op += match_len;
+        } else {
+            while(match_len-- > 0) {
+                out[op] = out[op - offset];
+                op++;
+            }
+        }
+    }
+
+    return op == dst_len ? LEDGER_OK : LEDGER_ERR_IO;
+}
@@ -0,0 +1,25 @@
+#ifndef LIB_LEDGER_LZ_H
+#define LIB_LEDGER_LZ_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// A byte oriented LZ77 codec in the style of LZ4. The input is a run of
+// sequences, each a token byte holding the literal and match lengths, the
+// literals, and a 16 bit little endian match offset. Lengths of 15 and up
+// continue in extra bytes. The last sequence is literals only.
+size_t lz_compress_bound(size_t len);
+ledger_status lz_compress(const void *src, size_t src_len,
+                          void *dst, size_t dst_len, size_t *out_len);
+ledger_status lz_decompress(const void *src, size_t src_len,
+                            void *dst, size_t dst_len);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
@@ -1,30 +1,123 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "message.h"
 
+// Payloads handed out of an arena's slab stay aligned for any field type
+#define ARENA_ALIGN 8
+
+static pthread_once_t local_arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t local_arena_key;
+static bool local_arena_ready = false;
+
 void ledger_message_init(ledger_message *message) {
     message->data = NULL;
     message->len = 0;
+    message->key = NULL;
+    message->key_len = 0;
+    message->borrowed = false;
 }
 
 void ledger_message_free(ledger_message *message) {
-    if(message->data) {
+    if(message->data && !message->borrowed) {
         free(message->data);
     }
 }
 
+// Grows the arena's message array to hold n messages, keeping the ones
+// it holds
+static ledger_status arena_reserve_messages(ledger_message_arena *arena, size_t n) {
+    ledger_status rc;
+    ledger_message *grown;
+    size_t len = arena->messages_len > 0 ? arena->messages_len : 16;
+
+    if(n <= arena->messages_len) {
+        return LEDGER_OK;
+    }
+    while(len < n) {
+        len *= 2;
+    }
+
+    grown = ledger_reallocarray(arena->messages, len, sizeof(ledger_message));
+    ledger_check_rc(grown != NULL, LEDGER_ERR_MEMORY, "Failed to grow arena messages");
+    arena->messages = grown;
+    arena->messages_len = len;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static ledger_status arena_reserve_backings(ledger_message_arena *arena, size_t n) {
+    ledger_status rc;
+    ledger_message_backing *grown;
+    size_t len = arena->backings_len > 0 ? arena->backings_len : 4;
+
+    if(n <= arena->backings_len) {
+        return LEDGER_OK;
+    }
+    while(len < n) {
+        len *= 2;
+    }
+
+    grown = ledger_reallocarray(arena->backings, len, sizeof(ledger_message_backing));
+    ledger_check_rc(grown != NULL, LEDGER_ERR_MEMORY, "Failed to grow arena backings");
+    arena->backings = grown;
+    arena->backings_len = len;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Makes the slab big enough for everything the last set asked for
+static void arena_reset(ledger_message_arena *arena) {
+    char *slab;
+
+    if(arena->requested > arena->slab_len) {
+        slab = malloc(arena->requested);
+        if(slab != NULL) {
+            free(arena->slab);
+            arena->slab = slab;
+            arena->slab_len = arena->requested;
+        }
+    }
+    arena->slab_used = 0;
+    arena->requested = 0;
+    arena->in_use = false;
+}
+
 ledger_status ledger_message_set_init(ledger_message_set *messages, size_t nmessages) {
+    return ledger_message_set_init_arena(messages, nmessages, NULL);
+}
+
+ledger_status ledger_message_set_init_arena(ledger_message_set *messages, size_t nmessages,
+                                            ledger_message_arena *arena) {
     ledger_status rc;
     int i;
     ledger_message *message;
 
     messages->initialized = false;
     messages->messages = NULL;
+    messages->nbackings = 0;
+    messages->backings = NULL;
+    messages->arena = NULL;
+
+    if(arena != NULL && !arena->in_use) {
+        arena->in_use = true;
+        messages->arena = arena;
+    }
 
     messages->nmessages = nmessages;
-    if(messages->nmessages > 0) {
+    if(messages->arena) {
+        rc = arena_reserve_messages(messages->arena, nmessages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate message set");
+        messages->messages = messages->arena->messages;
+        messages->backings = messages->arena->backings;
+    } else if(messages->nmessages > 0) {
         messages->messages = ledger_reallocarray(NULL, nmessages, sizeof(ledger_message));
         ledger_check_rc(messages->messages != NULL, LEDGER_ERR_MEMORY, "Failed to allocate message set");
     }
@@ -38,9 +131,14 @@ ledger_status ledger_message_set_init(ledger_message_set *messages, size_t nmess
     return LEDGER_OK;
 
 error:
-    if(messages->messages) {
+    if(messages->arena) {
+        arena_reset(messages->arena);
+        messages->arena = NULL;
+    } else if(messages->messages) {
         free(messages->messages);
     }
+    messages->messages = NULL;
+    messages->backings = NULL;
     return rc;
 }
 
@@ -53,10 +151,16 @@ ledger_status ledger_message_set_grow(ledger_message_set *messages, size_t nmess
     previous_size = messages->nmessages;
     new_size = previous_size + nmessages;
 
-    messages->messages = ledger_reallocarray(messages->messages, new_size, sizeof(ledger_message));
-    ledger_check_rc(messages->messages != NULL, LEDGER_ERR_MEMORY, "Failed to allocate message set");
+    if(messages->arena) {
+        rc = arena_reserve_messages(messages->arena, new_size);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate message set");
+        messages->messages = messages->arena->messages;
+    } else {
+        messages->messages = ledger_reallocarray(messages->messages, new_size, sizeof(ledger_message));
+        ledger_check_rc(messages->messages != NULL, LEDGER_ERR_MEMORY, "Failed to allocate message set");
+    }
 
-    for(i = previous_size-1; i < nmessages; i++) {
+    for(i = previous_size; i < new_size; i++) {
         message = &messages->messages[i];
         ledger_message_init(message);
     }
@@ -69,8 +173,60 @@ error:
     return rc;
 }
 
+ledger_status ledger_message_set_add_backing(ledger_message_set *messages, void *ref,
+                                             void (*release)(void *ref)) {
+    ledger_status rc;
+    ledger_message_backing *backings;
+
+    if(messages->arena) {
+        rc = arena_reserve_backings(messages->arena, messages->nbackings + 1);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to allocate message backing");
+        backings = messages->arena->backings;
+    } else {
+        backings = ledger_reallocarray(messages->backings, messages->nbackings + 1,
+                                       sizeof(ledger_message_backing));
+        ledger_check_rc(backings != NULL, LEDGER_ERR_MEMORY, "Failed to allocate message backing");
+    }
+
+    messages->backings = backings;
+    messages->backings[messages->nbackings].ref = ref;
+    messages->backings[messages->nbackings].release = release;
+    messages->nbackings++;
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+void *ledger_message_set_alloc(ledger_message_set *messages, size_t len) {
+    ledger_message_arena *arena = messages->arena;
+    size_t aligned = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    void *data;
+
+    if(arena) {
+        arena->requested += aligned;
+        if(arena->slab_used + aligned <= arena->slab_len) {
+            data = arena->slab + arena->slab_used;
+            arena->slab_used += aligned;
+            return data;
+        }
+    }
+
+    data = malloc(len > 0 ? len : 1);
+    if(data == NULL) {
+        return NULL;
+    }
+    if(ledger_message_set_add_backing(messages, data, free) != LEDGER_OK) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
 void ledger_message_set_free(ledger_message_set *messages) {
     ledger_message *message;
+    ledger_message_backing *backing;
     int i;
 
     if(messages->messages) {
@@ -78,6 +234,67 @@ void ledger_message_set_free(ledger_message_set *messages) {
             message = &messages->messages[i];
             ledger_message_free(message);
         }
-        free(messages->messages);
+        if(!messages->arena) {
+            free(messages->messages);
+        }
+        messages->messages = NULL;
+    }
+    if(messages->backings) {
+        for(i = 0; i < messages->nbackings; i++) {
+            backing = &messages->backings[i];
+            backing->release(backing->ref);
+        }
+        if(!messages->arena) {
+            free(messages->backings);
+        }
+        messages->backings = NULL;
+        messages->nbackings = 0;
+    }
+    if(messages->arena) {
+        arena_reset(messages->arena);
+        messages->arena = NULL;
+    }
+}
+
+void ledger_message_arena_init(ledger_message_arena *arena) {
+    memset(arena, 0, sizeof(ledger_message_arena));
+}
+
+void ledger_message_arena_free(ledger_message_arena *arena) {
+    free(arena->slab);
+    free(arena->messages);
+    free(arena->backings);
+    ledger_message_arena_init(arena);
+}
+
+static void free_local_arena(void *ptr) {
+    ledger_message_arena_free((ledger_message_arena *)ptr);
+    free(ptr);
+}
+
+static void init_local_arena_key(void) {
+    local_arena_ready = pthread_key_create(&local_arena_key, free_local_arena) == 0;
+}
+
+ledger_message_arena *ledger_message_arena_local(void) {
+    ledger_message_arena *arena;
+
+    pthread_once(&local_arena_once, init_local_arena_key);
+    if(!local_arena_ready) {
+        return NULL;
+    }
+
+    arena = pthread_getspecific(local_arena_key);
+    if(arena == NULL) {
+        arena = malloc(sizeof(ledger_message_arena));
+        if(arena == NULL) {
+            return NULL;
+        }
+        ledger_message_arena_init(arena);
+        if(pthread_setspecific(local_arena_key, arena) != 0) {
+            free(arena);
+            return NULL;
+        }
     }
+    return arena;
 }
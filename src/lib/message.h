@@ -10,29 +10,121 @@ extern "C" {
 
 #include "common.h"
 
+typedef enum {
+    LEDGER_CHECKSUM_CRC32 = 0,
+    LEDGER_CHECKSUM_CRC32C,
+    LEDGER_CHECKSUM_NONE
+} ledger_checksum;
+
+// The top bits of a record's length say which checksum covers it, so
+// every record verifies no matter what its topic uses now. Records from
+// before the choice existed have them clear, which is plain CRC32.
+#define LEDGER_MESSAGE_CHECKSUM_SHIFT 30
+#define LEDGER_MESSAGE_MAX_LEN ((1u << LEDGER_MESSAGE_CHECKSUM_SHIFT) - 1)
+// In place of a checksum, marks a record holding a batch of messages
+#define LEDGER_MESSAGE_BATCH 3
+
 typedef struct {
     uint32_t len;
     uint32_t crc32;
 } ledger_message_hdr;
 
+// Starts the body of a batch record. The compressed records follow, and
+// decompress to plain records of their own. The record's checksum covers
+// this header and the compressed bytes.
+typedef struct {
+    uint8_t codec;
+    uint8_t checksum;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t nmessages;
+    uint32_t raw_len;
+} ledger_batch_hdr;
+
+// Each record in the batch starts with a uint32_t key length and the
+// key, followed by the message
+#define LEDGER_BATCH_KEYED 0x01
+
+static inline uint32_t ledger_message_hdr_len(const ledger_message_hdr *hdr) {
+    return hdr->len & LEDGER_MESSAGE_MAX_LEN;
+}
+
+static inline ledger_checksum ledger_message_hdr_checksum(const ledger_message_hdr *hdr) {
+    return (ledger_checksum)(hdr->len >> LEDGER_MESSAGE_CHECKSUM_SHIFT);
+}
+
+static inline bool ledger_message_hdr_is_batch(const ledger_message_hdr *hdr) {
+    return hdr->len >> LEDGER_MESSAGE_CHECKSUM_SHIFT == LEDGER_MESSAGE_BATCH;
+}
+
 typedef struct {
     uint64_t id;
     void *data;
     size_t len;
+    // The key the message was written with, borrowed from the same place
+    // as its data. NULL for messages written without one.
+    void *key;
+    size_t key_len;
+    // Borrowed data points into one of the set's backings, and is
+    // not freed with the message
+    bool borrowed;
 } ledger_message;
 
+// Memory shared by messages in a set, released when the set is freed
+typedef struct {
+    void *ref;
+    void (*release)(void *ref);
+} ledger_message_backing;
+
+// Memory recycled from one message set to the next, so a reader that
+// frees each set before its next read stops allocating once the arena
+// has grown to fit. Payloads come from the slab. When a read needs more
+// than the slab holds, the rest is allocated on the side, and the slab
+// grows to fit it once the set is freed.
+typedef struct {
+    char *slab;
+    size_t slab_len;
+    size_t slab_used;
+    size_t requested;
+    ledger_message *messages;
+    size_t messages_len;
+    ledger_message_backing *backings;
+    size_t backings_len;
+    // Held by a set until it's freed. A second set reading meanwhile
+    // allocates from the heap instead.
+    bool in_use;
+} ledger_message_arena;
+
 typedef struct {
     uint64_t next_id;
     unsigned int partition_num;
     size_t nmessages;
     bool initialized;
     ledger_message *messages;
+    size_t nbackings;
+    ledger_message_backing *backings;
+    // The set's memory belongs to the arena when it's set
+    ledger_message_arena *arena;
 } ledger_message_set;
 
 ledger_status ledger_message_set_init(ledger_message_set *messages, size_t nmessages);
+// Like ledger_message_set_init, drawing on the arena while nothing else
+// holds it
+ledger_status ledger_message_set_init_arena(ledger_message_set *messages, size_t nmessages,
+                                            ledger_message_arena *arena);
 ledger_status ledger_message_set_grow(ledger_message_set *messages, size_t nmessages);
+ledger_status ledger_message_set_add_backing(ledger_message_set *messages, void *ref,
+                                             void (*release)(void *ref));
+// Memory that lives as long as the set. NULL when out of memory.
+void *ledger_message_set_alloc(ledger_message_set *messages, size_t len);
 void ledger_message_set_free(ledger_message_set *messages);
 
+void ledger_message_arena_init(ledger_message_arena *arena);
+void ledger_message_arena_free(ledger_message_arena *arena);
+// The calling thread's arena, freed when the thread exits. NULL when it
+// can't be allocated.
+ledger_message_arena *ledger_message_arena_local(void);
+
 void ledger_message_init(ledger_message *message);
 void ledger_message_free(ledger_message *message);
 
@@ -0,0 +1,92 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+// Opening is mostly waiting on the disk, so a pool runs more threads
+// than there are CPUs, but past this many they only queue up behind each
+// other
+#define MIN_POOL_THREADS 4
+#define MAX_POOL_THREADS 16
+
+typedef struct {
+    ledger_parallel_fn fn;
+    void *arg;
+    size_t n;
+    size_t next;
+    ledger_status rc;
+} parallel_work;
+
+static void *run_work(void *data) {
+    parallel_work *work = data;
+    ledger_status rc;
+    size_t i;
+
+    while(__atomic_load_n(&work->rc, __ATOMIC_RELAXED) == LEDGER_OK) {
+        i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if(i >= work->n) {
+            break;
+        }
+
+        rc = work->fn(work->arg, i);
+        if(rc != LEDGER_OK) {
+            __atomic_store_n(&work->rc, rc, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+ledger_status ledger_parallel_for(size_t n, size_t max_threads,
+                                  ledger_parallel_fn fn, void *arg) {
+    parallel_work work;
+    pthread_t *threads = NULL;
+    size_t i, nthreads = 0;
+
+    work.fn = fn;
+    work.arg = arg;
+    work.n = n;
+    work.next = 0;
+    work.rc = LEDGER_OK;
+
+    if(max_threads > n) {
+        max_threads = n;
+    }
+    if(max_threads > 1) {
+        threads = malloc((max_threads - 1) * sizeof(pthread_t));
+    }
+    if(threads != NULL) {
+        for(i = 0; i < max_threads - 1; i++) {
+            if(pthread_create(&threads[nthreads], NULL, run_work, &work) != 0) {
+                break;
+            }
+            nthreads++;
+        }
+    }
+
+    run_work(&work);
+
+    for(i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return work.rc;
+}
+
+size_t ledger_parallel_threads(size_t n) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpus > 0 ? 2 * (size_t)ncpus : 1;
+
+    if(nthreads < MIN_POOL_THREADS) {
+        nthreads = MIN_POOL_THREADS;
+    }
+    if(nthreads > MAX_POOL_THREADS) {
+        nthreads = MAX_POOL_THREADS;
+    }
+    if(nthreads > n) {
+        nthreads = n;
+    }
+    return nthreads;
+}
@@ -0,0 +1,26 @@
+#ifndef LIB_LEDGER_PARALLEL_H
+#define LIB_LEDGER_PARALLEL_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef ledger_status (*ledger_parallel_fn)(void *arg, size_t i);
+
+// Calls fn for every i below n, on at most max_threads threads counting
+// the caller's. Stops handing out work after the first failure, and
+// returns it. Runs everything on the caller when threads can't be had.
+ledger_status ledger_parallel_for(size_t n, size_t max_threads,
+                                  ledger_parallel_fn fn, void *arg);
+
+// How many threads a pool should use for n independent pieces of work
+size_t ledger_parallel_threads(size_t n);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
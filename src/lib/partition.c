@@ -1,6 +1,7 @@
 #define _XOPEN_SOURCE 500
 
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,148 +9,79 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "common.h"
+#include "dict.h"
 #include "journal.h"
 #include "partition.h"
 
 #define META_FILE "meta"
+#define META_TMP_FILE "meta.XXXXXX"
 #define LOCK_FILE "locks"
 
-static ledger_status purge_journals(ledger_partition *partition,
-                                    int truncate_index) {
-    ledger_status rc = LEDGER_OK;
-    ledger_journal_meta_entry *meta_entry;
+// How many journals ahead of the latest one purged files can be kept for
+#define MAX_SPARE_JOURNALS 2
 
-    if(truncate_index == -1) {
-        // No journals to be removed
-        return LEDGER_OK;
-    }
+// Messages compaction reads at a time
+#define COMPACT_READ_SIZE 256
 
-    int nremove = truncate_index + 1;
-    for(int i = 0; i < nremove; i++) {
-        meta_entry = &partition->meta.entries[i];
-        rc = ledger_journal_delete(partition->path, meta_entry->id);
-        ledger_check_rc(rc == LEDGER_OK, LEDGER_ERR_IO, "Error deleting journal file");
+static inline ledger_journal_meta_entry *find_latest_meta(ledger_partition *partition) {
+    if(partition->meta.nentries == 0) {
+        return NULL;
     }
 
-    return rc;
+    return &partition->meta.entries[partition->meta.nentries-1];
+}
 
-error:
-    return rc;
+static void init_journal_options(ledger_partition *partition,
+                                 ledger_journal_options *journal_options) {
+    journal_options->drop_corrupt = partition->options.drop_corrupt;
+    journal_options->max_size_bytes = partition->options.journal_max_size_bytes;
+    journal_options->read_mode = partition->options.read_mode;
+    journal_options->checksum = partition->options.checksum;
+    journal_options->codec = partition->options.codec;
+    journal_options->io_engine = partition->options.io_engine;
 }
 
-static ledger_status shrink_meta(ledger_partition *partition,
-                                 int truncate_index,
-                                 int meta_fd,
-                                 int* new_meta_fd) {
-    ledger_status rc = LEDGER_OK;
-    int tmp_fd = 0;
-    int fd = 0;
-    size_t write_size;
-    ledger_journal_meta_entry *meta_entry;
-    char *meta_path = NULL;
-    ssize_t path_len;
-    char tmp_name[] = "/tmp/ledgerd_metaXXXXXX";
+// Callers hold the meta lock
+static ledger_status latest_message_id(ledger_partition *partition, uint64_t *id) {
+    ledger_journal_meta_entry *latest_meta;
+    ledger_journal_tail tail;
+    ledger_cached_journal *cached = NULL;
+    ledger_journal_options journal_options;
+    ledger_status rc;
 
-    if(truncate_index == -1) {
-        // No changes to be made to the meta table
+    latest_meta = find_latest_meta(partition);
+    if(latest_meta == NULL) {
+        *id = 0;
         return LEDGER_OK;
     }
 
-    tmp_fd = mkstemp(tmp_name);
-    ledger_check_rc(tmp_fd != -1, LEDGER_ERR_IO, "Error opening meta temporary file");
-
-    uint32_t next_index = truncate_index + 1;
-    uint32_t nentries = partition->meta.nentries - next_index;
-    rc = ledger_pwrite(tmp_fd, (void *)&nentries, sizeof(uint32_t), 0);
-    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write meta number of entries");
-
-    // Update this temporarily until the meta file gets remapped
-    partition->meta.nentries = nentries;
-
-    meta_entry = &partition->meta.entries[next_index];
-    write_size = nentries * sizeof(ledger_journal_meta_entry);
-    rc = ledger_pwrite(tmp_fd, (void *)meta_entry, write_size, sizeof(uint32_t));
-    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write the shrunken meta entries");
-
-    path_len = ledger_concat_path(partition->path, META_FILE, &meta_path);
-    ledger_check_rc(path_len > 0, LEDGER_ERR_MEMORY, "Failed to build meta path");
+    ledger_journal_tail_load(&partition->lockfile.locks->tail, &tail);
+    if(tail.journal_id == latest_meta->id) {
+        *id = tail.next_message_id;
+        return LEDGER_OK;
+    }
 
-    rc = rename(tmp_name, meta_path);
-    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to rename temporary meta file");
+    init_journal_options(partition, &journal_options);
 
-    fd = open(meta_path, O_RDWR|O_CREAT, 0700);
-    ledger_check_rc(fd > 0 || errno == EEXIST, LEDGER_ERR_BAD_META, "Failed to open meta file");
+    rc = ledger_journal_cache_acquire(&partition->journals, latest_meta, &journal_options, &cached);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open journal");
 
-    *new_meta_fd = fd;
+    rc = ledger_journal_latest_message_id(&cached->journal, id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the latest message id");
 
-    free(meta_path);
-    close(tmp_fd);
+    ledger_journal_cache_release(cached);
     return LEDGER_OK;
 
 error:
-    if(tmp_fd) {
-        close(tmp_fd);
-    }
-    if(fd) {
-        close(fd);
-    }
-    if(meta_path) {
-        free(meta_path);
-    }
-    return rc;
-}
-
-// We pass in a new_meta_fd out pointer, which will always get a reference
-// to the active file descriptor for the meta file. This function may or
-// may not rewrite the meta file, in cases of truncation. After calling this
-// function, it is not valid for callers to access meta_fd directly anymore.
-static ledger_status remove_old_journals(ledger_partition *partition,
-                                         int meta_fd,
-                                         int *new_meta_fd) {
-    int rc;
-    struct timeval tv;
-    time_t journal_age;
-    ledger_journal_meta_entry *journal_meta;
-
-    *new_meta_fd = meta_fd;
-    if(partition->options.journal_purge_age_seconds == LEDGER_JOURNAL_NO_PURGE) {
-        return LEDGER_OK;
-    }
-
-    rc = gettimeofday(&tv, NULL);
-    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to fetch initial journal rotation time of day");
-
-    // Truncate all journals up until this index, inclusive.
-    int truncate_idx = -1;
-    for(int i = 0; i < partition->meta.nentries; i++) {
-        journal_meta = &partition->meta.entries[i];
-        journal_age = tv.tv_sec - journal_meta->create_time;
-        if(journal_age > partition->options.journal_purge_age_seconds) {
-            truncate_idx = i;
-        } else {
-            break;
-        }
+    if(cached) {
+        ledger_journal_cache_release(cached);
     }
-
-    rc = purge_journals(partition, truncate_idx);
-    ledger_check_rc(rc == LEDGER_OK, LEDGER_ERR_GENERAL, "Failed to remove journal files");
-
-    return shrink_meta(partition, truncate_idx, meta_fd, new_meta_fd);
-
-error:
     return rc;
 }
 
-static inline ledger_journal_meta_entry *find_latest_meta(ledger_partition *partition) {
-    if(partition->meta.nentries == 0) {
-        return NULL;
-    }
-
-    return &partition->meta.entries[partition->meta.nentries-1];
-}
-
 static ledger_status add_journal(ledger_partition *partition, int fd) {
     ledger_status rc;
     pthread_mutexattr_t mattr;
@@ -171,7 +103,7 @@ static ledger_status add_journal(ledger_partition *partition, int fd) {
     rc = pthread_mutex_init(&meta_entry.write_lock, &mattr);
     ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize index write mutex");
 
-    rc = ledger_partition_latest_message_id(partition, &meta_entry.first_message_id);
+    rc = latest_message_id(partition, &meta_entry.first_message_id);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to fetch the latest message id");
 
     latest_meta = find_latest_meta(partition);
@@ -230,6 +162,8 @@ static ledger_status create_locks(ledger_partition *partition, int fd) {
     pthread_mutexattr_t mattr;
     pthread_condattr_t cattr;
 
+    memset(&locks, 0, sizeof(ledger_partition_locks));
+
     rc = pthread_mutexattr_init(&mattr);
     ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize mutex attribute");
 
@@ -248,6 +182,11 @@ static ledger_status create_locks(ledger_partition *partition, int fd) {
     rc = pthread_cond_init(&locks.rotate_cond, &cattr);
     ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize journal rotate cond");
 
+    rc = pthread_mutex_init(&locks.write_lock, &mattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize partition write mutex");
+
+    ledger_signal_init_shared(&locks.message_signal, 0);
+
     rc = ledger_pwrite(fd, (void *)&locks, sizeof(ledger_partition_locks), 0);
     ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write meta number of entries");
 
@@ -257,6 +196,27 @@ error:
     return rc;
 }
 
+// Lock files from before the write lock was kept there get it
+// initialized in place, once they've grown to fit it
+static ledger_status init_write_lock(ledger_partition *partition) {
+    ledger_status rc;
+    pthread_mutexattr_t mattr;
+
+    rc = pthread_mutexattr_init(&mattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize mutex attribute");
+
+    rc = pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to set mutex attribute to shared");
+
+    rc = pthread_mutex_init(&partition->lockfile.locks->write_lock, &mattr);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize partition write mutex");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
 static ledger_status map_lockfile(ledger_partition *partition, int fd, size_t map_len) {
     ledger_status rc;
     void *map = NULL;
@@ -285,18 +245,62 @@ static ledger_status unmap_lockfile(ledger_partition *partition) {
     return LEDGER_OK;
 }
 
-static ledger_journal_meta_entry *find_meta(ledger_partition *partition, uint64_t message_id) {
-    ledger_journal_meta_entry *entry = NULL;
-    int i;
+static bool meta_contains(ledger_partition *partition, uint32_t index, uint64_t message_id) {
+    ledger_journal_meta_entry *entries = partition->meta.entries;
+
+    return entries[index].first_message_id <= message_id &&
+        (index + 1 == partition->meta.nentries || entries[index + 1].first_message_id > message_id);
+}
+
+// The last entry starting at or before message_id, or the first entry
+// when they all start after it
+static uint32_t search_meta(ledger_partition *partition, uint64_t message_id) {
+    uint32_t low = 0;
+    uint32_t high = partition->meta.nentries;
+    uint32_t mid;
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(partition->meta.entries[mid].first_message_id <= message_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
 
-    for(i = partition->meta.nentries-1; i >= 0; i--) {
-        entry = &partition->meta.entries[i];
-        if(entry->first_message_id <= message_id) {
-            return entry;
+static uint32_t find_meta_index(ledger_partition *partition, ledger_read_cursor *cursor,
+                                uint64_t message_id) {
+    uint32_t index;
+
+    // Compaction moves the entries, so the cached one has to still be there.
+    // Readers mostly stay on their journal, or move on to the next one.
+    if(cursor != NULL && cursor->valid && cursor->index < partition->meta.nentries &&
+       partition->meta.entries[cursor->index].id == cursor->journal_id) {
+        for(index = cursor->index;
+            index < partition->meta.nentries && index <= cursor->index + 1;
+            index++) {
+            if(meta_contains(partition, index, message_id)) {
+                return index;
+            }
         }
     }
 
-    return entry;
+    return search_meta(partition, message_id);
+}
+
+static ledger_journal_meta_entry *find_meta(ledger_partition *partition, ledger_read_cursor *cursor,
+                                            uint64_t message_id) {
+    uint32_t index;
+
+    index = find_meta_index(partition, cursor, message_id);
+    if(cursor != NULL) {
+        cursor->valid = true;
+        cursor->index = index;
+        cursor->journal_id = partition->meta.entries[index].id;
+    }
+    return &partition->meta.entries[index];
 }
 
 static void init_meta(ledger_partition_meta *meta) {
@@ -335,7 +339,8 @@ static ledger_status remap_meta(ledger_partition *partition, int fd, size_t map_
     ledger_status rc;
     uint32_t *nentries;
     size_t expected_len, old_len;
-    void *map, *old;
+    void *map = MAP_FAILED;
+    void *old;
 
     ledger_check_rc(map_len >= sizeof(uint32_t),
                     LEDGER_ERR_BAD_META, "Corrupt meta file, should contain the number of meta entries");
@@ -349,24 +354,25 @@ static ledger_status remap_meta(ledger_partition *partition, int fd, size_t map_
     expected_len = sizeof(uint32_t) + (*nentries * sizeof(ledger_journal_meta_entry));
     ledger_check_rc(expected_len == map_len, LEDGER_ERR_BAD_META, "Corrupt meta file, expected length does not match file length");
 
+    old = partition->meta.map;
+    old_len = partition->meta.map_len;
+
     partition->meta.nentries = *nentries;
     nentries++;
     partition->meta.entries = (ledger_journal_meta_entry *)nentries;
+    partition->meta.map = map;
+    partition->meta.map_len = map_len;
 
-    if(partition->meta.map) {
-        old = partition->meta.map;
-        old_len = partition->meta.map_len;
-
-        partition->meta.map = map;
-        partition->meta.map_len = map_len;
-
-        rc = munmap(old, old_len);
-        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to unmap old meta file");
+    if(old) {
+        munmap(old, old_len);
     }
 
     return LEDGER_OK;
 
 error:
+    if(map != MAP_FAILED) {
+        munmap(map, map_len);
+    }
     return rc;
 }
 
@@ -377,63 +383,165 @@ static ledger_status unmap_meta(ledger_partition *partition) {
     return LEDGER_OK;
 }
 
+// Writers in other processes rotate journals without telling this one,
+// only the shared tail moves on. Maps the meta file again once the tail
+// is in a journal newer than the latest one known here.
+static ledger_status refresh_meta(ledger_partition *partition) {
+    ledger_status rc;
+    ledger_journal_tail tail;
+    ledger_journal_meta_entry *latest_meta;
+    bool meta_locked = false;
+    bool stale;
+    struct stat st;
+    int fd = 0;
+
+    ledger_journal_tail_load(&partition->lockfile.locks->tail, &tail);
+
+    rc = pthread_rwlock_rdlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+    latest_meta = find_latest_meta(partition);
+    stale = latest_meta != NULL && tail.journal_id > latest_meta->id;
+    pthread_rwlock_unlock(&partition->meta_lock);
+
+    if(!stale) {
+        return LEDGER_OK;
+    }
+
+    // Compaction renames a new meta file into place, so it's opened by path
+    fd = open_meta(partition);
+    ledger_check_rc(fd > 0, fd, "Failed to open meta file");
+
+    rc = pthread_rwlock_wrlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+    meta_locked = true;
+
+    latest_meta = find_latest_meta(partition);
+    if(tail.journal_id > latest_meta->id) {
+        rc = fstat(fd, &st);
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat meta file");
+
+        // A rotation still being written leaves the count ahead of the
+        // entries, and the current mapping stands until the next read
+        remap_meta(partition, fd, st.st_size);
+    }
+
+    pthread_rwlock_unlock(&partition->meta_lock);
+    close(fd);
+    return LEDGER_OK;
+
+error:
+    if(meta_locked) {
+        pthread_rwlock_unlock(&partition->meta_lock);
+    }
+    if(fd > 0) {
+        close(fd);
+    }
+    return rc;
+}
+
+// A constant amount of work, purging and compacting the meta file
+// is left to the maintenance thread. Callers hold the write lock.
 static ledger_status rotate_journals(ledger_partition *partition) {
-    ledger_status rc = LEDGER_OK;
+    ledger_status rc;
     int fd = 0;
-    int new_fd = 0;
+    bool meta_locked = false;
     struct stat st;
 
     fd = open_meta(partition);
-    ledger_check_rc(fd > 0, rc, "Failed to open meta file");
+    ledger_check_rc(fd > 0, fd, "Failed to open meta file");
 
-    rc = remove_old_journals(partition, fd, &new_fd);
-    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to remove old journals");
+    rc = pthread_rwlock_wrlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+    meta_locked = true;
 
-    rc = add_journal(partition, new_fd);
+    rc = add_journal(partition, fd);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to add a journal");
 
-    rc = fstat(new_fd, &st);
+    rc = fstat(fd, &st);
     ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat meta file");
 
-    rc = remap_meta(partition, new_fd, st.st_size);
+    rc = remap_meta(partition, fd, st.st_size);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to remap meta during rotation");
 
-    close(new_fd);
+    pthread_rwlock_unlock(&partition->meta_lock);
+    close(fd);
     return LEDGER_OK;
 
 error:
-    if(fd) {
-        close(fd);
+    if(meta_locked) {
+        pthread_rwlock_unlock(&partition->meta_lock);
     }
-    if(new_fd) {
-        close(new_fd);
+    if(fd > 0) {
+        close(fd);
     }
     return rc;
 }
 
-ledger_status ledger_partition_latest_message_id(ledger_partition *partition, uint64_t *id) {
-    ledger_journal_meta_entry *latest_meta;
-    ledger_journal journal;
-    ledger_journal_options journal_options;
-    ledger_status rc;
+static uint64_t monotonic_ms() {
+    struct timespec ts;
 
-    latest_meta = find_latest_meta(partition);
-    if(latest_meta == NULL) {
-        *id = 0;
-        return LEDGER_OK;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Readers wait on the id after the last message
+static void notify_watches(ledger_partition *partition) {
+    ledger_partition_watch *watch;
+
+    if(__atomic_load_n(&partition->nwatches, __ATOMIC_SEQ_CST) == 0) {
+        return;
     }
+    pthread_mutex_lock(&partition->watch_lock);
+    for(watch = partition->watches; watch != NULL; watch = watch->next) {
+        watch->notify(watch);
+    }
+    pthread_mutex_unlock(&partition->watch_lock);
+}
 
-    rc = ledger_journal_open(&journal, partition->path, latest_meta, &journal_options);
+static void publish_tail(ledger_partition *partition) {
+    ledger_journal_tail tail;
+
+    ledger_journal_tail_load(&partition->lockfile.locks->tail, &tail);
+    ledger_signal_publish(&partition->lockfile.locks->message_signal, tail.next_message_id);
+    notify_watches(partition);
+}
+
+// The files are the source of truth for the tail. A writer that died
+// between appending and publishing, or a lock file written before the
+// tail existed, leaves it behind.
+ledger_status ledger_partition_recover(ledger_partition *partition) {
+    ledger_status rc;
+    pthread_mutex_t *write_lock = NULL;
+    ledger_cached_journal *cached = NULL;
+    ledger_journal_options journal_options;
+
+    init_journal_options(partition, &journal_options);
+
+    rc = pthread_mutex_lock(&partition->lockfile.locks->write_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition for writing");
+    write_lock = &partition->lockfile.locks->write_lock;
+    // Readers would wait forever on a tail left half stored
+    ledger_journal_tail_reset(&partition->lockfile.locks->tail);
+
+    rc = ledger_journal_cache_acquire(&partition->journals, find_latest_meta(partition),
+                                      &journal_options, &cached);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open journal");
 
-    rc = ledger_journal_latest_message_id(&journal, id);
-    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the latest message id");
+    rc = ledger_journal_recover_tail(&cached->journal);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to recover journal tail");
+    publish_tail(partition);
 
-    ledger_journal_close(&journal);
+    pthread_mutex_unlock(write_lock);
+    ledger_journal_cache_release(cached);
     return LEDGER_OK;
 
 error:
-    ledger_journal_close(&journal);
+    if(write_lock) {
+        pthread_mutex_unlock(write_lock);
+    }
+    if(cached) {
+        ledger_journal_cache_release(cached);
+    }
     return rc;
 }
 
@@ -446,6 +554,7 @@ ledger_status ledger_partition_open(ledger_partition *partition, const char *top
     ssize_t path_len;
     char *partition_path = NULL;
     struct stat st;
+    off_t lock_size;
 
     partition->path = NULL;
     partition->opened = false;
@@ -464,6 +573,45 @@ ledger_status ledger_partition_open(ledger_partition *partition, const char *top
     rc = mkdir(partition_path, 0755);
     ledger_check_rc(rc == 0 || errno == EEXIST, LEDGER_ERR_MKDIR, "Failed to create partition directory");
 
+    lock_fd = open_lockfile(partition);
+    ledger_check_rc(lock_fd > 0, rc, "Failed to open lockfile");
+
+    rc = fstat(lock_fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat lockfile");
+
+    if(st.st_size == 0) {
+        rc = create_locks(partition, lock_fd);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to create partition locks");
+    } else if(st.st_size < sizeof(ledger_partition_locks)) {
+        // Lock files from before the tail and message signal were kept
+        // grow to fit them. A zeroed signal is ready to use, and the tail
+        // is recovered by ledger_partition_recover.
+        rc = ftruncate(lock_fd, sizeof(ledger_partition_locks));
+        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to grow lock file");
+    }
+    lock_size = st.st_size;
+
+    rc = fstat(lock_fd, &st);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to restat lock file");
+
+    rc = map_lockfile(partition, lock_fd, st.st_size);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read memory mapped lock file");
+
+    if(lock_size > 0 && lock_size <= offsetof(ledger_partition_locks, write_lock)) {
+        rc = init_write_lock(partition);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to initialize partition write lock");
+    }
+
+    rc = pthread_rwlock_init(&partition->meta_lock, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to initialize partition meta lock");
+
+    pthread_mutex_init(&partition->watch_lock, NULL);
+    partition->watches = NULL;
+    partition->nwatches = 0;
+
+    ledger_journal_cache_init(&partition->journals, partition->path,
+                              &partition->lockfile.locks->tail);
+
     init_meta(&partition->meta);
 
     fd = open_meta(partition);
@@ -483,27 +631,18 @@ ledger_status ledger_partition_open(ledger_partition *partition, const char *top
     rc = remap_meta(partition, fd, st.st_size);
     ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read memory mapped meta file");
 
-    lock_fd = open_lockfile(partition);
-    ledger_check_rc(lock_fd > 0, rc, "Failed to open lockfile");
-
-    rc = fstat(lock_fd, &st);
-    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to stat lockfile");
-
-    if(st.st_size == 0) {
-        rc = create_locks(partition, lock_fd);
-        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to create partition locks");
-
-        rc = fstat(lock_fd, &st);
-        ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to restat lock file");
-    }
-
-    rc = map_lockfile(partition, lock_fd, st.st_size);
-    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read memory mapped lock file");
-
     close(fd);
     close(lock_fd);
 
-    ledger_signal_init(&partition->message_signal);
+    pthread_mutex_init(&partition->commit.lock, NULL);
+    pthread_cond_init(&partition->commit.done_cond, NULL);
+    partition->commit.flushing = false;
+    partition->commit.head = NULL;
+    partition->commit.tail = NULL;
+    partition->commit.unsynced_bytes = 0;
+    partition->commit.last_sync_ms = monotonic_ms();
+    partition->prepared_journal_id = 0;
+    partition->compacted_journal_id = UINT32_MAX;
 
     partition->opened = true;
 
@@ -522,111 +661,1321 @@ error:
     return rc;
 }
 
+ledger_status ledger_partition_latest_message_id(ledger_partition *partition, uint64_t *id) {
+    ledger_status rc;
+
+    rc = refresh_meta(partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to refresh partition meta");
+
+    rc = pthread_rwlock_rdlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+
+    rc = latest_message_id(partition, id);
+    pthread_rwlock_unlock(&partition->meta_lock);
+    return rc;
+
+error:
+    return rc;
+}
+
+static ledger_status commit_batch(ledger_partition *partition, const struct iovec *keys,
+                                  const struct iovec *messages, size_t nmessages,
+                                  ledger_write_batch_status *status);
+
 ledger_status ledger_partition_write(ledger_partition *partition, void *data,
                                      size_t len, ledger_write_status *status) {
-    ledger_status rc, write_status;
-    ledger_journal_meta_entry *latest_meta = NULL;
-    ledger_journal journal;
-    ledger_journal_options journal_options;
+    return ledger_partition_write_keyed(partition, NULL, 0, data, len, status);
+}
 
-    ledger_check_rc(partition->meta.nentries > 0, LEDGER_ERR_BAD_PARTITION, "No journal entry to write to");
+ledger_status ledger_partition_write_keyed(ledger_partition *partition, const void *key,
+                                           size_t key_len, void *data, size_t len,
+                                           ledger_write_status *status) {
+    ledger_status rc;
+    struct iovec key_vec;
+    struct iovec message;
+    ledger_write_batch_status batch_status;
+
+    key_vec.iov_base = (void *)key;
+    key_vec.iov_len = key_len;
+    message.iov_base = data;
+    message.iov_len = len;
+
+    rc = commit_batch(partition, key != NULL ? &key_vec : NULL, &message, 1,
+                      status != NULL ? &batch_status : NULL);
+    if(rc == LEDGER_OK && status != NULL) {
+        status->message_id = batch_status.first_message_id;
+        status->partition_num = batch_status.partition_num;
+    }
+    return rc;
+}
+
+static bool commit_needs_sync(ledger_partition *partition, size_t nbytes) {
+    ledger_partition_commit *commit = &partition->commit;
+
+    switch(partition->options.durability) {
+    case LEDGER_DURABILITY_BATCH:
+        return true;
+    case LEDGER_DURABILITY_BYTES:
+        return commit->unsynced_bytes + nbytes >= partition->options.durability_bytes;
+    case LEDGER_DURABILITY_INTERVAL:
+        return monotonic_ms() - commit->last_sync_ms >= partition->options.durability_interval_ms;
+    default:
+        return false;
+    }
+}
 
-    journal_options.drop_corrupt = partition->options.drop_corrupt;
-    journal_options.max_size_bytes = partition->options.journal_max_size_bytes;
+// Once the latest journal is half full, the one after it gets its space
+// allocated, so rotation doesn't have to wait on the file system.
+static void prepare_next_journal(ledger_partition *partition) {
+    ledger_journal_tail tail;
+    uint32_t journal_id;
 
-    if(status != NULL) {
-        status->partition_num = partition->number;
+    pthread_rwlock_rdlock(&partition->meta_lock);
+    journal_id = find_latest_meta(partition)->id;
+    pthread_rwlock_unlock(&partition->meta_lock);
+
+    if(partition->prepared_journal_id == journal_id + 1) {
+        return;
     }
 
-    do {
-        latest_meta = find_latest_meta(partition);
+    ledger_journal_tail_load(&partition->lockfile.locks->tail, &tail);
+    if(tail.journal_id != journal_id ||
+       tail.end_offset < partition->options.journal_max_size_bytes / 2) {
+        return;
+    }
+
+    // Best effort, the journal is created on rotation either way
+    if(ledger_journal_preallocate(partition->path, journal_id + 1,
+                                  partition->options.journal_max_size_bytes) == LEDGER_OK) {
+        partition->prepared_journal_id = journal_id + 1;
+    }
+}
+
+static ledger_status append_batch(ledger_partition *partition, const struct iovec *keys,
+                                  const struct iovec *messages, size_t nmessages,
+                                  ledger_write_batch_status *status, bool sync) {
+    ledger_status rc, write_status;
+    pthread_mutex_t *write_lock = NULL;
+    bool meta_locked = false;
+    ledger_cached_journal *cached = NULL;
+    ledger_journal_options journal_options;
+
+    init_journal_options(partition, &journal_options);
 
-        rc = pthread_mutex_lock(&latest_meta->write_lock);
-        ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition for writing");
+    rc = pthread_mutex_lock(&partition->lockfile.locks->write_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition for writing");
+    write_lock = &partition->lockfile.locks->write_lock;
+
+    do {
+        rc = pthread_rwlock_rdlock(&partition->meta_lock);
+        ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+        meta_locked = true;
 
-        rc = ledger_journal_open(&journal, partition->path, latest_meta, &journal_options);
+        rc = ledger_journal_cache_acquire(&partition->journals, find_latest_meta(partition),
+                                          &journal_options, &cached);
         ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open journal");
 
-        rc = ledger_journal_write(&journal, data, len, status);
+        if(keys != NULL) {
+            rc = ledger_journal_write_keyed_batch(&cached->journal, keys, messages, nmessages, status);
+        } else {
+            rc = ledger_journal_write_batch(&cached->journal, messages, nmessages, status);
+        }
         ledger_check_rc(rc == LEDGER_OK || rc == LEDGER_NEXT, rc, "Failed to write to journal");
 
         write_status = rc;
+        if(write_status == LEDGER_NEXT) {
+            // Earlier unsynced commits live in the journal we're leaving behind
+            if(partition->commit.unsynced_bytes > 0) {
+                rc = ledger_journal_sync(&cached->journal);
+                ledger_check_rc(rc == LEDGER_OK, rc, "Failed to sync journal before rotation");
+            }
+        } else if(sync) {
+            rc = ledger_journal_sync(&cached->journal);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to sync journal");
+        }
+
+        ledger_journal_cache_release(cached);
+        cached = NULL;
+        pthread_rwlock_unlock(&partition->meta_lock);
+        meta_locked = false;
+
         if(write_status == LEDGER_NEXT) {
             rc = rotate_journals(partition);
             ledger_check_rc(rc == LEDGER_OK, rc, "Failed to rotate journals");
         }
+    } while (write_status == LEDGER_NEXT);
 
-        // Signal any waiting consumers that there are messages available
-        ledger_partition_signal_readers(partition);
-        rc = pthread_mutex_unlock(&latest_meta->write_lock);
-        ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to unlock partition for writing");
+    // Wake the readers waiting on these messages
+    publish_tail(partition);
+    rc = pthread_mutex_unlock(write_lock);
+    write_lock = NULL;
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to unlock partition for writing");
 
-        ledger_journal_close(&journal);
-    } while (write_status == LEDGER_NEXT);
     return LEDGER_OK;
 
 error:
-    pthread_mutex_unlock(&latest_meta->write_lock);
-    ledger_journal_close(&journal);
+    if(cached) {
+        ledger_journal_cache_release(cached);
+    }
+    if(meta_locked) {
+        pthread_rwlock_unlock(&partition->meta_lock);
+    }
+    if(write_lock) {
+        pthread_mutex_unlock(write_lock);
+    }
     return rc;
 }
 
-void ledger_partition_wait_messages(ledger_partition *partition) {
-    ledger_signal_wait(&partition->message_signal);
+// Writes every queued request as one journal batch, so they share a
+// single write and, depending on the durability policy, a single sync.
+static void commit_flush(ledger_partition *partition, ledger_commit_request *group) {
+    ledger_status rc;
+    ledger_commit_request *request;
+    ledger_write_batch_status batch_status;
+    ledger_partition_commit *commit = &partition->commit;
+    struct iovec *messages = NULL;
+    struct iovec *keys = NULL;
+    const struct iovec *batch;
+    const struct iovec *batch_keys = NULL;
+    bool keyed = false;
+    size_t nmessages = 0;
+    size_t nbytes = 0;
+    size_t i;
+    uint64_t next_id;
+    bool sync;
+
+    for(request = group; request != NULL; request = request->next) {
+        for(i = 0; i < request->nmessages; i++) {
+            nbytes += request->messages[i].iov_len;
+        }
+        nmessages += request->nmessages;
+        keyed = keyed || request->keys != NULL;
+    }
+
+    if(group->next == NULL) {
+        batch = group->messages;
+        batch_keys = group->keys;
+    } else {
+        messages = ledger_reallocarray(NULL, nmessages, sizeof(struct iovec));
+        ledger_check_rc(messages != NULL, LEDGER_ERR_MEMORY, "Failed to allocate commit batch");
+
+        // Requests without keys go in with empty ones, which read back as none
+        if(keyed) {
+            keys = calloc(nmessages, sizeof(struct iovec));
+            ledger_check_rc(keys != NULL, LEDGER_ERR_MEMORY, "Failed to allocate commit batch keys");
+        }
+
+        i = 0;
+        for(request = group; request != NULL; request = request->next) {
+            memcpy(&messages[i], request->messages, request->nmessages * sizeof(struct iovec));
+            if(request->keys != NULL) {
+                memcpy(&keys[i], request->keys, request->nmessages * sizeof(struct iovec));
+            }
+            i += request->nmessages;
+        }
+        batch = messages;
+        batch_keys = keys;
+    }
+
+    sync = commit_needs_sync(partition, nbytes);
+    rc = append_batch(partition, batch_keys, batch, nmessages, &batch_status, sync);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to append commit batch");
+
+    if(sync) {
+        commit->unsynced_bytes = 0;
+        commit->last_sync_ms = monotonic_ms();
+    } else if(partition->options.durability != LEDGER_DURABILITY_NONE) {
+        commit->unsynced_bytes += nbytes;
+    }
+
+    next_id = batch_status.first_message_id;
+    for(request = group; request != NULL; request = request->next) {
+        request->status = LEDGER_OK;
+        request->first_message_id = next_id;
+        next_id += request->nmessages;
+    }
+
+    if(messages) {
+        free(messages);
+    }
+    if(keys) {
+        free(keys);
+    }
+    return;
+
+error:
+    for(request = group; request != NULL; request = request->next) {
+        request->status = rc;
+    }
+    if(messages) {
+        free(messages);
+    }
+    if(keys) {
+        free(keys);
+    }
+}
+
+ledger_status ledger_partition_write_batch(ledger_partition *partition, const struct iovec *messages,
+                                           size_t nmessages, ledger_write_batch_status *status) {
+    return commit_batch(partition, NULL, messages, nmessages, status);
+}
+
+ledger_status ledger_partition_write_keyed_batch(ledger_partition *partition, const struct iovec *keys,
+                                                 const struct iovec *messages, size_t nmessages,
+                                                 ledger_write_batch_status *status) {
+    return commit_batch(partition, keys, messages, nmessages, status);
+}
+
+static ledger_status commit_batch(ledger_partition *partition, const struct iovec *keys,
+                                  const struct iovec *messages, size_t nmessages,
+                                  ledger_write_batch_status *status) {
+    ledger_status rc;
+    ledger_partition_commit *commit = &partition->commit;
+    ledger_commit_request request;
+    ledger_commit_request *group, *next;
+
+    ledger_check_rc(partition->meta.nentries > 0, LEDGER_ERR_BAD_PARTITION, "No journal entry to write to");
+    ledger_check_rc(nmessages > 0, LEDGER_ERR_ARGS, "Empty write batch");
+
+    request.keys = keys;
+    request.messages = messages;
+    request.nmessages = nmessages;
+    request.status = LEDGER_ERR_GENERAL;
+    request.first_message_id = 0;
+    request.done = false;
+    request.next = NULL;
+
+    pthread_mutex_lock(&commit->lock);
+    if(commit->tail != NULL) {
+        commit->tail->next = &request;
+    } else {
+        commit->head = &request;
+    }
+    commit->tail = &request;
+
+    while(!request.done) {
+        if(commit->flushing) {
+            pthread_cond_wait(&commit->done_cond, &commit->lock);
+            continue;
+        }
+
+        // Nobody is flushing, so we take everything queued so far
+        commit->flushing = true;
+        group = commit->head;
+        commit->head = NULL;
+        commit->tail = NULL;
+        pthread_mutex_unlock(&commit->lock);
+
+        commit_flush(partition, group);
+
+        pthread_mutex_lock(&commit->lock);
+        for(; group != NULL; group = next) {
+            // Waiters own their requests once they're done
+            next = group->next;
+            group->done = true;
+        }
+        commit->flushing = false;
+        pthread_cond_broadcast(&commit->done_cond);
+    }
+    pthread_mutex_unlock(&commit->lock);
+
+    rc = request.status;
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to commit write batch");
+
+    if(status != NULL) {
+        status->first_message_id = request.first_message_id;
+        status->last_message_id = request.first_message_id + nmessages - 1;
+        status->partition_num = partition->number;
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+void ledger_partition_wait_messages(ledger_partition *partition) {
+    ledger_signal *sig = &partition->lockfile.locks->message_signal;
+
+    ledger_signal_wait(sig, ledger_signal_value(sig), -1);
+}
+
+ledger_status ledger_partition_wait_message(ledger_partition *partition, uint64_t id,
+                                            long int timeout_ms) {
+    return ledger_partition_wait_message_since(partition, id,
+                                               ledger_partition_reader_signals(partition),
+                                               timeout_ms);
+}
+
+ledger_signal *ledger_partition_message_signal(ledger_partition *partition) {
+    return &partition->lockfile.locks->message_signal;
+}
+
+uint32_t ledger_partition_reader_signals(ledger_partition *partition) {
+    return ledger_signal_kicks(&partition->lockfile.locks->message_signal);
+}
+
+ledger_status ledger_partition_wait_message_since(ledger_partition *partition, uint64_t id,
+                                                  uint32_t signals, long int timeout_ms) {
+    if(ledger_partition_has_message(partition, id)) {
+        return LEDGER_OK;
+    }
+    return ledger_signal_wait_since(&partition->lockfile.locks->message_signal, id,
+                                    signals, timeout_ms);
 }
 
 void ledger_partition_signal_readers(ledger_partition *partition) {
-    ledger_signal_broadcast(&partition->message_signal);
+    ledger_signal_broadcast(&partition->lockfile.locks->message_signal);
+}
+
+bool ledger_partition_has_message(ledger_partition *partition, uint64_t id) {
+    ledger_journal_tail tail;
+
+    // Writers in other processes only move the tail
+    ledger_journal_tail_load(&partition->lockfile.locks->tail, &tail);
+    return tail.next_message_id > id;
+}
+
+void ledger_partition_watch_add(ledger_partition *partition, ledger_partition_watch *watch) {
+    pthread_mutex_lock(&partition->watch_lock);
+    watch->next = partition->watches;
+    partition->watches = watch;
+    __atomic_add_fetch(&partition->nwatches, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&partition->watch_lock);
+}
+
+void ledger_partition_watch_remove(ledger_partition *partition, ledger_partition_watch *watch) {
+    ledger_partition_watch **link;
+
+    pthread_mutex_lock(&partition->watch_lock);
+    for(link = &partition->watches; *link != NULL; link = &(*link)->next) {
+        if(*link == watch) {
+            *link = watch->next;
+            __atomic_sub_fetch(&partition->nwatches, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&partition->watch_lock);
+}
+
+void ledger_read_cursor_init(ledger_read_cursor *cursor) {
+    cursor->valid = false;
+    cursor->index = 0;
+    cursor->journal_id = 0;
+    cursor->arena = NULL;
 }
 
 ledger_status ledger_partition_read(ledger_partition *partition, uint64_t start_id,
                                     size_t nmessages, ledger_message_set *messages) {
+    return ledger_partition_read_cursor(partition, NULL, start_id, nmessages, messages);
+}
+
+ledger_status ledger_partition_read_cursor(ledger_partition *partition, ledger_read_cursor *cursor,
+                                           uint64_t start_id, size_t nmessages,
+                                           ledger_message_set *messages) {
     ledger_status rc;
     ledger_journal_meta_entry *meta;
-    ledger_journal journal;
+    ledger_cached_journal *cached = NULL;
     ledger_journal_options journal_options;
+    bool meta_locked = false;
     uint64_t message_id;
-    size_t messages_left;
+    size_t messages_left, used;
 
-    ledger_check_rc(partition->meta.nentries > 0, LEDGER_ERR_BAD_PARTITION, "No journal entry to read from");
-
-    journal_options.drop_corrupt = partition->options.drop_corrupt;
-    journal_options.max_size_bytes = partition->options.journal_max_size_bytes;
+    init_journal_options(partition, &journal_options);
 
     memset(messages, 0, sizeof(ledger_message_set));
+    // Claimed by the first journal read
+    messages->arena = cursor != NULL ? cursor->arena : NULL;
+
+    rc = refresh_meta(partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to refresh partition meta");
+
+    rc = pthread_rwlock_rdlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+    meta_locked = true;
+
+    ledger_check_rc(partition->meta.nentries > 0, LEDGER_ERR_BAD_PARTITION, "No journal entry to read from");
+
+    // Messages before the first journal have been purged
+    if(start_id < partition->meta.entries[0].first_message_id) {
+        start_id = partition->meta.entries[0].first_message_id;
+    }
 
     messages->partition_num = partition->number;
     message_id = start_id;
     messages_left = nmessages;
     do {
-        meta = find_meta(partition, message_id);
+        meta = find_meta(partition, cursor, message_id);
 
-        rc = ledger_journal_open(&journal, partition->path, meta, &journal_options);
+        rc = ledger_journal_cache_acquire(&partition->journals, meta, &journal_options, &cached);
         ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open journal");
 
-        rc = ledger_journal_read(&journal, message_id, messages_left, messages);
+        rc = ledger_journal_read(&cached->journal, message_id, messages_left, messages);
         ledger_check_rc(rc == LEDGER_OK || rc == LEDGER_NEXT, rc, "Failed to read from the journal");
 
-        ledger_journal_close(&journal);
+        ledger_journal_cache_release(cached);
+        cached = NULL;
 
-        messages_left = messages_left - messages->nmessages;
+        // Counted in index entries read from this journal, so gaps compaction
+        // left count against the read too
+        used = messages->next_id > message_id ? messages->next_id - message_id : 0;
+        messages_left = used < messages_left ? messages_left - used : 0;
         message_id = messages->next_id;
 
-        if(meta->id == partition->meta.nentries-1) {
-            // Reached the last journal, and there's no more messages to read
+        // Journal ids stop matching meta positions once journals are purged
+        if(meta == find_latest_meta(partition) || messages_left == 0) {
+            // Reached the last journal, or read as many as asked for
             break;
         }
     } while (rc == LEDGER_NEXT);
 
+    pthread_rwlock_unlock(&partition->meta_lock);
+    return LEDGER_OK;
+
+error:
+    if(cached) {
+        ledger_journal_cache_release(cached);
+    }
+    if(meta_locked) {
+        pthread_rwlock_unlock(&partition->meta_lock);
+    }
+    if(messages->initialized) {
+        ledger_message_set_free(messages);
+    }
+    return rc;
+}
+
+// The last entry created in a second before time_ms. Every journal before
+// it was sealed before time_ms, so the search can start there.
+static uint32_t search_meta_time(ledger_partition *partition, uint64_t time_ms) {
+    uint64_t seconds = time_ms / 1000;
+    uint32_t low = 0;
+    uint32_t high = partition->meta.nentries;
+    uint32_t mid;
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(partition->meta.entries[mid].create_time < seconds) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+ledger_status ledger_partition_seek_time(ledger_partition *partition, uint64_t time_ms,
+                                         uint64_t *id) {
+    ledger_status rc;
+    ledger_cached_journal *cached = NULL;
+    ledger_journal_options journal_options;
+    bool meta_locked = false;
+    uint32_t index;
+
+    init_journal_options(partition, &journal_options);
+
+    rc = refresh_meta(partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to refresh partition meta");
+
+    rc = pthread_rwlock_rdlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+    meta_locked = true;
+
+    ledger_check_rc(partition->meta.nentries > 0, LEDGER_ERR_BAD_PARTITION, "No journal entry to seek in");
+
+    // Journals created in the same second as time_ms may still end before it
+    rc = LEDGER_NEXT;
+    for(index = search_meta_time(partition, time_ms);
+        index < partition->meta.nentries && rc == LEDGER_NEXT;
+        index++) {
+        rc = ledger_journal_cache_acquire(&partition->journals, &partition->meta.entries[index],
+                                          &journal_options, &cached);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open journal");
+
+        rc = ledger_journal_seek_time(&cached->journal, time_ms, id);
+        ledger_check_rc(rc == LEDGER_OK || rc == LEDGER_NEXT, rc, "Failed to seek in the journal");
+
+        ledger_journal_cache_release(cached);
+        cached = NULL;
+    }
+
+    // Everything was appended before time_ms, so the next message is the first after it
+    if(rc == LEDGER_NEXT) {
+        rc = latest_message_id(partition, id);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the latest message id");
+    }
+
+    pthread_rwlock_unlock(&partition->meta_lock);
+    return LEDGER_OK;
+
+error:
+    if(cached) {
+        ledger_journal_cache_release(cached);
+    }
+    if(meta_locked) {
+        pthread_rwlock_unlock(&partition->meta_lock);
+    }
+    return rc;
+}
+
+static ledger_status recycle_journal(ledger_partition *partition, uint32_t journal_id,
+                                     uint32_t latest_id) {
+    ledger_status rc;
+    int i;
+
+    for(i = 1; i <= MAX_SPARE_JOURNALS; i++) {
+        rc = ledger_journal_recycle(partition->path, journal_id, latest_id + i);
+        if(rc == LEDGER_OK) {
+            return rc;
+        }
+        // Files that can't be zeroed, or linked, are deleted instead
+        if(rc != LEDGER_NEXT) {
+            break;
+        }
+    }
+    return ledger_journal_delete(partition->path, journal_id);
+}
+
+// Rewrites the meta file without its first nremove entries, next to the
+// original so the rename stays on the same file system. Callers hold the
+// meta lock for writing.
+static ledger_status shrink_meta(ledger_partition *partition, uint32_t nremove) {
+    ledger_status rc;
+    int fd = -1;
+    char *meta_path = NULL;
+    char *tmp_path = NULL;
+    ssize_t path_len;
+    uint32_t nentries;
+    size_t write_size;
+
+    path_len = ledger_concat_path(partition->path, META_FILE, &meta_path);
+    ledger_check_rc(path_len > 0, LEDGER_ERR_MEMORY, "Failed to build meta path");
+
+    path_len = ledger_concat_path(partition->path, META_TMP_FILE, &tmp_path);
+    ledger_check_rc(path_len > 0, LEDGER_ERR_MEMORY, "Failed to build temporary meta path");
+
+    fd = mkstemp(tmp_path);
+    ledger_check_rc(fd != -1, LEDGER_ERR_IO, "Error opening meta temporary file");
+
+    nentries = partition->meta.nentries - nremove;
+    rc = ledger_pwrite(fd, (void *)&nentries, sizeof(uint32_t), 0);
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write meta number of entries");
+
+    write_size = nentries * sizeof(ledger_journal_meta_entry);
+    rc = ledger_pwrite(fd, (void *)&partition->meta.entries[nremove], write_size, sizeof(uint32_t));
+    ledger_check_rc(rc, LEDGER_ERR_IO, "Failed to write the shrunken meta entries");
+
+    rc = rename(tmp_path, meta_path);
+    ledger_check_rc(rc == 0, LEDGER_ERR_IO, "Failed to rename temporary meta file");
+
+    rc = remap_meta(partition, fd, sizeof(uint32_t) + write_size);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to remap the shrunken meta file");
+
+    close(fd);
+    free(tmp_path);
+    free(meta_path);
+    return LEDGER_OK;
+
+error:
+    if(fd != -1) {
+        close(fd);
+        unlink(tmp_path);
+    }
+    if(tmp_path) {
+        free(tmp_path);
+    }
+    if(meta_path) {
+        free(meta_path);
+    }
+    return rc;
+}
+
+static bool journal_expired(ledger_partition *partition, uint32_t index, time_t now) {
+    ledger_journal_meta_entry *entry = &partition->meta.entries[index];
+
+    return now - entry->create_time > partition->options.journal_purge_age_seconds;
+}
+
+static ledger_status purge_journals(ledger_partition *partition) {
+    ledger_status rc;
+    struct timeval tv;
+    pthread_mutex_t *write_lock = NULL;
+    bool meta_locked = false;
+    bool due, in_use;
+    uint32_t *purged = NULL;
+    uint32_t npurge = 0;
+    uint32_t latest_id = 0;
+    uint32_t i;
+
+    if(partition->options.journal_purge_age_seconds == LEDGER_JOURNAL_NO_PURGE) {
+        return LEDGER_OK;
+    }
+
+    rc = gettimeofday(&tv, NULL);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to fetch journal purge time of day");
+
+    // Most passes find nothing to do, and shouldn't hold up writers
+    pthread_rwlock_rdlock(&partition->meta_lock);
+    due = partition->meta.nentries > 1 && journal_expired(partition, 0, tv.tv_sec);
+    pthread_rwlock_unlock(&partition->meta_lock);
+    if(!due) {
+        return LEDGER_OK;
+    }
+
+    rc = pthread_mutex_lock(&partition->lockfile.locks->write_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition for writing");
+    write_lock = &partition->lockfile.locks->write_lock;
+
+    rc = pthread_rwlock_wrlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+    meta_locked = true;
+
+    // The latest journal is still being written to, so it always stays
+    while(npurge + 1 < partition->meta.nentries && journal_expired(partition, npurge, tv.tv_sec)) {
+        npurge++;
+    }
+
+    if(npurge > 0) {
+        purged = ledger_reallocarray(NULL, npurge, sizeof(uint32_t));
+        ledger_check_rc(purged != NULL, LEDGER_ERR_MEMORY, "Failed to allocate purged journal ids");
+
+        for(i = 0; i < npurge; i++) {
+            purged[i] = partition->meta.entries[i].id;
+        }
+        latest_id = find_latest_meta(partition)->id;
+
+        rc = shrink_meta(partition, npurge);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to shrink the meta file");
+    }
+
+    pthread_rwlock_unlock(&partition->meta_lock);
+    meta_locked = false;
+    pthread_mutex_unlock(write_lock);
+    write_lock = NULL;
+
+    // Nothing can find the purged journals anymore, so their files are
+    // removed without holding anybody up
+    for(i = 0; i < npurge; i++) {
+        in_use = ledger_journal_cache_evict(&partition->journals, purged[i]);
+
+        // Readers still on the journal, or borrowing from its mapping,
+        // must not see it overwritten
+        if(partition->options.journal_preallocate && !in_use &&
+           partition->options.read_mode != LEDGER_READ_MMAP) {
+            rc = recycle_journal(partition, purged[i], latest_id);
+        } else {
+            rc = ledger_journal_delete(partition->path, purged[i]);
+        }
+        ledger_check_rc(rc == LEDGER_OK, LEDGER_ERR_IO, "Error deleting journal file");
+    }
+
+    if(purged) {
+        free(purged);
+    }
+    return LEDGER_OK;
+
+error:
+    if(meta_locked) {
+        pthread_rwlock_unlock(&partition->meta_lock);
+    }
+    if(write_lock) {
+        pthread_mutex_unlock(write_lock);
+    }
+    if(purged) {
+        free(purged);
+    }
+    return rc;
+}
+
+typedef struct {
+    const void *data;
+    size_t len;
+} compact_key;
+
+// The latest message written with a key, and how many were written with
+// it. The key's bytes follow it.
+typedef struct {
+    compact_key key;
+    uint64_t id;
+    uint64_t count;
+} compact_entry;
+
+// A key's entry in a sealed journal's key summary, for the messages in
+// that journal. The key's bytes follow it.
+typedef struct {
+    uint64_t id;
+    uint32_t count;
+    uint32_t key_len;
+} summary_entry;
+
+static int compare_keys(const void *a, const void *b) {
+    const compact_key *ka = a;
+    const compact_key *kb = b;
+    int cmp;
+
+    cmp = memcmp(ka->data, kb->data, ka->len < kb->len ? ka->len : kb->len);
+    if(cmp != 0) {
+        return cmp;
+    }
+    return ka->len < kb->len ? -1 : ka->len > kb->len;
+}
+
+static void free_keys(dict_t *keys) {
+    dnode_t *cur;
+
+    for(cur = dict_first(keys); cur != NULL; cur = dict_next(keys, cur)) {
+        free(dnode_get(cur));
+    }
+    dict_free_nodes(keys);
+}
+
+// The journal among the sealed ones holding the message
+static uint32_t search_sealed(const ledger_journal_meta_entry *sealed, uint32_t nsealed,
+                              uint64_t message_id) {
+    uint32_t low = 0;
+    uint32_t high = nsealed;
+    uint32_t mid;
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(sealed[mid].first_message_id <= message_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+// Finds the key's entry, adding one without any messages yet
+static ledger_status lookup_key(dict_t *keys, const void *data, size_t len,
+                                compact_entry **out) {
+    ledger_status rc;
+    compact_key key;
+    compact_entry *entry;
+    dnode_t *node;
+
+    key.data = data;
+    key.len = len;
+    node = dict_lookup(keys, &key);
+    if(node != NULL) {
+        *out = dnode_get(node);
+        return LEDGER_OK;
+    }
+
+    entry = malloc(sizeof(compact_entry) + len);
+    ledger_check_rc(entry != NULL, LEDGER_ERR_MEMORY, "Failed to allocate compaction key");
+    memcpy(entry + 1, data, len);
+    entry->key.data = entry + 1;
+    entry->key.len = len;
+    entry->id = 0;
+    entry->count = 0;
+    if(!dict_alloc_insert(keys, &entry->key, entry)) {
+        free(entry);
+        ledger_check_rc(false, LEDGER_ERR_MEMORY, "Failed to insert compaction key");
+    }
+
+    *out = entry;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Notes count messages written with a key, the latest of them id, after
+// every message noted before. All but the latest message for a key are
+// replaced, and counted against the sealed journal holding them.
+static ledger_status note_key(dict_t *keys, const void *data, size_t len, uint64_t id,
+                              uint64_t count, const ledger_journal_meta_entry *sealed,
+                              uint32_t nsealed, uint64_t sealed_end, uint64_t *replaced) {
+    ledger_status rc;
+    compact_entry *entry;
+
+    rc = lookup_key(keys, data, len, &entry);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to look up compaction key");
+
+    if(entry->count > 0 && entry->id < sealed_end) {
+        replaced[search_sealed(sealed, nsealed, entry->id)]++;
+    }
+    if(count > 1 && id < sealed_end) {
+        replaced[search_sealed(sealed, nsealed, id)] += count - 1;
+    }
+    entry->id = id;
+    entry->count += count;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// Finds the latest message for each key from first_id up to end_id
+static ledger_status read_keys(ledger_partition *partition, dict_t *keys,
+                               uint64_t first_id, uint64_t end_id) {
+    ledger_status rc;
+    ledger_message_set messages;
+    ledger_message *message;
+    compact_entry *entry;
+    uint64_t id;
+    size_t i;
+
+    messages.initialized = false;
+    for(id = first_id; id < end_id; id = messages.next_id) {
+        rc = ledger_partition_read(partition, id, COMPACT_READ_SIZE, &messages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read messages to compact");
+        ledger_check_rc(messages.next_id > id, LEDGER_ERR_GENERAL, "Compaction read made no progress");
+
+        for(i = 0; i < messages.nmessages; i++) {
+            message = &messages.messages[i];
+            if(message->key == NULL || message->id >= end_id) {
+                continue;
+            }
+
+            rc = lookup_key(keys, message->key, message->key_len, &entry);
+            ledger_check_rc(rc == LEDGER_OK, rc, "Failed to look up compaction key");
+            entry->id = message->id;
+            entry->count++;
+        }
+        ledger_message_set_free(&messages);
+    }
+
+    return LEDGER_OK;
+
+error:
+    if(messages.initialized) {
+        ledger_message_set_free(&messages);
+    }
+    return rc;
+}
+
+static ledger_status fold_keys(dict_t *keys, dict_t *later,
+                               const ledger_journal_meta_entry *sealed, uint32_t nsealed,
+                               uint64_t sealed_end, uint64_t *replaced) {
+    ledger_status rc;
+    compact_entry *entry;
+    dnode_t *cur;
+
+    for(cur = dict_first(later); cur != NULL; cur = dict_next(later, cur)) {
+        entry = dnode_get(cur);
+        rc = note_key(keys, entry->key.data, entry->key.len, entry->id, entry->count,
+                      sealed, nsealed, sealed_end, replaced);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to note compaction key");
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static ledger_status append_summary(char **data, size_t *len, size_t *cap, const void *key,
+                                    uint32_t key_len, uint64_t id, uint64_t count) {
+    ledger_status rc;
+    summary_entry entry;
+    size_t needed = *len + sizeof(summary_entry) + key_len;
+    char *grown;
+
+    if(needed > *cap) {
+        grown = realloc(*data, needed > *cap * 2 ? needed : *cap * 2);
+        ledger_check_rc(grown != NULL, LEDGER_ERR_MEMORY, "Failed to grow key summary");
+        *data = grown;
+        *cap = needed > *cap * 2 ? needed : *cap * 2;
+    }
+
+    entry.id = id;
+    entry.count = count;
+    entry.key_len = key_len;
+    memcpy(*data + *len, &entry, sizeof(summary_entry));
+    memcpy(*data + *len + sizeof(summary_entry), key, key_len);
+    *len = needed;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static ledger_status fold_summary(dict_t *keys, const char *data, size_t len,
+                                  const ledger_journal_meta_entry *sealed, uint32_t nsealed,
+                                  uint64_t sealed_end, uint64_t *replaced) {
+    ledger_status rc;
+    summary_entry entry;
+    size_t pos = 0;
+
+    while(pos < len) {
+        ledger_check_rc(len - pos >= sizeof(summary_entry), LEDGER_ERR_IO, "Key summary is truncated");
+        memcpy(&entry, data + pos, sizeof(summary_entry));
+        pos += sizeof(summary_entry);
+        ledger_check_rc(len - pos >= entry.key_len, LEDGER_ERR_IO, "Key summary is truncated");
+
+        rc = note_key(keys, data + pos, entry.key_len, entry.id, entry.count,
+                      sealed, nsealed, sealed_end, replaced);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to note compaction key");
+        pos += entry.key_len;
+    }
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+// The keys written to a sealed journal, from its summary. A journal
+// without one is read and summarized, once after it's sealed.
+static ledger_status sealed_keys(ledger_partition *partition, const ledger_journal_meta_entry *meta,
+                                 uint64_t end_id, char **data, size_t *len) {
+    ledger_status rc;
+    dict_t summary;
+    compact_entry *entry;
+    dnode_t *cur;
+    size_t cap = 0;
+
+    rc = ledger_journal_read_keys(partition->path, meta->id, (void **)data, len);
+    if(rc != LEDGER_NEXT) {
+        return rc;
+    }
+
+    dict_init(&summary, DICTCOUNT_T_MAX, compare_keys);
+    *data = NULL;
+    *len = 0;
+
+    rc = read_keys(partition, &summary, meta->first_message_id, end_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read the journal's keys");
+
+    for(cur = dict_first(&summary); cur != NULL; cur = dict_next(&summary, cur)) {
+        entry = dnode_get(cur);
+        rc = append_summary(data, len, &cap, entry->key.data, entry->key.len,
+                            entry->id, entry->count);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to summarize the journal's keys");
+    }
+
+    rc = ledger_journal_write_keys(partition->path, meta->id, *data, *len);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write key summary");
+
+    free_keys(&summary);
+    return LEDGER_OK;
+
+error:
+    free_keys(&summary);
+    if(*data) {
+        free(*data);
+        *data = NULL;
+    }
+    return rc;
+}
+
+// Swaps the compacted files in, unless the journal was purged meanwhile
+static ledger_status commit_compaction(ledger_partition *partition,
+                                       ledger_journal_compaction *compaction) {
+    ledger_status rc;
+    bool found = false;
+    uint32_t i;
+
+    rc = pthread_rwlock_wrlock(&partition->meta_lock);
+    ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to lock partition meta");
+
+    for(i = 0; i < partition->meta.nentries && !found; i++) {
+        found = partition->meta.entries[i].id == compaction->metadata.id;
+    }
+
+    // Nothing can open the journal while the meta lock is held, so
+    // readers find either the old files or the new ones
+    if(found) {
+        ledger_journal_cache_evict(&partition->journals, compaction->metadata.id);
+        rc = ledger_journal_compaction_commit(compaction, partition->path);
+    } else {
+        ledger_journal_compaction_abort(compaction, partition->path);
+        rc = LEDGER_OK;
+    }
+
+    pthread_rwlock_unlock(&partition->meta_lock);
+    return rc;
+
+error:
+    ledger_journal_compaction_abort(compaction, partition->path);
+    return rc;
+}
+
+// Rewrites a sealed journal with only the messages that are the latest
+// for their key, or have none
+static ledger_status compact_journal(ledger_partition *partition, dict_t *keys,
+                                     const ledger_journal_meta_entry *meta, uint64_t end_id) {
+    ledger_status rc;
+    ledger_journal_options journal_options;
+    ledger_journal_compaction compaction;
+    ledger_message_set messages;
+    ledger_message *message;
+    ledger_message *kept = NULL;
+    compact_key key;
+    dnode_t *node;
+    bool opened = false;
+    char *summary = NULL;
+    size_t summary_len = 0, summary_cap = 0;
+    uint64_t id;
+    size_t i, nkept;
+
+    messages.initialized = false;
+    init_journal_options(partition, &journal_options);
+
+    kept = ledger_reallocarray(NULL, COMPACT_READ_SIZE, sizeof(ledger_message));
+    ledger_check_rc(kept != NULL, LEDGER_ERR_MEMORY, "Failed to allocate compaction buffer");
+
+    rc = ledger_journal_compaction_open(&compaction, partition->path, meta, &journal_options);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to start journal compaction");
+    opened = true;
+
+    for(id = meta->first_message_id; id < end_id; id = messages.next_id) {
+        rc = ledger_partition_read(partition, id, COMPACT_READ_SIZE, &messages);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read messages to compact");
+        ledger_check_rc(messages.next_id > id, LEDGER_ERR_GENERAL, "Compaction read made no progress");
+
+        nkept = 0;
+        for(i = 0; i < messages.nmessages; i++) {
+            message = &messages.messages[i];
+            if(message->id >= end_id) {
+                break;
+            }
+            if(message->key != NULL) {
+                key.data = message->key;
+                key.len = message->key_len;
+                node = dict_lookup(keys, &key);
+                if(node != NULL && ((compact_entry *)dnode_get(node))->id != message->id) {
+                    continue;
+                }
+
+                // Kept messages are the only ones left with their key
+                rc = append_summary(&summary, &summary_len, &summary_cap, message->key,
+                                    message->key_len, message->id, 1);
+                ledger_check_rc(rc == LEDGER_OK, rc, "Failed to summarize compacted keys");
+            }
+            kept[nkept++] = *message;
+        }
+
+        rc = ledger_journal_compaction_write(&compaction, kept, nkept);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write compacted messages");
+        ledger_message_set_free(&messages);
+    }
+
+    rc = ledger_journal_compaction_finish(&compaction, end_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to finish journal compaction");
+
+    rc = ledger_journal_compaction_write_keys(&compaction, partition->path, summary, summary_len);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to write compacted key summary");
+
+    opened = false;
+    rc = commit_compaction(partition, &compaction);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to replace compacted journal");
+
+    if(summary) {
+        free(summary);
+    }
+    free(kept);
+    return LEDGER_OK;
+
+error:
+    if(messages.initialized) {
+        ledger_message_set_free(&messages);
+    }
+    if(opened) {
+        ledger_journal_compaction_abort(&compaction, partition->path);
+    }
+    if(summary) {
+        free(summary);
+    }
+    if(kept) {
+        free(kept);
+    }
+    return rc;
+}
+
+// Only sealed journals are rewritten, but keys written to the latest one
+// still replace what came before them. Messages without keys are kept.
+// Sealed journals are only read once, for their key summaries, so each
+// pass reads the latest journal and whichever ones it compacts.
+static ledger_status compact_journals(ledger_partition *partition) {
+    ledger_status rc;
+    dict_t keys, latest_keys;
+    ledger_journal_meta_entry *sealed = NULL;
+    uint64_t *replaced = NULL;
+    char *summary = NULL;
+    size_t summary_len;
+    uint32_t latest_id;
+    uint32_t nsealed = 0;
+    uint64_t sealed_end, end_id;
+    uint32_t i;
+
+    dict_init(&keys, DICTCOUNT_T_MAX, compare_keys);
+    dict_init(&latest_keys, DICTCOUNT_T_MAX, compare_keys);
+
+    pthread_rwlock_rdlock(&partition->meta_lock);
+    latest_id = find_latest_meta(partition)->id;
+    if(partition->meta.nentries > 1 && latest_id != partition->compacted_journal_id) {
+        nsealed = partition->meta.nentries - 1;
+        sealed = ledger_reallocarray(NULL, nsealed, sizeof(ledger_journal_meta_entry));
+        if(sealed != NULL) {
+            memcpy(sealed, partition->meta.entries, nsealed * sizeof(ledger_journal_meta_entry));
+        }
+        sealed_end = partition->meta.entries[nsealed].first_message_id;
+    }
+    pthread_rwlock_unlock(&partition->meta_lock);
+
+    if(nsealed == 0) {
+        return LEDGER_OK;
+    }
+    ledger_check_rc(sealed != NULL, LEDGER_ERR_MEMORY, "Failed to allocate sealed journals");
+
+    replaced = calloc(nsealed, sizeof(uint64_t));
+    ledger_check_rc(replaced != NULL, LEDGER_ERR_MEMORY, "Failed to allocate compaction counts");
+
+    rc = ledger_partition_latest_message_id(partition, &end_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to find the latest message id");
+
+    for(i = 0; i < nsealed; i++) {
+        rc = sealed_keys(partition, &sealed[i],
+                         i + 1 < nsealed ? sealed[i + 1].first_message_id : sealed_end,
+                         &summary, &summary_len);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to load the journal's keys");
+
+        rc = fold_summary(&keys, summary, summary_len, sealed, nsealed, sealed_end, replaced);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to index the journal's keys");
+        free(summary);
+        summary = NULL;
+    }
+
+    rc = read_keys(partition, &latest_keys, sealed_end, end_id);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to read the latest journal's keys");
+
+    rc = fold_keys(&keys, &latest_keys, sealed, nsealed, sealed_end, replaced);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to index the latest journal's keys");
+
+    for(i = 0; i < nsealed; i++) {
+        if(replaced[i] == 0) {
+            continue;
+        }
+        rc = compact_journal(partition, &keys, &sealed[i],
+                             i + 1 < nsealed ? sealed[i + 1].first_message_id : sealed_end);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to compact journal");
+    }
+
+    partition->compacted_journal_id = latest_id;
+
+    free_keys(&keys);
+    free_keys(&latest_keys);
+    free(replaced);
+    free(sealed);
+    return LEDGER_OK;
+
+error:
+    free_keys(&keys);
+    free_keys(&latest_keys);
+    if(summary) {
+        free(summary);
+    }
+    if(replaced) {
+        free(replaced);
+    }
+    if(sealed) {
+        free(sealed);
+    }
+    return rc;
+}
+
+static ledger_status sync_latest_journal(ledger_partition *partition) {
+    ledger_status rc = LEDGER_OK;
+    ledger_journal_meta_entry *latest_meta;
+    ledger_cached_journal *cached;
+    ledger_journal_options journal_options;
+
+    init_journal_options(partition, &journal_options);
+
+    pthread_rwlock_rdlock(&partition->meta_lock);
+    latest_meta = find_latest_meta(partition);
+    if(latest_meta != NULL) {
+        rc = ledger_journal_cache_acquire(&partition->journals, latest_meta,
+                                          &journal_options, &cached);
+        if(rc == LEDGER_OK) {
+            rc = ledger_journal_sync(&cached->journal);
+            ledger_journal_cache_release(cached);
+        }
+    }
+    pthread_rwlock_unlock(&partition->meta_lock);
+
+    return rc;
+}
+
+// Interval durability only looks at the clock when the next write comes
+// in, so writes followed by a quiet spell are synced from here
+static ledger_status sync_overdue(ledger_partition *partition) {
+    ledger_status rc;
+    ledger_partition_commit *commit = &partition->commit;
+    bool overdue;
+
+    pthread_mutex_lock(&commit->lock);
+    overdue = !commit->flushing && commit->unsynced_bytes > 0 &&
+        monotonic_ms() - commit->last_sync_ms >= partition->options.durability_interval_ms;
+    if(!overdue) {
+        pthread_mutex_unlock(&commit->lock);
+        return LEDGER_OK;
+    }
+    // Writers queue up behind the sync as they would behind a flush
+    commit->flushing = true;
+    pthread_mutex_unlock(&commit->lock);
+
+    rc = sync_latest_journal(partition);
+
+    pthread_mutex_lock(&commit->lock);
+    if(rc == LEDGER_OK) {
+        commit->unsynced_bytes = 0;
+        commit->last_sync_ms = monotonic_ms();
+    }
+    commit->flushing = false;
+    pthread_cond_broadcast(&commit->done_cond);
+    pthread_mutex_unlock(&commit->lock);
+
+    return rc;
+}
+
+ledger_status ledger_partition_maintain(ledger_partition *partition) {
+    ledger_status rc;
+
+    rc = purge_journals(partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to purge old journals");
+
+    if(partition->options.compact) {
+        rc = compact_journals(partition);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to compact journals");
+    }
+
+    if(partition->options.journal_preallocate) {
+        prepare_next_journal(partition);
+    }
+
+    if(partition->options.durability == LEDGER_DURABILITY_INTERVAL) {
+        rc = sync_overdue(partition);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to sync partition");
+    }
+
     return LEDGER_OK;
 
 error:
-    ledger_journal_close(&journal);
     return rc;
 }
 
 void ledger_partition_close(ledger_partition *partition) {
+    ledger_partition_commit *commit = &partition->commit;
+    bool unsynced;
+
     if(partition->opened) {
+        // The flushing writer owns the count, as sync_overdue finds
+        pthread_mutex_lock(&commit->lock);
+        while(commit->flushing) {
+            pthread_cond_wait(&commit->done_cond, &commit->lock);
+        }
+        unsynced = commit->unsynced_bytes > 0;
+        pthread_mutex_unlock(&commit->lock);
+        if(unsynced) {
+            sync_latest_journal(partition);
+        }
+        pthread_mutex_destroy(&partition->commit.lock);
+        pthread_cond_destroy(&partition->commit.done_cond);
+        pthread_rwlock_destroy(&partition->meta_lock);
+        pthread_mutex_destroy(&partition->watch_lock);
+        ledger_journal_cache_close(&partition->journals);
         if(partition->path) {
             free(partition->path);
         }
@@ -6,6 +6,7 @@
 
 #include "signal.h"
 #include "journal.h"
+#include "journal_cache.h"
 
 #if defined(__cplusplus)
 extern "C" {
@@ -13,6 +14,13 @@ extern "C" {
 
 #define LEDGER_JOURNAL_NO_PURGE -1
 
+typedef enum {
+    LEDGER_DURABILITY_NONE = 0,
+    LEDGER_DURABILITY_INTERVAL,
+    LEDGER_DURABILITY_BYTES,
+    LEDGER_DURABILITY_BATCH
+} ledger_durability;
+
 typedef struct {
     void *map;
     size_t map_len;
@@ -24,6 +32,13 @@ typedef struct {
 typedef struct {
     pthread_mutex_t rotate_lock;
     pthread_cond_t rotate_cond;
+    ledger_journal_tail tail;
+    // Serializes writers across processes, the meta entries get moved
+    // around by compaction so they can't hold it
+    pthread_mutex_t write_lock;
+    // The next message id, raised by writers in every process that has
+    // the partition open and waited on by readers in any of them
+    ledger_signal message_signal;
 } ledger_partition_locks;
 
 typedef struct {
@@ -37,29 +52,136 @@ typedef struct {
     bool drop_corrupt;
     size_t journal_max_size_bytes;
     uint32_t journal_purge_age_seconds;
+    ledger_durability durability;
+    uint32_t durability_interval_ms;
+    size_t durability_bytes;
+    ledger_read_mode read_mode;
+    bool journal_preallocate;
+    ledger_checksum checksum;
+    ledger_codec_id codec;
+    ledger_io_engine *io_engine;
+    bool compact;
 } ledger_partition_options;
 
+// Remembers the journal a reader last read from, so reads following on
+// from it don't have to search the meta entries
+typedef struct {
+    bool valid;
+    uint32_t index;
+    uint32_t journal_id;
+    // When set, message sets read through the cursor draw on the arena,
+    // and each one must be freed before the next read
+    ledger_message_arena *arena;
+} ledger_read_cursor;
+
+typedef struct ledger_commit_request {
+    // NULL for messages written without keys
+    const struct iovec *keys;
+    const struct iovec *messages;
+    size_t nmessages;
+    ledger_status status;
+    uint64_t first_message_id;
+    bool done;
+    struct ledger_commit_request *next;
+} ledger_commit_request;
+
+// Writers queue up here, and whoever finds no flush in progress
+// writes and syncs everything queued on behalf of the others.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    bool flushing;
+    ledger_commit_request *head;
+    ledger_commit_request *tail;
+    size_t unsynced_bytes;
+    uint64_t last_sync_ms;
+} ledger_partition_commit;
+
+// Told of messages appended by this process, from the appending thread
+// with the partition's watch lock held, so it mustn't block
+typedef struct ledger_partition_watch {
+    void (*notify)(struct ledger_partition_watch *watch);
+    void *data;
+    struct ledger_partition_watch *next;
+} ledger_partition_watch;
+
 typedef struct {
     unsigned int number;
     bool opened;
     char *path;
     size_t path_len;
-    ledger_signal message_signal;
     ledger_partition_options options;
+    ledger_journal_cache journals;
+    ledger_partition_commit commit;
+    uint32_t prepared_journal_id;
+    // The latest journal when compaction last ran. Another pass is only
+    // worth it once a journal has been sealed since.
+    uint32_t compacted_journal_id;
+    // Held for writing only while the meta entries are swapped out
+    pthread_rwlock_t meta_lock;
     ledger_partition_meta meta;
     ledger_partition_lockfile lockfile;
+    pthread_mutex_t watch_lock;
+    ledger_partition_watch *watches;
+    uint32_t nwatches;
 } ledger_partition;
 
 ledger_status ledger_partition_open(ledger_partition *partition, const char *topic_path,
                                     unsigned int partition_number, ledger_partition_options *options);
+// Repairs the latest journal after a crash and loads the tail from it.
+// Runs once after opening, before anything reads or writes.
+ledger_status ledger_partition_recover(ledger_partition *partition);
 void ledger_partition_close(ledger_partition *partition);
 ledger_status ledger_partition_write(ledger_partition *partition, void *data,
                                      size_t len, ledger_write_status *status);
+ledger_status ledger_partition_write_batch(ledger_partition *partition, const struct iovec *messages,
+                                           size_t nmessages, ledger_write_batch_status *status);
+// Writes the messages along with their keys, which compaction goes by
+ledger_status ledger_partition_write_keyed(ledger_partition *partition, const void *key,
+                                           size_t key_len, void *data, size_t len,
+                                           ledger_write_status *status);
+ledger_status ledger_partition_write_keyed_batch(ledger_partition *partition, const struct iovec *keys,
+                                                 const struct iovec *messages, size_t nmessages,
+                                                 ledger_write_batch_status *status);
 ledger_status ledger_partition_read(ledger_partition *partition, uint64_t start_id,
                                     size_t nmessages, ledger_message_set *messages);
+ledger_status ledger_partition_read_cursor(ledger_partition *partition, ledger_read_cursor *cursor,
+                                           uint64_t start_id, size_t nmessages,
+                                           ledger_message_set *messages);
+void ledger_read_cursor_init(ledger_read_cursor *cursor);
 ledger_status ledger_partition_latest_message_id(ledger_partition *partition, uint64_t *id);
+// The id of the first message appended at or after time_ms, in
+// milliseconds since the epoch, or the next id to be written when there
+// is none yet
+ledger_status ledger_partition_seek_time(ledger_partition *partition, uint64_t time_ms,
+                                         uint64_t *id);
+// Purges journals past their age and compacts the meta file. For
+// compacted partitions, also rewrites the sealed journals keeping only
+// the latest message for each key. Runs from the context's maintenance
+// thread, off the write path.
+ledger_status ledger_partition_maintain(ledger_partition *partition);
+// Waits for the next write, or for readers to be signaled
 void ledger_partition_wait_messages(ledger_partition *partition);
+// Waits until message id has been written, for at most timeout_ms
+// unless it's negative. LEDGER_NEXT when it timed out, or readers were
+// signaled, first.
+ledger_status ledger_partition_wait_message(ledger_partition *partition, uint64_t id,
+                                            long int timeout_ms);
+// Times readers have been signaled, for ledger_partition_wait_message_since
+uint32_t ledger_partition_reader_signals(ledger_partition *partition);
+// As ledger_partition_wait_message, but also returns once readers have
+// been signaled since signals was read
+ledger_status ledger_partition_wait_message_since(ledger_partition *partition, uint64_t id,
+                                                  uint32_t signals, long int timeout_ms);
 void ledger_partition_signal_readers(ledger_partition *partition);
+// Whether message id has been written, without waiting
+bool ledger_partition_has_message(ledger_partition *partition, uint64_t id);
+// Raised by every process appending, unlike watches
+ledger_signal *ledger_partition_message_signal(ledger_partition *partition);
+// Messages appended by other processes don't notify watches, they only
+// show on the message signal
+void ledger_partition_watch_add(ledger_partition *partition, ledger_partition_watch *watch);
+void ledger_partition_watch_remove(ledger_partition *partition, ledger_partition_watch *watch);
 
 #if defined(__cplusplus)
 }
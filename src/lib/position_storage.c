@@ -1,28 +1,31 @@
 #include "position_storage.h"
 
 #include <stdio.h>
+#include <unistd.h>
 
 #define N_BUCKETS 255
 #define N_CELLS 5
+#define INITIAL_CAPACITY 256
 
 static ssize_t make_key(const char *position_key, unsigned int partition_num,
                               char **key_out) {
     ledger_status rc;
     size_t key_len, total_len;
-    char part_num[6];
+    char part_num[LEDGER_POSITION_KEY_SUFFIX_LEN];
     char *key_with_part = NULL;
 
-    rc = snprintf(part_num, 6, "%05d", partition_num);
+    rc = snprintf(part_num, LEDGER_POSITION_KEY_SUFFIX_LEN, "%05d", partition_num);
     ledger_check_rc(rc > 0, LEDGER_ERR_GENERAL, "Error building partition number");
 
     key_len = strlen(position_key);
-    total_len = key_len+6;
+    ledger_check_rc(key_len <= LEDGER_POSITION_KEY_MAX, LEDGER_ERR_ARGS, "Position key is too long");
+    total_len = key_len+LEDGER_POSITION_KEY_SUFFIX_LEN;
 
     key_with_part = malloc(total_len);
     ledger_check_rc(key_with_part != NULL, LEDGER_ERR_MEMORY, "Error allocating key memory");
 
     memcpy(key_with_part, position_key, key_len);
-    memcpy(key_with_part+key_len, part_num, 6);
+    memcpy(key_with_part+key_len, part_num, LEDGER_POSITION_KEY_SUFFIX_LEN);
 
     *key_out = key_with_part;
 
@@ -32,42 +35,57 @@ error:
     if(key_with_part) {
         free(key_with_part);
     }
-    return LEDGER_ERR_GENERAL;
+    return rc;
 }
 
 void ledger_position_storage_init(ledger_position_storage *storage) {
     storage->position_path = NULL;
-    fsd_map_init(&storage->positions, N_BUCKETS, N_CELLS);
+    storage->legacy_position_path = NULL;
+    storage->has_legacy = false;
+    fsd_map_init(&storage->legacy_positions, N_BUCKETS, N_CELLS);
 }
 
 ledger_status ledger_position_storage_open(ledger_position_storage *storage, const char *root_directory) {
     int rs;
     ledger_status rc;
     ssize_t size;
-    char *position_path = NULL;
 
-    size = ledger_concat_path(root_directory, "position_storage.map", &position_path);
+    size = ledger_concat_path(root_directory, "positions.map", &storage->position_path);
     ledger_check_rc(size > 0, size, "Failed to build position storage map path");
 
-    storage->position_path = position_path;
+    rc = ledger_disk_map_open(&storage->positions, storage->position_path, INITIAL_CAPACITY);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open position storage map");
+
+    size = ledger_concat_path(root_directory, "position_storage.map", &storage->legacy_position_path);
+    ledger_check_rc(size > 0, size, "Failed to build legacy position storage map path");
 
-    rs = fsd_map_open(&storage->positions, storage->position_path);
-    ledger_check_rc(rs == FSD_MAP_OK, LEDGER_ERR_GENERAL, "Failed to open position storage map");
+    if(access(storage->legacy_position_path, F_OK) == 0) {
+        rs = fsd_map_open(&storage->legacy_positions, storage->legacy_position_path);
+        ledger_check_rc(rs == FSD_MAP_OK, LEDGER_ERR_GENERAL, "Failed to open legacy position storage map");
+        storage->has_legacy = true;
+    }
 
     return LEDGER_OK;
 
 error:
-    if(position_path) {
-        free(position_path);
-    }
+    ledger_position_storage_close(storage);
     return rc;
 }
 
 void ledger_position_storage_close(ledger_position_storage *storage) {
-    fsd_map_close(&storage->positions);
-
     if(storage->position_path) {
+        ledger_disk_map_close(&storage->positions);
         free(storage->position_path);
+        storage->position_path = NULL;
+    }
+
+    if(storage->has_legacy) {
+        fsd_map_close(&storage->legacy_positions);
+        storage->has_legacy = false;
+    }
+    if(storage->legacy_position_path) {
+        free(storage->legacy_position_path);
+        storage->legacy_position_path = NULL;
     }
 }
 
@@ -80,9 +98,9 @@ ledger_status ledger_position_storage_set(ledger_position_storage *storage,
     rc = make_key(position_key, partition_num, &key_with_part);
     ledger_check_rc(rc > 0, rc, "Error building position storage key");
 
-    rc = fsd_map_set(&storage->positions, (const char *)key_with_part,
-                     rc, pos);
-    ledger_check_rc(rc == FSD_MAP_OK, LEDGER_ERR_GENERAL, "Failed to set the position storage map location");
+    rc = ledger_disk_map_set(&storage->positions, (const char *)key_with_part,
+                             rc, pos);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to set the position storage map location");
 
     free(key_with_part);
     return LEDGER_OK;
@@ -98,15 +116,22 @@ ledger_status ledger_position_storage_get(ledger_position_storage *storage,
                                           const char *position_key, unsigned int partition_num,
                                           uint64_t *pos) {
     ssize_t rc;
+    size_t key_len;
     char *key_with_part = NULL;
 
     rc = make_key(position_key, partition_num, &key_with_part);
     ledger_check_rc(rc > 0, rc, "Error building position storage key");
 
-    rc = fsd_map_get(&storage->positions, (const char *)key_with_part,
-                     rc, pos);
-    ledger_check_rc(rc == FSD_MAP_OK || rc == FSD_MAP_NOT_FOUND, LEDGER_ERR_GENERAL, "Failed to get the position storage map location");
-    if(rc == FSD_MAP_NOT_FOUND) {
+    key_len = rc;
+    rc = ledger_disk_map_get(&storage->positions, (const char *)key_with_part,
+                             key_len, pos);
+    if(rc == LEDGER_NEXT && storage->has_legacy) {
+        rc = fsd_map_get(&storage->legacy_positions, (const char *)key_with_part,
+                         key_len, pos);
+        ledger_check_rc(rc == FSD_MAP_OK || rc == FSD_MAP_NOT_FOUND, LEDGER_ERR_GENERAL, "Failed to get the legacy position storage map location");
+        rc = rc == FSD_MAP_OK ? LEDGER_OK : LEDGER_NEXT;
+    }
+    if(rc == LEDGER_NEXT) {
         rc = LEDGER_ERR_POSITION_NOT_FOUND;
         goto error;
     }
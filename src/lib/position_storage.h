@@ -1,20 +1,30 @@
 #ifndef LIB_LEDGER_POSITION_STORAGE_H
 #define LIB_LEDGER_POSITION_STORAGE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "disk_map.h"
 #include "fixed_size_disk_map.h"
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
+// Keys are stored with a 6 byte partition suffix
+#define LEDGER_POSITION_KEY_SUFFIX_LEN 6
+#define LEDGER_POSITION_KEY_MAX (LEDGER_DISK_MAP_KEY_MAX - LEDGER_POSITION_KEY_SUFFIX_LEN)
+
 typedef struct {
-    fsd_map_t positions;
+    ledger_disk_map positions;
     char *position_path;
+    // Positions stored before the disk map, read when it has none
+    fsd_map_t legacy_positions;
+    char *legacy_position_path;
+    bool has_legacy;
 } ledger_position_storage;
 
 void ledger_position_storage_init(ledger_position_storage *storage);
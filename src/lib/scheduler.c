@@ -0,0 +1,490 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+// How often parked tasks are checked for work nothing woke them for
+#define SWEEP_INTERVAL_MS 100
+
+enum {
+    TASK_IDLE,
+    TASK_QUEUED,
+    TASK_RUNNING,
+    // Woken while running, and queued again once it's done
+    TASK_WOKEN
+};
+
+static pthread_once_t current_worker_once = PTHREAD_ONCE_INIT;
+static pthread_key_t current_worker_key;
+
+static void init_current_worker_key(void) {
+    pthread_key_create(&current_worker_key, NULL);
+}
+
+static uint64_t now_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void queue_init(ledger_task_queue *queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+static void queue_push(ledger_task_queue *queue, ledger_task *task) {
+    pthread_mutex_lock(&queue->lock);
+    task->queue_next = NULL;
+    if(queue->tail) {
+        queue->tail->queue_next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static ledger_task *queue_pop(ledger_task_queue *queue) {
+    ledger_task *task;
+
+    pthread_mutex_lock(&queue->lock);
+    task = queue->head;
+    if(task) {
+        queue->head = task->queue_next;
+        if(queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return task;
+}
+
+// The calling thread's worker, when it's one of this scheduler's
+static ledger_scheduler_worker *current_worker(ledger_scheduler *scheduler) {
+    ledger_scheduler_worker *worker = pthread_getspecific(current_worker_key);
+
+    if(worker != NULL && worker->scheduler == scheduler) {
+        return worker;
+    }
+    return NULL;
+}
+
+// Workers queue tasks on their own queue, other threads spread them out
+static void enqueue(ledger_scheduler *scheduler, ledger_scheduler_worker *worker,
+                    ledger_task *task) {
+    size_t i;
+
+    if(worker == NULL) {
+        i = __atomic_fetch_add(&scheduler->next_worker, 1, __ATOMIC_RELAXED);
+        worker = &scheduler->workers[i % scheduler->nworkers];
+    }
+    queue_push(&worker->queue, task);
+    ledger_signal_publish(&scheduler->work,
+                          __atomic_add_fetch(&scheduler->nqueued, 1, __ATOMIC_SEQ_CST));
+}
+
+static ledger_task *next_task(ledger_scheduler_worker *worker) {
+    ledger_scheduler *scheduler = worker->scheduler;
+    ledger_task *task;
+    size_t i;
+
+    task = queue_pop(&worker->queue);
+    for(i = 1; task == NULL && i < scheduler->nworkers; i++) {
+        task = queue_pop(&scheduler->workers[(worker->index + i) % scheduler->nworkers].queue);
+    }
+    return task;
+}
+
+static void run_task(ledger_scheduler_worker *worker, ledger_task *task) {
+    uint32_t expected = TASK_RUNNING;
+
+    __atomic_store_n(&task->state, TASK_RUNNING, __ATOMIC_SEQ_CST);
+
+    switch(task->run(task)) {
+    case LEDGER_TASK_DONE:
+        break;
+    case LEDGER_TASK_YIELD:
+        __atomic_store_n(&task->state, TASK_QUEUED, __ATOMIC_SEQ_CST);
+        enqueue(worker->scheduler, worker, task);
+        break;
+    case LEDGER_TASK_PARK:
+        if(!__atomic_compare_exchange_n(&task->state, &expected, TASK_IDLE, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&task->state, TASK_QUEUED, __ATOMIC_SEQ_CST);
+            enqueue(worker->scheduler, worker, task);
+        }
+        break;
+    }
+}
+
+static void task_push(ledger_task **list, ledger_task *task) {
+    task->prev = NULL;
+    task->next = *list;
+    if(*list) {
+        (*list)->prev = task;
+    }
+    *list = task;
+}
+
+static void task_unlink(ledger_task **list, ledger_task *task) {
+    if(task->prev) {
+        task->prev->next = task->next;
+    } else {
+        *list = task->next;
+    }
+    if(task->next) {
+        task->next->prev = task->prev;
+    }
+    task->prev = NULL;
+    task->next = NULL;
+}
+
+static void watch_push(ledger_task_watch **list, ledger_task_watch *watch) {
+    watch->prev = NULL;
+    watch->next = *list;
+    if(*list) {
+        (*list)->prev = watch;
+    }
+    *list = watch;
+}
+
+static void watch_unlink(ledger_task_watch **list, ledger_task_watch *watch) {
+    if(watch->prev) {
+        watch->prev->next = watch->next;
+    } else {
+        *list = watch->next;
+    }
+    if(watch->next) {
+        watch->next->prev = watch->prev;
+    }
+    watch->prev = NULL;
+    watch->next = NULL;
+}
+
+// Queues the watch's ready tasks, once its signal has moved. Only the
+// tasks sharing the signal are checked.
+static void check_watch(ledger_scheduler *scheduler, ledger_task_watch *watch) {
+    // Read before the ready checks, so a wait from it ends on anything after
+    uint32_t seq = ledger_signal_seq(watch->signal);
+    ledger_task *task;
+
+    if(seq == watch->seq) {
+        return;
+    }
+    watch->seq = seq;
+    for(task = watch->tasks; task != NULL; task = task->next) {
+        if(__atomic_load_n(&task->state, __ATOMIC_SEQ_CST) == TASK_IDLE &&
+           (task->ready == NULL || task->ready(task))) {
+            ledger_scheduler_wake(scheduler, task);
+        }
+    }
+}
+
+static void sweep(ledger_scheduler *scheduler) {
+    uint64_t now = now_ms();
+    uint64_t last = __atomic_load_n(&scheduler->last_sweep_ms, __ATOMIC_RELAXED);
+    ledger_task_watch *watch;
+    ledger_task *task;
+
+    // One worker sweeps per interval
+    if(now - last < SWEEP_INTERVAL_MS ||
+       !__atomic_compare_exchange_n(&scheduler->last_sweep_ms, &last, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // Claimed watches are checked by the workers waiting on them
+    pthread_mutex_lock(&scheduler->tasks_lock);
+    for(task = scheduler->tasks; task != NULL; task = task->next) {
+        if(task->ready != NULL &&
+           __atomic_load_n(&task->state, __ATOMIC_SEQ_CST) == TASK_IDLE &&
+           task->ready(task)) {
+            ledger_scheduler_wake(scheduler, task);
+        }
+    }
+    for(watch = scheduler->unclaimed; watch != NULL; watch = watch->next) {
+        check_watch(scheduler, watch);
+    }
+    pthread_mutex_unlock(&scheduler->tasks_lock);
+}
+
+// Waits for queued work, and for the signals of the watches this worker
+// claims to move. False when there's nothing left to claim, or the
+// kernel can't wait on several signals.
+static bool wait_watching(ledger_scheduler_worker *worker, uint64_t seen) {
+    ledger_scheduler *scheduler = worker->scheduler;
+    ledger_task_watch *claimed[LEDGER_SIGNAL_WAIT_ANY_MAX];
+    ledger_signal *sigs[LEDGER_SIGNAL_WAIT_ANY_MAX];
+    uint32_t seqs[LEDGER_SIGNAL_WAIT_ANY_MAX];
+    ledger_status rc = LEDGER_OK;
+    ledger_task_watch *watch;
+    size_t i, nsigs;
+
+    pthread_mutex_lock(&scheduler->tasks_lock);
+    if(scheduler->unclaimed == NULL || scheduler->watch_unsupported) {
+        pthread_mutex_unlock(&scheduler->tasks_lock);
+        return false;
+    }
+
+    sigs[0] = &scheduler->work;
+    seqs[0] = ledger_signal_seq(&scheduler->work);
+    // Past the limit, other idle workers or the sweep take the rest
+    for(nsigs = 1; scheduler->unclaimed != NULL && nsigs < LEDGER_SIGNAL_WAIT_ANY_MAX; nsigs++) {
+        watch = scheduler->unclaimed;
+        // Catches anything that moved while nobody waited on it
+        check_watch(scheduler, watch);
+        watch_unlink(&scheduler->unclaimed, watch);
+        watch_push(&scheduler->claimed, watch);
+        watch->worker = worker->index;
+        claimed[nsigs] = watch;
+        sigs[nsigs] = watch->signal;
+        seqs[nsigs] = watch->seq;
+    }
+    pthread_mutex_unlock(&scheduler->tasks_lock);
+
+    // Covers anything queued since seen was read, the wakes above included
+    if(ledger_signal_value(&scheduler->work) <= seen) {
+        rc = ledger_signal_wait_any(sigs, seqs, nsigs, SWEEP_INTERVAL_MS);
+    }
+
+    pthread_mutex_lock(&scheduler->tasks_lock);
+    for(i = 1; i < nsigs; i++) {
+        check_watch(scheduler, claimed[i]);
+        watch_unlink(&scheduler->claimed, claimed[i]);
+        watch_push(&scheduler->unclaimed, claimed[i]);
+        claimed[i]->worker = LEDGER_TASK_WATCH_UNCLAIMED;
+    }
+    scheduler->watch_unsupported = rc != LEDGER_OK;
+    pthread_cond_broadcast(&scheduler->watch_done);
+    pthread_mutex_unlock(&scheduler->tasks_lock);
+
+    return true;
+}
+
+static void *worker_loop(void *arg) {
+    ledger_scheduler_worker *worker = (ledger_scheduler_worker *)arg;
+    ledger_scheduler *scheduler = worker->scheduler;
+    ledger_task *task;
+    uint64_t seen;
+
+    pthread_setspecific(current_worker_key, worker);
+
+    while(__atomic_load_n(&scheduler->running, __ATOMIC_ACQUIRE)) {
+        sweep(scheduler);
+
+        task = next_task(worker);
+        if(task == NULL) {
+            // Anything queued after this wakes the wait below
+            seen = ledger_signal_value(&scheduler->work);
+            task = next_task(worker);
+        }
+        if(task == NULL) {
+            if(!wait_watching(worker, seen)) {
+                ledger_signal_wait(&scheduler->work, seen, SWEEP_INTERVAL_MS);
+            }
+            continue;
+        }
+        run_task(worker, task);
+    }
+
+    return NULL;
+}
+
+void ledger_task_init(ledger_task *task,
+                      ledger_task_status (*run)(ledger_task *task),
+                      bool (*ready)(ledger_task *task),
+                      void *data) {
+    task->run = run;
+    task->ready = ready;
+    task->signal = NULL;
+    task->data = data;
+    task->state = TASK_IDLE;
+    task->watch = NULL;
+    task->prev = NULL;
+    task->next = NULL;
+    task->queue_next = NULL;
+}
+
+ledger_status ledger_scheduler_start(ledger_scheduler *scheduler, size_t nworkers) {
+    ledger_status rc;
+    size_t i, started = 0;
+
+    ledger_check_rc(nworkers > 0, LEDGER_ERR_ARGS, "A scheduler needs workers");
+    pthread_once(&current_worker_once, init_current_worker_key);
+
+    scheduler->nworkers = nworkers;
+    scheduler->running = true;
+    scheduler->nqueued = 0;
+    scheduler->next_worker = 0;
+    scheduler->last_sweep_ms = now_ms();
+    scheduler->tasks = NULL;
+    scheduler->unclaimed = NULL;
+    scheduler->claimed = NULL;
+    scheduler->watch_unsupported = false;
+    ledger_signal_init(&scheduler->work, 0);
+    pthread_mutex_init(&scheduler->tasks_lock, NULL);
+    pthread_cond_init(&scheduler->watch_done, NULL);
+
+    scheduler->workers = ledger_reallocarray(NULL, nworkers, sizeof(ledger_scheduler_worker));
+    ledger_check_rc(scheduler->workers != NULL, LEDGER_ERR_MEMORY, "Failed to allocate scheduler workers");
+
+    for(i = 0; i < nworkers; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+        scheduler->workers[i].index = i;
+        queue_init(&scheduler->workers[i].queue);
+    }
+
+    for(started = 0; started < nworkers; started++) {
+        rc = pthread_create(&scheduler->workers[started].thread, NULL, worker_loop,
+                            &scheduler->workers[started]);
+        ledger_check_rc(rc == 0, LEDGER_ERR_GENERAL, "Failed to start scheduler worker");
+    }
+
+    return LEDGER_OK;
+
+error:
+    __atomic_store_n(&scheduler->running, false, __ATOMIC_RELEASE);
+    if(scheduler->workers) {
+        ledger_signal_broadcast(&scheduler->work);
+        for(i = 0; i < started; i++) {
+            pthread_join(scheduler->workers[i].thread, NULL);
+        }
+        for(i = 0; i < nworkers; i++) {
+            pthread_mutex_destroy(&scheduler->workers[i].queue.lock);
+        }
+        free(scheduler->workers);
+        scheduler->workers = NULL;
+    }
+    pthread_mutex_destroy(&scheduler->tasks_lock);
+    pthread_cond_destroy(&scheduler->watch_done);
+    return rc;
+}
+
+void ledger_scheduler_stop(ledger_scheduler *scheduler) {
+    ledger_task_watch *watch;
+    size_t i;
+
+    __atomic_store_n(&scheduler->running, false, __ATOMIC_RELEASE);
+    ledger_signal_broadcast(&scheduler->work);
+
+    for(i = 0; i < scheduler->nworkers; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+    for(i = 0; i < scheduler->nworkers; i++) {
+        pthread_mutex_destroy(&scheduler->workers[i].queue.lock);
+    }
+    free(scheduler->workers);
+    scheduler->workers = NULL;
+    // Left by tasks never removed
+    while((watch = scheduler->unclaimed) != NULL) {
+        scheduler->unclaimed = watch->next;
+        free(watch);
+    }
+    pthread_mutex_destroy(&scheduler->tasks_lock);
+    pthread_cond_destroy(&scheduler->watch_done);
+}
+
+// The watch on signal, if any task is already waiting on it
+static ledger_task_watch *find_watch(ledger_scheduler *scheduler, ledger_signal *signal) {
+    ledger_task_watch *watch;
+
+    for(watch = scheduler->unclaimed; watch != NULL; watch = watch->next) {
+        if(watch->signal == signal) {
+            return watch;
+        }
+    }
+    for(watch = scheduler->claimed; watch != NULL; watch = watch->next) {
+        if(watch->signal == signal) {
+            return watch;
+        }
+    }
+    return NULL;
+}
+
+ledger_status ledger_scheduler_add(ledger_scheduler *scheduler, ledger_task *task) {
+    ledger_status rc;
+    ledger_task_watch *watch = NULL;
+
+    pthread_mutex_lock(&scheduler->tasks_lock);
+    if(task->signal != NULL) {
+        watch = find_watch(scheduler, task->signal);
+        if(watch == NULL) {
+            watch = malloc(sizeof(ledger_task_watch));
+            ledger_check_rc(watch != NULL, LEDGER_ERR_MEMORY, "Failed to allocate task watch");
+            watch->signal = task->signal;
+            watch->seq = ledger_signal_seq(task->signal);
+            watch->tasks = NULL;
+            watch->worker = LEDGER_TASK_WATCH_UNCLAIMED;
+            watch_push(&scheduler->unclaimed, watch);
+        }
+        task->watch = watch;
+        task_push(&watch->tasks, task);
+    } else {
+        task_push(&scheduler->tasks, task);
+    }
+    pthread_mutex_unlock(&scheduler->tasks_lock);
+
+    __atomic_store_n(&task->state, TASK_IDLE, __ATOMIC_SEQ_CST);
+    ledger_scheduler_wake(scheduler, task);
+    return LEDGER_OK;
+
+error:
+    pthread_mutex_unlock(&scheduler->tasks_lock);
+    return rc;
+}
+
+void ledger_scheduler_remove(ledger_scheduler *scheduler, ledger_task *task) {
+    ledger_task_watch *watch = task->watch;
+
+    pthread_mutex_lock(&scheduler->tasks_lock);
+    if(watch == NULL) {
+        task_unlink(&scheduler->tasks, task);
+        pthread_mutex_unlock(&scheduler->tasks_lock);
+        return;
+    }
+
+    task_unlink(&watch->tasks, task);
+    task->watch = NULL;
+    if(watch->tasks == NULL) {
+        // The worker waiting on the signal lets it go once it's woken
+        if(watch->worker != LEDGER_TASK_WATCH_UNCLAIMED) {
+            ledger_signal_broadcast(&scheduler->work);
+            while(watch->worker != LEDGER_TASK_WATCH_UNCLAIMED) {
+                pthread_cond_wait(&scheduler->watch_done, &scheduler->tasks_lock);
+            }
+        }
+        watch_unlink(&scheduler->unclaimed, watch);
+        free(watch);
+    }
+    pthread_mutex_unlock(&scheduler->tasks_lock);
+}
+
+void ledger_scheduler_wake(ledger_scheduler *scheduler, ledger_task *task) {
+    uint32_t state = __atomic_load_n(&task->state, __ATOMIC_SEQ_CST);
+
+    for(;;) {
+        switch(state) {
+        case TASK_IDLE:
+            if(__atomic_compare_exchange_n(&task->state, &state, TASK_QUEUED, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                enqueue(scheduler, current_worker(scheduler), task);
+                return;
+            }
+            break;
+        case TASK_RUNNING:
+            if(__atomic_compare_exchange_n(&task->state, &state, TASK_WOKEN, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return;
+            }
+            break;
+        default:
+            // Already going to run
+            return;
+        }
+    }
+}
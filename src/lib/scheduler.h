@@ -0,0 +1,128 @@
+#ifndef LIB_LEDGER_SCHEDULER_H
+#define LIB_LEDGER_SCHEDULER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "signal.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef enum {
+    // Has more to do, and is queued again behind the others
+    LEDGER_TASK_YIELD,
+    // Has nothing to do until it's woken
+    LEDGER_TASK_PARK,
+    // Finished, and no longer touched by the scheduler
+    LEDGER_TASK_DONE
+} ledger_task_status;
+
+struct ledger_task_watch;
+
+typedef struct ledger_task {
+    ledger_task_status (*run)(struct ledger_task *task);
+    // Whether a parked task has work after all. Checked every so often,
+    // for work nothing wakes the task for, and when its signal moves.
+    // May be NULL.
+    bool (*ready)(struct ledger_task *task);
+    // Set before the task is added, where work can turn up without a
+    // wake, as messages from other processes do. An idle worker waits on
+    // it and queues the task when it moves and the task is ready. May be
+    // NULL, and must outlive the task being removed.
+    ledger_signal *signal;
+    void *data;
+    uint32_t state;
+    // The watch on the task's signal, with the tasks sharing it
+    struct ledger_task_watch *watch;
+    // In the watch's tasks, or the scheduler's tasks without a signal
+    struct ledger_task *prev;
+    struct ledger_task *next;
+    // In a worker's queue
+    struct ledger_task *queue_next;
+} ledger_task;
+
+#define LEDGER_TASK_WATCH_UNCLAIMED ((size_t)-1)
+
+// One per signal the tasks wait on, however many tasks share it
+typedef struct ledger_task_watch {
+    ledger_signal *signal;
+    // The sequence the tasks were last checked at
+    uint32_t seq;
+    ledger_task *tasks;
+    // The idle worker waiting on the signal, or
+    // LEDGER_TASK_WATCH_UNCLAIMED
+    size_t worker;
+    // In the scheduler's claimed or unclaimed watches
+    struct ledger_task_watch *prev;
+    struct ledger_task_watch *next;
+} ledger_task_watch;
+
+typedef struct {
+    pthread_mutex_t lock;
+    ledger_task *head;
+    ledger_task *tail;
+} ledger_task_queue;
+
+struct ledger_scheduler;
+
+typedef struct {
+    struct ledger_scheduler *scheduler;
+    size_t index;
+    ledger_task_queue queue;
+    pthread_t thread;
+} ledger_scheduler_worker;
+
+// Runs many tasks on a few threads. Each worker takes tasks from its
+// own queue first and steals from the others when that runs dry, so a
+// worker stuck in a long task doesn't hold up the rest of its queue.
+typedef struct ledger_scheduler {
+    size_t nworkers;
+    ledger_scheduler_worker *workers;
+    bool running;
+    // Raised with every task queued, idle workers wait on it
+    ledger_signal work;
+    uint64_t nqueued;
+    size_t next_worker;
+    uint64_t last_sweep_ms;
+    pthread_mutex_t tasks_lock;
+    // Tasks without a signal, which only the sweep checks
+    ledger_task *tasks;
+    // Each idle worker claims as many unclaimed watches as it can wait
+    // on, so the signals are spread over the idle workers, and the sweep
+    // checks any left over. Changed with the tasks lock held.
+    ledger_task_watch *unclaimed;
+    ledger_task_watch *claimed;
+    pthread_cond_t watch_done;
+    // The kernel can't wait on several signals, so only the sweep finds
+    // the work they'd show
+    bool watch_unsupported;
+} ledger_scheduler;
+
+void ledger_task_init(ledger_task *task,
+                      ledger_task_status (*run)(ledger_task *task),
+                      bool (*ready)(ledger_task *task),
+                      void *data);
+
+ledger_status ledger_scheduler_start(ledger_scheduler *scheduler, size_t nworkers);
+// Tasks still added are never run again
+void ledger_scheduler_stop(ledger_scheduler *scheduler);
+
+// Adds the task and queues it to run
+ledger_status ledger_scheduler_add(ledger_scheduler *scheduler, ledger_task *task);
+// Called by the task itself, before it returns LEDGER_TASK_DONE. Once it
+// returns, the task's signal is no longer waited on.
+void ledger_scheduler_remove(ledger_scheduler *scheduler, ledger_task *task);
+// Queues a parked task to run. A running one runs again once it's done,
+// however many times it's woken meanwhile. Only ever holds a queue lock
+// briefly, so writers can wake readers.
+void ledger_scheduler_wake(ledger_scheduler *scheduler, ledger_task *task);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
@@ -1,28 +1,184 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "signal.h"
 
-void ledger_signal_init(ledger_signal *sig) {
-    pthread_cond_init(&sig->cond, NULL);
-    pthread_mutex_init(&sig->lock, NULL);
+#define FUTEX_BUCKETS 32
+
+static int futex(ledger_signal *sig, int op, uint32_t val, const struct timespec *timeout,
+                 uint32_t bitset) {
+    return syscall(SYS_futex, &sig->seq, op | sig->futex_flags, val, timeout, NULL, bitset);
+}
+
+static void deadline_after(long int timeout_ms, struct timespec *deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static uint32_t bucket(uint64_t after) {
+    return 1u << (after % FUTEX_BUCKETS);
+}
+
+// The buckets of the waiters satisfied by the watermark going from old
+// to value, which wait on everything from old to value - 1
+static uint32_t satisfied_buckets(uint64_t old, uint64_t value) {
+    uint32_t buckets = 0;
+    uint64_t after;
+
+    if(value - old >= FUTEX_BUCKETS) {
+        return FUTEX_BITSET_MATCH_ANY;
+    }
+    for(after = old; after < value; after++) {
+        buckets |= bucket(after);
+    }
+    return buckets;
+}
+
+static void wake(ledger_signal *sig, uint32_t buckets) {
+    // Waiters count themselves before they look at seq, so either this
+    // sees them or they see the new seq and don't sleep
+    __atomic_add_fetch(&sig->seq, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&sig->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex(sig, FUTEX_WAKE_BITSET, INT_MAX, NULL, buckets);
+    }
+}
+
+void ledger_signal_init(ledger_signal *sig, uint64_t value) {
+    ledger_signal_init_shared(sig, value);
+    sig->futex_flags = FUTEX_PRIVATE_FLAG;
+}
+
+void ledger_signal_init_shared(ledger_signal *sig, uint64_t value) {
+    sig->seq = 0;
+    sig->waiters = 0;
+    sig->kicks = 0;
+    sig->futex_flags = 0;
+    sig->value = value;
+}
+
+uint64_t ledger_signal_value(ledger_signal *sig) {
+    return __atomic_load_n(&sig->value, __ATOMIC_ACQUIRE);
+}
+
+void ledger_signal_publish(ledger_signal *sig, uint64_t value) {
+    uint64_t old = __atomic_load_n(&sig->value, __ATOMIC_RELAXED);
+
+    do {
+        if(value <= old) {
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&sig->value, &old, value, false,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    wake(sig, satisfied_buckets(old, value));
 }
 
 void ledger_signal_broadcast(ledger_signal *sig) {
-    pthread_mutex_lock(&sig->lock);
-    pthread_cond_broadcast(&sig->cond);
-    pthread_mutex_unlock(&sig->lock);
+    __atomic_add_fetch(&sig->kicks, 1, __ATOMIC_SEQ_CST);
+    wake(sig, FUTEX_BITSET_MATCH_ANY);
 }
 
-void ledger_signal_wait(ledger_signal *sig) {
-    pthread_mutex_lock(&sig->lock);
-    pthread_cond_wait(&sig->cond, &sig->lock);
-    pthread_mutex_unlock(&sig->lock);
+ledger_status ledger_signal_wait(ledger_signal *sig, uint64_t after, long int timeout_ms) {
+    return ledger_signal_wait_since(sig, after, ledger_signal_kicks(sig), timeout_ms);
 }
 
-void ledger_signal_wait_with_timeout(ledger_signal *sig, long int ms_timeout) {
-    const struct timespec ts = {
-        0,
-        ms_timeout * 1000L * 1000L,
-    };
-    pthread_mutex_lock(&sig->lock);
-    pthread_cond_timedwait(&sig->cond, &sig->lock, &ts);
-    pthread_mutex_unlock(&sig->lock);
+uint32_t ledger_signal_kicks(ledger_signal *sig) {
+    return __atomic_load_n(&sig->kicks, __ATOMIC_SEQ_CST);
+}
+
+ledger_status ledger_signal_wait_since(ledger_signal *sig, uint64_t after, uint32_t kicks,
+                                       long int timeout_ms) {
+    ledger_status rc = LEDGER_NEXT;
+    struct timespec deadline;
+    uint32_t seq;
+    int rv;
+
+    if(timeout_ms >= 0) {
+        // FUTEX_WAIT_BITSET takes an absolute time on the monotonic clock
+        deadline_after(timeout_ms, &deadline);
+    }
+
+    __atomic_add_fetch(&sig->waiters, 1, __ATOMIC_SEQ_CST);
+    for(;;) {
+        seq = __atomic_load_n(&sig->seq, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&sig->value, __ATOMIC_ACQUIRE) > after) {
+            rc = LEDGER_OK;
+            break;
+        }
+        if(__atomic_load_n(&sig->kicks, __ATOMIC_SEQ_CST) != kicks) {
+            break;
+        }
+
+        rv = futex(sig, FUTEX_WAIT_BITSET, seq, timeout_ms >= 0 ? &deadline : NULL,
+                   bucket(after));
+        if(rv == -1 && errno == ETIMEDOUT) {
+            if(__atomic_load_n(&sig->value, __ATOMIC_ACQUIRE) > after) {
+                rc = LEDGER_OK;
+            }
+            break;
+        }
+    }
+    __atomic_sub_fetch(&sig->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return rc;
+}
+
+uint32_t ledger_signal_seq(ledger_signal *sig) {
+    return __atomic_load_n(&sig->seq, __ATOMIC_SEQ_CST);
+}
+
+ledger_status ledger_signal_wait_any(ledger_signal **sigs, const uint32_t *seqs, size_t nsigs,
+                                     long int timeout_ms) {
+#if defined(SYS_futex_waitv) && defined(FUTEX_32)
+    struct futex_waitv waiters[LEDGER_SIGNAL_WAIT_ANY_MAX];
+    struct timespec deadline;
+    size_t i;
+    int rv;
+
+    if(nsigs == 0 || nsigs > LEDGER_SIGNAL_WAIT_ANY_MAX) {
+        return LEDGER_ERR_ARGS;
+    }
+    if(timeout_ms >= 0) {
+        deadline_after(timeout_ms, &deadline);
+    }
+
+    // Counted as waiters so raising them wakes the futex, waking this
+    // whatever the bucket
+    for(i = 0; i < nsigs; i++) {
+        __atomic_add_fetch(&sigs[i]->waiters, 1, __ATOMIC_SEQ_CST);
+        waiters[i].val = seqs[i];
+        waiters[i].uaddr = (uintptr_t)&sigs[i]->seq;
+        waiters[i].flags = FUTEX_32 | sigs[i]->futex_flags;
+        waiters[i].__reserved = 0;
+    }
+    // Returns straight away if any seq has already moved
+    rv = syscall(SYS_futex_waitv, waiters, (unsigned int)nsigs, 0,
+                 timeout_ms >= 0 ? &deadline : NULL, CLOCK_MONOTONIC);
+    for(i = 0; i < nsigs; i++) {
+        __atomic_sub_fetch(&sigs[i]->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if(rv == -1 && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+        return LEDGER_ERR_GENERAL;
+    }
+    return LEDGER_OK;
+#else
+    (void)sigs;
+    (void)seqs;
+    (void)nsigs;
+    (void)timeout_ms;
+    return LEDGER_ERR_GENERAL;
+#endif
 }
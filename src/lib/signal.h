@@ -1,21 +1,60 @@
 #ifndef LIB_LEDGER_SIGNAL_H
 #define LIB_LEDGER_SIGNAL_H
 
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
+// A high-watermark that waiters block on until it passes the value they
+// want. Waiters are sorted into futex bitset buckets by that value, so
+// raising the watermark only wakes the ones it satisfies, give or take
+// a bucket collision.
 typedef struct {
-    pthread_cond_t cond;
-    pthread_mutex_t lock;
+    // Bumped whenever the watermark rises or waiters are kicked, it's
+    // what the futex waits on
+    uint32_t seq;
+    uint32_t waiters;
+    uint32_t kicks;
+    // Futex operation flags. Zeroed memory is a signal shared between
+    // processes.
+    uint32_t futex_flags;
+    uint64_t value;
 } ledger_signal;
 
-void ledger_signal_init(ledger_signal *sig);
+// Signals within a process
+void ledger_signal_init(ledger_signal *sig, uint64_t value);
+// Signals living in memory mapped by several processes, which all wake
+// each other
+void ledger_signal_init_shared(ledger_signal *sig, uint64_t value);
+uint64_t ledger_signal_value(ledger_signal *sig);
+// Raises the watermark to value. Values at or below it are ignored.
+void ledger_signal_publish(ledger_signal *sig, uint64_t value);
+// Wakes every waiter, whatever it waits for
 void ledger_signal_broadcast(ledger_signal *sig);
-void ledger_signal_wait(ledger_signal *sig);
-void ledger_signal_wait_with_timeout(ledger_signal *sig, long int ms_timeout);
+// Waits until the watermark is above after, for at most timeout_ms
+// unless it's negative. LEDGER_OK once the watermark is above it,
+// LEDGER_NEXT when the wait timed out or was broadcast to first.
+ledger_status ledger_signal_wait(ledger_signal *sig, uint64_t after, long int timeout_ms);
+// Broadcasts so far, for ledger_signal_wait_since
+uint32_t ledger_signal_kicks(ledger_signal *sig);
+// As ledger_signal_wait, but a broadcast any time after kicks was read
+// ends the wait, so a waiter that reads it before checking whether to
+// wait at all can't miss one
+ledger_status ledger_signal_wait_since(ledger_signal *sig, uint64_t after, uint32_t kicks,
+                                       long int timeout_ms);
+// Moves whenever the signal is raised or broadcast to
+uint32_t ledger_signal_seq(ledger_signal *sig);
+// Waits until any of the signals' seqs moves from seqs, for at most
+// timeout_ms unless it's negative. At most LEDGER_SIGNAL_WAIT_ANY_MAX
+// signals, and LEDGER_ERR_GENERAL when the kernel can't wait on them.
+#define LEDGER_SIGNAL_WAIT_ANY_MAX 128
+ledger_status ledger_signal_wait_any(ledger_signal **sigs, const uint32_t *seqs, size_t nsigs,
+                                     long int timeout_ms);
 
 #if defined(__cplusplus)
 }
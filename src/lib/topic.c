@@ -1,9 +1,12 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #include "common.h"
+#include "parallel.h"
 #include "topic.h"
 
 ledger_status ledger_topic_new(const char *name, ledger_topic **topic_out) {
@@ -19,6 +22,8 @@ ledger_status ledger_topic_new(const char *name, ledger_topic **topic_out) {
     ledger_check_rc(tname != NULL, LEDGER_ERR_MEMORY, "Failed to allocate topic name");
     strncpy(tname, name, tlen);
     topic->name = tname;
+    topic->io_engine = NULL;
+    topic->refs = 0;
     *topic_out = topic;
     
     return LEDGER_OK;
@@ -37,10 +42,44 @@ ledger_status ledger_topic_options_init(ledger_topic_options *options) {
     options->drop_corrupt = false;
     options->journal_max_size_bytes = DEFAULT_JOURNAL_MAX_SIZE;
     options->journal_purge_age_seconds = LEDGER_JOURNAL_NO_PURGE;
+    options->durability = LEDGER_DURABILITY_NONE;
+    options->durability_interval_ms = 0;
+    options->durability_bytes = 0;
+    options->read_mode = LEDGER_READ_COALESCED;
+    options->journal_preallocate = false;
+    options->checksum = LEDGER_CHECKSUM_CRC32C;
+    options->compression = LEDGER_CODEC_NONE;
+    options->io_backend = LEDGER_IO_SYNC;
+    options->compact = false;
 
     return LEDGER_OK;
 }
 
+typedef struct {
+    ledger_topic *topic;
+    const unsigned int *partition_ids;
+    ledger_partition_options *options;
+} partition_open_work;
+
+// Partitions share nothing but the topic directory, so each one opens
+// and recovers on whichever pool thread picks it up
+static ledger_status open_partition(void *arg, size_t i) {
+    ledger_status rc;
+    partition_open_work *work = arg;
+    ledger_partition *partition = &work->topic->partitions[i];
+
+    rc = ledger_partition_open(partition, work->topic->path, work->partition_ids[i], work->options);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open partition");
+
+    rc = ledger_partition_recover(partition);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to recover partition");
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
 ledger_status ledger_topic_open(ledger_topic *topic, const char *root,
                                 const unsigned int *partition_ids,
                                 size_t partition_count,
@@ -48,12 +87,13 @@ ledger_status ledger_topic_open(ledger_topic *topic, const char *root,
     int i;
     ledger_status rc;
     ssize_t path_len;
-    ledger_partition *partition = NULL;
     ledger_partition_options partition_options;
+    partition_open_work work;
     char *topic_path = NULL;
 
     topic->opened = false;
     topic->path = NULL;
+    topic->partitions = NULL;
 
     ledger_check_rc(partition_count < MAX_PARTITIONS, LEDGER_ERR_ARGS, "Too many partitions");
 
@@ -70,24 +110,47 @@ ledger_status ledger_topic_open(ledger_topic *topic, const char *root,
 
     topic->partitions = ledger_reallocarray(NULL, partition_count, sizeof(ledger_partition));
     ledger_check_rc(topic->partitions != NULL, LEDGER_ERR_MEMORY, "Failed to allocate partitions");
-
     for(i = 0; i < partition_count; i++) {
-        partition = &topic->partitions[i];
-        partition_options.drop_corrupt = options->drop_corrupt;
-        partition_options.journal_max_size_bytes = options->journal_max_size_bytes;
-        partition_options.journal_purge_age_seconds = options->journal_purge_age_seconds;
-
-        rc = ledger_partition_open(partition, topic_path, partition_ids[i], &partition_options);
-        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open partition");
+        topic->partitions[i].opened = false;
     }
 
+    partition_options.drop_corrupt = options->drop_corrupt;
+    partition_options.journal_max_size_bytes = options->journal_max_size_bytes;
+    partition_options.journal_purge_age_seconds = options->journal_purge_age_seconds;
+    partition_options.durability = options->durability;
+    partition_options.durability_interval_ms = options->durability_interval_ms;
+    partition_options.durability_bytes = options->durability_bytes;
+    partition_options.read_mode = options->read_mode;
+    partition_options.journal_preallocate = options->journal_preallocate;
+    partition_options.checksum = options->checksum;
+    partition_options.codec = options->compression;
+    partition_options.io_engine = topic->io_engine;
+    partition_options.compact = options->compact;
+
+    work.topic = topic;
+    work.partition_ids = partition_ids;
+    work.options = &partition_options;
+    rc = ledger_parallel_for(partition_count, ledger_parallel_threads(partition_count),
+                             open_partition, &work);
+    ledger_check_rc(rc == LEDGER_OK, rc, "Failed to open partitions");
+
     topic->opened = true;
 
     return LEDGER_OK;
 
 error:
+    if(topic->partitions) {
+        for(i = 0; i < partition_count; i++) {
+            if(topic->partitions[i].opened) {
+                ledger_partition_close(&topic->partitions[i]);
+            }
+        }
+        free(topic->partitions);
+        topic->partitions = NULL;
+    }
     if(topic_path) {
         free(topic_path);
+        topic->path = NULL;
     }
     return rc;
 }
@@ -106,6 +169,36 @@ error:
     return rc;
 }
 
+ledger_status ledger_topic_write_partition_keyed(ledger_topic *topic, unsigned int partition_num,
+                                                 const void *key, size_t key_len,
+                                                 void *data, size_t len, ledger_write_status *status) {
+    ledger_status rc;
+    ledger_partition *partition;
+
+    ledger_check_rc(partition_num < topic->npartitions, LEDGER_ERR_BAD_PARTITION, "Write to unknown partition");
+    partition = &topic->partitions[partition_num];
+
+    return ledger_partition_write_keyed(partition, key, key_len, data, len, status);
+
+error:
+    return rc;
+}
+
+ledger_status ledger_topic_write_partition_batch(ledger_topic *topic, unsigned int partition_num,
+                                                 const struct iovec *messages, size_t nmessages,
+                                                 ledger_write_batch_status *status) {
+    ledger_status rc;
+    ledger_partition *partition;
+
+    ledger_check_rc(partition_num < topic->npartitions, LEDGER_ERR_BAD_PARTITION, "Write to unknown partition");
+    partition = &topic->partitions[partition_num];
+
+    return ledger_partition_write_batch(partition, messages, nmessages, status);
+
+error:
+    return rc;
+}
+
 ledger_status ledger_topic_read_partition(ledger_topic *topic, unsigned int partition_num,
                                           uint64_t start_id, size_t nmessages,
                                           ledger_message_set *messages) {
@@ -121,6 +214,21 @@ error:
     return rc;
 }
 
+ledger_status ledger_topic_read_partition_cursor(ledger_topic *topic, unsigned int partition_num,
+                                                 ledger_read_cursor *cursor, uint64_t start_id,
+                                                 size_t nmessages, ledger_message_set *messages) {
+    ledger_status rc;
+    ledger_partition *partition;
+
+    ledger_check_rc(partition_num < topic->npartitions, LEDGER_ERR_BAD_PARTITION, "Read from unknown partition");
+    partition = &topic->partitions[partition_num];
+
+    return ledger_partition_read_cursor(partition, cursor, start_id, nmessages, messages);
+
+error:
+    return rc;
+}
+
 ledger_status ledger_topic_latest_message_id(ledger_topic *topic, unsigned int partition_num,
                                              uint64_t *id) {
     ledger_status rc;
@@ -135,6 +243,20 @@ error:
     return rc;
 }
 
+ledger_status ledger_topic_seek_time(ledger_topic *topic, unsigned int partition_num,
+                                     uint64_t time_ms, uint64_t *id) {
+    ledger_status rc;
+    ledger_partition *partition;
+
+    ledger_check_rc(partition_num < topic->npartitions, LEDGER_ERR_BAD_PARTITION, "Bad partition id");
+    partition = &topic->partitions[partition_num];
+
+    return ledger_partition_seek_time(partition, time_ms, id);
+
+error:
+    return rc;
+}
+
 ledger_status ledger_topic_wait_messages(ledger_topic *topic, unsigned int partition_num) {
     ledger_status rc;
     ledger_partition *partition;
@@ -150,6 +272,20 @@ error:
     return rc;
 }
 
+ledger_status ledger_topic_wait_message(ledger_topic *topic, unsigned int partition_num,
+                                        uint64_t id, long int timeout_ms) {
+    ledger_status rc;
+    ledger_partition *partition;
+
+    ledger_check_rc(partition_num < topic->npartitions, LEDGER_ERR_BAD_PARTITION, "Waiting on unknown partition");
+    partition = &topic->partitions[partition_num];
+
+    return ledger_partition_wait_message(partition, id, timeout_ms);
+
+error:
+    return rc;
+}
+
 ledger_status ledger_topic_signal_readers(ledger_topic *topic, unsigned int partition_num) {
     ledger_status rc;
     ledger_partition *partition;
@@ -165,6 +301,31 @@ error:
     return rc;
 }
 
+ledger_status ledger_topic_maintain(ledger_topic *topic) {
+    ledger_status rc;
+    int i;
+    ledger_partition *partition;
+
+    if(!topic->opened) {
+        return LEDGER_OK;
+    }
+
+    for(i = 0; i < topic->npartitions; i++) {
+        partition = topic->partitions + i;
+        if(!partition->opened) {
+            continue;
+        }
+
+        rc = ledger_partition_maintain(partition);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to maintain partition");
+    }
+
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
 void ledger_topic_close(ledger_topic *topic) {
     int i;
     ledger_partition *partition;
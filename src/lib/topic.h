@@ -17,6 +17,25 @@ typedef struct {
     bool drop_corrupt;
     size_t journal_max_size_bytes;
     int32_t journal_purge_age_seconds;
+    // When journal writes are synced to disk. INTERVAL syncs at most
+    // every durability_interval_ms, BYTES once durability_bytes have
+    // been written since the last sync, and BATCH on every commit.
+    ledger_durability durability;
+    uint32_t durability_interval_ms;
+    size_t durability_bytes;
+    ledger_read_mode read_mode;
+    // Allocate the next journal ahead of rotation, and reuse the files
+    // of purged journals rather than deleting them
+    bool journal_preallocate;
+    // Checksum for new messages. Existing messages keep theirs.
+    ledger_checksum checksum;
+    // Codec for batches of new messages. Existing messages are read back
+    // with whichever codec they were written with.
+    ledger_codec_id compression;
+    ledger_io_backend io_backend;
+    // Keep only the latest message for each key in sealed journals.
+    // Message ids don't change, readers skip over the ones removed.
+    bool compact;
 } ledger_topic_options;
 
 typedef struct {
@@ -27,6 +46,11 @@ typedef struct {
     size_t npartitions;
     char *path;
     size_t path_len;
+    // The context's engine, for topics using LEDGER_IO_URING
+    ledger_io_engine *io_engine;
+    // Maintenance passes and blocked calls still using the topic, which
+    // closing it waits for
+    uint32_t refs;
 } ledger_topic;
 
 ledger_status ledger_topic_new(const char *name, ledger_topic **topic_out);
@@ -38,15 +62,29 @@ ledger_status ledger_topic_open(ledger_topic *topic, const char *root,
 void ledger_topic_close(ledger_topic *topic);
 ledger_status ledger_topic_write_partition(ledger_topic *topic, unsigned int partition_num,
                                            void *data, size_t len, ledger_write_status *status);
+ledger_status ledger_topic_write_partition_keyed(ledger_topic *topic, unsigned int partition_num,
+                                                 const void *key, size_t key_len,
+                                                 void *data, size_t len, ledger_write_status *status);
+ledger_status ledger_topic_write_partition_batch(ledger_topic *topic, unsigned int partition_num,
+                                                 const struct iovec *messages, size_t nmessages,
+                                                 ledger_write_batch_status *status);
 ledger_status ledger_topic_read_partition(ledger_topic *topic, unsigned int partition_num,
                                           uint64_t start_id, size_t nmessages,
                                           ledger_message_set *messages);
+ledger_status ledger_topic_read_partition_cursor(ledger_topic *topic, unsigned int partition_num,
+                                                 ledger_read_cursor *cursor, uint64_t start_id,
+                                                 size_t nmessages, ledger_message_set *messages);
 
 ledger_status ledger_topic_latest_message_id(ledger_topic *topic, unsigned int patition_num,
                                              uint64_t *id);
+ledger_status ledger_topic_seek_time(ledger_topic *topic, unsigned int partition_num,
+                                     uint64_t time_ms, uint64_t *id);
 
 ledger_status ledger_topic_wait_messages(ledger_topic *topic, unsigned int partition_num);
+ledger_status ledger_topic_wait_message(ledger_topic *topic, unsigned int partition_num,
+                                        uint64_t id, long int timeout_ms);
 ledger_status ledger_topic_signal_readers(ledger_topic *topic, unsigned int partition_num);
+ledger_status ledger_topic_maintain(ledger_topic *topic);
 
 #if defined(__cplusplus)
 }
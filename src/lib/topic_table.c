@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "murmur3.h"
+#include "topic_table.h"
+
+#define MIN_CAPACITY 16
+#define HASH_SEED 0x9747b28c
+#define SYNCHRONIZE_POLL_NS 100000
+
+// Marks the slot of a removed topic, so probes carry on past it
+static ledger_topic removed_topic;
+#define REMOVED (&removed_topic)
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash;
+
+    MurmurHash3_x86_32(name, strlen(name), HASH_SEED, &hash);
+    return hash;
+}
+
+static ledger_topic_slots *alloc_slots(size_t capacity) {
+    ledger_topic_slots *slots;
+
+    slots = malloc(sizeof(ledger_topic_slots));
+    if(slots == NULL) {
+        return NULL;
+    }
+    slots->slots = calloc(capacity, sizeof(ledger_topic_slot));
+    if(slots->slots == NULL) {
+        free(slots);
+        return NULL;
+    }
+    slots->capacity = capacity;
+    slots->retired_epoch = 0;
+    slots->retired = NULL;
+    return slots;
+}
+
+static void free_slots(ledger_topic_slots *slots) {
+    free(slots->slots);
+    free(slots);
+}
+
+static bool drained(ledger_topic_table *table, uint64_t epoch) {
+    return __atomic_load_n(&table->readers[epoch & 1], __ATOMIC_SEQ_CST) == 0;
+}
+
+// Frees the tables replaced before this epoch once its predecessor's
+// sections have ended, and moves on to a new epoch for the rest. Never
+// waits, so anything left goes on a later call.
+static void reclaim(ledger_topic_table *table) {
+    ledger_topic_slots **link = &table->retired;
+    ledger_topic_slots *slots;
+
+    if(table->retired == NULL || !drained(table, table->epoch - 1)) {
+        return;
+    }
+    while((slots = *link) != NULL) {
+        if(slots->retired_epoch < table->epoch) {
+            *link = slots->retired;
+            free_slots(slots);
+        } else {
+            link = &slots->retired;
+        }
+    }
+    // Sections starting from here can't see what's left
+    if(table->retired != NULL) {
+        __atomic_store_n(&table->epoch, table->epoch + 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void place(ledger_topic_slots *slots, uint32_t hash, ledger_topic *topic) {
+    size_t mask = slots->capacity - 1;
+    size_t i;
+
+    for(i = hash & mask; slots->slots[i].topic != NULL; i = (i + 1) & mask);
+
+    // Lookups read the topic first, so the hash has to be there before it
+    slots->slots[i].hash = hash;
+    __atomic_store_n(&slots->slots[i].topic, topic, __ATOMIC_RELEASE);
+}
+
+// Moves the topics to a new table sized for them, leaving the removed
+// slots behind
+static ledger_status grow(ledger_topic_table *table) {
+    ledger_topic_slots *old = table->current;
+    ledger_topic_slots *slots;
+    ledger_topic *topic;
+    size_t i, capacity = MIN_CAPACITY;
+
+    while(capacity < (table->ntopics + 1) * 2) {
+        capacity *= 2;
+    }
+
+    slots = alloc_slots(capacity);
+    if(slots == NULL) {
+        return LEDGER_ERR_MEMORY;
+    }
+
+    if(old != NULL) {
+        for(i = 0; i < old->capacity; i++) {
+            topic = old->slots[i].topic;
+            if(topic != NULL && topic != REMOVED) {
+                place(slots, old->slots[i].hash, topic);
+            }
+        }
+    }
+
+    __atomic_store_n(&table->current, slots, __ATOMIC_SEQ_CST);
+    table->nremoved = 0;
+    if(old != NULL) {
+        old->retired_epoch = table->epoch;
+        old->retired = table->retired;
+        table->retired = old;
+    }
+    reclaim(table);
+    return LEDGER_OK;
+}
+
+void ledger_topic_table_init(ledger_topic_table *table) {
+    table->current = NULL;
+    table->ntopics = 0;
+    table->nremoved = 0;
+    // Past zero, so the epoch before it is always there to check
+    table->epoch = 1;
+    table->readers[0] = 0;
+    table->readers[1] = 0;
+    table->retired = NULL;
+}
+
+ledger_status ledger_topic_table_insert(ledger_topic_table *table, ledger_topic *topic) {
+    ledger_status rc;
+
+    // Filled and removed slots both lengthen probes, and a lookup needs
+    // an empty slot to stop at
+    if(table->current == NULL ||
+       (table->ntopics + table->nremoved + 1) * 4 > table->current->capacity * 3) {
+        rc = grow(table);
+        ledger_check_rc(rc == LEDGER_OK, rc, "Failed to grow topic table");
+    }
+
+    place(table->current, hash_name(topic->name), topic);
+    table->ntopics++;
+    return LEDGER_OK;
+
+error:
+    return rc;
+}
+
+static ledger_topic_slot *find_slot(ledger_topic_slots *slots, const char *name) {
+    uint32_t hash = hash_name(name);
+    size_t mask = slots->capacity - 1;
+    ledger_topic *topic;
+    size_t i;
+
+    for(i = hash & mask;; i = (i + 1) & mask) {
+        topic = __atomic_load_n(&slots->slots[i].topic, __ATOMIC_ACQUIRE);
+        if(topic == NULL) {
+            return NULL;
+        }
+        if(topic != REMOVED && slots->slots[i].hash == hash && strcmp(topic->name, name) == 0) {
+            return &slots->slots[i];
+        }
+    }
+}
+
+ledger_topic *ledger_topic_table_lookup(ledger_topic_table *table, const char *name) {
+    ledger_topic_slots *slots = __atomic_load_n(&table->current, __ATOMIC_ACQUIRE);
+    ledger_topic_slot *slot;
+
+    if(slots == NULL) {
+        return NULL;
+    }
+    slot = find_slot(slots, name);
+    return slot != NULL ? slot->topic : NULL;
+}
+
+ledger_topic *ledger_topic_table_remove(ledger_topic_table *table, const char *name) {
+    ledger_topic_slot *slot;
+    ledger_topic *topic;
+
+    if(table->current == NULL) {
+        return NULL;
+    }
+    slot = find_slot(table->current, name);
+    if(slot == NULL) {
+        return NULL;
+    }
+
+    topic = slot->topic;
+    __atomic_store_n(&slot->topic, REMOVED, __ATOMIC_SEQ_CST);
+    table->ntopics--;
+    table->nremoved++;
+    return topic;
+}
+
+size_t ledger_topic_table_enter(ledger_topic_table *table) {
+    uint64_t epoch;
+
+    for(;;) {
+        epoch = __atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&table->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        // Otherwise the epoch moved on before the section was counted,
+        // and nothing waits for it
+        if(__atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return epoch & 1;
+        }
+        __atomic_sub_fetch(&table->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void ledger_topic_table_exit(ledger_topic_table *table, size_t section) {
+    __atomic_sub_fetch(&table->readers[section], 1, __ATOMIC_SEQ_CST);
+}
+
+static void wait_drained(ledger_topic_table *table, uint64_t epoch) {
+    struct timespec poll = {0, SYNCHRONIZE_POLL_NS};
+
+    while(!drained(table, epoch)) {
+        nanosleep(&poll, NULL);
+    }
+}
+
+void ledger_topic_table_synchronize(ledger_topic_table *table) {
+    uint64_t epoch = table->epoch;
+
+    // The other parity's sections have to end before its count is reused
+    wait_drained(table, epoch - 1);
+    __atomic_store_n(&table->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    wait_drained(table, epoch);
+    reclaim(table);
+}
+
+ledger_topic *ledger_topic_table_next(ledger_topic_table *table, size_t *pos) {
+    ledger_topic *topic;
+
+    if(table->current == NULL) {
+        return NULL;
+    }
+    while(*pos < table->current->capacity) {
+        topic = table->current->slots[(*pos)++].topic;
+        if(topic != NULL && topic != REMOVED) {
+            return topic;
+        }
+    }
+    return NULL;
+}
+
+void ledger_topic_table_free(ledger_topic_table *table) {
+    ledger_topic_slots *slots;
+
+    while((slots = table->retired) != NULL) {
+        table->retired = slots->retired;
+        free_slots(slots);
+    }
+    if(table->current != NULL) {
+        free_slots(table->current);
+    }
+    ledger_topic_table_init(table);
+}
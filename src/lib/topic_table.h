@@ -0,0 +1,68 @@
+#ifndef LIB_LEDGER_TOPIC_TABLE_H
+#define LIB_LEDGER_TOPIC_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "topic.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t hash;
+    ledger_topic *topic;
+} ledger_topic_slot;
+
+typedef struct ledger_topic_slots {
+    size_t capacity;
+    ledger_topic_slot *slots;
+    // Once replaced, the epoch it was replaced in, and the next table
+    // waiting for the lookups still on it to finish
+    uint64_t retired_epoch;
+    struct ledger_topic_slots *retired;
+} ledger_topic_slots;
+
+// Open addressed topics by name. Lookups take no lock and run alongside
+// inserts and removals, which callers serialize among themselves. A slot
+// is only ever filled and then emptied, and growing publishes a new
+// table rather than moving topics around in the old one.
+//
+// Lookups run in a reader section, counted by the parity of the epoch
+// it started in. Replaced tables are freed once every section that
+// could have seen them has ended, and removed topics once
+// ledger_topic_table_synchronize returns.
+typedef struct {
+    ledger_topic_slots *current;
+    size_t ntopics;
+    size_t nremoved;
+    uint64_t epoch;
+    uint64_t readers[2];
+    ledger_topic_slots *retired;
+} ledger_topic_table;
+
+void ledger_topic_table_init(ledger_topic_table *table);
+ledger_status ledger_topic_table_insert(ledger_topic_table *table, ledger_topic *topic);
+// Called in a reader section, and the topic is only safe to use until
+// the section ends
+ledger_topic *ledger_topic_table_lookup(ledger_topic_table *table, const char *name);
+// Returns the removed topic, NULL when there was none by that name. It
+// may still be in use until ledger_topic_table_synchronize returns.
+ledger_topic *ledger_topic_table_remove(ledger_topic_table *table, const char *name);
+// Returns the section, to pass to ledger_topic_table_exit
+size_t ledger_topic_table_enter(ledger_topic_table *table);
+void ledger_topic_table_exit(ledger_topic_table *table, size_t section);
+// Waits for every reader section already started to end. Serialized with
+// inserts and removals, but never called holding up a section.
+void ledger_topic_table_synchronize(ledger_topic_table *table);
+// Walks the topics from *pos, which starts at 0. NULL once every topic
+// has been seen.
+ledger_topic *ledger_topic_table_next(ledger_topic_table *table, size_t *pos);
+void ledger_topic_table_free(ledger_topic_table *table);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
@@ -0,0 +1,125 @@
+// Compares the position storage maps: the disk map against the fixed
+// size disk map it replaced, setting and getting the same keys over and
+// over the way consumer checkpoints do.
+//
+// Every fsd_map set appends a cell to the key's bucket, and cells of one
+// key all land in the same bucket however far the table grows, so a few
+// sets of a key write over the next bucket. Its keys are only set once,
+// and its gets run for every round. Its 16 bit bucket count also keeps
+// it to some ten thousand keys.
+//
+//   map_bench [keys] [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "disk_map.h"
+#include "fixed_size_disk_map.h"
+
+static const char *DISK_MAP_PATH = "/tmp/ledger_map_bench";
+static const char *DISK_MAP_NEXT_PATH = "/tmp/ledger_map_bench.next";
+static const char *FSD_MAP_PATH = "/tmp/ledger_fsd_map_bench";
+
+static double now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char *name, const char *op, double ms, long ops) {
+    printf("%-8s %-4s %10ld ops %10.2f ms %8.1f ns/op\n", name, op, ops, ms,
+           ms * 1000000.0 / ops);
+}
+
+static bool bench_disk_map(std::vector<std::string> &keys, int rounds) {
+    ledger_disk_map map;
+    uint64_t val;
+    double start;
+    int round;
+    size_t i;
+
+    unlink(DISK_MAP_PATH);
+    unlink(DISK_MAP_NEXT_PATH);
+    if(ledger_disk_map_open(&map, DISK_MAP_PATH, 16) != LEDGER_OK) {
+        fprintf(stderr, "Failed to open disk map\n");
+        return false;
+    }
+
+    start = now_ms();
+    for(round = 0; round < rounds; round++) {
+        for(i = 0; i < keys.size(); i++) {
+            ledger_disk_map_set(&map, keys[i].c_str(), keys[i].size(), round);
+        }
+    }
+    report("disk_map", "set", now_ms() - start, (long)rounds * keys.size());
+
+    start = now_ms();
+    for(round = 0; round < rounds; round++) {
+        for(i = 0; i < keys.size(); i++) {
+            ledger_disk_map_get(&map, keys[i].c_str(), keys[i].size(), &val);
+        }
+    }
+    report("disk_map", "get", now_ms() - start, (long)rounds * keys.size());
+
+    printf("disk_map file %lu bytes\n", (unsigned long)map.current->mmap_len);
+    ledger_disk_map_close(&map);
+    unlink(DISK_MAP_PATH);
+    return true;
+}
+
+static bool bench_fsd_map(std::vector<std::string> &keys, int rounds) {
+    fsd_map_t map;
+    uint64_t val;
+    double start;
+    int round;
+    size_t i;
+
+    unlink(FSD_MAP_PATH);
+    // What position storage used
+    if(fsd_map_init(&map, 255, 5) != FSD_MAP_OK ||
+       fsd_map_open(&map, FSD_MAP_PATH) != FSD_MAP_OK) {
+        fprintf(stderr, "Failed to open fsd map\n");
+        return false;
+    }
+
+    start = now_ms();
+    for(i = 0; i < keys.size(); i++) {
+        fsd_map_set(&map, keys[i].c_str(), keys[i].size(), 0);
+    }
+    report("fsd_map", "set", now_ms() - start, keys.size());
+
+    start = now_ms();
+    for(round = 0; round < rounds; round++) {
+        for(i = 0; i < keys.size(); i++) {
+            fsd_map_get(&map, keys[i].c_str(), keys[i].size(), &val);
+        }
+    }
+    report("fsd_map", "get", now_ms() - start, (long)rounds * keys.size());
+
+    printf("fsd_map file %lu bytes\n", (unsigned long)map.mmap_len);
+    fsd_map_close(&map);
+    unlink(FSD_MAP_PATH);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int nkeys = argc > 1 ? atoi(argv[1]) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100;
+    std::vector<std::string> keys;
+    int i;
+
+    for(i = 0; i < nkeys; i++) {
+        keys.push_back("consumer" + std::to_string(i / 16) + "-" + std::to_string(i % 16));
+    }
+    printf("%d keys, %d rounds\n", nkeys, rounds);
+
+    if(!bench_disk_map(keys, rounds) || !bench_fsd_map(keys, rounds)) {
+        return 1;
+    }
+    return 0;
+}
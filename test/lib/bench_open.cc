@@ -0,0 +1,135 @@
+// Times a cold ledger_open_topic over topics x partitions, to keep an eye
+// on startup. Page cache for the files is dropped before every run, the
+// dentry and inode caches stay warm.
+//
+//   open_bench [topics] [partitions] [runs]
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "ledger.h"
+
+static const char *BENCH_DIR = "/tmp/ledger_open_bench";
+
+static int remove_cb(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    return remove(path);
+}
+
+static int drop_cache_cb(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    int fd;
+
+    if(typeflag != FTW_F) {
+        return 0;
+    }
+    fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    return 0;
+}
+
+static double now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static std::string topic_name(int topic) {
+    return "topic" + std::to_string(topic);
+}
+
+static bool open_topics(ledger_ctx *ctx, int ntopics, std::vector<unsigned int> &partition_ids) {
+    ledger_topic_options options;
+    int i;
+
+    if(ledger_topic_options_init(&options) != LEDGER_OK) {
+        return false;
+    }
+    for(i = 0; i < ntopics; i++) {
+        if(ledger_open_topic(ctx, topic_name(i).c_str(), partition_ids.data(),
+                             partition_ids.size(), &options) != LEDGER_OK) {
+            fprintf(stderr, "Failed to open topic %d\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int ntopics = argc > 1 ? atoi(argv[1]) : 4;
+    int npartitions = argc > 2 ? atoi(argv[2]) : 256;
+    int nruns = argc > 3 ? atoi(argv[3]) : 5;
+    std::vector<unsigned int> partition_ids;
+    std::vector<double> times;
+    ledger_ctx ctx;
+    struct rlimit limit;
+    double start;
+    int i, j;
+
+    if(ntopics <= 0 || npartitions <= 0 || nruns <= 0) {
+        fprintf(stderr, "usage: %s [topics] [partitions] [runs]\n", argv[0]);
+        return 1;
+    }
+
+    // Every partition keeps its latest journal open
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    for(i = 0; i < npartitions; i++) {
+        partition_ids.push_back(i);
+    }
+
+    nftw(BENCH_DIR, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    if(mkdir(BENCH_DIR, 0755) != 0) {
+        perror(BENCH_DIR);
+        return 1;
+    }
+
+    if(ledger_open_context(&ctx, BENCH_DIR) != LEDGER_OK || !open_topics(&ctx, ntopics, partition_ids)) {
+        return 1;
+    }
+    for(i = 0; i < ntopics; i++) {
+        for(j = 0; j < npartitions; j++) {
+            if(ledger_write_partition(&ctx, topic_name(i).c_str(), j, (void *)"bench", 5, NULL) != LEDGER_OK) {
+                fprintf(stderr, "Failed to write topic %d partition %d\n", i, j);
+                return 1;
+            }
+        }
+    }
+    ledger_close_context(&ctx);
+
+    for(i = 0; i < nruns; i++) {
+        nftw(BENCH_DIR, drop_cache_cb, 64, FTW_PHYS);
+
+        if(ledger_open_context(&ctx, BENCH_DIR) != LEDGER_OK) {
+            return 1;
+        }
+        start = now_ms();
+        if(!open_topics(&ctx, ntopics, partition_ids)) {
+            return 1;
+        }
+        times.push_back(now_ms() - start);
+        ledger_close_context(&ctx);
+    }
+
+    std::sort(times.begin(), times.end());
+    printf("open %d topics x %d partitions: min %.1f ms, median %.1f ms, max %.1f ms over %d runs\n",
+           ntopics, npartitions, times.front(), times[times.size() / 2], times.back(), nruns);
+
+    nftw(BENCH_DIR, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+namespace ledger_checkpoint_test {
+static const char *WORKING_DIR = "/tmp/checkpoint_ledger";
+static const char *KEY = "my_consumer";
+
+static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    return remove(fpath);
+}
+
+static int cleanup(const char *directory) {
+    return nftw(directory, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Polls for the stored position, for up to a second
+static ledger_status stored_position(ledger_position_storage *storage, uint64_t want) {
+    ledger_status rc = LEDGER_ERR_POSITION_NOT_FOUND;
+    uint64_t pos;
+    int i;
+
+    for(i = 0; i < 100; i++) {
+        rc = ledger_position_storage_get(storage, KEY, 0, &pos);
+        if(rc == LEDGER_OK && pos == want) {
+            return LEDGER_OK;
+        }
+        usleep(10 * 1000);
+    }
+    return rc == LEDGER_OK ? LEDGER_ERR_GENERAL : rc;
+}
+
+class LedgerCheckpoint : public ::testing::Test {
+protected:
+    ledger_position_storage storage;
+    ledger_checkpointer checkpointer;
+
+    void SetUp() override {
+        cleanup(WORKING_DIR);
+        ASSERT_EQ(0, mkdir(WORKING_DIR, 0777));
+        ledger_position_storage_init(&storage);
+        ASSERT_EQ(LEDGER_OK, ledger_position_storage_open(&storage, WORKING_DIR));
+        ASSERT_EQ(LEDGER_OK, ledger_checkpointer_start(&checkpointer, &storage));
+    }
+
+    void TearDown() override {
+        ledger_position_storage_close(&storage);
+        cleanup(WORKING_DIR);
+    }
+};
+
+TEST_F(LedgerCheckpoint, StoredWhenRequested) {
+    ledger_checkpoint *checkpoint;
+    uint64_t pos;
+
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_register(&checkpointer, KEY, 0, 0, 0, &checkpoint));
+
+    ledger_checkpoint_update(checkpoint, 5);
+    usleep(50 * 1000);
+    EXPECT_EQ(LEDGER_ERR_POSITION_NOT_FOUND, ledger_position_storage_get(&storage, KEY, 0, &pos));
+
+    ledger_checkpointer_request(&checkpointer, checkpoint);
+    EXPECT_EQ(LEDGER_OK, stored_position(&storage, 5));
+
+    ledger_checkpointer_unregister(&checkpointer, checkpoint);
+    ledger_checkpointer_stop(&checkpointer);
+}
+
+TEST_F(LedgerCheckpoint, StoredOnInterval) {
+    ledger_checkpoint *checkpoint;
+    int i;
+
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_register(&checkpointer, KEY, 0, 0, 20, &checkpoint));
+
+    // Coalesced into one stored position per interval
+    for(i = 1; i <= 1000; i++) {
+        ledger_checkpoint_update(checkpoint, i);
+    }
+    EXPECT_EQ(LEDGER_OK, stored_position(&storage, 1000));
+
+    ledger_checkpointer_unregister(&checkpointer, checkpoint);
+    ledger_checkpointer_stop(&checkpointer);
+}
+
+TEST_F(LedgerCheckpoint, FlushAndStop) {
+    ledger_checkpoint *checkpoint, *other;
+    uint64_t pos;
+
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_register(&checkpointer, KEY, 0, 0, 0, &checkpoint));
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_register(&checkpointer, KEY, 1, 0, 0, &other));
+
+    ledger_checkpoint_update(checkpoint, 3);
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_flush(&checkpointer, checkpoint));
+    ASSERT_EQ(LEDGER_OK, ledger_position_storage_get(&storage, KEY, 0, &pos));
+    EXPECT_EQ(3, pos);
+    ledger_checkpointer_unregister(&checkpointer, checkpoint);
+
+    // Still registered, so stored by stopping
+    ledger_checkpoint_update(other, 7);
+    ledger_checkpointer_stop(&checkpointer);
+    ASSERT_EQ(LEDGER_OK, ledger_position_storage_get(&storage, KEY, 1, &pos));
+    EXPECT_EQ(7, pos);
+}
+
+TEST_F(LedgerCheckpoint, StoredWithoutHoldingUpConsumers) {
+    ledger_checkpoint *checkpoint, *other;
+    uint64_t pos;
+
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_register(&checkpointer, KEY, 0, 0, 0, &checkpoint));
+
+    // Standing in for a slow write, the pass waits its turn to store
+    pthread_mutex_lock(&checkpointer.store_lock);
+    ledger_checkpoint_update(checkpoint, 4);
+    ledger_checkpointer_request(&checkpointer, checkpoint);
+    usleep(50 * 1000);
+
+    // None of which waits on the write
+    ASSERT_EQ(LEDGER_OK, ledger_checkpointer_register(&checkpointer, KEY, 1, 0, 0, &other));
+    ledger_checkpoint_update(other, 9);
+    ledger_checkpointer_request(&checkpointer, other);
+    EXPECT_EQ(LEDGER_ERR_POSITION_NOT_FOUND, ledger_position_storage_get(&storage, KEY, 0, &pos));
+    pthread_mutex_unlock(&checkpointer.store_lock);
+
+    EXPECT_EQ(LEDGER_OK, stored_position(&storage, 4));
+    ledger_checkpointer_unregister(&checkpointer, checkpoint);
+    ledger_checkpointer_stop(&checkpointer);
+    ASSERT_EQ(LEDGER_OK, ledger_position_storage_get(&storage, KEY, 1, &pos));
+    EXPECT_EQ(9, pos);
+}
+}
@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "codec.h"
+
+namespace codec_tests {
+
+static std::vector<char> roundtrip(const ledger_codec *codec, const std::vector<char> &input) {
+    std::vector<char> compressed(codec->bound(input.size()));
+    std::vector<char> output(input.size());
+    size_t compressed_len;
+
+    EXPECT_EQ(LEDGER_OK, codec->compress(input.data(), input.size(), compressed.data(),
+                                         compressed.size(), &compressed_len));
+    EXPECT_LE(compressed_len, compressed.size());
+    EXPECT_EQ(LEDGER_OK, codec->decompress(compressed.data(), compressed_len,
+                                           output.data(), output.size()));
+    compressed.resize(compressed_len);
+    EXPECT_EQ(input, output);
+    return compressed;
+}
+
+TEST(Codec, Lookup) {
+    ASSERT_TRUE(ledger_codec_lookup(LEDGER_CODEC_NONE) != NULL);
+    ASSERT_TRUE(ledger_codec_lookup(LEDGER_CODEC_LZ) != NULL);
+    EXPECT_STREQ("lz", ledger_codec_lookup(LEDGER_CODEC_LZ)->name);
+    EXPECT_TRUE(ledger_codec_lookup((ledger_codec_id)99) == NULL);
+}
+
+TEST(Codec, LzRoundtrip) {
+    const ledger_codec *lz = ledger_codec_lookup(LEDGER_CODEC_LZ);
+    std::vector<char> input;
+    std::vector<char> compressed;
+    const char *line = "{\"event\": \"page_view\", \"user\": 12345}\n";
+
+    for(int i = 0; i < 1000; i++) {
+        input.insert(input.end(), line, line + strlen(line));
+    }
+    compressed = roundtrip(lz, input);
+    EXPECT_LT(compressed.size(), input.size() / 10);
+
+    srand(7);
+    for(size_t len = 0; len < 70000; len = len * 2 + 1) {
+        input.resize(len);
+        for(size_t i = 0; i < len; i++) {
+            input[i] = rand() % 4;
+        }
+        roundtrip(lz, input);
+    }
+}
+
+TEST(Codec, LzRejectsBadInput) {
+    const ledger_codec *lz = ledger_codec_lookup(LEDGER_CODEC_LZ);
+    std::vector<char> input(4096, 'a');
+    std::vector<char> compressed(lz->bound(input.size()));
+    std::vector<char> output(input.size());
+    size_t compressed_len;
+
+    ASSERT_EQ(LEDGER_OK, lz->compress(input.data(), input.size(), compressed.data(),
+                                      compressed.size(), &compressed_len));
+
+    EXPECT_NE(LEDGER_OK, lz->decompress(compressed.data(), compressed_len - 1,
+                                        output.data(), output.size()));
+    EXPECT_NE(LEDGER_OK, lz->decompress(compressed.data(), compressed_len,
+                                        output.data(), output.size() - 1));
+
+    // Garbage must fail cleanly rather than read or write out of bounds
+    srand(11);
+    for(int i = 0; i < 1000; i++) {
+        for(size_t j = 0; j < compressed_len; j++) {
+            compressed[j] = rand();
+        }
+        lz->decompress(compressed.data(), compressed_len, output.data(), output.size());
+    }
+}
+
+TEST(Codec, NoneRoundtrip) {
+    const ledger_codec *none = ledger_codec_lookup(LEDGER_CODEC_NONE);
+    std::vector<char> input(1000, 'x');
+
+    EXPECT_EQ(input.size(), roundtrip(none, input).size());
+}
+
+}
@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
 
+#include <dirent.h>
 #include <ftw.h>
+#include <sys/wait.h>
+
+#include <atomic>
+#include <vector>
 
 #include "consumer.h"
 
@@ -392,6 +397,51 @@ TEST(LedgerConsumer, PositionWithNoKey) {
     ASSERT_EQ(0, cleanup(WORKING_DIR));
 }
 
+TEST(LedgerConsumer, PositionKeyTooLong) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_consumer consumer;
+    ledger_consumer_options consumer_opts;
+    ledger_write_status status;
+    std::string concated_str;
+    std::string key(LEDGER_POSITION_KEY_MAX, 'k');
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    ASSERT_EQ(LEDGER_OK, ledger_init_consumer_options(&consumer_opts));
+    consumer_opts.position_behavior = LEDGER_STORE;
+    consumer_opts.position_key = key.c_str();
+
+    // The longest key is stored
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)"hello", 5, &status));
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_init(&consumer, concat_consume_function, &consumer_opts, &concated_str));
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_attach(&consumer, &ctx, TOPIC, 0));
+    EXPECT_EQ(LEDGER_OK, ledger_consumer_start(&consumer, LEDGER_BEGIN));
+    ledger_consumer_wait_for_position(&consumer, status.message_id);
+    ledger_consumer_stop(&consumer);
+    ledger_consumer_wait(&consumer);
+    EXPECT_EQ(LEDGER_OK, consumer.status);
+    ledger_consumer_close(&consumer);
+
+    uint64_t pos;
+    ASSERT_EQ(LEDGER_OK, ledger_position_storage_get(&ctx.position_storage, key.c_str(), 0, &pos));
+    EXPECT_EQ(1, pos);
+
+    // One byte more is turned away up front
+    key.push_back('k');
+    consumer_opts.position_key = key.c_str();
+    EXPECT_EQ(LEDGER_ERR_ARGS, ledger_consumer_init(&consumer, concat_consume_function, &consumer_opts, &concated_str));
+    EXPECT_EQ(LEDGER_ERR_ARGS, ledger_position_storage_get(&ctx.position_storage, key.c_str(), 0, &pos));
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
 TEST(LedgerConsumer, ConsumerTriggersStopAndWait) {
     ledger_ctx ctx;
     ledger_topic_options options;
@@ -424,6 +474,303 @@ TEST(LedgerConsumer, ConsumerTriggersStopAndWait) {
     ASSERT_EQ(0, cleanup(WORKING_DIR));
 }
 
+static ledger_consume_status counting_consume_function(ledger_consumer_ctx *ctx, ledger_message_set *messages, void *data) {
+    std::atomic<size_t> *consumed_size = static_cast<std::atomic<size_t>*>(data);
+    int i;
+
+    for(i = 0; i < messages->nmessages; i++) {
+        *consumed_size += messages->messages[i].len;
+    }
+
+    return LEDGER_CONSUMER_OK;
+}
+
+static size_t thread_count() {
+    DIR *dir = opendir("/proc/self/task");
+    size_t count = 0;
+
+    while(dir != NULL && readdir(dir) != NULL) {
+        count++;
+    }
+    if(dir != NULL) {
+        closedir(dir);
+    }
+    return count;
+}
+
+TEST(LedgerConsumer, ScheduledConsumerStopsItself) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_consumer consumer;
+    ledger_consumer_options consumer_opts;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)"hello", 5, NULL));
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)"there", 5, NULL));
+
+    size_t consumed_size = 0;
+    ASSERT_EQ(LEDGER_OK, ledger_init_consumer_options(&consumer_opts));
+    consumer_opts.read_chunk_size = 2;
+    consumer_opts.scheduled = true;
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_init(&consumer, stop_consume_function, &consumer_opts, &consumed_size));
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_attach(&consumer, &ctx, TOPIC, 0));
+    EXPECT_EQ(LEDGER_OK, ledger_consumer_start(&consumer, LEDGER_BEGIN));
+
+    ledger_consumer_wait(&consumer);
+    EXPECT_EQ(10, consumed_size);
+
+    ledger_consumer_close(&consumer);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(LedgerConsumer, ScheduledConsumersShareThreads) {
+    const unsigned int npartitions = 64;
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_consumer_options consumer_opts;
+    std::vector<unsigned int> partition_ids;
+    std::vector<ledger_consumer> consumers(npartitions);
+    std::atomic<size_t> consumed_size(0);
+    size_t threads_before;
+    unsigned int i;
+    int waited;
+
+    for(i = 0; i < npartitions; i++) {
+        partition_ids.push_back(i);
+    }
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids.data(), npartitions, &options));
+
+    for(i = 0; i < npartitions; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, i, (void *)"hello", 5, NULL));
+    }
+
+    threads_before = thread_count();
+    ASSERT_EQ(LEDGER_OK, ledger_init_consumer_options(&consumer_opts));
+    consumer_opts.scheduled = true;
+    for(i = 0; i < npartitions; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_consumer_init(&consumers[i], counting_consume_function, &consumer_opts, &consumed_size));
+        ASSERT_EQ(LEDGER_OK, ledger_consumer_attach(&consumers[i], &ctx, TOPIC, i));
+        ASSERT_EQ(LEDGER_OK, ledger_consumer_start(&consumers[i], LEDGER_BEGIN));
+    }
+    // One pool, however many partitions
+    EXPECT_LE(thread_count(), threads_before + 16);
+
+    // Parked consumers are woken by the writes
+    for(i = 0; i < npartitions; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, i, (void *)"there", 5, NULL));
+    }
+    for(waited = 0; consumed_size < npartitions * 10 && waited < 5000; waited++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(npartitions * 10, consumed_size);
+
+    for(i = 0; i < npartitions; i++) {
+        ledger_consumer_stop(&consumers[i]);
+    }
+    for(i = 0; i < npartitions; i++) {
+        ledger_consumer_wait(&consumers[i]);
+        EXPECT_EQ(LEDGER_OK, consumers[i].status);
+        ledger_consumer_close(&consumers[i]);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TEST(LedgerConsumer, ScheduledConsumerWokenByAnotherProcess) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_consumer consumer;
+    ledger_consumer_options consumer_opts;
+    unsigned int partition_ids[] = {0};
+    const int rounds = 20;
+    int turns[2];
+    pid_t child;
+    int child_status;
+    uint64_t started;
+    char turn;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    ASSERT_EQ(0, pipe(turns));
+
+    // The child writes a message each time the parent's consumer has
+    // caught up and hands it the turn
+    child = fork();
+    ASSERT_NE(-1, child);
+    if(child == 0) {
+        close(turns[1]);
+        if(ledger_open_context(&ctx, WORKING_DIR) != LEDGER_OK ||
+           ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options) != LEDGER_OK) {
+            _exit(1);
+        }
+        while(read(turns[0], &turn, 1) == 1) {
+            if(ledger_write_partition(&ctx, TOPIC, 0, (void *)"x", 1, NULL) != LEDGER_OK) {
+                _exit(1);
+            }
+        }
+        ledger_close_context(&ctx);
+        _exit(0);
+    }
+    close(turns[0]);
+
+    std::string concated_str;
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    ASSERT_EQ(LEDGER_OK, ledger_init_consumer_options(&consumer_opts));
+    consumer_opts.scheduled = true;
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_init(&consumer, concat_consume_function, &consumer_opts, &concated_str));
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_attach(&consumer, &ctx, TOPIC, 0));
+    EXPECT_EQ(LEDGER_OK, ledger_consumer_start(&consumer, LEDGER_BEGIN));
+
+    started = now_ms();
+    for(i = 0; i < rounds; i++) {
+        ASSERT_EQ(1, write(turns[1], "t", 1));
+        ledger_consumer_wait_for_position(&consumer, i);
+    }
+    // Waiting out the scheduler's sweep each round would take about a
+    // second
+    EXPECT_GT(500, now_ms() - started);
+    close(turns[1]);
+
+    ASSERT_EQ(child, waitpid(child, &child_status, 0));
+    EXPECT_TRUE(WIFEXITED(child_status));
+    EXPECT_EQ(0, WEXITSTATUS(child_status));
+
+    ledger_consumer_stop(&consumer);
+    ledger_consumer_wait(&consumer);
+    EXPECT_EQ(LEDGER_OK, consumer.status);
+    EXPECT_EQ(std::string(rounds, 'x'), concated_str);
+
+    ledger_consumer_close(&consumer);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static void consume_read_ahead(bool scheduled) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_consumer consumer;
+    ledger_consumer_options consumer_opts;
+    ledger_write_status status;
+    std::string expected, concated;
+    char message[16];
+    int i, len;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < 50; i++) {
+        len = snprintf(message, sizeof(message), "m%d,", i);
+        expected.append(message, len);
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, message, len, NULL));
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_init_consumer_options(&consumer_opts));
+    consumer_opts.read_chunk_size = 3;
+    consumer_opts.prefetch_messages = 8;
+    consumer_opts.prefetch_bytes = 16;
+    consumer_opts.scheduled = scheduled;
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_init(&consumer, concat_consume_function, &consumer_opts, &concated));
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_attach(&consumer, &ctx, TOPIC, 0));
+    EXPECT_EQ(LEDGER_OK, ledger_consumer_start(&consumer, LEDGER_BEGIN));
+
+    // Read ahead is woken by writes once it's caught up
+    for(i = 50; i < 100; i++) {
+        len = snprintf(message, sizeof(message), "m%d,", i);
+        expected.append(message, len);
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, message, len, &status));
+    }
+
+    ledger_consumer_wait_for_position(&consumer, status.message_id);
+    ledger_consumer_stop(&consumer);
+    ledger_consumer_wait(&consumer);
+    EXPECT_EQ(LEDGER_OK, consumer.status);
+    EXPECT_EQ(expected, concated);
+
+    ledger_consumer_close(&consumer);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(LedgerConsumer, ConsumingReadAhead) {
+    consume_read_ahead(false);
+}
+
+TEST(LedgerConsumer, ScheduledConsumingReadAhead) {
+    consume_read_ahead(true);
+}
+
+TEST(LedgerConsumer, ReadAheadStoresPositionAtTheEnd) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_consumer consumer;
+    ledger_consumer_options consumer_opts;
+    ledger_write_status status;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)"hello", 5, &status));
+
+    ASSERT_EQ(LEDGER_OK, ledger_init_consumer_options(&consumer_opts));
+    consumer_opts.position_behavior = LEDGER_STORE;
+    consumer_opts.position_key = "my_consumer";
+    consumer_opts.prefetch_messages = 8;
+
+    std::string concated_str;
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_init(&consumer, concat_consume_function, &consumer_opts, &concated_str));
+    ASSERT_EQ(LEDGER_OK, ledger_consumer_attach(&consumer, &ctx, TOPIC, 0));
+    EXPECT_EQ(LEDGER_OK, ledger_consumer_start(&consumer, LEDGER_END));
+    // Not sure the best way to 'park' on the end.
+    sleep(1);
+    ledger_consumer_stop(&consumer);
+    ledger_consumer_wait(&consumer);
+    EXPECT_EQ(LEDGER_OK, consumer.status);
+
+    // Resumes after the end it found, not from the beginning
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)"there", 5, &status));
+    EXPECT_EQ(LEDGER_OK, ledger_consumer_start(&consumer, LEDGER_BEGIN));
+    ledger_consumer_wait_for_position(&consumer, status.message_id);
+    ledger_consumer_stop(&consumer);
+    ledger_consumer_wait(&consumer);
+    EXPECT_EQ(1, ledger_consumer_position_get(&consumer.position));
+    EXPECT_EQ("there", concated_str);
+
+    ledger_consumer_close(&consumer);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
 TEST(LedgerConsumerGroup, ConsumerGroupMultiplePartitions) {
     ledger_ctx ctx;
     ledger_topic_options options;
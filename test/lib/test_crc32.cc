@@ -0,0 +1,51 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <vector>
+
+#include "crc32.h"
+
+namespace crc32_tests {
+
+TEST(Crc32, KnownValues) {
+    const char check[] = "123456789";
+
+    EXPECT_EQ(0xCBF43926, crc32_compute(0, check, 9));
+    EXPECT_EQ(0xE3069283, crc32c_compute(0, check, 9));
+    EXPECT_EQ(0xE3069283, crc32c_compute_sw(0, check, 9));
+    EXPECT_EQ(0, crc32c_compute(0, check, 0));
+}
+
+TEST(Crc32, Crc32cKernelsAgree) {
+    std::vector<unsigned char> buf(100000 + 8);
+    size_t len;
+    int offset;
+
+    srand(42);
+    for(size_t i = 0; i < buf.size(); i++) {
+        buf[i] = rand();
+    }
+
+    // Covers unaligned starts, and both block sizes of the interleaved kernel
+    for(len = 0; len < buf.size() - 8; len = len * 3 / 2 + 1) {
+        for(offset = 0; offset < 8; offset++) {
+            ASSERT_EQ(crc32c_compute_sw(0, &buf[offset], len),
+                      crc32c_compute(0, &buf[offset], len)) << "length " << len << " offset " << offset;
+        }
+    }
+}
+
+TEST(Crc32, Crc32cIncremental) {
+    std::vector<unsigned char> buf(50000);
+    uint32_t crc;
+
+    for(size_t i = 0; i < buf.size(); i++) {
+        buf[i] = i * 7;
+    }
+
+    crc = crc32c_compute(0, &buf[0], 777);
+    crc = crc32c_compute(crc, &buf[777], buf.size() - 777);
+    EXPECT_EQ(crc32c_compute(0, &buf[0], buf.size()), crc);
+}
+
+}
@@ -0,0 +1,234 @@
+#include <gtest/gtest.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "disk_map.h"
+
+namespace disk_map_tests {
+
+static const char *MAP_PATH = "/tmp/disk_map";
+static const char *NEXT_PATH = "/tmp/disk_map.next";
+
+static void cleanup() {
+    unlink(MAP_PATH);
+    unlink(NEXT_PATH);
+}
+
+static std::string key(int i) {
+    return "consumer" + std::to_string(i);
+}
+
+TEST(DiskMap, GetAndSet) {
+    ledger_disk_map map;
+    uint64_t val;
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    EXPECT_EQ(LEDGER_NEXT, ledger_disk_map_get(&map, "hello", 5, &val));
+
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "hello", 5, 10));
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "hello", 5, &val));
+    EXPECT_EQ(10, val);
+
+    // Updated in place rather than added again
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "hello", 5, 11));
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "hello", 5, &val));
+    EXPECT_EQ(11, val);
+    EXPECT_EQ(1, map.current->hdr->count);
+
+    // Keys are compared in full, not just by hash
+    EXPECT_EQ(LEDGER_NEXT, ledger_disk_map_get(&map, "hell", 4, &val));
+
+    ledger_disk_map_close(&map);
+    cleanup();
+}
+
+TEST(DiskMap, Reopen) {
+    ledger_disk_map map;
+    uint64_t val;
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "hello", 5, 10));
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "there", 5, 20));
+    ledger_disk_map_close(&map);
+
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "hello", 5, &val));
+    EXPECT_EQ(10, val);
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "there", 5, &val));
+    EXPECT_EQ(20, val);
+    ledger_disk_map_close(&map);
+
+    cleanup();
+}
+
+TEST(DiskMap, RepairsHalfWrittenSlotsOnOpen) {
+    ledger_disk_map map;
+    uint64_t val, i;
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "hello", 5, 10));
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "there", 5, 20));
+    // As left by a process killed while writing every slot
+    for(i = 0; i < map.current->hdr->capacity; i++) {
+        map.current->slots[i].seq |= 1;
+    }
+    ledger_disk_map_close(&map);
+
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "hello", 5, &val));
+    EXPECT_EQ(10, val);
+    EXPECT_EQ(LEDGER_NEXT, ledger_disk_map_get(&map, "other", 5, &val));
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "there", 5, 21));
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "there", 5, &val));
+    EXPECT_EQ(21, val);
+    ledger_disk_map_close(&map);
+
+    cleanup();
+}
+
+TEST(DiskMap, Grows) {
+    ledger_disk_map map;
+    std::string k;
+    uint64_t val;
+    int i;
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    for(i = 0; i < 1000; i++) {
+        k = key(i);
+        ASSERT_EQ(LEDGER_OK, ledger_disk_map_set(&map, k.c_str(), k.size(), i));
+        // Everything set so far is found while growing
+        if(i % 97 == 0) {
+            for(int j = 0; j <= i; j++) {
+                k = key(j);
+                ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, k.c_str(), k.size(), &val));
+                ASSERT_EQ(j, val);
+            }
+        }
+    }
+    EXPECT_GE(map.current->hdr->capacity, 1024);
+    ledger_disk_map_close(&map);
+
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    for(i = 0; i < 1000; i++) {
+        k = key(i);
+        ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, k.c_str(), k.size(), &val));
+        EXPECT_EQ(i, val);
+    }
+    EXPECT_EQ(1000, map.current->hdr->count);
+    ledger_disk_map_close(&map);
+
+    cleanup();
+}
+
+TEST(DiskMap, FinishesGrowingOnOpen) {
+    ledger_disk_map map;
+    std::string k;
+    uint64_t val;
+    int i;
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 1024));
+    for(i = 0; i < 768; i++) {
+        k = key(i);
+        ASSERT_EQ(LEDGER_OK, ledger_disk_map_set(&map, k.c_str(), k.size(), i));
+    }
+    // Starts growing, and stops partway through
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_set(&map, "extra", 5, 1));
+    ASSERT_NE(nullptr, map.next);
+    k = key(0);
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_set(&map, k.c_str(), k.size(), 5000));
+    ASSERT_NE(nullptr, map.next);
+    ASSERT_EQ(0, access(NEXT_PATH, F_OK));
+    ledger_disk_map_close(&map);
+
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    EXPECT_EQ(nullptr, map.next);
+    EXPECT_NE(0, access(NEXT_PATH, F_OK));
+    EXPECT_EQ(2048, map.current->hdr->capacity);
+    for(i = 0; i < 768; i++) {
+        k = key(i);
+        ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, k.c_str(), k.size(), &val));
+        EXPECT_EQ(i == 0 ? 5000 : i, val);
+    }
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, "extra", 5, &val));
+    EXPECT_EQ(1, val);
+    EXPECT_EQ(769, map.current->hdr->count);
+    ledger_disk_map_close(&map);
+
+    cleanup();
+}
+
+TEST(DiskMap, KeyLength) {
+    ledger_disk_map map;
+    std::string k(LEDGER_DISK_MAP_KEY_MAX + 1, 'k');
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    EXPECT_EQ(LEDGER_ERR_ARGS, ledger_disk_map_set(&map, k.c_str(), k.size(), 1));
+    EXPECT_EQ(LEDGER_OK, ledger_disk_map_set(&map, k.c_str(), k.size() - 1, 1));
+    ledger_disk_map_close(&map);
+    cleanup();
+}
+
+static std::atomic<bool> writing;
+
+static void *write_keys(void *map_ptr) {
+    ledger_disk_map *map = (ledger_disk_map *)map_ptr;
+    std::string k;
+    uint64_t round;
+    int i;
+
+    // Values of key i are always a multiple of i + 1
+    for(round = 1; round <= 20; round++) {
+        for(i = 0; i < 500; i++) {
+            k = key(i);
+            ledger_disk_map_set(map, k.c_str(), k.size(), round * (i + 1));
+        }
+    }
+    writing = false;
+    return NULL;
+}
+
+TEST(DiskMap, GetsDuringSets) {
+    ledger_disk_map map;
+    pthread_t writer;
+    std::string k;
+    uint64_t val;
+    int i;
+    bool torn = false;
+
+    cleanup();
+    ASSERT_EQ(LEDGER_OK, ledger_disk_map_open(&map, MAP_PATH, 16));
+    writing = true;
+    ASSERT_EQ(0, pthread_create(&writer, NULL, write_keys, &map));
+
+    while(writing) {
+        for(i = 0; i < 500; i++) {
+            k = key(i);
+            if(ledger_disk_map_get(&map, k.c_str(), k.size(), &val) == LEDGER_OK &&
+               val % (i + 1) != 0) {
+                torn = true;
+            }
+        }
+    }
+    pthread_join(writer, NULL);
+    EXPECT_FALSE(torn);
+
+    for(i = 0; i < 500; i++) {
+        k = key(i);
+        ASSERT_EQ(LEDGER_OK, ledger_disk_map_get(&map, k.c_str(), k.size(), &val));
+        EXPECT_EQ(20 * (i + 1), val);
+    }
+    ledger_disk_map_close(&map);
+    cleanup();
+}
+}
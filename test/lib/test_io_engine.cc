@@ -0,0 +1,291 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "io_engine.h"
+#include "scheduler.h"
+
+namespace io_engine_tests {
+
+static const char *IO_FILE = "/tmp/ledger_io_engine_test";
+
+class IoEngineTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        available = ledger_io_engine_open(&engine, 32) == LEDGER_OK;
+        fd = open(IO_FILE, O_RDWR|O_CREAT|O_TRUNC, 0600);
+        ASSERT_TRUE(fd > 0);
+    }
+
+    virtual void TearDown() {
+        if(available) {
+            ledger_io_engine_close(&engine);
+        }
+        close(fd);
+        unlink(IO_FILE);
+    }
+
+    ledger_io_engine engine;
+    bool available;
+    int fd;
+};
+
+TEST_F(IoEngineTest, LinkedWritesThenRead) {
+    char header[] = "header:";
+    char payload[] = "payload";
+    struct iovec iov[2];
+    char buf[32];
+    ledger_io_request requests[2];
+
+    if(!available) {
+        return;
+    }
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = strlen(payload);
+    ledger_io_request_init(&requests[0], LEDGER_IO_WRITEV, fd, NULL, iov[0].iov_len + iov[1].iov_len, 0);
+    requests[0].iov = iov;
+    requests[0].iovcnt = 2;
+    ledger_io_request_init(&requests[1], LEDGER_IO_WRITE, fd, (void *)"!", 1, 14);
+    requests[1].link = true;
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_run(&engine, requests, 2));
+    EXPECT_EQ(14, requests[0].result);
+    EXPECT_EQ(1, requests[1].result);
+
+    memset(buf, 0, sizeof(buf));
+    ledger_io_request_init(&requests[0], LEDGER_IO_READ, fd, buf, 15, 0);
+    requests[0].file_slot = ledger_io_engine_register_file(&engine, fd);
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_run(&engine, requests, 1));
+    EXPECT_STREQ("header:payload!", buf);
+    ledger_io_engine_unregister_file(&engine, requests[0].file_slot);
+}
+
+TEST_F(IoEngineTest, ShortReadsFail) {
+    char buf[16];
+    ledger_io_request request;
+
+    if(!available) {
+        return;
+    }
+
+    ASSERT_EQ(4, pwrite(fd, "abcd", 4, 0));
+    ledger_io_request_init(&request, LEDGER_IO_READ, fd, buf, sizeof(buf), 0);
+    EXPECT_EQ(LEDGER_ERR_IO, ledger_io_engine_run(&engine, &request, 1));
+}
+
+TEST_F(IoEngineTest, RegisteredBuffers) {
+    std::vector<char> pinned(4096, 'p');
+    struct iovec buffer;
+    ledger_io_request request;
+
+    if(!available) {
+        return;
+    }
+
+    buffer.iov_base = pinned.data();
+    buffer.iov_len = pinned.size();
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_register_buffers(&engine, &buffer, 1));
+
+    ledger_io_request_init(&request, LEDGER_IO_WRITE, fd, pinned.data(), 100, 0);
+    request.buf_index = 0;
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_run(&engine, &request, 1));
+
+    memset(pinned.data(), 0, 100);
+    ledger_io_request_init(&request, LEDGER_IO_READ, fd, pinned.data() + 1000, 100, 0);
+    request.buf_index = 0;
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_run(&engine, &request, 1));
+    EXPECT_EQ(std::string(100, 'p'), std::string(pinned.data() + 1000, 100));
+}
+
+struct writer_args {
+    ledger_io_engine *engine;
+    int fd;
+    int id;
+};
+
+static void *write_blocks(void *ptr) {
+    writer_args *args = (writer_args *)ptr;
+    char block[512];
+    ledger_io_request request;
+
+    memset(block, 'a' + args->id, sizeof(block));
+    for(int i = 0; i < 50; i++) {
+        ledger_io_request_init(&request, LEDGER_IO_WRITE, args->fd, block, sizeof(block),
+                               (args->id * 50 + i) * sizeof(block));
+        if(ledger_io_engine_run(args->engine, &request, 1) != LEDGER_OK) {
+            return (void *)1;
+        }
+    }
+    return NULL;
+}
+
+TEST_F(IoEngineTest, ConcurrentSubmitters) {
+    const int nthreads = 8;
+    pthread_t threads[nthreads];
+    writer_args args[nthreads];
+    char block[512];
+    void *result;
+
+    if(!available) {
+        return;
+    }
+
+    for(int i = 0; i < nthreads; i++) {
+        args[i].engine = &engine;
+        args[i].fd = fd;
+        args[i].id = i;
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, write_blocks, &args[i]));
+    }
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], &result);
+        EXPECT_TRUE(result == NULL);
+    }
+
+    for(int i = 0; i < nthreads * 50; i++) {
+        ASSERT_EQ((ssize_t)sizeof(block), pread(fd, block, sizeof(block), i * sizeof(block)));
+        EXPECT_EQ('a' + i / 50, block[0]);
+        EXPECT_EQ('a' + i / 50, block[sizeof(block) - 1]);
+    }
+}
+
+TEST_F(IoEngineTest, SubmissionsNotHeldUpBehindPendingReads) {
+    int pipe_fds[2];
+    char pending_buf[4];
+    ledger_io_request pending, write;
+    ledger_io_submission submission;
+
+    if(!available) {
+        return;
+    }
+
+    // Nothing completes the pipe read until it's written to
+    ASSERT_EQ(0, pipe(pipe_fds));
+    ledger_io_request_init(&pending, LEDGER_IO_READ, pipe_fds[0], pending_buf, 4, 0);
+    ledger_io_engine_submit(&engine, &submission, &pending, 1, NULL, NULL);
+
+    ledger_io_request_init(&write, LEDGER_IO_WRITE, fd, (void *)"next", 4, 0);
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_run(&engine, &write, 1));
+    EXPECT_FALSE(ledger_io_engine_done(&engine, &submission));
+
+    ASSERT_EQ(4, ::write(pipe_fds[1], "pipe", 4));
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_complete(&engine, &submission));
+    EXPECT_EQ(0, memcmp(pending_buf, "pipe", 4));
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+struct parked_read {
+    ledger_scheduler *scheduler;
+    ledger_io_engine *engine;
+    ledger_task task;
+    ledger_io_submission submission;
+    std::vector<ledger_io_request> requests;
+    std::vector<char> buf;
+    int fd;
+    bool submitted;
+    ledger_status status;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    bool done;
+};
+
+static void wake_parked_read(void *arg) {
+    parked_read *read = (parked_read *)arg;
+    ledger_scheduler_wake(read->scheduler, &read->task);
+}
+
+static ledger_task_status run_parked_read(ledger_task *task) {
+    parked_read *read = (parked_read *)task->data;
+
+    if(!read->submitted) {
+        for(size_t i = 0; i < read->requests.size(); i++) {
+            ledger_io_request_init(&read->requests[i], LEDGER_IO_READ, read->fd,
+                                   &read->buf[i * 16], 16, i * 16);
+        }
+        read->submitted = true;
+        ledger_io_engine_submit(read->engine, &read->submission, read->requests.data(),
+                                read->requests.size(), wake_parked_read, read);
+        return LEDGER_TASK_PARK;
+    }
+    if(!ledger_io_engine_done(read->engine, &read->submission)) {
+        return LEDGER_TASK_PARK;
+    }
+
+    read->status = ledger_io_engine_complete(read->engine, &read->submission);
+    ledger_scheduler_remove(read->scheduler, task);
+    pthread_mutex_lock(&read->lock);
+    read->done = true;
+    pthread_cond_signal(&read->done_cond);
+    pthread_mutex_unlock(&read->lock);
+    return LEDGER_TASK_DONE;
+}
+
+TEST_F(IoEngineTest, SubmittedReadsWakeParkedTask) {
+    ledger_scheduler scheduler;
+    parked_read read;
+    std::string expected;
+
+    if(!available) {
+        return;
+    }
+
+    // More requests than the ring holds go in pieces
+    for(int i = 0; i < 100; i++) {
+        expected += std::string(16, 'a' + i % 26);
+    }
+    ASSERT_EQ((ssize_t)expected.size(), pwrite(fd, expected.data(), expected.size(), 0));
+
+    ASSERT_EQ(LEDGER_OK, ledger_scheduler_start(&scheduler, 1));
+    read.scheduler = &scheduler;
+    read.engine = &engine;
+    read.requests.resize(100);
+    read.buf.resize(expected.size());
+    read.fd = fd;
+    read.submitted = false;
+    read.status = LEDGER_ERR_GENERAL;
+    read.done = false;
+    pthread_mutex_init(&read.lock, NULL);
+    pthread_cond_init(&read.done_cond, NULL);
+    ledger_task_init(&read.task, run_parked_read, NULL, &read);
+    ASSERT_EQ(LEDGER_OK, ledger_scheduler_add(&scheduler, &read.task));
+
+    pthread_mutex_lock(&read.lock);
+    while(!read.done) {
+        pthread_cond_wait(&read.done_cond, &read.lock);
+    }
+    pthread_mutex_unlock(&read.lock);
+
+    EXPECT_EQ(LEDGER_OK, read.status);
+    EXPECT_EQ(expected, std::string(read.buf.data(), read.buf.size()));
+
+    ledger_scheduler_stop(&scheduler);
+    pthread_cond_destroy(&read.done_cond);
+    pthread_mutex_destroy(&read.lock);
+}
+
+TEST(IoEngine, SyncFallback) {
+    char buf[8];
+    ledger_io_request request;
+    int fd = open(IO_FILE, O_RDWR|O_CREAT|O_TRUNC, 0600);
+
+    ASSERT_TRUE(fd > 0);
+    ASSERT_EQ(4, pwrite(fd, "sync", 4, 0));
+
+    // Without an engine, requests run as plain system calls
+    ledger_io_request_init(&request, LEDGER_IO_READ, fd, buf, 4, 0);
+    ASSERT_EQ(LEDGER_OK, ledger_io_engine_run(NULL, &request, 1));
+    EXPECT_EQ(0, memcmp(buf, "sync", 4));
+
+    close(fd);
+    unlink(IO_FILE);
+}
+
+}
@@ -2,9 +2,16 @@
 
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <ftw.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
 
 #include "ledger.h"
 
@@ -223,6 +230,258 @@ TEST(Ledger, LookupTopic) {
     ASSERT_EQ(0, cleanup(WORKING_DIR));
 }
 
+TEST(Ledger, ManyTopics) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_topic *topic;
+    ledger_write_status status;
+    const int ntopics = 300;
+    char name[32];
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+
+    for(i = 0; i < ntopics; i++) {
+        snprintf(name, sizeof(name), "topic_%d", i);
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, name, partition_ids, 1, &options));
+    }
+    // With no lookups in flight, tables grown out of don't pile up
+    EXPECT_TRUE(ctx.topics.retired == NULL || ctx.topics.retired->retired == NULL);
+
+    // Closing every other topic leaves holes lookups have to probe past
+    for(i = 0; i < ntopics; i += 2) {
+        snprintf(name, sizeof(name), "topic_%d", i);
+        ledger_close_topic(&ctx, name);
+    }
+    for(i = 0; i < ntopics; i++) {
+        snprintf(name, sizeof(name), "topic_%d", i);
+        topic = ledger_lookup_topic(&ctx, name);
+        if(i % 2 == 0) {
+            EXPECT_EQ(NULL, topic);
+        } else {
+            ASSERT_TRUE(topic != NULL);
+            EXPECT_STREQ(name, topic->name);
+        }
+    }
+
+    // Reopened topics pick up where they left off
+    for(i = 0; i < ntopics; i += 2) {
+        snprintf(name, sizeof(name), "topic_%d", i);
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, name, partition_ids, 1, &options));
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, name, 0, (void *)name, strlen(name), &status));
+        EXPECT_EQ(0, status.message_id);
+    }
+    for(i = 0; i < ntopics; i++) {
+        snprintf(name, sizeof(name), "topic_%d", i);
+        topic = ledger_lookup_topic(&ctx, name);
+        ASSERT_TRUE(topic != NULL);
+        EXPECT_STREQ(name, topic->name);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, Handles) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_topic_handle topic;
+    ledger_partition_handle partitions[2];
+    ledger_partition_handle bad;
+    ledger_message_set messages;
+    ledger_write_status status;
+    struct iovec vecs[2];
+    uint64_t latest_id;
+    const char message[] = "hello";
+    size_t total = 0;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0, 1};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 2, &options));
+
+    EXPECT_EQ(LEDGER_ERR_BAD_TOPIC, ledger_get_topic_handle(&ctx, "NOT_FOUND", &topic));
+    EXPECT_EQ(LEDGER_ERR_BAD_TOPIC, ledger_get_partition_handle(&ctx, "NOT_FOUND", 0, &bad));
+    EXPECT_EQ(LEDGER_ERR_BAD_PARTITION, ledger_get_partition_handle(&ctx, TOPIC, 2, &bad));
+
+    ASSERT_EQ(LEDGER_OK, ledger_get_topic_handle(&ctx, TOPIC, &topic));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_handle_partition(&topic, 0, &partitions[0]));
+    ASSERT_EQ(LEDGER_OK, ledger_get_partition_handle(&ctx, TOPIC, 1, &partitions[1]));
+    EXPECT_EQ(1, partitions[1].partition_num);
+
+    ASSERT_EQ(LEDGER_OK, ledger_partition_handle_write(&partitions[0], (void *)message,
+                                                       sizeof(message), &status));
+    EXPECT_EQ(0, status.message_id);
+    vecs[0].iov_base = (void *)message;
+    vecs[0].iov_len = sizeof(message);
+    vecs[1] = vecs[0];
+    ASSERT_EQ(LEDGER_OK, ledger_partition_handle_write_batch(&partitions[1], vecs, 2, NULL));
+
+    // Keyed writes land in the same partition as through the name
+    ASSERT_EQ(LEDGER_OK, ledger_topic_handle_write(&topic, "key", 3, (void *)message,
+                                                   sizeof(message), &status));
+    ASSERT_EQ(LEDGER_OK, ledger_write(&ctx, TOPIC, "key", 3, (void *)message,
+                                      sizeof(message), &status));
+
+    for(i = 0; i < 2; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_partition_handle_latest_message_id(&partitions[i], &latest_id));
+        ASSERT_EQ(LEDGER_OK, ledger_partition_handle_read(&partitions[i], LEDGER_BEGIN,
+                                                          LEDGER_CHUNK_SIZE, &messages));
+        EXPECT_EQ(latest_id, messages.nmessages);
+        EXPECT_STREQ(message, (const char *)messages.messages[0].data);
+        total += messages.nmessages;
+        ledger_message_set_free(&messages);
+    }
+    EXPECT_EQ(5, total);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static void *delayed_write(void *ctx_ptr) {
+    ledger_ctx *ctx = (ledger_ctx *)ctx_ptr;
+
+    usleep(50 * 1000);
+    ledger_write_partition(ctx, TOPIC, 0, (void *)"hello", 5, NULL);
+    return NULL;
+}
+
+TEST(Ledger, WaitForMessage) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    pthread_t writer;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    EXPECT_EQ(LEDGER_NEXT, ledger_wait_message(&ctx, TOPIC, 0, 0, 10));
+    EXPECT_EQ(LEDGER_ERR_BAD_PARTITION, ledger_wait_message(&ctx, TOPIC, 1, 0, 10));
+
+    ASSERT_EQ(0, pthread_create(&writer, NULL, delayed_write, &ctx));
+    EXPECT_EQ(LEDGER_OK, ledger_wait_message(&ctx, TOPIC, 0, 0, 5000));
+    pthread_join(writer, NULL);
+
+    // Messages already written don't wait, a later one still does
+    EXPECT_EQ(LEDGER_OK, ledger_wait_message(&ctx, TOPIC, 0, 0, -1));
+    EXPECT_EQ(LEDGER_NEXT, ledger_wait_message(&ctx, TOPIC, 0, 1, 10));
+    ledger_close_context(&ctx);
+
+    // Reopened partitions know what was written before
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    EXPECT_EQ(LEDGER_OK, ledger_wait_message(&ctx, TOPIC, 0, 0, -1));
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, WaitForMessageFromAnotherProcess) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    unsigned int partition_ids[] = {0};
+    ledger_message_set messages;
+    pid_t child;
+    int child_status;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+
+    // Forked before any ledger threads exist, the child writes once the
+    // parent is waiting
+    child = fork();
+    ASSERT_NE(-1, child);
+    if(child == 0) {
+        usleep(200 * 1000);
+        if(ledger_open_context(&ctx, WORKING_DIR) != LEDGER_OK ||
+           ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options) != LEDGER_OK ||
+           ledger_write_partition(&ctx, TOPIC, 0, (void *)"hello", 6, NULL) != LEDGER_OK) {
+            _exit(1);
+        }
+        ledger_close_context(&ctx);
+        _exit(0);
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    EXPECT_EQ(LEDGER_OK, ledger_wait_message(&ctx, TOPIC, 0, 0, 5000));
+
+    ASSERT_EQ(child, waitpid(child, &child_status, 0));
+    EXPECT_TRUE(WIFEXITED(child_status));
+    EXPECT_EQ(0, WEXITSTATUS(child_status));
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(1, messages.nmessages);
+    EXPECT_STREQ("hello", (const char *)messages.messages[0].data);
+    ledger_message_set_free(&messages);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, ReadRotatedJournalsFromAnotherProcess) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    unsigned int partition_ids[] = {0};
+    ledger_message_set messages;
+    const int messages_count = 30;
+    pid_t child;
+    int child_status;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 100;
+
+    // The child rotates through several journals the parent only learns
+    // about through the shared tail
+    child = fork();
+    ASSERT_NE(-1, child);
+    if(child == 0) {
+        usleep(200 * 1000);
+        if(ledger_open_context(&ctx, WORKING_DIR) != LEDGER_OK ||
+           ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options) != LEDGER_OK) {
+            _exit(1);
+        }
+        for(i = 0; i < messages_count; i++) {
+            if(ledger_write_partition(&ctx, TOPIC, 0, (void *)"hello", 6, NULL) != LEDGER_OK) {
+                _exit(1);
+            }
+        }
+        ledger_close_context(&ctx);
+        _exit(0);
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    EXPECT_EQ(LEDGER_OK, ledger_wait_message(&ctx, TOPIC, 0, messages_count - 1, 5000));
+
+    ASSERT_EQ(child, waitpid(child, &child_status, 0));
+    EXPECT_TRUE(WIFEXITED(child_status));
+    EXPECT_EQ(0, WEXITSTATUS(child_status));
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, messages_count * 2, &messages));
+    ASSERT_EQ(messages_count, messages.nmessages);
+    EXPECT_EQ(messages_count - 1, messages.messages[messages_count - 1].id);
+    EXPECT_EQ(messages_count, messages.next_id);
+    ledger_message_set_free(&messages);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
 TEST(Ledger, HeapAllocatedTopicNames) {
     ledger_ctx ctx;
     ledger_topic_options options;
@@ -377,6 +636,57 @@ TEST(Ledger, DoubleCorruptMessage) {
     ASSERT_EQ(0, cleanup(CORRUPT_WORKING_DIR));
 }
 
+TEST(Ledger, ChecksumChoiceKeptPerMessage) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const char *payloads[] = {"hello", "there", "friend"};
+    ledger_checksum checksums[] = {LEDGER_CHECKSUM_CRC32, LEDGER_CHECKSUM_CRC32C, LEDGER_CHECKSUM_NONE};
+    ledger_message_set messages;
+    int fd;
+    int i;
+
+    cleanup(CORRUPT_WORKING_DIR);
+    ASSERT_EQ(0, setup(CORRUPT_WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, CORRUPT_WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.drop_corrupt = true;
+    unsigned int partition_ids[] = {0};
+
+    // Every message is written under a different checksum setting
+    for(i = 0; i < 3; i++) {
+        options.checksum = checksums[i];
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+        EXPECT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)payloads[i],
+                                                    strlen(payloads[i]) + 1, NULL));
+        ledger_close_topic(&ctx, TOPIC);
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    EXPECT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(3, messages.nmessages);
+    for(i = 0; i < 3; i++) {
+        EXPECT_STREQ(payloads[i], (const char *)messages.messages[i].data);
+    }
+    ledger_message_set_free(&messages);
+
+    // Corrupt every message, only the unchecked one gets through
+    fd = open("/tmp/corrupt_ledger/my_data/0/00000000.jnl", O_RDWR, 0755);
+    ASSERT_TRUE(fd > 0);
+    ASSERT_EQ(1, pwrite(fd, "j", 1, 8));
+    ASSERT_EQ(1, pwrite(fd, "w", 1, 22));
+    ASSERT_EQ(1, pwrite(fd, "t", 1, 36));
+    close(fd);
+
+    EXPECT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(1, messages.nmessages);
+    EXPECT_EQ(2, messages.messages[0].id);
+    EXPECT_STREQ("triend", (const char *)messages.messages[0].data);
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(CORRUPT_WORKING_DIR));
+}
+
 TEST(Ledger, MultipleMessagesAtOffset) {
     ledger_ctx ctx;
     ledger_topic_options options;
@@ -528,7 +838,7 @@ TEST(Ledger, JournalRotation) {
     while((dit = readdir(dir)) != NULL) {
         journal_count++;
     }
-    EXPECT_EQ(8, journal_count);
+    EXPECT_EQ(10, journal_count);
 
     ledger_message_set_free(&messages);
     ASSERT_EQ(0, closedir(dir));
@@ -536,6 +846,144 @@ TEST(Ledger, JournalRotation) {
     ASSERT_EQ(0, cleanup(WORKING_DIR));
 }
 
+TEST(Ledger, ReadAcrossJournalsStopsAtCount) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const char message1[] = "hello";
+    size_t mlen = sizeof(message1);
+    ledger_message_set messages;
+    size_t nmessages[] = {16, 17, 24, 40};
+    uint64_t start_ids[] = {0, 1, 5, 13};
+    int i, j, k;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 100;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // A handful of messages per journal
+    for(i = 0; i < 60; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)message1, mlen, NULL));
+    }
+
+    // Reads starting mid journal, and spanning at least three of them
+    for(i = 0; i < 4; i++) {
+        for(j = 0; j < 4; j++) {
+            ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, start_ids[j], nmessages[i], &messages));
+            ASSERT_EQ(nmessages[i], messages.nmessages);
+            for(k = 0; k < messages.nmessages; k++) {
+                EXPECT_EQ(start_ids[j] + k, messages.messages[k].id);
+            }
+            EXPECT_EQ(start_ids[j] + nmessages[i], messages.next_id);
+            ledger_message_set_free(&messages);
+        }
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static void *close_topic(void *arg) {
+    ledger_ctx *ctx = (ledger_ctx *)arg;
+
+    ledger_close_topic(ctx, TOPIC);
+    return NULL;
+}
+
+TEST(Ledger, TopicsOpenAndCloseDuringMaintenance) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_topic *topic;
+    pthread_t closer;
+    unsigned int partition_ids[] = {0};
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+
+    // Standing in for a pass in progress
+    pthread_mutex_lock(&ctx.maintenance_lock);
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, "other", partition_ids, 1, &options));
+    ledger_close_topic(&ctx, "other");
+    EXPECT_TRUE(ledger_lookup_topic(&ctx, "other") == NULL);
+    pthread_mutex_unlock(&ctx.maintenance_lock);
+
+    // Closing a topic a pass is still working on waits for the pass
+    topic = ledger_lookup_topic(&ctx, TOPIC);
+    ASSERT_TRUE(topic != NULL);
+    pthread_mutex_lock(&ctx.topics_lock);
+    topic->refs++;
+    pthread_mutex_unlock(&ctx.topics_lock);
+
+    ASSERT_EQ(0, pthread_create(&closer, NULL, close_topic, &ctx));
+    while(ledger_lookup_topic(&ctx, TOPIC) != NULL) {
+        usleep(1000);
+    }
+    usleep(50000);
+    pthread_mutex_lock(&ctx.topics_lock);
+    EXPECT_EQ(1, topic->refs);
+    EXPECT_TRUE(topic->opened);
+    topic->refs--;
+    pthread_cond_broadcast(&ctx.topics_cond);
+    pthread_mutex_unlock(&ctx.topics_lock);
+    pthread_join(closer, NULL);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static void *wait_topic_messages(void *arg) {
+    ledger_ctx *ctx = (ledger_ctx *)arg;
+
+    ledger_wait_messages(ctx, TOPIC, 0);
+    return NULL;
+}
+
+TEST(Ledger, ClosingTopicWaitsForCallsUsingIt) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_topic *topic;
+    pthread_t closer, waiter;
+    size_t section;
+    unsigned int partition_ids[] = {0};
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // Standing in for a call that looked the topic up by name
+    section = ledger_topic_table_enter(&ctx.topics);
+    topic = ledger_lookup_topic(&ctx, TOPIC);
+    ASSERT_TRUE(topic != NULL);
+
+    ASSERT_EQ(0, pthread_create(&closer, NULL, close_topic, &ctx));
+    usleep(50000);
+    EXPECT_TRUE(topic->opened);
+    ledger_topic_table_exit(&ctx.topics, section);
+    pthread_join(closer, NULL);
+
+    // Waiting on a topic doesn't keep it from closing
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    topic = ledger_lookup_topic(&ctx, TOPIC);
+    ASSERT_EQ(0, pthread_create(&waiter, NULL, wait_topic_messages, &ctx));
+    while(__atomic_load_n(&topic->refs, __ATOMIC_SEQ_CST) == 0) {
+        usleep(1000);
+    }
+    ledger_close_topic(&ctx, TOPIC);
+    pthread_join(waiter, NULL);
+    EXPECT_TRUE(ledger_lookup_topic(&ctx, TOPIC) == NULL);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
 TEST(Ledger, JournalPurges) {
     ledger_ctx ctx;
     ledger_topic_options options;
@@ -569,8 +1017,12 @@ TEST(Ledger, JournalPurges) {
         ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)message1, mlen, NULL));
     }
 
+    // Don't wait on the maintenance thread to get around to it
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+
     ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, messages_count*2, &messages));
-    EXPECT_EQ(52, messages.nmessages);
+    EXPECT_EQ(44, messages.nmessages);
+    EXPECT_EQ(56, messages.messages[0].id);
 
     dir = opendir("/tmp/ledger/my_data/0");
     ASSERT_TRUE(dir != NULL);
@@ -579,7 +1031,7 @@ TEST(Ledger, JournalPurges) {
     while((dit = readdir(dir)) != NULL) {
         journal_count++;
     }
-    EXPECT_EQ(17, journal_count);
+    EXPECT_EQ(22, journal_count);
 
     ledger_message_set_free(&messages);
     ASSERT_EQ(0, closedir(dir));
@@ -587,4 +1039,1319 @@ TEST(Ledger, JournalPurges) {
     ASSERT_EQ(0, cleanup(WORKING_DIR));
 }
 
+
+TEST(Ledger, IntervalDurabilitySyncsQuietPartitions) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_partition_handle partition;
+    int waited;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.durability = LEDGER_DURABILITY_INTERVAL;
+    options.durability_interval_ms = 500;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    ASSERT_EQ(LEDGER_OK, ledger_get_partition_handle(&ctx, TOPIC, 0, &partition));
+
+    // Written within the interval of opening, so it's left unsynced
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)"hello", 5, NULL));
+    EXPECT_LT(0, __atomic_load_n(&partition.partition->commit.unsynced_bytes, __ATOMIC_SEQ_CST));
+
+    // No more writes come, the maintenance thread syncs it
+    for(waited = 0; waited < 3000; waited += 10) {
+        if(__atomic_load_n(&partition.partition->commit.unsynced_bytes, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    EXPECT_EQ(0, __atomic_load_n(&partition.partition->commit.unsynced_bytes, __ATOMIC_SEQ_CST));
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, WriteBatch) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const char *payloads[] = {"hello", "there", "my", "friend"};
+    struct iovec batch[4];
+    ledger_message_set messages;
+    ledger_write_batch_status status;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0, 1};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 2, &options));
+
+    for(i = 0; i < 4; i++) {
+        batch[i].iov_base = (void *)payloads[i];
+        batch[i].iov_len = strlen(payloads[i]) + 1;
+    }
+
+    EXPECT_EQ(LEDGER_ERR_ARGS, ledger_write_partition_batch(&ctx, TOPIC, 1, batch, 0, &status));
+    EXPECT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 1, (void *)"first", 6, NULL));
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 1, batch, 4, &status));
+    EXPECT_EQ(1, status.first_message_id);
+    EXPECT_EQ(4, status.last_message_id);
+    EXPECT_EQ(1, status.partition_num);
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 1, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(5, messages.nmessages);
+    EXPECT_STREQ("first", (const char *)messages.messages[0].data);
+    for(i = 0; i < 4; i++) {
+        EXPECT_EQ(i + 1, messages.messages[i+1].id);
+        EXPECT_EQ(strlen(payloads[i]) + 1, messages.messages[i+1].len);
+        EXPECT_STREQ(payloads[i], (const char *)messages.messages[i+1].data);
+    }
+    EXPECT_EQ(5, messages.next_id);
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, LargeWriteBatchWithRotation) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int batch_size = 3000;
+    std::vector<struct iovec> batch(batch_size);
+    std::vector<uint32_t> payloads(batch_size);
+    ledger_message_set messages;
+    ledger_write_batch_status status;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 1000;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < batch_size; i++) {
+        payloads[i] = i;
+        batch[i].iov_base = &payloads[i];
+        batch[i].iov_len = sizeof(uint32_t);
+    }
+
+    // The first batch overflows the journal, the second one lands in a new journal
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 0, batch.data(), batch_size, &status));
+    EXPECT_EQ(0, status.first_message_id);
+    EXPECT_EQ(batch_size - 1, status.last_message_id);
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 0, batch.data(), batch_size, &status));
+    EXPECT_EQ(batch_size, status.first_message_id);
+    EXPECT_EQ(batch_size * 2 - 1, status.last_message_id);
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, batch_size * 2, &messages));
+    ASSERT_EQ(batch_size * 2, messages.nmessages);
+    for(i = 0; i < batch_size * 2; i++) {
+        EXPECT_EQ(i, messages.messages[i].id);
+        EXPECT_EQ(i % batch_size, *(uint32_t *)messages.messages[i].data);
+    }
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, JournalCacheBudget) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const char message[] = "hello";
+    size_t mlen = sizeof(message);
+    ledger_message_set messages;
+    unsigned int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0, 1, 2, 3};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 4, &options));
+
+    // Only enough room for a single journal and its index
+    ledger_journal_cache_set_max_files(2);
+    for(i = 0; i < 4; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, i, (void *)message, mlen, NULL));
+        EXPECT_EQ(2, ledger_journal_cache_open_files());
+    }
+
+    for(i = 0; i < 4; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, i, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+        EXPECT_EQ(1, messages.nmessages);
+        EXPECT_STREQ(message, (const char *)messages.messages[0].data);
+        EXPECT_EQ(2, ledger_journal_cache_open_files());
+        ledger_message_set_free(&messages);
+    }
+
+    ledger_close_context(&ctx);
+    EXPECT_EQ(0, ledger_journal_cache_open_files());
+    ledger_journal_cache_set_max_files(LEDGER_JOURNAL_CACHE_MAX_FILES);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, MmapReads) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 100;
+    uint32_t payload;
+    ledger_message_set first, second;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.read_mode = LEDGER_READ_MMAP;
+    options.journal_max_size_bytes = 500;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < nmessages; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, nmessages * 2, &first));
+    ASSERT_EQ(nmessages, first.nmessages);
+    EXPECT_GT(first.nbackings, 1);
+
+    // Growing the active journal remaps it, without moving earlier reads
+    for(i = nmessages; i < nmessages * 2; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, nmessages * 2, &second));
+    ASSERT_EQ(nmessages * 2, second.nmessages);
+
+    // Borrowed messages outlive the journals they were read from
+    ledger_close_context(&ctx);
+
+    for(i = 0; i < nmessages; i++) {
+        EXPECT_TRUE(first.messages[i].borrowed);
+        EXPECT_EQ(sizeof(uint32_t), first.messages[i].len);
+        EXPECT_EQ(i, *(uint32_t *)first.messages[i].data);
+    }
+    for(i = 0; i < nmessages * 2; i++) {
+        EXPECT_EQ(i, second.messages[i].id);
+        EXPECT_EQ(i, *(uint32_t *)second.messages[i].data);
+    }
+
+    ledger_message_set_free(&first);
+    ledger_message_set_free(&second);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, CoalescedReadsSplitLargeRuns) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 8;
+    const size_t large_len = 400000;
+    std::vector<std::vector<char> > payloads(nmessages);
+    ledger_message_set messages;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    EXPECT_EQ(LEDGER_READ_COALESCED, options.read_mode);
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // Alternate large and small messages so runs have to be split
+    for(i = 0; i < nmessages; i++) {
+        payloads[i].assign(i % 2 == 0 ? large_len : 16, 'a' + i);
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, payloads[i].data(),
+                                                    payloads[i].size(), NULL));
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(nmessages, messages.nmessages);
+    EXPECT_EQ(nmessages, messages.next_id);
+    EXPECT_GT(messages.nbackings, 1);
+    EXPECT_LT(messages.nbackings, nmessages);
+    for(i = 0; i < nmessages; i++) {
+        EXPECT_EQ(i, messages.messages[i].id);
+        ASSERT_EQ(payloads[i].size(), messages.messages[i].len);
+        EXPECT_EQ(0, memcmp(payloads[i].data(), messages.messages[i].data, messages.messages[i].len));
+    }
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, TailRecoveredOnOpen) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const char message[] = "hello";
+    size_t mlen = sizeof(message);
+    ledger_message_set messages;
+    ledger_write_status status;
+    uint64_t latest_id;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    for(i = 0; i < 3; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)message, mlen, NULL));
+    }
+    ledger_close_context(&ctx);
+
+    // Strip the tail off the lock file, as if it predates the tail
+    ASSERT_EQ(0, truncate("/tmp/ledger/my_data/0/locks", offsetof(ledger_partition_locks, tail)));
+
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    ASSERT_EQ(LEDGER_OK, ledger_latest_message_id(&ctx, TOPIC, 0, &latest_id));
+    EXPECT_EQ(3, latest_id);
+
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)message, mlen, &status));
+    EXPECT_EQ(3, status.message_id);
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(4, messages.nmessages);
+    for(i = 0; i < 4; i++) {
+        EXPECT_EQ(i, messages.messages[i].id);
+        EXPECT_STREQ(message, (const char *)messages.messages[i].data);
+    }
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, HalfStoredTailRecoveredOnOpen) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const char message[] = "hello";
+    size_t mlen = sizeof(message);
+    ledger_message_set messages;
+    ledger_write_status status;
+    off_t seq_offset = offsetof(ledger_partition_locks, tail) + offsetof(ledger_journal_tail, seq);
+    uint32_t seq;
+    int fd, i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    for(i = 0; i < 3; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)message, mlen, NULL));
+    }
+    ledger_close_context(&ctx);
+
+    // Leave seq odd, as a writer killed while storing the tail does
+    fd = open("/tmp/ledger/my_data/0/locks", O_RDWR);
+    ASSERT_LT(0, fd);
+    ASSERT_EQ(sizeof(seq), pread(fd, &seq, sizeof(seq), seq_offset));
+    seq |= 1;
+    ASSERT_EQ(sizeof(seq), pwrite(fd, &seq, sizeof(seq), seq_offset));
+    close(fd);
+
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    for(i = 0; i < 2; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, (void *)message, mlen, &status));
+        EXPECT_EQ(3 + i, status.message_id);
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    EXPECT_EQ(5, messages.nmessages);
+    EXPECT_EQ(5, messages.next_id);
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+
+    if(stat(path, &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+static void partition_file(char *path, size_t len, int partition, const char *ext) {
+    snprintf(path, len, "%s/%d/00000000.%s", FULL_TOPIC, partition, ext);
+}
+
+TEST(Ledger, TornWritesRecoveredOnOpen) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nplain = 3;
+    const int batch_size = 4;
+    const char *plain[] = {"first", "second", "third"};
+    const char *batch[] = {"alpha", "beta", "gamma", "delta"};
+    const char garbage[] = "torn write";
+    // The batch goes back in with its index append cut short, after a
+    // torn record, cut off, or written again without being indexed
+    const uint64_t expected[] = {7, 7, 3, 11};
+    unsigned int partition_ids[] = {0, 1, 2, 3};
+    struct iovec vecs[batch_size];
+    char jnl_path[64], idx_path[64];
+    char record[256];
+    uint64_t batch_offset, latest_id;
+    off_t jnl_size;
+    ledger_message_set messages;
+    ledger_write_status status;
+    int fd, i, p;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.compression = LEDGER_CODEC_LZ;
+    options.drop_corrupt = true;
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 4, &options));
+
+    for(i = 0; i < batch_size; i++) {
+        vecs[i].iov_base = (void *)batch[i];
+        vecs[i].iov_len = strlen(batch[i]) + 1;
+    }
+    for(p = 0; p < 4; p++) {
+        for(i = 0; i < nplain; i++) {
+            ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, p, (void *)plain[i],
+                                                        strlen(plain[i]) + 1, NULL));
+        }
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, p, vecs, batch_size, NULL));
+    }
+    ledger_close_context(&ctx);
+
+    partition_file(idx_path, sizeof(idx_path), 0, "idx");
+    ASSERT_EQ(0, truncate(idx_path, file_size(idx_path) - 2 * sizeof(uint64_t) + 3));
+
+    partition_file(jnl_path, sizeof(jnl_path), 1, "jnl");
+    fd = open(jnl_path, O_WRONLY|O_APPEND);
+    ASSERT_TRUE(fd > 0);
+    ASSERT_EQ(sizeof(garbage), write(fd, garbage, sizeof(garbage)));
+    close(fd);
+
+    partition_file(jnl_path, sizeof(jnl_path), 2, "jnl");
+    ASSERT_EQ(0, truncate(jnl_path, file_size(jnl_path) - 5));
+
+    partition_file(jnl_path, sizeof(jnl_path), 3, "jnl");
+    partition_file(idx_path, sizeof(idx_path), 3, "idx");
+    fd = open(idx_path, O_RDONLY);
+    ASSERT_TRUE(fd > 0);
+    ASSERT_EQ(sizeof(batch_offset), pread(fd, &batch_offset, sizeof(batch_offset),
+                                          file_size(idx_path) - sizeof(batch_offset)));
+    close(fd);
+    jnl_size = file_size(jnl_path);
+    ASSERT_LT(jnl_size - batch_offset, sizeof(record));
+    fd = open(jnl_path, O_RDWR);
+    ASSERT_TRUE(fd > 0);
+    ASSERT_EQ(jnl_size - batch_offset, pread(fd, record, jnl_size - batch_offset, batch_offset));
+    ASSERT_EQ(jnl_size - batch_offset, pwrite(fd, record, jnl_size - batch_offset, jnl_size));
+    close(fd);
+
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 4, &options));
+    for(p = 0; p < 4; p++) {
+        ASSERT_EQ(LEDGER_OK, ledger_latest_message_id(&ctx, TOPIC, p, &latest_id));
+        EXPECT_EQ(expected[p], latest_id);
+
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, p, (void *)plain[0],
+                                                    strlen(plain[0]) + 1, &status));
+        EXPECT_EQ(expected[p], status.message_id);
+
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, p, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+        ASSERT_EQ(expected[p] + 1, messages.nmessages);
+        for(i = 0; i < (int)messages.nmessages; i++) {
+            EXPECT_EQ(i, messages.messages[i].id);
+            if(i < nplain) {
+                EXPECT_STREQ(plain[i], (const char *)messages.messages[i].data);
+            } else if(i < (int)expected[p]) {
+                EXPECT_STREQ(batch[(i - nplain) % batch_size], (const char *)messages.messages[i].data);
+            } else {
+                EXPECT_STREQ(plain[0], (const char *)messages.messages[i].data);
+            }
+        }
+        ledger_message_set_free(&messages);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, JournalPreallocation) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 50;
+    uint32_t payload;
+    ledger_message_set messages;
+    struct stat st;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 1000;
+    options.journal_preallocate = true;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // Past half of the first journal, maintenance allocates the next one
+    for(i = 0; i < nmessages; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+    ASSERT_EQ(0, stat("/tmp/ledger/my_data/0/00000001.jnl", &st));
+    EXPECT_EQ(0, st.st_size);
+
+    // Rotating into the preallocated journal
+    for(i = nmessages; i < nmessages * 2; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+    ASSERT_EQ(0, stat("/tmp/ledger/my_data/0/00000001.jnl", &st));
+    EXPECT_GT(st.st_size, 0);
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, nmessages * 2, &messages));
+    ASSERT_EQ(nmessages * 2, messages.nmessages);
+    for(i = 0; i < nmessages * 2; i++) {
+        EXPECT_EQ(i, messages.messages[i].id);
+        EXPECT_EQ(i, *(uint32_t *)messages.messages[i].data);
+    }
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, PurgedJournalsRecycled) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 50;
+    uint32_t payload, first_id;
+    ledger_message_set messages;
+    struct stat st;
+    char path[PATH_MAX], ext[4];
+    uint8_t head[64], zeros[64] = {0};
+    DIR *dir;
+    struct dirent *dit;
+    uint32_t journal_id, latest_id = 0;
+    int fd, i, recycled = 0;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 100;
+    options.journal_purge_age_seconds = 1;
+    options.journal_preallocate = true;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // Nothing's written after the purge, so rotation can't take the spares
+    // before they're checked, whichever pass recycles them
+    for(i = 0; i < nmessages * 2; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+    sleep(2);
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, nmessages * 2, &messages));
+    ASSERT_GT(messages.nmessages, 0);
+    first_id = messages.messages[0].id;
+    ledger_message_set_free(&messages);
+
+    dir = opendir("/tmp/ledger/my_data/0");
+    ASSERT_TRUE(dir != NULL);
+    while((dit = readdir(dir)) != NULL) {
+        if(sscanf(dit->d_name, "%08u.%3s", &journal_id, ext) == 2 && strcmp(ext, "idx") == 0 &&
+           journal_id > latest_id) {
+            latest_id = journal_id;
+        }
+    }
+    ASSERT_EQ(0, closedir(dir));
+
+    // The spare journals keep their blocks, but none of the purged records
+    for(journal_id = latest_id + 1; journal_id <= latest_id + 2; journal_id++) {
+        snprintf(path, sizeof(path), "/tmp/ledger/my_data/0/%08u.jnl", journal_id);
+        if(stat(path, &st) != 0) {
+            continue;
+        }
+        recycled++;
+        EXPECT_GT(st.st_size, 0);
+        EXPECT_GT(st.st_blocks, 0);
+
+        fd = open(path, O_RDONLY);
+        ASSERT_LT(0, fd);
+        ASSERT_LT(0, pread(fd, head, sizeof(head), 0));
+        EXPECT_EQ(0, memcmp(zeros, head, st.st_size < (off_t)sizeof(head) ? st.st_size : sizeof(head)));
+        close(fd);
+    }
+    EXPECT_GT(recycled, 0);
+
+    // Rotating into the spares, then recovering them on open
+    for(i = nmessages * 2; i < nmessages * 3; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+    ledger_close_context(&ctx);
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, first_id, nmessages * 3, &messages));
+    ASSERT_EQ(nmessages * 3 - first_id, messages.nmessages);
+    for(i = 0; i < (int)messages.nmessages; i++) {
+        EXPECT_EQ(first_id + i, messages.messages[i].id);
+        EXPECT_EQ(first_id + i, *(uint32_t *)messages.messages[i].data);
+    }
+    EXPECT_EQ(nmessages * 3, messages.next_id);
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, ReadAcrossManyJournals) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 200;
+    const int chunk = 7;
+    uint32_t payload;
+    uint64_t next_id;
+    ledger_message_set messages;
+    ledger_read_cursor cursor;
+    int i, j;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 100;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < nmessages; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+    }
+
+    // Random access, each read searches for its journal
+    for(i = nmessages - 1; i >= 0; i -= 3) {
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, i, 1, &messages));
+        ASSERT_EQ(1, messages.nmessages);
+        EXPECT_EQ(i, messages.messages[0].id);
+        EXPECT_EQ(i, *(uint32_t *)messages.messages[0].data);
+        ledger_message_set_free(&messages);
+    }
+
+    // Sequential reads follow the cursor from one journal to the next
+    ledger_read_cursor_init(&cursor);
+    next_id = LEDGER_BEGIN;
+    for(i = 0; i < nmessages; i += chunk) {
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition_cursor(&ctx, TOPIC, 0, &cursor, next_id,
+                                                          chunk, &messages));
+        ASSERT_EQ(std::min(chunk, nmessages - i), (int)messages.nmessages);
+        for(j = 0; j < messages.nmessages; j++) {
+            EXPECT_EQ(i + j, messages.messages[j].id);
+            EXPECT_EQ(i + j, *(uint32_t *)messages.messages[j].data);
+        }
+        next_id = messages.next_id;
+        ledger_message_set_free(&messages);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, CompressedBatches) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nbatches = 6;
+    const int batch_size = 50;
+    const int nplain = 10;
+    const int nmessages = nbatches * batch_size + nplain;
+    const int chunk = 17;
+    ledger_read_mode read_modes[] = {LEDGER_READ_COPY, LEDGER_READ_MMAP, LEDGER_READ_COALESCED};
+    char payloads[nmessages][64];
+    struct iovec vecs[batch_size];
+    uint64_t next_id;
+    ledger_message_set messages;
+    int i, j, mode;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 500;
+    options.compression = LEDGER_CODEC_LZ;
+    options.drop_corrupt = true;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < nmessages; i++) {
+        snprintf(payloads[i], sizeof(payloads[i]), "message number %04d of the test run", i);
+    }
+    for(i = 0; i < nbatches; i++) {
+        for(j = 0; j < batch_size; j++) {
+            vecs[j].iov_base = payloads[i * batch_size + j];
+            vecs[j].iov_len = strlen(payloads[i * batch_size + j]) + 1;
+        }
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 0, vecs, batch_size, NULL));
+    }
+    ledger_close_topic(&ctx, TOPIC);
+
+    // Plain messages follow the batches in the same partition
+    options.compression = LEDGER_CODEC_NONE;
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    for(i = nbatches * batch_size; i < nmessages; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, payloads[i],
+                                                    strlen(payloads[i]) + 1, NULL));
+    }
+    ledger_close_topic(&ctx, TOPIC);
+
+    for(mode = 0; mode < 3; mode++) {
+        options.read_mode = read_modes[mode];
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+        // Chunks start and end in the middle of batches
+        next_id = LEDGER_BEGIN;
+        for(i = 0; i < nmessages; i += messages.nmessages) {
+            ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, next_id, chunk, &messages));
+            ASSERT_LT(0, messages.nmessages);
+            for(j = 0; j < messages.nmessages; j++) {
+                EXPECT_EQ(i + j, messages.messages[j].id);
+                EXPECT_STREQ(payloads[i + j], (const char *)messages.messages[j].data);
+            }
+            next_id = messages.next_id;
+            ledger_message_set_free(&messages);
+        }
+        EXPECT_EQ(nmessages, i);
+
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, 123, 1, &messages));
+        ASSERT_EQ(1, messages.nmessages);
+        EXPECT_EQ(123, messages.messages[0].id);
+        EXPECT_STREQ(payloads[123], (const char *)messages.messages[0].data);
+        ledger_message_set_free(&messages);
+
+        ledger_close_topic(&ctx, TOPIC);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, CorruptBatchDropsItsMessages) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int batch_size = 20;
+    char payloads[batch_size * 2][32];
+    struct iovec vecs[batch_size];
+    ledger_message_set messages;
+    int fd;
+    int i, j;
+
+    cleanup(CORRUPT_WORKING_DIR);
+    ASSERT_EQ(0, setup(CORRUPT_WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, CORRUPT_WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.compression = LEDGER_CODEC_LZ;
+    options.drop_corrupt = true;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < 2; i++) {
+        for(j = 0; j < batch_size; j++) {
+            snprintf(payloads[i * batch_size + j], sizeof(payloads[0]), "batch %d message %d", i, j);
+            vecs[j].iov_base = payloads[i * batch_size + j];
+            vecs[j].iov_len = strlen(payloads[i * batch_size + j]) + 1;
+        }
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 0, vecs, batch_size, NULL));
+    }
+
+    // Damage the first batch, past its record and batch headers
+    fd = open("/tmp/corrupt_ledger/my_data/0/00000000.jnl", O_RDWR, 0755);
+    ASSERT_TRUE(fd > 0);
+    ASSERT_EQ(1, pwrite(fd, "\xff", 1, 30));
+    close(fd);
+
+    EXPECT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, LEDGER_CHUNK_SIZE, &messages));
+    ASSERT_EQ(batch_size, messages.nmessages);
+    for(j = 0; j < batch_size; j++) {
+        EXPECT_EQ(batch_size + j, messages.messages[j].id);
+        EXPECT_STREQ(payloads[batch_size + j], (const char *)messages.messages[j].data);
+    }
+    ledger_message_set_free(&messages);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(CORRUPT_WORKING_DIR));
+}
+
+TEST(Ledger, ArenaReads) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 100;
+    const int chunk = 10;
+    ledger_read_mode read_modes[] = {LEDGER_READ_COPY, LEDGER_READ_MMAP, LEDGER_READ_COALESCED};
+    ledger_message_arena arena;
+    ledger_read_cursor cursor;
+    ledger_message_set messages, other;
+    uint64_t payload;
+    char *slab;
+    int i, j, mode, pass;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    for(i = 0; i < nmessages; i++) {
+        payload = i;
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint64_t), NULL));
+    }
+    ledger_close_topic(&ctx, TOPIC);
+
+    ledger_message_arena_init(&arena);
+    for(mode = 0; mode < 3; mode++) {
+        options.read_mode = read_modes[mode];
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+        // The first pass sizes the arena, the second runs out of it
+        for(pass = 0; pass < 2; pass++) {
+            ledger_read_cursor_init(&cursor);
+            cursor.arena = &arena;
+            for(i = 0; i < nmessages; i += chunk) {
+                ASSERT_EQ(LEDGER_OK, ledger_read_partition_cursor(&ctx, TOPIC, 0, &cursor, i,
+                                                                  chunk, &messages));
+                ASSERT_EQ(chunk, messages.nmessages);
+                EXPECT_TRUE(messages.arena == &arena);
+                EXPECT_TRUE(messages.messages == arena.messages);
+                for(j = 0; j < chunk; j++) {
+                    EXPECT_EQ(i + j, messages.messages[j].id);
+                    EXPECT_EQ(i + j, *(uint64_t *)messages.messages[j].data);
+                    if(pass == 1 && options.read_mode != LEDGER_READ_MMAP) {
+                        slab = (char *)messages.messages[j].data;
+                        EXPECT_TRUE(slab >= arena.slab && slab < arena.slab + arena.slab_len);
+                    }
+                }
+
+                // A set read while the arena is taken comes from the heap
+                ASSERT_EQ(LEDGER_OK, ledger_read_partition_cursor(&ctx, TOPIC, 0, &cursor, i,
+                                                                  1, &other));
+                ASSERT_EQ(1, other.nmessages);
+                EXPECT_TRUE(other.arena == NULL);
+                EXPECT_EQ(i, *(uint64_t *)other.messages[0].data);
+                ledger_message_set_free(&other);
+
+                ledger_message_set_free(&messages);
+                EXPECT_FALSE(arena.in_use);
+            }
+        }
+        ledger_close_topic(&ctx, TOPIC);
+    }
+
+    // Decompressed batches come out of the arena too
+    options.read_mode = LEDGER_READ_COPY;
+    options.compression = LEDGER_CODEC_LZ;
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, "batched", partition_ids, 1, &options));
+    for(i = 0; i < nmessages; i += chunk) {
+        uint64_t payloads[chunk];
+        struct iovec vecs[chunk];
+        for(j = 0; j < chunk; j++) {
+            payloads[j] = i + j;
+            vecs[j].iov_base = &payloads[j];
+            vecs[j].iov_len = sizeof(uint64_t);
+        }
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, "batched", 0, vecs, chunk, NULL));
+    }
+    for(pass = 0; pass < 2; pass++) {
+        ledger_read_cursor_init(&cursor);
+        cursor.arena = &arena;
+        for(i = 0; i < nmessages; i += chunk) {
+            ASSERT_EQ(LEDGER_OK, ledger_read_partition_cursor(&ctx, "batched", 0, &cursor, i,
+                                                              chunk, &messages));
+            ASSERT_EQ(chunk, messages.nmessages);
+            for(j = 0; j < chunk; j++) {
+                EXPECT_EQ(i + j, *(uint64_t *)messages.messages[j].data);
+                if(pass == 1) {
+                    slab = (char *)messages.messages[j].data;
+                    EXPECT_TRUE(slab >= arena.slab && slab < arena.slab + arena.slab_len);
+                }
+            }
+            ledger_message_set_free(&messages);
+        }
+    }
+    ledger_close_topic(&ctx, "batched");
+    ledger_message_arena_free(&arena);
+
+    EXPECT_TRUE(ledger_message_arena_local() != NULL);
+    EXPECT_EQ(ledger_message_arena_local(), ledger_message_arena_local());
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, IoUringBackend) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nmessages = 1200;
+    ledger_read_mode read_modes[] = {LEDGER_READ_COPY, LEDGER_READ_MMAP, LEDGER_READ_COALESCED};
+    std::vector<struct iovec> vecs(nmessages);
+    std::vector<uint64_t> payloads(nmessages);
+    ledger_message_set messages;
+    uint64_t next_id;
+    int i, j, mode;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.io_backend = LEDGER_IO_URING;
+    options.journal_max_size_bytes = 2000;
+    unsigned int partition_ids[] = {0, 1};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 2, &options));
+
+    for(i = 0; i < nmessages; i++) {
+        payloads[i] = i;
+        vecs[i].iov_base = &payloads[i];
+        vecs[i].iov_len = sizeof(uint64_t);
+    }
+    // Single writes and batches large enough to need several writev chunks
+    for(i = 0; i < 20; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payloads[i], sizeof(uint64_t), NULL));
+    }
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 0, &vecs[20], nmessages - 20, NULL));
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 1, &vecs[0], nmessages, NULL));
+    ledger_close_topic(&ctx, TOPIC);
+
+    for(mode = 0; mode < 3; mode++) {
+        options.read_mode = read_modes[mode];
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 2, &options));
+        for(j = 0; j < 2; j++) {
+            next_id = LEDGER_BEGIN;
+            for(i = 0; i < nmessages; i += messages.nmessages) {
+                ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, j, next_id, 64, &messages));
+                ASSERT_LT(0, messages.nmessages);
+                for(size_t k = 0; k < messages.nmessages; k++) {
+                    EXPECT_EQ(i + k, messages.messages[k].id);
+                    EXPECT_EQ(i + k, *(uint64_t *)messages.messages[k].data);
+                }
+                next_id = messages.next_id;
+                ledger_message_set_free(&messages);
+            }
+            EXPECT_EQ(nmessages, i);
+        }
+        ledger_close_topic(&ctx, TOPIC);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+
+TEST(Ledger, IoUringCompressedAndKeyedWrites) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nbatched = 300;
+    const int nkeyed = 50;
+    std::vector<struct iovec> vecs(nbatched);
+    std::vector<uint64_t> payloads(nbatched + nkeyed);
+    ledger_message_set messages;
+    uint64_t next_id;
+    char key[16];
+    int i, key_len;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.io_backend = LEDGER_IO_URING;
+    options.compression = LEDGER_CODEC_LZ;
+    options.journal_max_size_bytes = 2000;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < nbatched + nkeyed; i++) {
+        payloads[i] = i;
+    }
+    for(i = 0; i < nbatched; i++) {
+        vecs[i].iov_base = &payloads[i];
+        vecs[i].iov_len = sizeof(uint64_t);
+    }
+    // Compressed batch records, and keyed ones, go through the engine too
+    ASSERT_EQ(LEDGER_OK, ledger_write_partition_batch(&ctx, TOPIC, 0, vecs.data(), nbatched, NULL));
+    for(i = nbatched; i < nbatched + nkeyed; i++) {
+        key_len = snprintf(key, sizeof(key), "k%d", i);
+        ASSERT_EQ(LEDGER_OK, ledger_write(&ctx, TOPIC, key, key_len, &payloads[i], sizeof(uint64_t), NULL));
+    }
+    // Reopening recovers the tail through the engine
+    ledger_close_topic(&ctx, TOPIC);
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    next_id = LEDGER_BEGIN;
+    for(i = 0; i < nbatched + nkeyed; i += messages.nmessages) {
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, next_id, 64, &messages));
+        ASSERT_LT(0, messages.nmessages);
+        for(size_t k = 0; k < messages.nmessages; k++) {
+            EXPECT_EQ(i + k, messages.messages[k].id);
+            EXPECT_EQ(i + k, *(uint64_t *)messages.messages[k].data);
+            if(i + k >= nbatched) {
+                key_len = snprintf(key, sizeof(key), "k%zu", i + k);
+                ASSERT_EQ(key_len, messages.messages[k].key_len);
+                EXPECT_EQ(0, memcmp(key, messages.messages[k].key, key_len));
+            }
+        }
+        next_id = messages.next_id;
+        ledger_message_set_free(&messages);
+    }
+    EXPECT_EQ(nbatched + nkeyed, i);
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TEST(Ledger, SeekTime) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    const int nbursts = 4;
+    const int burst_size = 30;
+    uint64_t burst_times[nbursts];
+    uint32_t payload;
+    uint64_t id;
+    int i, j;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 200;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // Nothing written yet, so the next message is the one to start at
+    ASSERT_EQ(LEDGER_OK, ledger_seek_time(&ctx, TOPIC, 0, now_ms(), &id));
+    EXPECT_EQ(0, id);
+
+    // Bursts spanning several journals, one of them a second later so
+    // the meta entries narrow the search
+    for(i = 0; i < nbursts; i++) {
+        usleep(i == 2 ? 1100000 : 20000);
+        burst_times[i] = now_ms();
+        for(j = 0; j < burst_size; j++) {
+            payload = i * burst_size + j;
+            ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+        }
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_seek_time(&ctx, TOPIC, 0, 0, &id));
+    EXPECT_EQ(0, id);
+    for(i = 0; i < nbursts; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_seek_time(&ctx, TOPIC, 0, burst_times[i], &id));
+        EXPECT_EQ(i * burst_size, id);
+    }
+    ASSERT_EQ(LEDGER_OK, ledger_seek_time(&ctx, TOPIC, 0, now_ms() + 3600000, &id));
+    EXPECT_EQ(nbursts * burst_size, id);
+
+    // The time index survives reopening
+    ledger_close_topic(&ctx, TOPIC);
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    ASSERT_EQ(LEDGER_OK, ledger_seek_time(&ctx, TOPIC, 0, burst_times[3], &id));
+    EXPECT_EQ(3 * burst_size, id);
+
+    EXPECT_EQ(LEDGER_ERR_BAD_PARTITION, ledger_seek_time(&ctx, TOPIC, 1, 0, &id));
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+TEST(Ledger, TimeIndexSharedBetweenWriters) {
+    ledger_ctx ctxs[2];
+    ledger_topic_options options;
+    ledger_journal_time_entry entry;
+    uint64_t started, last_time = 0;
+    uint32_t payload = 0;
+    char path[256];
+    FILE *file;
+    int i;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    // Standing in for two processes, sharing only the lock file
+    for(i = 0; i < 2; i++) {
+        ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctxs[i], WORKING_DIR));
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctxs[i], TOPIC, partition_ids, 1, &options));
+    }
+
+    // Taking turns within the same milliseconds
+    started = now_ms();
+    while(now_ms() - started < 20) {
+        for(i = 0; i < 2; i++) {
+            ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctxs[i], TOPIC, 0, &payload,
+                                                        sizeof(uint32_t), NULL));
+            payload++;
+        }
+    }
+    for(i = 0; i < 2; i++) {
+        ledger_close_context(&ctxs[i]);
+    }
+
+    // One entry per millisecond, whoever wrote first in it
+    partition_file(path, sizeof(path), 0, "tim");
+    file = fopen(path, "r");
+    ASSERT_TRUE(file != NULL);
+    for(i = 0; fread(&entry, sizeof(entry), 1, file) == 1; i++) {
+        EXPECT_LT(last_time, entry.time_ms);
+        last_time = entry.time_ms;
+    }
+    fclose(file);
+    EXPECT_LT(0, i);
+
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+
+TEST(Ledger, KeyedMessages) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_read_mode read_modes[] = {LEDGER_READ_COPY, LEDGER_READ_MMAP, LEDGER_READ_COALESCED};
+    const char *keys[] = {"alpha", "", "gamma"};
+    ledger_message_set messages;
+    uint32_t payload;
+    int i, mode;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < 30; i++) {
+        payload = i;
+        if(i % 4 == 3) {
+            ASSERT_EQ(LEDGER_OK, ledger_write_partition(&ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+        } else {
+            ASSERT_EQ(LEDGER_OK, ledger_write(&ctx, TOPIC, keys[i % 4], strlen(keys[i % 4]),
+                                              &payload, sizeof(uint32_t), NULL));
+        }
+    }
+    ledger_close_topic(&ctx, TOPIC);
+
+    for(mode = 0; mode < 3; mode++) {
+        options.read_mode = read_modes[mode];
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN, 30, &messages));
+        ASSERT_EQ(30, messages.nmessages);
+        for(i = 0; i < 30; i++) {
+            EXPECT_EQ(i, messages.messages[i].id);
+            ASSERT_EQ(sizeof(uint32_t), messages.messages[i].len);
+            EXPECT_EQ(i, *(uint32_t *)messages.messages[i].data);
+            // Empty keys read back as none
+            if(i % 4 == 1 || i % 4 == 3) {
+                EXPECT_TRUE(messages.messages[i].key == NULL);
+                EXPECT_EQ(0, messages.messages[i].key_len);
+            } else {
+                ASSERT_EQ(strlen(keys[i % 4]), messages.messages[i].key_len);
+                EXPECT_EQ(0, memcmp(keys[i % 4], messages.messages[i].key, messages.messages[i].key_len));
+            }
+        }
+        ledger_message_set_free(&messages);
+        ledger_close_topic(&ctx, TOPIC);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+static void write_compaction_round(ledger_ctx *ctx, int first, int count) {
+    char key[8];
+    uint32_t payload;
+    int i;
+
+    for(i = first; i < first + count; i++) {
+        payload = i;
+        if(i % 10 == 9) {
+            ASSERT_EQ(LEDGER_OK, ledger_write_partition(ctx, TOPIC, 0, &payload, sizeof(uint32_t), NULL));
+        } else {
+            snprintf(key, sizeof(key), "key-%d", i % 4);
+            ASSERT_EQ(LEDGER_OK, ledger_write(ctx, TOPIC, key, strlen(key), &payload,
+                                              sizeof(uint32_t), NULL));
+        }
+    }
+}
+
+// Sealed journals keep messages without keys and the latest for each
+// key. The latest journal keeps everything.
+static void check_compacted(ledger_ctx *ctx, int nwritten, std::vector<uint64_t> *ids) {
+    ledger_partition *partition = &ledger_lookup_topic(ctx, TOPIC)->partitions[0];
+    uint64_t latest_first = partition->meta.entries[partition->meta.nentries - 1].first_message_id;
+    ledger_message_set messages;
+    ledger_message *message;
+    uint64_t last_key_ids[4] = {0, 0, 0, 0};
+    char key[8];
+    uint64_t id = LEDGER_BEGIN;
+    size_t i;
+    int j;
+
+    for(j = 0; j < nwritten; j++) {
+        if(j % 10 != 9) {
+            last_key_ids[j % 4] = j;
+        }
+    }
+
+    ids->clear();
+    do {
+        ASSERT_EQ(LEDGER_OK, ledger_read_partition(ctx, TOPIC, 0, id, 16, &messages));
+        for(i = 0; i < messages.nmessages; i++) {
+            message = &messages.messages[i];
+            EXPECT_EQ(message->id, *(uint32_t *)message->data);
+            if(!ids->empty()) {
+                EXPECT_LT(ids->back(), message->id);
+            }
+            ids->push_back(message->id);
+
+            if(message->id % 10 == 9) {
+                EXPECT_TRUE(message->key == NULL);
+                continue;
+            }
+            snprintf(key, sizeof(key), "key-%d", (int)(message->id % 4));
+            ASSERT_EQ(strlen(key), message->key_len);
+            EXPECT_EQ(0, memcmp(key, message->key, message->key_len));
+            if(message->id < latest_first) {
+                EXPECT_EQ(last_key_ids[message->id % 4], message->id);
+            }
+        }
+        id = messages.next_id;
+        ledger_message_set_free(&messages);
+    } while(id < (uint64_t)nwritten);
+    EXPECT_EQ(nwritten, id);
+
+    // Every message without a key, and the latest one for each key
+    for(j = 0; j < nwritten; j++) {
+        if(j % 10 == 9 || last_key_ids[j % 4] == (uint64_t)j || (uint64_t)j >= latest_first) {
+            EXPECT_TRUE(std::find(ids->begin(), ids->end(), (uint64_t)j) != ids->end()) << j;
+        }
+    }
+}
+
+TEST(Ledger, Compaction) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    ledger_read_mode read_modes[] = {LEDGER_READ_COPY, LEDGER_READ_MMAP, LEDGER_READ_COALESCED};
+    std::vector<uint64_t> ids, reopened_ids;
+    int mode;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 300;
+    options.compact = true;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    write_compaction_round(&ctx, 0, 200);
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+    check_compacted(&ctx, 200, &ids);
+    EXPECT_GT(50, ids.size());
+
+    // Later writes replace keys kept by the first pass
+    write_compaction_round(&ctx, 200, 100);
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+    check_compacted(&ctx, 300, &ids);
+    EXPECT_GT(60, ids.size());
+    ledger_close_topic(&ctx, TOPIC);
+
+    // The gaps persist, and every read mode skips them
+    for(mode = 0; mode < 3; mode++) {
+        options.read_mode = read_modes[mode];
+        ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+        check_compacted(&ctx, 300, &reopened_ids);
+        EXPECT_EQ(ids, reopened_ids);
+        ledger_close_topic(&ctx, TOPIC);
+    }
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
+// Inodes of the sealed journals' key summaries, which are replaced
+// whenever one is rewritten
+static void key_summaries(ledger_ctx *ctx, std::vector<ino_t> *inodes) {
+    ledger_partition *partition = &ledger_lookup_topic(ctx, TOPIC)->partitions[0];
+    char path[PATH_MAX];
+    struct stat st;
+    uint32_t i;
+
+    inodes->clear();
+    for(i = 0; i + 1 < partition->meta.nentries; i++) {
+        snprintf(path, sizeof(path), "/tmp/ledger/my_data/0/%08u.key", partition->meta.entries[i].id);
+        ASSERT_EQ(0, stat(path, &st)) << path;
+        inodes->push_back(st.st_ino);
+    }
+}
+
+TEST(Ledger, CompactionKeepsKeySummaries) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    std::vector<uint64_t> ids, reopened_ids;
+    std::vector<ino_t> summaries, reopened_summaries;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.journal_max_size_bytes = 300;
+    options.compact = true;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    // Compacted journals have their summaries written with them
+    write_compaction_round(&ctx, 0, 200);
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+    check_compacted(&ctx, 200, &ids);
+    key_summaries(&ctx, &summaries);
+    EXPECT_LT(1, summaries.size());
+    ledger_close_topic(&ctx, TOPIC);
+
+    // Reopening compacts from the summaries, without reading the sealed
+    // journals again
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+    key_summaries(&ctx, &reopened_summaries);
+    EXPECT_EQ(summaries, reopened_summaries);
+    check_compacted(&ctx, 200, &reopened_ids);
+    EXPECT_EQ(ids, reopened_ids);
+
+    // Later keys still replace what the summaries hold
+    write_compaction_round(&ctx, 200, 100);
+    ASSERT_EQ(LEDGER_OK, ledger_run_maintenance(&ctx));
+    check_compacted(&ctx, 300, &ids);
+    EXPECT_GT(60, ids.size());
+
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
+
 }
@@ -1,7 +1,11 @@
 #include <gtest/gtest.h>
 
 #include <atomic>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
 
+#include "scheduler.h"
 #include "signal.h"
 
 static std::atomic<bool> signaled(false);
@@ -9,9 +13,53 @@ static std::atomic<bool> signaled(false);
 static void *leader_exec(void *signal_ptr) {
     ledger_signal *sig = (ledger_signal *)signal_ptr;
 
-    sleep(1);
+    usleep(100 * 1000);
     signaled = true;
+    ledger_signal_publish(sig, 1);
+    return NULL;
+}
+
+static void *stepping_leader_exec(void *signal_ptr) {
+    ledger_signal *sig = (ledger_signal *)signal_ptr;
+    uint64_t i;
+
+    for(i = 1; i <= 10; i++) {
+        usleep(10 * 1000);
+        ledger_signal_publish(sig, i);
+    }
+    return NULL;
+}
+
+static void *kick_exec(void *signal_ptr) {
+    ledger_signal *sig = (ledger_signal *)signal_ptr;
+
+    usleep(50 * 1000);
     ledger_signal_broadcast(sig);
+    return NULL;
+}
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+struct signaled_task {
+    ledger_task task;
+    ledger_signal sig;
+    std::atomic<int> runs;
+};
+
+static ledger_task_status run_signaled(ledger_task *task) {
+    ((signaled_task *)task->data)->runs++;
+    return LEDGER_TASK_PARK;
+}
+
+static void wait_runs(signaled_task *task, int runs) {
+    while(task->runs < runs) {
+        usleep(100);
+    }
 }
 
 namespace ledger_signal_test {
@@ -19,19 +67,100 @@ TEST(LedgerSignal, BasicWait) {
     ledger_signal sig;
     pthread_t leader_thread;
 
-    ledger_signal_init(&sig);
+    signaled = false;
+    ledger_signal_init(&sig, 0);
     pthread_create(&leader_thread, NULL, leader_exec, &sig);
-    ledger_signal_wait(&sig);
-    ASSERT_TRUE(signaled);
+    EXPECT_EQ(LEDGER_OK, ledger_signal_wait(&sig, 0, -1));
+    EXPECT_TRUE(signaled);
+    EXPECT_EQ(1, ledger_signal_value(&sig));
+    pthread_join(leader_thread, NULL);
 }
 
 TEST(LedgerSignal, WithTimeout) {
     ledger_signal sig;
     pthread_t leader_thread;
+    struct timespec start;
 
-    ledger_signal_init(&sig);
+    signaled = false;
+    ledger_signal_init(&sig, 0);
     pthread_create(&leader_thread, NULL, leader_exec, &sig);
-    ledger_signal_wait_with_timeout(&sig, 2);
-    ASSERT_TRUE(signaled);
+
+    // Gives up well before the leader gets there
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    EXPECT_EQ(LEDGER_NEXT, ledger_signal_wait(&sig, 0, 20));
+    EXPECT_GE(elapsed_ms(&start), 20);
+    EXPECT_FALSE(signaled);
+
+    EXPECT_EQ(LEDGER_OK, ledger_signal_wait(&sig, 0, 5000));
+    EXPECT_TRUE(signaled);
+    pthread_join(leader_thread, NULL);
+}
+
+TEST(LedgerSignal, PublishedBeforeWait) {
+    ledger_signal sig;
+
+    ledger_signal_init(&sig, 0);
+    ledger_signal_publish(&sig, 3);
+    EXPECT_EQ(LEDGER_OK, ledger_signal_wait(&sig, 2, -1));
+    EXPECT_EQ(LEDGER_NEXT, ledger_signal_wait(&sig, 3, 0));
+
+    // The watermark never goes back
+    ledger_signal_publish(&sig, 1);
+    EXPECT_EQ(3, ledger_signal_value(&sig));
+}
+
+TEST(LedgerSignal, WaitsForItsValue) {
+    ledger_signal sig;
+    pthread_t leader_thread;
+
+    ledger_signal_init(&sig, 0);
+    pthread_create(&leader_thread, NULL, stepping_leader_exec, &sig);
+    EXPECT_EQ(LEDGER_OK, ledger_signal_wait(&sig, 7, 5000));
+    EXPECT_GE(ledger_signal_value(&sig), 8);
+    pthread_join(leader_thread, NULL);
+}
+
+TEST(LedgerSignal, BroadcastWakesWaiters) {
+    ledger_signal sig;
+    pthread_t kick_thread;
+
+    ledger_signal_init(&sig, 0);
+    pthread_create(&kick_thread, NULL, kick_exec, &sig);
+    EXPECT_EQ(LEDGER_NEXT, ledger_signal_wait(&sig, 0, -1));
+    EXPECT_EQ(0, ledger_signal_value(&sig));
+    pthread_join(kick_thread, NULL);
+}
+
+TEST(LedgerSignal, ScheduledTasksWokenByTheirSignals) {
+    ledger_scheduler scheduler;
+    // More signals than one worker can wait on at once
+    std::vector<signaled_task> tasks(300);
+    struct timespec start;
+    size_t i;
+
+    ASSERT_EQ(LEDGER_OK, ledger_scheduler_start(&scheduler, 3));
+    for(i = 0; i < tasks.size(); i++) {
+        ledger_signal_init(&tasks[i].sig, 0);
+        tasks[i].runs = 0;
+        ledger_task_init(&tasks[i].task, run_signaled, NULL, &tasks[i]);
+        tasks[i].task.signal = &tasks[i].sig;
+        ASSERT_EQ(LEDGER_OK, ledger_scheduler_add(&scheduler, &tasks[i].task));
+    }
+    for(i = 0; i < tasks.size(); i++) {
+        wait_runs(&tasks[i], 1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < tasks.size(); i++) {
+        ledger_signal_publish(&tasks[i].sig, 1);
+        wait_runs(&tasks[i], 2);
+    }
+    // Left to the sweep, each would take about 50ms
+    EXPECT_GT(5000, elapsed_ms(&start));
+
+    for(i = 0; i < tasks.size(); i++) {
+        ledger_scheduler_remove(&scheduler, &tasks[i].task);
+    }
+    ledger_scheduler_stop(&scheduler);
 }
 }
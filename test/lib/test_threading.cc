@@ -126,4 +126,81 @@ TEST(LedgerThreading, DISABLED_WriteThreadingWithRotation) {
     ledger_close_context(&ctx);
     ASSERT_EQ(0, cleanup(WORKING_DIR));
 }
+
+static const int NUM_DURABLE_MESSAGES = 200;
+
+typedef struct {
+    ledger_ctx *ctx;
+    uint32_t worker;
+    uint64_t ids[NUM_DURABLE_MESSAGES];
+    bool ok;
+} durable_worker_state;
+
+void *durable_write_worker(void *state_ptr) {
+    durable_worker_state *state = (durable_worker_state *)state_ptr;
+    ledger_write_status status;
+    ledger_status rc;
+    uint32_t message;
+    int i;
+
+    state->ok = false;
+    for(i = 0; i < NUM_DURABLE_MESSAGES; i++) {
+        message = state->worker * NUM_DURABLE_MESSAGES + i;
+        rc = ledger_write_partition(state->ctx, TOPIC, 0, (void *)&message, sizeof(uint32_t), &status);
+        if(rc != LEDGER_OK) {
+            printf("Failed to write to partition: %d\n", rc);
+            return NULL;
+        }
+        state->ids[i] = status.message_id;
+    }
+    state->ok = true;
+
+    return NULL;
+}
+
+TEST(LedgerThreading, GroupCommitDurableWrites) {
+    ledger_ctx ctx;
+    ledger_topic_options options;
+    pthread_t threads[NUM_THREADS];
+    durable_worker_state states[NUM_THREADS];
+    ledger_message_set messages;
+    uint32_t expected;
+    int i, j;
+
+    cleanup(WORKING_DIR);
+    ASSERT_EQ(0, setup(WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_open_context(&ctx, WORKING_DIR));
+    ASSERT_EQ(LEDGER_OK, ledger_topic_options_init(&options));
+    options.durability = LEDGER_DURABILITY_BATCH;
+    unsigned int partition_ids[] = {0};
+    ASSERT_EQ(LEDGER_OK, ledger_open_topic(&ctx, TOPIC, partition_ids, 1, &options));
+
+    for(i = 0; i < NUM_THREADS; i++) {
+        states[i].ctx = &ctx;
+        states[i].worker = i;
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, durable_write_worker, &states[i]));
+    }
+
+    for(i = 0; i < NUM_THREADS; i++) {
+        ASSERT_EQ(0, pthread_join(threads[i], NULL));
+        ASSERT_TRUE(states[i].ok);
+    }
+
+    ASSERT_EQ(LEDGER_OK, ledger_read_partition(&ctx, TOPIC, 0, LEDGER_BEGIN,
+                                               NUM_THREADS * NUM_DURABLE_MESSAGES, &messages));
+    ASSERT_EQ(NUM_THREADS * NUM_DURABLE_MESSAGES, messages.nmessages);
+
+    // Every writer must have been handed the id its message landed at
+    for(i = 0; i < NUM_THREADS; i++) {
+        for(j = 0; j < NUM_DURABLE_MESSAGES; j++) {
+            expected = i * NUM_DURABLE_MESSAGES + j;
+            ASSERT_LT(states[i].ids[j], messages.nmessages);
+            EXPECT_EQ(expected, *(uint32_t *)messages.messages[states[i].ids[j]].data);
+        }
+    }
+
+    ledger_message_set_free(&messages);
+    ledger_close_context(&ctx);
+    ASSERT_EQ(0, cleanup(WORKING_DIR));
+}
 }